@@ -40,6 +40,11 @@ enum MemoryOrder {
     memory_order_seq_cst = __ATOMIC_SEQ_CST
 };
 
+static inline void atomic_thread_fence(MemoryOrder order) noexcept
+{
+    __atomic_thread_fence(order);
+}
+
 template<typename T>
 static inline T atomic_exchange(volatile T* var, T desired, MemoryOrder order = memory_order_seq_cst) noexcept
 {
@@ -84,3 +84,17 @@ ALWAYS_INLINE int count_trailing_zeroes_32(unsigned int val)
     return 0;
 #endif
 }
+
+ALWAYS_INLINE int count_leading_zeroes_32(unsigned int val)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_clz(val);
+#else
+    for (u8 i = 0; i < 32; ++i) {
+        if ((val << i) & 0x80000000) {
+            return i;
+        }
+    }
+    return 0;
+#endif
+}
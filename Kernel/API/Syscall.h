@@ -193,7 +193,12 @@ namespace Kernel {
     S(recvfd)                 \
     S(sysconf)                \
     S(set_process_name)       \
-    S(disown)
+    S(disown)                 \
+    S(fsync)                  \
+    S(readv)                  \
+    S(pread)                  \
+    S(pwrite)                 \
+    S(sendfile)
 
 namespace Syscall {
 
@@ -333,6 +338,9 @@ struct SC_futex_params {
     int futex_op;
     i32 val;
     Userspace<const timespec*> timeout;
+    u32 val2;
+    Userspace<const i32*> userspace_address2;
+    u32 val3;
 };
 
 struct SC_setkeymap_params {
@@ -443,6 +451,25 @@ struct SC_ptrace_params {
     int data;
 };
 
+struct SC_pread_params {
+    int fd;
+    MutableBufferArgument<u8, size_t> buffer;
+    ssize_t offset;
+};
+
+struct SC_pwrite_params {
+    int fd;
+    ImmutableBufferArgument<u8, size_t> data;
+    ssize_t offset;
+};
+
+struct SC_sendfile_params {
+    int out_fd;
+    int in_fd;
+    Userspace<ssize_t*> offset;
+    size_t count;
+};
+
 struct SC_ptrace_peek_params {
     Userspace<const u32*> address;
     Userspace<u32*> out_data;
@@ -972,6 +972,7 @@ void Processor::early_initialize(u32 cpu)
     m_scheduler_initialized = false;
 
     m_message_queue = nullptr;
+    m_active_cr3 = 0;
     m_idle_thread = nullptr;
     m_current_thread = nullptr;
     m_scheduler_data = nullptr;
@@ -1131,6 +1132,7 @@ extern "C" void enter_thread_context(Thread* from_thread, Thread* to_thread)
     tls_descriptor.set_base(to_thread->thread_specific_data().as_ptr());
     tls_descriptor.set_limit(to_thread->thread_specific_region_size());
 
+    processor.set_active_cr3(to_tss.cr3);
     if (from_tss.cr3 != to_tss.cr3)
         write_cr3(to_tss.cr3);
 
@@ -1461,8 +1463,18 @@ void Processor::check_invoke_scheduler()
     }
 }
 
+// Invalidating more pages than this one by one is slower than just reloading cr3.
+static constexpr size_t tlb_full_flush_threshold = 64;
+
+static TLBShootdownStatistics s_tlb_shootdown_statistics;
+
 void Processor::flush_tlb_local(VirtualAddress vaddr, size_t page_count)
 {
+    if (page_count > tlb_full_flush_threshold) {
+        atomic_fetch_add(&s_tlb_shootdown_statistics.full_flushes, 1u, AK::MemoryOrder::memory_order_relaxed);
+        flush_entire_tlb_local();
+        return;
+    }
     auto ptr = vaddr.as_ptr();
     while (page_count > 0) {
         asm volatile("invlpg %0"
@@ -1474,11 +1486,50 @@ void Processor::flush_tlb_local(VirtualAddress vaddr, size_t page_count)
     }
 }
 
-void Processor::flush_tlb(VirtualAddress vaddr, size_t page_count)
+void Processor::flush_tlb_local(const TLBFlushRange* ranges, size_t range_count)
 {
-    flush_tlb_local(vaddr, page_count);
+    size_t total_page_count = 0;
+    for (size_t i = 0; i < range_count; ++i)
+        total_page_count += ranges[i].page_count;
+    if (total_page_count > tlb_full_flush_threshold) {
+        atomic_fetch_add(&s_tlb_shootdown_statistics.full_flushes, 1u, AK::MemoryOrder::memory_order_relaxed);
+        flush_entire_tlb_local();
+        return;
+    }
+    for (size_t i = 0; i < range_count; ++i)
+        flush_tlb_local(VirtualAddress(ranges[i].ptr), ranges[i].page_count);
+}
+
+void Processor::flush_tlb(u32 cr3, VirtualAddress vaddr, size_t page_count)
+{
+    TLBFlushRange range { vaddr.as_ptr(), page_count };
+    flush_tlb(cr3, &range, 1);
+}
+
+void Processor::flush_tlb(u32 cr3, const TLBFlushRange* ranges, size_t range_count)
+{
+    ScopedCritical critical;
+    // Without the address space loaded, this processor has nothing cached for it.
+    if (!cr3 || Processor::current().active_cr3() == cr3)
+        flush_tlb_local(ranges, range_count);
     if (s_smp_enabled)
-        smp_broadcast_flush_tlb(vaddr, page_count);
+        smp_flush_tlb(cr3, ranges, range_count);
+}
+
+TLBShootdownStatistics Processor::tlb_shootdown_statistics()
+{
+    TLBShootdownStatistics statistics;
+    statistics.shootdowns = atomic_load(&s_tlb_shootdown_statistics.shootdowns, AK::MemoryOrder::memory_order_relaxed);
+    statistics.ipis = atomic_load(&s_tlb_shootdown_statistics.ipis, AK::MemoryOrder::memory_order_relaxed);
+    statistics.skipped_cpus = atomic_load(&s_tlb_shootdown_statistics.skipped_cpus, AK::MemoryOrder::memory_order_relaxed);
+    statistics.full_flushes = atomic_load(&s_tlb_shootdown_statistics.full_flushes, AK::MemoryOrder::memory_order_relaxed);
+    statistics.batched_ranges = atomic_load(&s_tlb_shootdown_statistics.batched_ranges, AK::MemoryOrder::memory_order_relaxed);
+    return statistics;
+}
+
+void Processor::count_batched_tlb_flush_ranges(size_t range_count)
+{
+    atomic_fetch_add(&s_tlb_shootdown_statistics.batched_ranges, static_cast<u32>(range_count), AK::MemoryOrder::memory_order_relaxed);
 }
 
 static volatile ProcessorMessage* s_message_pool;
@@ -1595,7 +1646,7 @@ bool Processor::smp_process_pending_messages()
                     msg->callback_with_data.handler(msg->callback_with_data.data);
                     break;
                 case ProcessorMessage::FlushTlb:
-                    flush_tlb_local(VirtualAddress(msg->flush_tlb.ptr), msg->flush_tlb.page_count);
+                    flush_tlb_local(msg->flush_tlb.ranges, msg->flush_tlb.range_count);
                     break;
             }
 
@@ -1672,6 +1723,84 @@ void Processor::smp_broadcast_message(ProcessorMessage& msg, bool async)
     }
 }
 
+void Processor::smp_unicast_message(u32 cpu, ProcessorMessage& msg, bool async)
+{
+    auto& cur_proc = Processor::current();
+    ASSERT(cpu != cur_proc.id());
+    auto& target_proc = *processors()[cpu];
+    msg.async = async;
+#ifdef SMP_DEBUG
+    dbg() << "SMP[" << cur_proc.id() << "]: Send message " << VirtualAddress(&msg) << " to cpu #" << cpu << " proc: " << VirtualAddress(&target_proc);
+#endif
+    atomic_store(&msg.refs, 1u, AK::MemoryOrder::memory_order_release);
+    if (target_proc.smp_queue_message(msg)) {
+        // Only the first queued message needs to trigger an IPI, the
+        // target processor drains its entire queue when handling it
+        APIC::the().send_ipi(cpu);
+    }
+
+    if (!async) {
+        while (atomic_load(&msg.refs, AK::MemoryOrder::memory_order_consume) != 0) {
+            // TODO: pause for a bit?
+        }
+
+        smp_cleanup_message(msg);
+        smp_return_to_pool(msg);
+    }
+}
+
+void Processor::smp_multicast_message(u32 cpu_mask, ProcessorMessage& msg, bool async)
+{
+    auto& cur_proc = Processor::current();
+    ASSERT(cpu_mask);
+    ASSERT(!(cpu_mask & (1u << cur_proc.id())));
+    msg.async = async;
+#ifdef SMP_DEBUG
+    dbg() << "SMP[" << cur_proc.id() << "]: Multicast message " << VirtualAddress(&msg) << " to cpu mask " << String::format("%x", cpu_mask);
+#endif
+    atomic_store(&msg.refs, (u32)__builtin_popcount(cpu_mask), AK::MemoryOrder::memory_order_release);
+    for_each(
+        [&](Processor& proc) -> IterationDecision
+        {
+            if (!(cpu_mask & (1u << proc.id())))
+                return IterationDecision::Continue;
+            if (proc.smp_queue_message(msg)) {
+                // Same as in smp_unicast_message(), only the first queued
+                // message needs to trigger an IPI
+                atomic_fetch_add(&s_tlb_shootdown_statistics.ipis, 1u, AK::MemoryOrder::memory_order_relaxed);
+                APIC::the().send_ipi(proc.id());
+            }
+            return IterationDecision::Continue;
+        });
+
+    if (!async) {
+        while (atomic_load(&msg.refs, AK::MemoryOrder::memory_order_consume) != 0) {
+            // TODO: pause for a bit?
+        }
+
+        smp_cleanup_message(msg);
+        smp_return_to_pool(msg);
+    }
+}
+
+void Processor::smp_unicast(u32 cpu, void (*callback)(void*), void* data, void (*free_data)(void*), bool async)
+{
+    auto& msg = smp_get_from_pool();
+    msg.type = ProcessorMessage::CallbackWithData;
+    msg.callback_with_data.handler = callback;
+    msg.callback_with_data.data = data;
+    msg.callback_with_data.free = free_data;
+    smp_unicast_message(cpu, msg, async);
+}
+
+void Processor::smp_unicast(u32 cpu, void (*callback)(), bool async)
+{
+    auto& msg = smp_get_from_pool();
+    msg.type = ProcessorMessage::Callback;
+    msg.callback.handler = callback;
+    smp_unicast_message(cpu, msg, async);
+}
+
 void Processor::smp_broadcast(void (*callback)(void*), void* data, void (*free_data)(void*), bool async)
 {
     auto& msg = smp_get_from_pool();
@@ -1690,13 +1819,42 @@ void Processor::smp_broadcast(void (*callback)(), bool async)
     smp_broadcast_message(msg, async);
 }
 
-void Processor::smp_broadcast_flush_tlb(VirtualAddress vaddr, size_t page_count)
+void Processor::smp_flush_tlb(u32 cr3, const TLBFlushRange* ranges, size_t range_count)
 {
+    auto& cur_proc = Processor::current();
+    ASSERT(cur_proc.in_critical());
+
+    // Make our page table updates visible before looking at which address
+    // space everybody else has loaded. A processor that loads cr3 after
+    // this point will walk the updated page tables anyway.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    u32 cpu_mask = 0;
+    u32 skipped_cpus = 0;
+    for_each(
+        [&](Processor& proc) -> IterationDecision
+        {
+            if (&proc == &cur_proc)
+                return IterationDecision::Continue;
+            if (cr3 && proc.active_cr3() != cr3)
+                ++skipped_cpus;
+            else
+                cpu_mask |= 1u << proc.id();
+            return IterationDecision::Continue;
+        });
+
+    if (skipped_cpus)
+        atomic_fetch_add(&s_tlb_shootdown_statistics.skipped_cpus, skipped_cpus, AK::MemoryOrder::memory_order_relaxed);
+    if (!cpu_mask)
+        return;
+
+    atomic_fetch_add(&s_tlb_shootdown_statistics.shootdowns, 1u, AK::MemoryOrder::memory_order_relaxed);
+    // This is synchronous, so the ranges can live on the caller's stack.
     auto& msg = smp_get_from_pool();
     msg.type = ProcessorMessage::FlushTlb;
-    msg.flush_tlb.ptr = vaddr.as_ptr();
-    msg.flush_tlb.page_count = page_count;
-    smp_broadcast_message(msg, false);
+    msg.flush_tlb.ranges = ranges;
+    msg.flush_tlb.range_count = range_count;
+    smp_multicast_message(cpu_mask, msg, false);
 }
 
 void Processor::smp_broadcast_halt()
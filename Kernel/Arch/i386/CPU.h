@@ -34,6 +34,7 @@
 #include <Kernel/VirtualAddress.h>
 
 #define PAGE_SIZE 4096
+#define LARGE_PAGE_SIZE 0x200000
 #define GENERIC_INTERRUPT_HANDLERS_COUNT (256 - IRQ_VECTOR_BASE)
 #define PAGE_MASK ((FlatPtr)0xfffff000u)
 
@@ -636,6 +637,19 @@ class SchedulerPerProcessorData;
 struct MemoryManagerData;
 struct ProcessorMessageEntry;
 
+struct TLBFlushRange {
+    u8* ptr;
+    size_t page_count;
+};
+
+struct TLBShootdownStatistics {
+    u32 shootdowns { 0 };
+    u32 ipis { 0 };
+    u32 skipped_cpus { 0 };
+    u32 full_flushes { 0 };
+    u32 batched_ranges { 0 };
+};
+
 struct ProcessorMessage {
     enum Type {
         FlushTlb,
@@ -655,8 +669,8 @@ struct ProcessorMessage {
             void (*free)(void*);
         } callback_with_data;
         struct {
-            u8* ptr;
-            size_t page_count;
+            const TLBFlushRange* ranges;
+            size_t range_count;
         } flush_tlb;
     };
 
@@ -698,6 +712,7 @@ class Processor {
     Thread* m_idle_thread;
 
     volatile ProcessorMessageEntry* m_message_queue; // atomic, LIFO
+    volatile u32 m_active_cr3; // atomic
 
     bool m_invoke_scheduler_async;
     bool m_scheduler_initialized;
@@ -713,6 +728,8 @@ class Processor {
     static void smp_cleanup_message(ProcessorMessage& msg);
     bool smp_queue_message(ProcessorMessage& msg);
     static void smp_broadcast_message(ProcessorMessage& msg, bool async);
+    static void smp_unicast_message(u32 cpu, ProcessorMessage& msg, bool async);
+    static void smp_multicast_message(u32 cpu_mask, ProcessorMessage& msg, bool async);
     static void smp_broadcast_halt();
 
     void cpu_detect();
@@ -723,6 +740,9 @@ class Processor {
 public:
     Processor() = default;
 
+    // Processors are addressed by bit in u32 masks (e.g. thread affinity)
+    static constexpr u32 max_count = sizeof(u32) * 8;
+
     void early_initialize(u32 cpu);
     void initialize(u32 cpu);
 
@@ -747,7 +767,26 @@ public:
     }
 
     static void flush_tlb_local(VirtualAddress vaddr, size_t page_count);
-    static void flush_tlb(VirtualAddress vaddr, size_t page_count);
+    static void flush_tlb_local(const TLBFlushRange* ranges, size_t range_count);
+
+    // Flushes the given ranges on this processor and on every other processor
+    // that currently has the page directory with the given cr3 loaded. A cr3 of
+    // 0 means the ranges are mapped in every address space (e.g. kernel memory).
+    static void flush_tlb(u32 cr3, VirtualAddress vaddr, size_t page_count);
+    static void flush_tlb(u32 cr3, const TLBFlushRange* ranges, size_t range_count);
+    static TLBShootdownStatistics tlb_shootdown_statistics();
+    static void count_batched_tlb_flush_ranges(size_t range_count);
+
+    // Must be called before loading a new cr3, so that nobody skips
+    // this processor when shooting down mappings in that address space.
+    ALWAYS_INLINE void set_active_cr3(u32 cr3)
+    {
+        AK::atomic_store(&m_active_cr3, cr3);
+    }
+    ALWAYS_INLINE u32 active_cr3() const
+    {
+        return AK::atomic_load(&m_active_cr3);
+    }
 
     Descriptor& get_gdt_entry(u16 selector);
     void flush_gdt();
@@ -912,7 +951,24 @@ public:
     }
     static void smp_broadcast(void (*callback)(), bool async);
     static void smp_broadcast(void (*callback)(void*), void* data, void (*free_data)(void*), bool async);
-    static void smp_broadcast_flush_tlb(VirtualAddress vaddr, size_t page_count);
+    template<typename Callback>
+    static void smp_unicast(u32 cpu, Callback callback, bool async)
+    {
+        auto* data = new Callback(move(callback));
+        smp_unicast(
+            cpu,
+            [](void* data) {
+                (*reinterpret_cast<Callback*>(data))();
+            },
+            data,
+            [](void* data) {
+                delete reinterpret_cast<Callback*>(data);
+            },
+            async);
+    }
+    static void smp_unicast(u32 cpu, void (*callback)(), bool async);
+    static void smp_unicast(u32 cpu, void (*callback)(void*), void* data, void (*free_data)(void*), bool async);
+    static void smp_flush_tlb(u32 cr3, const TLBFlushRange* ranges, size_t range_count);
 
     ALWAYS_INLINE bool has_feature(CPUFeature f) const
     {
@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <AK/StringView.h>
+#include <Kernel/Devices/AHCIController.h>
+#include <Kernel/Devices/AHCIDiskDevice.h>
+#include <Kernel/IO.h>
+#include <Kernel/Process.h>
+#include <Kernel/VM/MemoryManager.h>
+
+namespace Kernel {
+
+//#define AHCI_DEBUG
+
+#define PCI_Mass_Storage_Class 0x1
+#define PCI_SATA_Controller_Subclass 0x6
+#define PCI_AHCI_Programming_Interface 0x1
+
+#define AHCI_GHC_IE (1u << 1)
+#define AHCI_GHC_AE (1u << 31)
+
+#define AHCI_CAP2_BOH (1u << 0)
+#define AHCI_BOHC_BOS (1u << 0)
+#define AHCI_BOHC_OOS (1u << 1)
+#define AHCI_BOHC_BB (1u << 4)
+
+#define AHCI_SD_MAJOR 8
+
+// create() only ever sets up the first controller it finds.
+static AHCIController* s_controller;
+
+OwnPtr<AHCIController> AHCIController::create()
+{
+    Optional<PCI::Address> pci_address;
+    PCI::enumerate([&](const PCI::Address& address, PCI::ID id) {
+        if (pci_address.has_value())
+            return;
+        if (PCI::get_class(address) == PCI_Mass_Storage_Class && PCI::get_subclass(address) == PCI_SATA_Controller_Subclass && PCI::get_programming_interface(address) == PCI_AHCI_Programming_Interface) {
+            pci_address = address;
+            klog() << "AHCIController: AHCI controller found, ID " << id;
+        }
+    });
+    if (!pci_address.has_value())
+        return nullptr;
+    return make<AHCIController>(pci_address.value(), PCI::get_interrupt_line(pci_address.value()));
+}
+
+AHCIController::AHCIController(PCI::Address address, u8 irq)
+    : PCI::Device(address, irq)
+{
+    initialize();
+}
+
+AHCIController::~AHCIController()
+{
+}
+
+bool AHCIController::take_ownership_from_bios()
+{
+    if (!(registers().capabilities_extended & AHCI_CAP2_BOH))
+        return true;
+    registers().bios_handoff_control = registers().bios_handoff_control | AHCI_BOHC_OOS;
+    // The BIOS gets 25 ms to notice, and then up to 2 seconds if it says it's busy.
+    IO::delay(25000);
+    for (size_t i = 0; i < 2000 && (registers().bios_handoff_control & (AHCI_BOHC_BOS | AHCI_BOHC_BB)); ++i)
+        IO::delay(1000);
+    return !(registers().bios_handoff_control & AHCI_BOHC_BOS);
+}
+
+void AHCIController::initialize()
+{
+    auto abar = PhysicalAddress(PCI::get_BAR5(pci_address()) & 0xfffffff0);
+    m_registers_offset = abar.offset_in_page();
+    m_registers_region = MM.allocate_kernel_region(abar.page_base(), PAGE_ROUND_UP(m_registers_offset + sizeof(AHCIHostRegisters)), "AHCI HBA", Region::Access::Read | Region::Access::Write, false, false);
+    if (!m_registers_region) {
+        klog() << "AHCIController: Couldn't map the HBA registers at " << abar;
+        return;
+    }
+
+    PCI::enable_interrupt_line(pci_address());
+    PCI::enable_bus_mastering(pci_address());
+
+    if (!take_ownership_from_bios())
+        klog() << "AHCIController: BIOS didn't let go of the controller, trying anyway";
+
+    registers().global_host_control = registers().global_host_control | AHCI_GHC_AE;
+    m_capabilities = registers().capabilities;
+    u32 ports_implemented = registers().ports_implemented;
+    klog() << "AHCIController: Version " << String::format("%x", registers().version) << ", " << command_slot_count() << " command slots, NCQ " << (supports_ncq() ? "supported" : "not supported") << ", ports " << String::format("%08x", ports_implemented);
+
+    // Let's find out what's connected before we start taking interrupts.
+    registers().global_host_control = registers().global_host_control & ~AHCI_GHC_IE;
+    for (u8 port_index = 0; port_index < 32; ++port_index) {
+        if (!(ports_implemented & (1u << port_index)))
+            continue;
+        auto disk = AHCIDiskDevice::create(*this, port_index, AHCI_SD_MAJOR, m_disks.size() * 16);
+        if (!disk)
+            continue;
+        m_ports[port_index] = disk.ptr();
+        m_disks.append(disk.release_nonnull());
+    }
+
+    if (!m_disks.is_empty()) {
+        s_controller = this;
+        Thread* recovery_thread = nullptr;
+        Process::create_kernel_process(recovery_thread, "AHCIRecoveryTask", [] {
+            s_controller->recovery_task_main();
+        });
+    }
+
+    registers().interrupt_status = 0xffffffff;
+    registers().global_host_control = registers().global_host_control | AHCI_GHC_IE;
+    enable_irq();
+}
+
+void AHCIController::schedule_recovery(u8 port_index)
+{
+    m_ports_needing_recovery.fetch_or(1u << port_index);
+    m_recovery_wait_queue.wake_all();
+}
+
+void AHCIController::recovery_task_main()
+{
+    for (;;) {
+        u32 ports = m_ports_needing_recovery.exchange(0);
+        if (!ports) {
+            Thread::current()->wait_on(m_recovery_wait_queue, "AHCIRecoveryTask");
+            continue;
+        }
+        for (u8 port_index = 0; port_index < 32; ++port_index) {
+            if (ports & (1u << port_index))
+                m_ports[port_index]->recover_from_error();
+        }
+    }
+}
+
+void AHCIController::handle_irq(const RegisterState&)
+{
+    u32 pending_ports = registers().interrupt_status;
+    if (!pending_ports)
+        return;
+#ifdef AHCI_DEBUG
+    klog() << "AHCIController: Interrupt for ports " << String::format("%08x", pending_ports);
+#endif
+    for (u8 port_index = 0; port_index < 32; ++port_index) {
+        if (!(pending_ports & (1u << port_index)))
+            continue;
+        // The port's own interrupt status has to be cleared before ours.
+        if (auto* disk = m_ports[port_index])
+            disk->handle_interrupt();
+        else
+            registers().ports[port_index].interrupt_status = 0xffffffff;
+    }
+    registers().interrupt_status = pending_ports;
+}
+
+}
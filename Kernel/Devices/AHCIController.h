@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+//
+// Advanced Host Controller Interface (AHCI) SATA controller driver
+//
+// The controller exposes up to 32 ports, each of which can have a SATA drive
+// attached. Every drive gets its own AHCIDiskDevice, which talks to the port
+// registers directly; the controller itself only sets up the HBA and routes
+// interrupts to the ports that raised them.
+//
+// More information about AHCI can be found here:
+//      https://www.intel.com/content/dam/www/public/us/en/documents/technical-specifications/serial-ata-ahci-spec-rev1-3-1.pdf
+//
+
+#pragma once
+
+#include <AK/Atomic.h>
+#include <AK/NonnullRefPtrVector.h>
+#include <AK/OwnPtr.h>
+#include <Kernel/PCI/Access.h>
+#include <Kernel/PCI/Device.h>
+#include <Kernel/VM/Region.h>
+#include <Kernel/WaitQueue.h>
+
+namespace Kernel {
+
+struct AHCIPortRegisters {
+    u32 command_list_base;
+    u32 command_list_base_upper;
+    u32 fis_base;
+    u32 fis_base_upper;
+    u32 interrupt_status;
+    u32 interrupt_enable;
+    u32 command;
+    u32 reserved0;
+    u32 task_file_data;
+    u32 signature;
+    u32 sata_status;
+    u32 sata_control;
+    u32 sata_error;
+    u32 sata_active;
+    u32 command_issue;
+    u32 sata_notification;
+    u32 fis_based_switching_control;
+    u32 reserved1[11];
+    u32 vendor_specific[4];
+};
+
+static_assert(sizeof(AHCIPortRegisters) == 0x80);
+
+struct AHCIHostRegisters {
+    u32 capabilities;
+    u32 global_host_control;
+    u32 interrupt_status;
+    u32 ports_implemented;
+    u32 version;
+    u32 command_completion_coalescing_control;
+    u32 command_completion_coalescing_ports;
+    u32 enclosure_management_location;
+    u32 enclosure_management_control;
+    u32 capabilities_extended;
+    u32 bios_handoff_control;
+    u8 reserved[0xa0 - 0x2c];
+    u8 vendor_specific[0x100 - 0xa0];
+    AHCIPortRegisters ports[32];
+};
+
+static_assert(sizeof(AHCIHostRegisters) == 0x1100);
+
+class AHCIDiskDevice;
+
+class AHCIController final : public PCI::Device {
+    friend class AHCIDiskDevice;
+    AK_MAKE_ETERNAL
+public:
+    static OwnPtr<AHCIController> create();
+    AHCIController(PCI::Address address, u8 irq);
+    virtual ~AHCIController() override;
+
+    const NonnullRefPtrVector<AHCIDiskDevice>& disks() const { return m_disks; }
+
+    virtual const char* purpose() const override { return "AHCI Controller"; }
+
+private:
+    //^ IRQHandler
+    virtual void handle_irq(const RegisterState&) override;
+
+    void initialize();
+    bool take_ownership_from_bios();
+
+    // Getting a port going again after an error can take seconds, which is
+    // far too long to spend in the IRQ handler, so a task of ours does it.
+    void schedule_recovery(u8 port_index);
+    [[noreturn]] void recovery_task_main();
+
+    volatile AHCIHostRegisters& registers() { return *reinterpret_cast<volatile AHCIHostRegisters*>(m_registers_region->vaddr().offset(m_registers_offset).as_ptr()); }
+
+    bool supports_ncq() const { return m_capabilities & (1u << 30); }
+    size_t command_slot_count() const { return ((m_capabilities >> 8) & 0x1f) + 1; }
+
+    OwnPtr<Region> m_registers_region;
+    size_t m_registers_offset { 0 };
+    u32 m_capabilities { 0 };
+
+    AHCIDiskDevice* m_ports[32] {};
+    NonnullRefPtrVector<AHCIDiskDevice> m_disks;
+
+    Atomic<u32> m_ports_needing_recovery { 0 };
+    WaitQueue m_recovery_wait_queue;
+};
+
+}
@@ -0,0 +1,505 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <AK/StringBuilder.h>
+#include <Kernel/Devices/AHCIController.h>
+#include <Kernel/Devices/AHCIDiskDevice.h>
+#include <Kernel/FileSystem/FileDescription.h>
+#include <Kernel/IO.h>
+#include <Kernel/VM/MemoryManager.h>
+
+namespace Kernel {
+
+//#define AHCI_DEBUG
+
+#define AHCI_PORT_CMD_ST (1u << 0)
+#define AHCI_PORT_CMD_SUD (1u << 1)
+#define AHCI_PORT_CMD_POD (1u << 2)
+#define AHCI_PORT_CMD_FRE (1u << 4)
+#define AHCI_PORT_CMD_FR (1u << 14)
+#define AHCI_PORT_CMD_CR (1u << 15)
+
+#define AHCI_PORT_IS_DHRS (1u << 0)
+#define AHCI_PORT_IS_PSS (1u << 1)
+#define AHCI_PORT_IS_DSS (1u << 2)
+#define AHCI_PORT_IS_SDBS (1u << 3)
+#define AHCI_PORT_IS_IFS (1u << 27)
+#define AHCI_PORT_IS_HBDS (1u << 28)
+#define AHCI_PORT_IS_HBFS (1u << 29)
+#define AHCI_PORT_IS_TFES (1u << 30)
+#define AHCI_PORT_IS_ERRORS (AHCI_PORT_IS_IFS | AHCI_PORT_IS_HBDS | AHCI_PORT_IS_HBFS | AHCI_PORT_IS_TFES)
+#define AHCI_PORT_INTERRUPTS (AHCI_PORT_IS_DHRS | AHCI_PORT_IS_PSS | AHCI_PORT_IS_DSS | AHCI_PORT_IS_SDBS | AHCI_PORT_IS_ERRORS)
+
+#define AHCI_SSTS_DET_PRESENT 0x3
+#define AHCI_SIG_ATA 0x00000101
+
+#define AHCI_COMMAND_HEADER_WRITE (1u << 6)
+#define AHCI_PRD_MAX_BYTE_COUNT (4 * MiB)
+
+#define FIS_TYPE_REG_H2D 0x27
+#define FIS_H2D_COMMAND (1u << 7)
+
+#define ATA_SR_BSY 0x80
+#define ATA_SR_DRQ 0x08
+#define ATA_SR_ERR 0x01
+
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+#define ATA_CMD_IDENTIFY 0xEC
+
+struct [[gnu::packed]] AHCICommandHeader {
+    u16 flags;
+    u16 prdt_length;
+    u32 prd_byte_count;
+    u32 command_table_base;
+    u32 command_table_base_upper;
+    u32 reserved[4];
+};
+
+static_assert(sizeof(AHCICommandHeader) == 32);
+
+struct [[gnu::packed]] AHCIPhysicalRegionDescriptor {
+    u32 data_base;
+    u32 data_base_upper;
+    u32 reserved;
+    u32 byte_count;
+};
+
+struct [[gnu::packed]] RegisterHostToDeviceFIS {
+    u8 type;
+    u8 flags;
+    u8 command;
+    u8 feature_low;
+    u8 lba0;
+    u8 lba1;
+    u8 lba2;
+    u8 device;
+    u8 lba3;
+    u8 lba4;
+    u8 lba5;
+    u8 feature_high;
+    u8 count_low;
+    u8 count_high;
+    u8 icc;
+    u8 control;
+    u32 reserved;
+};
+
+static constexpr size_t command_table_prdt_offset = 0x80;
+static constexpr size_t received_fis_offset = 0x400;
+
+static bool wait_for(volatile u32& reg, u32 mask, u32 value, size_t timeout_in_ms)
+{
+    for (size_t i = 0; i < timeout_in_ms; ++i) {
+        if ((reg & mask) == value)
+            return true;
+        IO::delay(1000);
+    }
+    return (reg & mask) == value;
+}
+
+static void write_command_fis(u8* table, u8 command, u64 lba, u16 count, bool queued, u8 tag)
+{
+    memset(table, 0, command_table_prdt_offset);
+    auto& fis = *reinterpret_cast<RegisterHostToDeviceFIS*>(table);
+    fis.type = FIS_TYPE_REG_H2D;
+    fis.flags = FIS_H2D_COMMAND;
+    fis.command = command;
+    fis.device = 0x40;
+    fis.lba0 = lba & 0xff;
+    fis.lba1 = (lba >> 8) & 0xff;
+    fis.lba2 = (lba >> 16) & 0xff;
+    fis.lba3 = (lba >> 24) & 0xff;
+    fis.lba4 = (lba >> 32) & 0xff;
+    fis.lba5 = (lba >> 40) & 0xff;
+    if (queued) {
+        // First-party DMA commands carry the sector count in the feature
+        // register and the command slot they were issued in as their tag.
+        fis.feature_low = count & 0xff;
+        fis.feature_high = count >> 8;
+        fis.count_low = tag << 3;
+    } else {
+        fis.count_low = count & 0xff;
+        fis.count_high = count >> 8;
+    }
+}
+
+static size_t append_prd_entry(u8* table, size_t entry_count, PhysicalAddress paddr, u32 size)
+{
+    auto* prdt = reinterpret_cast<AHCIPhysicalRegionDescriptor*>(table + command_table_prdt_offset);
+    if (entry_count) {
+        // Adjacent pages often turn out to be physically contiguous too.
+        auto& last = prdt[entry_count - 1];
+        u32 last_size = (last.byte_count & 0x3fffff) + 1;
+        if (last.data_base + last_size == paddr.get() && last_size + size <= AHCI_PRD_MAX_BYTE_COUNT) {
+            last.byte_count = last_size + size - 1;
+            return entry_count;
+        }
+    }
+    ASSERT(entry_count < (PAGE_SIZE - command_table_prdt_offset) / sizeof(AHCIPhysicalRegionDescriptor));
+    auto& entry = prdt[entry_count];
+    entry.data_base = paddr.get();
+    entry.data_base_upper = 0;
+    entry.reserved = 0;
+    entry.byte_count = size - 1;
+    return entry_count + 1;
+}
+
+RefPtr<AHCIDiskDevice> AHCIDiskDevice::create(AHCIController& controller, u8 port_index, int major, int minor)
+{
+    auto disk = adopt(*new AHCIDiskDevice(controller, port_index, major, minor));
+    if (!disk->initialize())
+        return nullptr;
+    return disk;
+}
+
+AHCIDiskDevice::AHCIDiskDevice(AHCIController& controller, u8 port_index, int major, int minor)
+    : BlockDevice(major, minor, 512)
+    , m_controller(controller)
+    , m_port_index(port_index)
+{
+}
+
+AHCIDiskDevice::~AHCIDiskDevice()
+{
+}
+
+const char* AHCIDiskDevice::class_name() const
+{
+    return "AHCIDiskDevice";
+}
+
+volatile AHCIPortRegisters& AHCIDiskDevice::port()
+{
+    return m_controller.registers().ports[m_port_index];
+}
+
+u8* AHCIDiskDevice::command_table(u8 slot)
+{
+    return m_command_table_pages[slot]->paddr().offset(0xc0000000).as_ptr();
+}
+
+void AHCIDiskDevice::set_command_header(u8 slot, size_t prdt_entry_count, bool write)
+{
+    auto* command_list = reinterpret_cast<AHCICommandHeader*>(m_command_list_page->paddr().offset(0xc0000000).as_ptr());
+    auto& header = command_list[slot];
+    header.flags = (sizeof(RegisterHostToDeviceFIS) / sizeof(u32)) | (write ? AHCI_COMMAND_HEADER_WRITE : 0);
+    header.prdt_length = prdt_entry_count;
+    header.prd_byte_count = 0;
+    header.command_table_base = m_command_table_pages[slot]->paddr().get();
+    header.command_table_base_upper = 0;
+    // Make sure the command is all there before the HBA gets to see it.
+    memory_barrier();
+}
+
+bool AHCIDiskDevice::stop_command_engine()
+{
+    port().command = port().command & ~AHCI_PORT_CMD_ST;
+    return wait_for(port().command, AHCI_PORT_CMD_CR, 0, 500);
+}
+
+bool AHCIDiskDevice::start_command_engine()
+{
+    if (!wait_for(port().command, AHCI_PORT_CMD_CR, 0, 500))
+        return false;
+    port().command = port().command | AHCI_PORT_CMD_FRE;
+    if (!wait_for(port().task_file_data, ATA_SR_BSY | ATA_SR_DRQ, 0, 1000))
+        return false;
+    port().command = port().command | AHCI_PORT_CMD_ST;
+    return true;
+}
+
+bool AHCIDiskDevice::initialize()
+{
+    if ((port().sata_status & 0xf) != AHCI_SSTS_DET_PRESENT)
+        return false;
+
+    // The firmware may have left the port running with its own memory set up.
+    if (!stop_command_engine())
+        return false;
+    port().command = port().command & ~AHCI_PORT_CMD_FRE;
+    if (!wait_for(port().command, AHCI_PORT_CMD_FR, 0, 500))
+        return false;
+
+    m_command_list_page = MM.allocate_supervisor_physical_page();
+    m_command_table_pages[0] = MM.allocate_supervisor_physical_page();
+    if (!m_command_list_page || !m_command_table_pages[0])
+        return false;
+    port().command_list_base = m_command_list_page->paddr().get();
+    port().command_list_base_upper = 0;
+    port().fis_base = m_command_list_page->paddr().offset(received_fis_offset).get();
+    port().fis_base_upper = 0;
+
+    port().interrupt_enable = 0;
+    port().sata_error = 0xffffffff;
+    port().interrupt_status = 0xffffffff;
+    port().command = port().command | AHCI_PORT_CMD_SUD | AHCI_PORT_CMD_POD;
+
+    if (!start_command_engine()) {
+        klog() << "AHCIDiskDevice: Port " << m_port_index << " didn't come up";
+        return false;
+    }
+
+    if (port().signature != AHCI_SIG_ATA) {
+        klog() << "AHCIDiskDevice: Port " << m_port_index << ": Ignoring device with signature " << String::format("%08x", port().signature);
+        stop_command_engine();
+        return false;
+    }
+
+    if (!identify()) {
+        klog() << "AHCIDiskDevice: Port " << m_port_index << ": IDENTIFY failed";
+        stop_command_engine();
+        return false;
+    }
+
+    for (size_t slot = 1; slot < m_command_slot_count; ++slot) {
+        m_command_table_pages[slot] = MM.allocate_supervisor_physical_page();
+        if (!m_command_table_pages[slot]) {
+            m_command_slot_count = slot;
+            break;
+        }
+    }
+
+    port().interrupt_status = 0xffffffff;
+    port().interrupt_enable = AHCI_PORT_INTERRUPTS;
+    return true;
+}
+
+bool AHCIDiskDevice::execute_polled_command(u8 command, PhysicalAddress buffer, size_t size)
+{
+    auto* table = command_table(0);
+    write_command_fis(table, command, 0, 0, false, 0);
+    size_t entry_count = append_prd_entry(table, 0, buffer, size);
+    set_command_header(0, entry_count, false);
+    port().command_issue = 1;
+
+    for (size_t i = 0; i < 1000; ++i) {
+        if (port().interrupt_status & AHCI_PORT_IS_ERRORS)
+            return false;
+        if (!(port().command_issue & 1))
+            return !(port().task_file_data & ATA_SR_ERR);
+        IO::delay(1000);
+    }
+    return false;
+}
+
+bool AHCIDiskDevice::identify()
+{
+    auto buffer_page = MM.allocate_supervisor_physical_page();
+    if (!buffer_page || !execute_polled_command(ATA_CMD_IDENTIFY, buffer_page->paddr(), 512))
+        return false;
+
+    auto* words = reinterpret_cast<const u16*>(buffer_page->paddr().offset(0xc0000000).as_ptr());
+    if (words[83] & (1 << 10))
+        m_block_count = (u64)words[100] | ((u64)words[101] << 16) | ((u64)words[102] << 32) | ((u64)words[103] << 48);
+    else
+        m_block_count = (u64)words[60] | ((u64)words[61] << 16);
+
+    bool drive_supports_ncq = words[76] & (1 << 8);
+    size_t queue_depth = (words[75] & 0x1f) + 1;
+    m_ncq_enabled = m_controller.supports_ncq() && drive_supports_ncq;
+    // Without NCQ the drive only ever works on one command at a time anyway.
+    m_command_slot_count = m_ncq_enabled ? min(m_controller.command_slot_count(), queue_depth) : 1;
+
+    StringBuilder model;
+    for (size_t i = 27; i <= 46; ++i) {
+        model.append((char)(words[i] >> 8));
+        model.append((char)(words[i] & 0xff));
+    }
+    klog() << "AHCIDiskDevice: Port " << m_port_index << ": " << model.to_string().trim_whitespace() << ", " << m_block_count << " sectors, " << (m_ncq_enabled ? "NCQ" : "no NCQ") << " with " << m_command_slot_count << " command slot(s)";
+    return true;
+}
+
+void AHCIDiskDevice::submit_requests(Span<NonnullRefPtr<AsyncBlockDeviceRequest>> requests)
+{
+    queue_requests(requests);
+    issue_transfers();
+}
+
+void AHCIDiskDevice::issue_transfers()
+{
+    ScopedSpinLock lock(m_slot_lock);
+    if (m_recovering)
+        return;
+    for (u8 slot = 0; slot < m_command_slot_count; ++slot) {
+        if (m_busy_slots & (1u << slot))
+            continue;
+        auto& transfer = m_slot_transfers[slot];
+        if (!take_next_transfer(transfer))
+            return;
+
+        auto& first = *transfer.first();
+        bool write = first.type() == AsyncBlockDeviceRequest::Type::Write;
+        u32 block_count = 0;
+        auto* table = command_table(slot);
+        size_t entry_count = 0;
+        for (auto* request : transfer) {
+            block_count += request->block_count();
+            for (auto& segment : request->segments())
+                entry_count = append_prd_entry(table, entry_count, segment.paddr, segment.size);
+        }
+        ASSERT(block_count <= 0xffff);
+
+        u8 command;
+        if (m_ncq_enabled)
+            command = write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+        else
+            command = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+        write_command_fis(table, command, first.block_index(), block_count, m_ncq_enabled, slot);
+        set_command_header(slot, entry_count, write);
+
+#ifdef AHCI_DEBUG
+        klog() << "AHCIDiskDevice: Issuing slot " << slot << ": " << (write ? "write" : "read") << " " << first.block_index() << " x" << block_count << " in " << entry_count << " PRD(s)";
+#endif
+        m_busy_slots |= 1u << slot;
+        if (m_ncq_enabled)
+            port().sata_active = 1u << slot;
+        port().command_issue = 1u << slot;
+    }
+}
+
+void AHCIDiskDevice::complete_slot(u8 slot, bool success)
+{
+    TransferRequests transfer;
+    {
+        ScopedSpinLock lock(m_slot_lock);
+        ASSERT(m_busy_slots & (1u << slot));
+        transfer = move(m_slot_transfers[slot]);
+        m_slot_transfers[slot].clear_with_capacity();
+        m_busy_slots &= ~(1u << slot);
+    }
+    complete_transfer(transfer, success);
+}
+
+void AHCIDiskDevice::recover_from_error()
+{
+    klog() << "AHCIDiskDevice: Port " << m_port_index << ": Error, IS=" << String::format("%08x", port().interrupt_status) << " TFD=" << String::format("%08x", port().task_file_data) << " SERR=" << String::format("%08x", port().sata_error);
+
+    // Stopping the command engine drops every command in flight. We don't
+    // try to find out which one the drive choked on; they all fail. Since
+    // nothing was issued after the error, that's everything that's busy.
+    stop_command_engine();
+    u32 failed_slots;
+    {
+        ScopedSpinLock lock(m_slot_lock);
+        ASSERT(m_recovering);
+        failed_slots = m_busy_slots;
+    }
+    port().sata_error = 0xffffffff;
+    port().interrupt_status = 0xffffffff;
+
+    if (port().task_file_data & (ATA_SR_BSY | ATA_SR_DRQ)) {
+        // The drive is wedged, so give it a COMRESET.
+        port().sata_control = (port().sata_control & ~0xf) | 1;
+        IO::delay(1000);
+        port().sata_control = port().sata_control & ~0xf;
+        wait_for(port().sata_status, 0xf, AHCI_SSTS_DET_PRESENT, 1000);
+        port().sata_error = 0xffffffff;
+    }
+
+    if (!start_command_engine())
+        klog() << "AHCIDiskDevice: Port " << m_port_index << ": Couldn't restart after error";
+
+    {
+        ScopedSpinLock lock(m_slot_lock);
+        m_recovering = false;
+    }
+    port().interrupt_status = 0xffffffff;
+    port().interrupt_enable = AHCI_PORT_INTERRUPTS;
+
+    for (u8 slot = 0; slot < 32; ++slot) {
+        if (failed_slots & (1u << slot))
+            complete_slot(slot, false);
+    }
+    issue_transfers();
+}
+
+void AHCIDiskDevice::handle_interrupt()
+{
+    u32 status = port().interrupt_status;
+    port().interrupt_status = status;
+
+    if (status & AHCI_PORT_IS_ERRORS) {
+        // Keep the port quiet until the recovery task got it going again.
+        port().interrupt_enable = 0;
+        {
+            ScopedSpinLock lock(m_slot_lock);
+            m_recovering = true;
+        }
+        m_controller.schedule_recovery(m_port_index);
+        return;
+    }
+
+    u32 finished_slots;
+    {
+        ScopedSpinLock lock(m_slot_lock);
+        // Queued commands are done once the drive clears their SActive bit,
+        // everything else once the HBA clears the command issue bit.
+        u32 busy_slots = port().command_issue | (m_ncq_enabled ? port().sata_active : 0);
+        finished_slots = m_busy_slots & ~busy_slots;
+    }
+    for (u8 slot = 0; finished_slots && slot < 32; ++slot) {
+        if (!(finished_slots & (1u << slot)))
+            continue;
+        finished_slots &= ~(1u << slot);
+        complete_slot(slot, true);
+    }
+    issue_transfers();
+}
+
+bool AHCIDiskDevice::read_blocks(unsigned index, u16 count, u8* out)
+{
+    return transfer_blocks(AsyncBlockDeviceRequest::Type::Read, index, count, out);
+}
+
+bool AHCIDiskDevice::write_blocks(unsigned index, u16 count, const u8* data)
+{
+    return transfer_blocks(AsyncBlockDeviceRequest::Type::Write, index, count, const_cast<u8*>(data));
+}
+
+KResultOr<size_t> AHCIDiskDevice::read(FileDescription&, size_t offset, u8* outbuf, size_t len)
+{
+    return read_with_requests(offset, outbuf, len);
+}
+
+bool AHCIDiskDevice::can_read(const FileDescription&, size_t offset) const
+{
+    return offset < m_block_count * block_size();
+}
+
+KResultOr<size_t> AHCIDiskDevice::write(FileDescription&, size_t offset, const u8* inbuf, size_t len)
+{
+    return write_with_requests(offset, inbuf, len);
+}
+
+bool AHCIDiskDevice::can_write(const FileDescription&, size_t offset) const
+{
+    return offset < m_block_count * block_size();
+}
+
+}
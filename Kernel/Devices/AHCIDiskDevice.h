@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+//
+// A SATA drive attached to a port of an AHCI controller
+//
+// With native command queuing, the drive is handed up to 32 commands at
+// once and is free to complete them in whatever order suits it best.
+//
+
+#pragma once
+
+#include <Kernel/Devices/BlockDevice.h>
+#include <Kernel/SpinLock.h>
+#include <Kernel/VM/PhysicalPage.h>
+
+namespace Kernel {
+
+class AHCIController;
+struct AHCIPortRegisters;
+
+class AHCIDiskDevice final : public BlockDevice {
+    friend class AHCIController;
+public:
+    static RefPtr<AHCIDiskDevice> create(AHCIController&, u8 port_index, int major, int minor);
+    virtual ~AHCIDiskDevice() override;
+
+    // ^BlockDevice
+    virtual bool read_blocks(unsigned index, u16 count, u8*) override;
+    virtual bool write_blocks(unsigned index, u16 count, const u8*) override;
+    virtual void submit_requests(Span<NonnullRefPtr<AsyncBlockDeviceRequest>>) override;
+
+    virtual KResultOr<size_t> read(FileDescription&, size_t, u8*, size_t) override;
+    virtual bool can_read(const FileDescription&, size_t) const override;
+    virtual KResultOr<size_t> write(FileDescription&, size_t, const u8*, size_t) override;
+    virtual bool can_write(const FileDescription&, size_t) const override;
+
+    bool is_ncq_enabled() const { return m_ncq_enabled; }
+    size_t command_slot_count() const { return m_command_slot_count; }
+
+protected:
+    AHCIDiskDevice(AHCIController&, u8 port_index, int major, int minor);
+
+    // Each command table fills a page: the command FIS area followed by the PRDT.
+    static constexpr size_t max_prdt_entries = (PAGE_SIZE - 0x80) / 16;
+
+    // ^BlockDevice
+    virtual size_t max_blocks_per_transfer() const override { return 1024; }
+    virtual size_t max_segments_per_transfer() const override { return max_prdt_entries; }
+
+private:
+    // ^DiskDevice
+    virtual const char* class_name() const override;
+
+    volatile AHCIPortRegisters& port();
+
+    bool initialize();
+    bool start_command_engine();
+    bool stop_command_engine();
+    bool identify();
+    void recover_from_error();
+
+    u8* command_table(u8 slot);
+    void set_command_header(u8 slot, size_t prdt_entry_count, bool write);
+    bool execute_polled_command(u8 command, PhysicalAddress, size_t size);
+    void issue_transfers();
+    void handle_interrupt();
+    void complete_slot(u8 slot, bool success);
+
+    AHCIController& m_controller;
+    u8 m_port_index { 0 };
+    u64 m_block_count { 0 };
+    bool m_ncq_enabled { false };
+    size_t m_command_slot_count { 1 };
+
+    // The command list (1 KiB) and the received FIS area (256 bytes) share a page.
+    RefPtr<PhysicalPage> m_command_list_page;
+    RefPtr<PhysicalPage> m_command_table_pages[32];
+
+    SpinLock<u8> m_slot_lock;
+    u32 m_busy_slots { 0 };
+    // Set from the moment an error is noticed until the port has been
+    // restarted. Nothing gets issued in the meantime.
+    bool m_recovering { false };
+    TransferRequests m_slot_transfers[32];
+};
+
+}
@@ -24,10 +24,58 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <AK/ByteBuffer.h>
 #include <Kernel/Devices/BlockDevice.h>
+#include <Kernel/StdLib.h>
+#include <Kernel/Thread.h>
+#include <Kernel/VM/MemoryManager.h>
+
+//#define BLOCK_REQUEST_DEBUG
 
 namespace Kernel {
 
+auto AsyncBlockDeviceRequest::wait() -> Result
+{
+    // If we complete between checking and going to sleep, the wake is
+    // remembered by the WaitQueue and we'll come right back around.
+    while (m_result == Result::Pending)
+        Thread::current()->wait_on(m_completion_queue, "BlockRequest");
+    return m_result;
+}
+
+bool AsyncBlockDeviceRequest::build_segments(size_t block_size)
+{
+    VirtualAddress vaddr(m_buffer);
+    size_t remaining = m_block_count * block_size;
+    if (is_user_address(vaddr)) {
+        klog() << "AsyncBlockDeviceRequest: Can't transfer directly to or from " << vaddr;
+        return false;
+    }
+    m_segments.ensure_capacity(remaining / PAGE_SIZE + 2);
+    while (remaining) {
+        size_t size = min(remaining, (size_t)(PAGE_SIZE - (vaddr.get() & ~PAGE_MASK)));
+        auto paddr = MM.physical_address_for_kernel_vaddr(vaddr);
+        if (paddr.is_null())
+            return false;
+        m_segments.append({ paddr, (u32)size });
+        vaddr = vaddr.offset(size);
+        remaining -= size;
+    }
+    return true;
+}
+
+void AsyncBlockDeviceRequest::complete(Result result)
+{
+    ASSERT(result != Result::Pending);
+    // Whoever is waiting may drop the last reference as soon as it sees the
+    // result, so make sure we stay alive until we're done here.
+    NonnullRefPtr<AsyncBlockDeviceRequest> protector(*this);
+    m_result = result;
+    if (on_complete)
+        on_complete(*this);
+    m_completion_queue.wake_all();
+}
+
 BlockDevice::~BlockDevice()
 {
 }
@@ -62,4 +110,300 @@ bool BlockDevice::write_raw(u32 offset, unsigned length, const u8* in)
     return write_blocks(first_block, end_block - first_block, in);
 }
 
+void BlockDevice::submit_request(AsyncBlockDeviceRequest& request)
+{
+    NonnullRefPtr<AsyncBlockDeviceRequest> request_ref(request);
+    submit_requests({ &request_ref, 1 });
+}
+
+void BlockDevice::queue_requests(Span<NonnullRefPtr<AsyncBlockDeviceRequest>> requests)
+{
+    for (auto& request : requests) {
+        ASSERT(request->block_count());
+        if (max_segments_per_transfer() && !request->build_segments(block_size()))
+            request->complete(AsyncBlockDeviceRequest::Result::Failure);
+    }
+
+    ScopedSpinLock lock(m_request_lock);
+    for (auto& request : requests) {
+        if (request->is_complete())
+            continue;
+        // Keep pending requests sorted by block index for the elevator.
+        size_t low = 0;
+        size_t high = m_pending_requests.size();
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            if (m_pending_requests[middle]->block_index() <= request->block_index())
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        m_pending_requests.insert(low, request.ptr());
+        ++m_statistics.submitted_requests;
+    }
+
+    u32 queue_depth = m_pending_requests.size() + m_requests_in_flight;
+    if (queue_depth > m_statistics.max_queue_depth)
+        m_statistics.max_queue_depth = queue_depth;
+}
+
+void BlockDevice::submit_requests(Span<NonnullRefPtr<AsyncBlockDeviceRequest>> requests)
+{
+    queue_requests(requests);
+    {
+        ScopedSpinLock lock(m_request_lock);
+        // Whoever is already servicing requests will pick these up.
+        if (m_requests_in_progress || m_pending_requests.is_empty())
+            return;
+        m_requests_in_progress = true;
+    }
+    start_next_requests();
+}
+
+u32 BlockDevice::pick_next_transfer(TransferRequests& transfer)
+{
+    ASSERT(m_request_lock.is_locked());
+    ASSERT(transfer.is_empty());
+    ASSERT(!m_pending_requests.is_empty());
+
+    // Sweep upwards from where the last transfer ended and wrap around to
+    // the lowest pending block once we run off the end (C-LOOK).
+    size_t index = 0;
+    while (index < m_pending_requests.size() && m_pending_requests[index]->block_index() < m_elevator_position)
+        ++index;
+    if (index == m_pending_requests.size())
+        index = 0;
+
+    auto* first = m_pending_requests.take(index);
+    transfer.append(first);
+    u32 block_count = first->block_count();
+    size_t segment_count = first->segments().size();
+
+    // Requests that pick up exactly where the previous one ends can go out
+    // as part of the same transfer.
+    while (index < m_pending_requests.size()) {
+        auto* next = m_pending_requests[index];
+        if (next->block_index() != first->block_index() + block_count || next->type() != first->type())
+            break;
+        if (block_count + next->block_count() > max_blocks_per_transfer())
+            break;
+        if (max_segments_per_transfer() && segment_count + next->segments().size() > max_segments_per_transfer())
+            break;
+        m_pending_requests.remove(index);
+        transfer.append(next);
+        block_count += next->block_count();
+        segment_count += next->segments().size();
+        ++m_statistics.merged_requests;
+    }
+
+    m_elevator_position = first->block_index() + block_count;
+    m_requests_in_flight += transfer.size();
+    ++m_statistics.transfers;
+#ifdef BLOCK_REQUEST_DEBUG
+    klog() << "BlockDevice: Starting " << transfer.size() << " request(s) at block " << first->block_index() << " x" << block_count;
+#endif
+    return block_count;
+}
+
+bool BlockDevice::take_next_transfer(TransferRequests& transfer)
+{
+    ScopedSpinLock lock(m_request_lock);
+    if (m_pending_requests.is_empty())
+        return false;
+    pick_next_transfer(transfer);
+    return true;
+}
+
+void BlockDevice::complete_transfer(TransferRequests& transfer, bool success)
+{
+    ASSERT(!transfer.is_empty());
+    {
+        ScopedSpinLock lock(m_request_lock);
+        if (success) {
+            u32 block_count = 0;
+            for (auto* request : transfer)
+                block_count += request->block_count();
+            if (transfer.first()->type() == AsyncBlockDeviceRequest::Type::Read)
+                m_statistics.blocks_read += block_count;
+            else
+                m_statistics.blocks_written += block_count;
+        } else {
+            m_statistics.failed_requests += transfer.size();
+        }
+        m_requests_in_flight -= transfer.size();
+    }
+
+    auto result = success ? AsyncBlockDeviceRequest::Result::Success : AsyncBlockDeviceRequest::Result::Failure;
+    for (auto* request : transfer)
+        request->complete(result);
+    transfer.clear_with_capacity();
+}
+
+void BlockDevice::start_next_requests()
+{
+    for (;;) {
+        {
+            ScopedSpinLock lock(m_request_lock);
+            ASSERT(m_requests_in_progress);
+            if (m_pending_requests.is_empty()) {
+                m_requests_in_progress = false;
+                return;
+            }
+            m_active_block_count = pick_next_transfer(m_active_requests);
+            m_starting_requests = true;
+        }
+
+        start_active_requests();
+
+        ScopedSpinLock lock(m_request_lock);
+        m_starting_requests = false;
+        // If the device hasn't completed the requests yet, it will carry on
+        // from complete_active_requests() when it does.
+        if (!m_active_requests.is_empty())
+            return;
+    }
+}
+
+void BlockDevice::start_active_requests()
+{
+    bool success = true;
+    for_each_active_request([&](auto& request) {
+        if (!success)
+            return;
+        if (request.type() == AsyncBlockDeviceRequest::Type::Read)
+            success = read_blocks(request.block_index(), request.block_count(), request.buffer());
+        else
+            success = write_blocks(request.block_index(), request.block_count(), request.buffer());
+    });
+    complete_active_requests(success);
+}
+
+void BlockDevice::complete_active_requests(bool success)
+{
+    TransferRequests completed_requests;
+    bool should_continue;
+    {
+        ScopedSpinLock lock(m_request_lock);
+        ASSERT(!m_active_requests.is_empty());
+        for (auto* request : m_active_requests)
+            completed_requests.append(request);
+        m_active_requests.clear_with_capacity();
+        m_active_block_count = 0;
+        should_continue = !m_starting_requests;
+    }
+
+    complete_transfer(completed_requests, success);
+
+    if (should_continue)
+        start_next_requests();
+}
+
+bool BlockDevice::transfer_blocks(AsyncBlockDeviceRequest::Type type, u32 index, u32 count, u8* buffer)
+{
+    u32 blocks_per_request = min((u32)max_blocks_per_transfer(), (u32)0xffff);
+    Vector<NonnullRefPtr<AsyncBlockDeviceRequest>, 8> requests;
+    while (count) {
+        u32 request_count = min(count, blocks_per_request);
+        requests.append(AsyncBlockDeviceRequest::create(type, index, request_count, buffer));
+        index += request_count;
+        count -= request_count;
+        buffer += request_count * block_size();
+    }
+    submit_requests(requests);
+
+    bool success = true;
+    for (auto& request : requests) {
+        if (request->wait() != AsyncBlockDeviceRequest::Result::Success)
+            success = false;
+    }
+    return success;
+}
+
+KResultOr<size_t> BlockDevice::read_with_requests(size_t offset, u8* outbuf, size_t len)
+{
+    unsigned index = offset / block_size();
+    size_t whole_blocks = len / block_size();
+    ssize_t remaining = len % block_size();
+
+    // Userspace buffers can't be handed to the controller, so we bounce them
+    // through the kernel one transfer at a time.
+    bool is_user_buffer = is_user_address(VirtualAddress(outbuf));
+    if (is_user_buffer && whole_blocks >= max_blocks_per_transfer()) {
+        whole_blocks = max_blocks_per_transfer();
+        remaining = 0;
+    }
+
+    if (whole_blocks > 0) {
+        if (is_user_buffer) {
+            auto buf = ByteBuffer::create_uninitialized(whole_blocks * block_size());
+            if (!transfer_blocks(AsyncBlockDeviceRequest::Type::Read, index, whole_blocks, buf.data()))
+                return -1;
+            copy_to_user(outbuf, buf.data(), buf.size());
+        } else if (!transfer_blocks(AsyncBlockDeviceRequest::Type::Read, index, whole_blocks, outbuf)) {
+            return -1;
+        }
+    }
+
+    off_t pos = whole_blocks * block_size();
+
+    if (remaining > 0) {
+        auto buf = ByteBuffer::create_uninitialized(block_size());
+        if (!read_blocks(index + whole_blocks, 1, buf.data()))
+            return pos;
+        if (is_user_buffer)
+            copy_to_user(&outbuf[pos], buf.data(), remaining);
+        else
+            memcpy(&outbuf[pos], buf.data(), remaining);
+    }
+
+    return pos + remaining;
+}
+
+KResultOr<size_t> BlockDevice::write_with_requests(size_t offset, const u8* inbuf, size_t len)
+{
+    unsigned index = offset / block_size();
+    size_t whole_blocks = len / block_size();
+    ssize_t remaining = len % block_size();
+
+    bool is_user_buffer = is_user_address(VirtualAddress(inbuf));
+    if (is_user_buffer && whole_blocks >= max_blocks_per_transfer()) {
+        whole_blocks = max_blocks_per_transfer();
+        remaining = 0;
+    }
+
+    if (whole_blocks > 0) {
+        if (is_user_buffer) {
+            auto buf = ByteBuffer::create_uninitialized(whole_blocks * block_size());
+            copy_from_user(buf.data(), inbuf, buf.size());
+            if (!transfer_blocks(AsyncBlockDeviceRequest::Type::Write, index, whole_blocks, buf.data()))
+                return -1;
+        } else if (!transfer_blocks(AsyncBlockDeviceRequest::Type::Write, index, whole_blocks, const_cast<u8*>(inbuf))) {
+            return -1;
+        }
+    }
+
+    off_t pos = whole_blocks * block_size();
+
+    // Partial blocks have to be read, modified and written back whole.
+    if (remaining > 0) {
+        auto buf = ByteBuffer::create_zeroed(block_size());
+        if (!read_blocks(index + whole_blocks, 1, buf.data()))
+            return pos;
+        if (is_user_buffer)
+            copy_from_user(buf.data(), &inbuf[pos], remaining);
+        else
+            memcpy(buf.data(), &inbuf[pos], remaining);
+        if (!write_blocks(index + whole_blocks, 1, buf.data()))
+            return pos;
+    }
+
+    return pos + remaining;
+}
+
+auto BlockDevice::request_queue_statistics() const -> RequestQueueStatistics
+{
+    ScopedSpinLock lock(m_request_lock);
+    return m_statistics;
+}
+
 }
@@ -26,10 +26,80 @@
 
 #pragma once
 
+#include <AK/Function.h>
+#include <AK/RefCounted.h>
+#include <AK/Span.h>
+#include <AK/Vector.h>
 #include <Kernel/Devices/Device.h>
+#include <Kernel/PhysicalAddress.h>
+#include <Kernel/SpinLock.h>
+#include <Kernel/WaitQueue.h>
 
 namespace Kernel {
 
+class AsyncBlockDeviceRequest : public RefCounted<AsyncBlockDeviceRequest> {
+public:
+    enum class Type {
+        Read,
+        Write,
+    };
+
+    enum class Result {
+        Pending,
+        Success,
+        Failure,
+    };
+
+    // One physically contiguous piece of the request buffer, never crossing a page boundary.
+    struct Segment {
+        PhysicalAddress paddr;
+        u32 size { 0 };
+    };
+
+    static NonnullRefPtr<AsyncBlockDeviceRequest> create(Type type, u32 block_index, u32 block_count, u8* buffer)
+    {
+        return adopt(*new AsyncBlockDeviceRequest(type, block_index, block_count, buffer));
+    }
+
+    Type type() const { return m_type; }
+    u32 block_index() const { return m_block_index; }
+    u32 block_count() const { return m_block_count; }
+    u8* buffer() const { return m_buffer; }
+    const Vector<Segment>& segments() const { return m_segments; }
+
+    Result result() const { return m_result; }
+    bool is_complete() const { return m_result != Result::Pending; }
+
+    // Blocks the current thread until the request has completed.
+    Result wait();
+
+    // Called once the request has completed, possibly from an IRQ handler.
+    Function<void(AsyncBlockDeviceRequest&)> on_complete;
+
+private:
+    friend class BlockDevice;
+    friend class DiskPartition;
+
+    AsyncBlockDeviceRequest(Type type, u32 block_index, u32 block_count, u8* buffer)
+        : m_type(type)
+        , m_block_index(block_index)
+        , m_block_count(block_count)
+        , m_buffer(buffer)
+    {
+    }
+
+    bool build_segments(size_t block_size);
+    void complete(Result);
+
+    Type m_type;
+    u32 m_block_index { 0 };
+    u32 m_block_count { 0 };
+    u8* m_buffer { nullptr };
+    Vector<Segment> m_segments;
+    volatile Result m_result { Result::Pending };
+    WaitQueue m_completion_queue;
+};
+
 class BlockDevice : public Device {
 public:
     virtual ~BlockDevice() override;
@@ -45,6 +115,28 @@ public:
     virtual bool read_blocks(unsigned index, u16 count, u8*) = 0;
     virtual bool write_blocks(unsigned index, u16 count, const u8*) = 0;
 
+    // Queues requests without waiting for them. The caller must keep a reference
+    // to each request until it has completed. Pending requests are sorted by block
+    // index and requests that continue each other are merged into one transfer,
+    // so submitting related requests together gives them the best chance of that.
+    virtual void submit_requests(Span<NonnullRefPtr<AsyncBlockDeviceRequest>>);
+    void submit_request(AsyncBlockDeviceRequest&);
+
+    // Splits the transfer into requests the device can handle, keeps all of
+    // them in flight at once, and waits for them to complete.
+    bool transfer_blocks(AsyncBlockDeviceRequest::Type, u32 index, u32 count, u8* buffer);
+
+    struct RequestQueueStatistics {
+        u32 submitted_requests { 0 };
+        u32 merged_requests { 0 };
+        u32 transfers { 0 };
+        u32 failed_requests { 0 };
+        u32 max_queue_depth { 0 };
+        u64 blocks_read { 0 };
+        u64 blocks_written { 0 };
+    };
+    RequestQueueStatistics request_queue_statistics() const;
+
 protected:
     BlockDevice(unsigned major, unsigned minor, size_t block_size = PAGE_SIZE)
         : Device(major, minor)
@@ -52,10 +144,57 @@ protected:
     {
     }
 
+    // For devices that do all their I/O through requests: read() and write()
+    // on top of transfer_blocks(), bouncing userspace buffers through the kernel.
+    KResultOr<size_t> read_with_requests(size_t offset, u8*, size_t);
+    KResultOr<size_t> write_with_requests(size_t offset, const u8*, size_t);
+
+    virtual size_t max_blocks_per_transfer() const { return 0xffff; }
+    virtual size_t max_segments_per_transfer() const { return 0; }
+
+    // Starts servicing the active requests. The device must call
+    // complete_active_requests() once they're done, either right away or
+    // later from its IRQ handler. The default implementation performs the
+    // requests synchronously with read_blocks() and write_blocks().
+    virtual void start_active_requests();
+    void complete_active_requests(bool success);
+
+    AsyncBlockDeviceRequest::Type active_request_type() const { return m_active_requests.first()->type(); }
+    u32 active_block_index() const { return m_active_requests.first()->block_index(); }
+    u32 active_block_count() const { return m_active_block_count; }
+
+    template<typename Callback>
+    void for_each_active_request(Callback callback)
+    {
+        for (auto* request : m_active_requests)
+            callback(*request);
+    }
+
+    // Devices that can have several transfers in flight at once override
+    // submit_requests() with these and do their own dispatching. Transfers
+    // still come off the queue in elevator order with requests merged.
+    using TransferRequests = Vector<AsyncBlockDeviceRequest*, 16>;
+    void queue_requests(Span<NonnullRefPtr<AsyncBlockDeviceRequest>>);
+    bool take_next_transfer(TransferRequests&);
+    void complete_transfer(TransferRequests&, bool success);
+
 private:
     virtual bool is_block_device() const final { return true; }
 
+    void start_next_requests();
+    u32 pick_next_transfer(TransferRequests&);
+
     size_t m_block_size { 0 };
+
+    mutable SpinLock<u8> m_request_lock;
+    Vector<AsyncBlockDeviceRequest*> m_pending_requests;
+    TransferRequests m_active_requests;
+    u32 m_requests_in_flight { 0 };
+    u32 m_active_block_count { 0 };
+    u32 m_elevator_position { 0 };
+    bool m_requests_in_progress { false };
+    bool m_starting_requests { false };
+    RequestQueueStatistics m_statistics;
 };
 
 }
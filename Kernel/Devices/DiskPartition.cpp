@@ -110,6 +110,17 @@ bool DiskPartition::write_blocks(unsigned index, u16 count, const u8* data)
     return m_device->write_blocks(m_block_offset + index, count, data);
 }
 
+void DiskPartition::submit_requests(Span<NonnullRefPtr<AsyncBlockDeviceRequest>> requests)
+{
+    for (auto& request : requests) {
+#ifdef OFFD_DEBUG
+        klog() << "DiskPartition::submit_requests " << request->block_index() << " (really: " << (m_block_offset + request->block_index()) << ") count=" << request->block_count();
+#endif
+        request->m_block_index += m_block_offset;
+    }
+    m_device->submit_requests(requests);
+}
+
 const char* DiskPartition::class_name() const
 {
     return "DiskPartition";
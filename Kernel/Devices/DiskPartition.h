@@ -38,6 +38,7 @@ public:
 
     virtual bool read_blocks(unsigned index, u16 count, u8*) override;
     virtual bool write_blocks(unsigned index, u16 count, const u8*) override;
+    virtual void submit_requests(Span<NonnullRefPtr<AsyncBlockDeviceRequest>>) override;
 
     // ^BlockDevice
     virtual KResultOr<size_t> read(FileDescription&, size_t, u8*, size_t) override;
@@ -61,15 +61,21 @@ KResultOr<Region*> MBVGADevice::mmap(Process& process, FileDescription&, Virtual
     auto vmobject = AnonymousVMObject::create_for_physical_range(m_framebuffer_address, framebuffer_size_in_bytes());
     if (!vmobject)
         return KResult(-ENOMEM);
+    // Align the mapping so that the framebuffer can use large pages.
+    auto range = process.allocate_range(preferred_vaddr, framebuffer_size_in_bytes(), LARGE_PAGE_SIZE);
+    if (!range.is_valid())
+        return KResult(-ENOMEM);
     auto* region = process.allocate_region_with_vmobject(
-        preferred_vaddr,
-        framebuffer_size_in_bytes(),
+        range,
         vmobject.release_nonnull(),
         0,
         "MBVGA Framebuffer",
         prot);
+    if (!region)
+        return KResult(-ENOMEM);
+    region->set_wants_large_pages(true);
+    region->remap();
     dbg() << "MBVGADevice: mmap with size " << region->size() << " at " << region->vaddr();
-    ASSERT(region);
     return region;
 }
 
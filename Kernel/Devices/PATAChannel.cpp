@@ -165,8 +165,6 @@ void PATAChannel::initialize(bool force_pio)
     // Let's try to set up DMA transfers.
     PCI::enable_bus_mastering(pci_address());
     m_prdt_page = MM.allocate_supervisor_physical_page();
-    prdt().end_of_table = 0x8000;
-    m_dma_buffer_page = MM.allocate_supervisor_physical_page();
     klog() << "PATAChannel: Bus master IDE: " << m_bus_master_base;
 }
 
@@ -206,6 +204,10 @@ void PATAChannel::handle_irq(const RegisterState&)
 #ifdef PATA_DEBUG
     klog() << "PATAChannel: interrupt: DRQ=" << ((status & ATA_SR_DRQ) != 0) << " BSY=" << ((status & ATA_SR_BSY) != 0) << " DRDY=" << ((status & ATA_SR_DRDY) != 0);
 #endif
+    if (m_dma_device) {
+        complete_dma_transfer();
+        return;
+    }
     m_irq_queue.wake_all();
 }
 
@@ -274,45 +276,78 @@ void PATAChannel::detect_disks()
     }
 }
 
-bool PATAChannel::ata_read_sectors_with_dma(u32 lba, u16 count, u8* outbuf, bool slave_request)
+bool PATAChannel::can_use_dma()
 {
-    LOCKER(s_lock());
-#ifdef PATA_DEBUG
-    dbg() << "PATAChannel::ata_read_sectors_with_dma (" << lba << " x" << count << ") -> " << outbuf;
-#endif
+    return m_prdt_page && !m_bus_master_base.is_null() && m_dma_enabled.resource();
+}
 
-    prdt().offset = m_dma_buffer_page->paddr();
-    prdt().size = 512 * count;
+void PATAChannel::start_dma_requests(PATADiskDevice& device)
+{
+    {
+        ScopedSpinLock lock(m_dma_lock);
+        if (m_dma_device) {
+            // The other drive is busy, we'll get going when it's done.
+            ASSERT(m_dma_device != &device && !m_waiting_dma_device);
+            m_waiting_dma_device = &device;
+            return;
+        }
+        m_dma_device = &device;
+    }
+    issue_dma_transfer(device);
+}
 
-    ASSERT(prdt().size <= PAGE_SIZE);
+void PATAChannel::issue_dma_transfer(PATADiskDevice& device)
+{
+    // NOTE: This may be called from our IRQ handler, so it must not block.
+    auto* descriptors = prdt();
+    size_t entry_count = 0;
+    device.for_each_active_request([&](auto& request) {
+        for (auto& segment : request.segments()) {
+            ASSERT(entry_count < max_prdt_entries);
+            auto& descriptor = descriptors[entry_count++];
+            descriptor.offset = segment.paddr;
+            descriptor.size = segment.size;
+            descriptor.end_of_table = 0;
+        }
+    });
+    ASSERT(entry_count);
+    descriptors[entry_count - 1].end_of_table = 0x8000;
+
+    bool is_write = device.active_request_type() == AsyncBlockDeviceRequest::Type::Write;
+    u32 lba = device.active_block_index();
+    u16 count = device.active_block_count();
+#ifdef PATA_DEBUG
+    dbg() << "PATAChannel: DMA " << (is_write ? "write" : "read") << " (" << lba << " x" << count << ") using " << entry_count << " descriptor(s)";
+#endif
 
     // Stop bus master
     m_bus_master_base.out<u8>(0);
 
     // Write the PRDT location
-    m_bus_master_base.offset(4).out(m_prdt_page->paddr().get());
+    m_bus_master_base.offset(4).out<u32>(m_prdt_page->paddr().get());
 
     // Turn on "Interrupt" and "Error" flag. The error flag should be cleared by hardware.
     m_bus_master_base.offset(2).out<u8>(m_bus_master_base.offset(2).in<u8>() | 0x6);
 
     // Set transfer direction
-    m_bus_master_base.out<u8>(0x8);
+    m_bus_master_base.out<u8>(is_write ? 0x0 : 0x8);
 
     while (m_io_base.offset(ATA_REG_STATUS).in<u8>() & ATA_SR_BSY)
         ;
 
     m_control_base.offset(ATA_CTL_CONTROL).out<u8>(0);
-    m_io_base.offset(ATA_REG_HDDEVSEL).out<u8>(0x40 | (static_cast<u8>(slave_request) << 4));
+    m_io_base.offset(ATA_REG_HDDEVSEL).out<u8>(0x40 | (static_cast<u8>(device.is_slave()) << 4));
     io_delay();
 
     m_io_base.offset(ATA_REG_FEATURES).out<u16>(0);
 
-    m_io_base.offset(ATA_REG_SECCOUNT0).out<u8>(0);
-    m_io_base.offset(ATA_REG_LBA0).out<u8>(0);
+    // With the 48-bit commands, each register takes the high byte first.
+    m_io_base.offset(ATA_REG_SECCOUNT0).out<u8>(count >> 8);
+    m_io_base.offset(ATA_REG_LBA0).out<u8>((lba & 0xff000000) >> 24);
     m_io_base.offset(ATA_REG_LBA1).out<u8>(0);
     m_io_base.offset(ATA_REG_LBA2).out<u8>(0);
 
-    m_io_base.offset(ATA_REG_SECCOUNT0).out<u8>(count);
+    m_io_base.offset(ATA_REG_SECCOUNT0).out<u8>(count & 0xff);
     m_io_base.offset(ATA_REG_LBA0).out<u8>((lba & 0x000000ff) >> 0);
     m_io_base.offset(ATA_REG_LBA1).out<u8>((lba & 0x0000ff00) >> 8);
     m_io_base.offset(ATA_REG_LBA2).out<u8>((lba & 0x00ff0000) >> 16);
@@ -323,87 +358,39 @@ bool PATAChannel::ata_read_sectors_with_dma(u32 lba, u16 count, u8* outbuf, bool
             break;
     }
 
-    m_io_base.offset(ATA_REG_COMMAND).out<u8>(ATA_CMD_READ_DMA_EXT);
+    m_io_base.offset(ATA_REG_COMMAND).out<u8>(is_write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
     io_delay();
 
-    prepare_for_irq();
+    enable_irq();
     // Start bus master
-    m_bus_master_base.out<u8>(0x9);
-
-    wait_for_irq();
-
-    if (m_device_error)
-        return false;
-
-    memcpy(outbuf, m_dma_buffer_page->paddr().offset(0xc0000000).as_ptr(), 512 * count);
-
-    // I read somewhere that this may trigger a cache flush so let's do it.
-    m_bus_master_base.offset(2).out<u8>(m_bus_master_base.offset(2).in<u8>() | 0x6);
-    return true;
+    m_bus_master_base.out<u8>(is_write ? 0x1 : 0x9);
 }
 
-bool PATAChannel::ata_write_sectors_with_dma(u32 lba, u16 count, const u8* inbuf, bool slave_request)
+void PATAChannel::complete_dma_transfer()
 {
-    LOCKER(s_lock());
-#ifdef PATA_DEBUG
-    dbg() << "PATAChannel::ata_write_sectors_with_dma (" << lba << " x" << count << ") <- " << inbuf;
-#endif
-
-    prdt().offset = m_dma_buffer_page->paddr();
-    prdt().size = 512 * count;
-
-    memcpy(m_dma_buffer_page->paddr().offset(0xc0000000).as_ptr(), inbuf, 512 * count);
-
-    ASSERT(prdt().size <= PAGE_SIZE);
-
-    // Stop bus master
+    // Stop bus master, and clear the interrupt bit. I read somewhere that
+    // this may also trigger a cache flush so let's do it.
     m_bus_master_base.out<u8>(0);
-
-    // Write the PRDT location
-    m_bus_master_base.offset(4).out<u32>(m_prdt_page->paddr().get());
-
-    // Turn on "Interrupt" and "Error" flag. The error flag should be cleared by hardware.
     m_bus_master_base.offset(2).out<u8>(m_bus_master_base.offset(2).in<u8>() | 0x6);
-
-    while (m_io_base.offset(ATA_REG_STATUS).in<u8>() & ATA_SR_BSY)
-        ;
-
-    m_control_base.offset(ATA_CTL_CONTROL).out<u8>(0);
-    m_io_base.offset(ATA_REG_HDDEVSEL).out<u8>(0x40 | (static_cast<u8>(slave_request) << 4));
-    io_delay();
-
-    m_io_base.offset(ATA_REG_FEATURES).out<u16>(0);
-
-    m_io_base.offset(ATA_REG_SECCOUNT0).out<u8>(0);
-    m_io_base.offset(ATA_REG_LBA0).out<u8>(0);
-    m_io_base.offset(ATA_REG_LBA1).out<u8>(0);
-    m_io_base.offset(ATA_REG_LBA2).out<u8>(0);
-
-    m_io_base.offset(ATA_REG_SECCOUNT0).out<u8>(count);
-    m_io_base.offset(ATA_REG_LBA0).out<u8>((lba & 0x000000ff) >> 0);
-    m_io_base.offset(ATA_REG_LBA1).out<u8>((lba & 0x0000ff00) >> 8);
-    m_io_base.offset(ATA_REG_LBA2).out<u8>((lba & 0x00ff0000) >> 16);
-
-    for (;;) {
-        auto status = m_io_base.offset(ATA_REG_STATUS).in<u8>();
-        if (!(status & ATA_SR_BSY) && (status & ATA_SR_DRDY))
-            break;
+    bool success = !m_device_error;
+
+    PATADiskDevice* completed_device;
+    PATADiskDevice* next_device;
+    {
+        ScopedSpinLock lock(m_dma_lock);
+        completed_device = m_dma_device;
+        next_device = m_waiting_dma_device;
+        m_waiting_dma_device = nullptr;
+        m_dma_device = next_device;
     }
 
-    m_io_base.offset(ATA_REG_COMMAND).out<u8>(ATA_CMD_WRITE_DMA_EXT);
-    io_delay();
+    if (next_device)
+        issue_dma_transfer(*next_device);
+    else
+        disable_irq();
 
-    prepare_for_irq();
-    // Start bus master
-    m_bus_master_base.out<u8>(0x1);
-    wait_for_irq();
-
-    if (m_device_error)
-        return false;
-
-    // I read somewhere that this may trigger a cache flush so let's do it.
-    m_bus_master_base.offset(2).out<u8>(m_bus_master_base.offset(2).in<u8>() | 0x6);
-    return true;
+    // This may well start the next transfer for the same drive.
+    completed_device->complete_active_requests(success);
 }
 
 bool PATAChannel::ata_read_sectors(u32 lba, u16 count, u8* outbuf, bool slave_request)
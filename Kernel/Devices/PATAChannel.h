@@ -45,6 +45,7 @@
 #include <Kernel/PCI/Device.h>
 #include <Kernel/PhysicalAddress.h>
 #include <Kernel/Random.h>
+#include <Kernel/SpinLock.h>
 #include <Kernel/VM/PhysicalPage.h>
 #include <Kernel/WaitQueue.h>
 
@@ -84,8 +85,10 @@ private:
     void detect_disks();
 
     void wait_for_irq();
-    bool ata_read_sectors_with_dma(u32, u16, u8*, bool);
-    bool ata_write_sectors_with_dma(u32, u16, const u8*, bool);
+    bool can_use_dma();
+    void start_dma_requests(PATADiskDevice&);
+    void issue_dma_transfer(PATADiskDevice&);
+    void complete_dma_transfer();
     bool ata_read_sectors(u32, u16, u8*, bool);
     bool ata_write_sectors(u32, u16, const u8*, bool);
 
@@ -99,10 +102,18 @@ private:
 
     WaitQueue m_irq_queue;
 
-    PhysicalRegionDescriptor& prdt() { return *reinterpret_cast<PhysicalRegionDescriptor*>(m_prdt_page->paddr().offset(0xc0000000).as_ptr()); }
+    // Each descriptor covers at most one page of a request buffer, so the
+    // whole table always fits in a single page.
+    static constexpr size_t max_prdt_entries = 128;
+    PhysicalRegionDescriptor* prdt() { return reinterpret_cast<PhysicalRegionDescriptor*>(m_prdt_page->paddr().offset(0xc0000000).as_ptr()); }
     RefPtr<PhysicalPage> m_prdt_page;
-    RefPtr<PhysicalPage> m_dma_buffer_page;
     IOAddress m_bus_master_base;
+
+    // Only one drive on the channel can have a DMA transfer in flight. If the
+    // other one wants to start while we're busy, it waits its turn.
+    SpinLock<u8> m_dma_lock;
+    PATADiskDevice* m_dma_device { nullptr };
+    PATADiskDevice* m_waiting_dma_device { nullptr };
     Lockable<bool> m_dma_enabled;
     EntropySource m_entropy_source;
 
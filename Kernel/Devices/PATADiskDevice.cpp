@@ -31,6 +31,7 @@
 #include <Kernel/Devices/PATAChannel.h>
 #include <Kernel/Devices/PATADiskDevice.h>
 #include <Kernel/FileSystem/FileDescription.h>
+#include <Kernel/VM/MemoryManager.h>
 
 namespace Kernel {
 
@@ -57,15 +58,15 @@ const char* PATADiskDevice::class_name() const
 
 bool PATADiskDevice::read_blocks(unsigned index, u16 count, u8* out)
 {
-    if (!m_channel.m_bus_master_base.is_null() && m_channel.m_dma_enabled.resource())
-        return read_sectors_with_dma(index, count, out);
+    if (m_channel.can_use_dma())
+        return transfer_blocks(AsyncBlockDeviceRequest::Type::Read, index, count, out);
     return read_sectors(index, count, out);
 }
 
 bool PATADiskDevice::write_blocks(unsigned index, u16 count, const u8* data)
 {
-    if (!m_channel.m_bus_master_base.is_null() && m_channel.m_dma_enabled.resource())
-        return write_sectors_with_dma(index, count, data);
+    if (m_channel.can_use_dma())
+        return transfer_blocks(AsyncBlockDeviceRequest::Type::Write, index, count, const_cast<u8*>(data));
     for (unsigned i = 0; i < count; ++i) {
         if (!write_sectors(index + i, 1, data + i * 512))
             return false;
@@ -73,6 +74,36 @@ bool PATADiskDevice::write_blocks(unsigned index, u16 count, const u8* data)
     return true;
 }
 
+size_t PATADiskDevice::max_segments_per_transfer() const
+{
+    // Without a PRDT we can't do DMA at all, so there's no need to find out
+    // where request buffers live in physical memory.
+    return m_channel.m_prdt_page ? PATAChannel::max_prdt_entries : 0;
+}
+
+void PATADiskDevice::start_active_requests()
+{
+    // DMA may have been switched off while requests were queued. We can only
+    // fall back to PIO if we're not in the IRQ handler finishing a transfer.
+    if (m_channel.can_use_dma() || (m_channel.m_prdt_page && Processor::current().in_irq())) {
+        m_channel.start_dma_requests(*this);
+        return;
+    }
+
+    bool success = true;
+    for_each_active_request([&](auto& request) {
+        if (!success)
+            return;
+        if (request.type() == AsyncBlockDeviceRequest::Type::Read) {
+            success = read_sectors(request.block_index(), request.block_count(), request.buffer());
+            return;
+        }
+        for (u32 i = 0; success && i < request.block_count(); ++i)
+            success = write_sectors(request.block_index() + i, 1, request.buffer() + i * block_size());
+    });
+    complete_active_requests(success);
+}
+
 void PATADiskDevice::set_drive_geometry(u16 cyls, u16 heads, u16 spt)
 {
     m_cylinders = cyls;
@@ -80,18 +111,25 @@ void PATADiskDevice::set_drive_geometry(u16 cyls, u16 heads, u16 spt)
     m_sectors_per_track = spt;
 }
 
+size_t PATADiskDevice::max_blocks_per_call(const u8* buffer) const
+{
+    // Userspace buffers can't be handed to the controller, so we bounce them
+    // through the kernel one transfer at a time. Without DMA, we're limited
+    // by what the sector count register can express anyway.
+    if (!is_user_address(VirtualAddress(buffer)) && m_channel.can_use_dma())
+        return 0xffff;
+    return max_blocks_per_transfer();
+}
+
 KResultOr<size_t> PATADiskDevice::read(FileDescription&, size_t offset, u8* outbuf, size_t len)
 {
     unsigned index = offset / block_size();
-    u16 whole_blocks = len / block_size();
+    size_t whole_blocks = len / block_size();
     ssize_t remaining = len % block_size();
 
-    unsigned blocks_per_page = PAGE_SIZE / block_size();
-
-    // PATAChannel will chuck a wobbly if we try to read more than PAGE_SIZE
-    // at a time, because it uses a single page for its DMA buffer.
-    if (whole_blocks >= blocks_per_page) {
-        whole_blocks = blocks_per_page;
+    size_t max_blocks = max_blocks_per_call(outbuf);
+    if (whole_blocks >= max_blocks) {
+        whole_blocks = max_blocks;
         remaining = 0;
     }
 
@@ -100,8 +138,14 @@ KResultOr<size_t> PATADiskDevice::read(FileDescription&, size_t offset, u8* outb
 #endif
 
     if (whole_blocks > 0) {
-        if (!read_blocks(index, whole_blocks, outbuf))
+        if (is_user_address(VirtualAddress(outbuf))) {
+            auto buf = ByteBuffer::create_uninitialized(whole_blocks * block_size());
+            if (!read_blocks(index, whole_blocks, buf.data()))
+                return -1;
+            copy_to_user(outbuf, buf.data(), buf.size());
+        } else if (!read_blocks(index, whole_blocks, outbuf)) {
             return -1;
+        }
     }
 
     off_t pos = whole_blocks * block_size();
@@ -110,7 +154,10 @@ KResultOr<size_t> PATADiskDevice::read(FileDescription&, size_t offset, u8* outb
         auto buf = ByteBuffer::create_uninitialized(block_size());
         if (!read_blocks(index + whole_blocks, 1, buf.data()))
             return pos;
-        memcpy(&outbuf[pos], buf.data(), remaining);
+        if (is_user_address(VirtualAddress(outbuf)))
+            copy_to_user(&outbuf[pos], buf.data(), remaining);
+        else
+            memcpy(&outbuf[pos], buf.data(), remaining);
     }
 
     return pos + remaining;
@@ -124,15 +171,12 @@ bool PATADiskDevice::can_read(const FileDescription&, size_t offset) const
 KResultOr<size_t> PATADiskDevice::write(FileDescription&, size_t offset, const u8* inbuf, size_t len)
 {
     unsigned index = offset / block_size();
-    u16 whole_blocks = len / block_size();
+    size_t whole_blocks = len / block_size();
     ssize_t remaining = len % block_size();
 
-    unsigned blocks_per_page = PAGE_SIZE / block_size();
-
-    // PATAChannel will chuck a wobbly if we try to write more than PAGE_SIZE
-    // at a time, because it uses a single page for its DMA buffer.
-    if (whole_blocks >= blocks_per_page) {
-        whole_blocks = blocks_per_page;
+    size_t max_blocks = max_blocks_per_call(inbuf);
+    if (whole_blocks >= max_blocks) {
+        whole_blocks = max_blocks;
         remaining = 0;
     }
 
@@ -141,8 +185,14 @@ KResultOr<size_t> PATADiskDevice::write(FileDescription&, size_t offset, const u
 #endif
 
     if (whole_blocks > 0) {
-        if (!write_blocks(index, whole_blocks, inbuf))
+        if (is_user_address(VirtualAddress(inbuf))) {
+            auto buf = ByteBuffer::create_uninitialized(whole_blocks * block_size());
+            copy_from_user(buf.data(), inbuf, buf.size());
+            if (!write_blocks(index, whole_blocks, buf.data()))
+                return -1;
+        } else if (!write_blocks(index, whole_blocks, inbuf)) {
             return -1;
+        }
     }
 
     off_t pos = whole_blocks * block_size();
@@ -154,7 +204,10 @@ KResultOr<size_t> PATADiskDevice::write(FileDescription&, size_t offset, const u
         auto buf = ByteBuffer::create_zeroed(block_size());
         if (!read_blocks(index + whole_blocks, 1, buf.data()))
             return pos;
-        memcpy(buf.data(), &inbuf[pos], remaining);
+        if (is_user_address(VirtualAddress(inbuf)))
+            copy_from_user(buf.data(), &inbuf[pos], remaining);
+        else
+            memcpy(buf.data(), &inbuf[pos], remaining);
         if (!write_blocks(index + whole_blocks, 1, buf.data()))
             return pos;
     }
@@ -167,21 +220,11 @@ bool PATADiskDevice::can_write(const FileDescription&, size_t offset) const
     return offset < (m_cylinders * m_heads * m_sectors_per_track * block_size());
 }
 
-bool PATADiskDevice::read_sectors_with_dma(u32 lba, u16 count, u8* outbuf)
-{
-    return m_channel.ata_read_sectors_with_dma(lba, count, outbuf, is_slave());
-}
-
 bool PATADiskDevice::read_sectors(u32 start_sector, u16 count, u8* outbuf)
 {
     return m_channel.ata_read_sectors(start_sector, count, outbuf, is_slave());
 }
 
-bool PATADiskDevice::write_sectors_with_dma(u32 lba, u16 count, const u8* inbuf)
-{
-    return m_channel.ata_write_sectors_with_dma(lba, count, inbuf, is_slave());
-}
-
 bool PATADiskDevice::write_sectors(u32 start_sector, u16 count, const u8* inbuf)
 {
     return m_channel.ata_write_sectors(start_sector, count, inbuf, is_slave());
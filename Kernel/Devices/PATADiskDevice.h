@@ -40,6 +40,7 @@ class PATAChannel;
 
 class PATADiskDevice final : public BlockDevice {
     AK_MAKE_ETERNAL
+    friend class PATAChannel;
 public:
     // Type of drive this IDEDiskDevice is on the ATA channel.
     //
@@ -69,13 +70,17 @@ public:
 protected:
     explicit PATADiskDevice(PATAChannel&, DriveType, int, int);
 
+    // ^BlockDevice
+    virtual size_t max_blocks_per_transfer() const override { return 256; }
+    virtual size_t max_segments_per_transfer() const override;
+    virtual void start_active_requests() override;
+
 private:
     // ^DiskDevice
     virtual const char* class_name() const override;
 
     bool wait_for_irq();
-    bool read_sectors_with_dma(u32 lba, u16 count, u8*);
-    bool write_sectors_with_dma(u32 lba, u16 count, const u8*);
+    size_t max_blocks_per_call(const u8* buffer) const;
     bool read_sectors(u32 lba, u16 count, u8* buffer);
     bool write_sectors(u32 lba, u16 count, const u8* data);
     bool is_slave() const;
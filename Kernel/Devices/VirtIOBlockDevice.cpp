@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <AK/StringView.h>
+#include <Kernel/Devices/VirtIOBlockDevice.h>
+#include <Kernel/VM/MemoryManager.h>
+
+namespace Kernel {
+
+//#define VIRTIO_BLOCK_DEBUG
+
+#define VIRTIO_BLK_F_SIZE_MAX (1u << 1)
+#define VIRTIO_BLK_F_SEG_MAX (1u << 2)
+#define VIRTIO_BLK_F_RO (1u << 5)
+
+#define VIRTIO_BLK_CONFIG_CAPACITY 0
+#define VIRTIO_BLK_CONFIG_SIZE_MAX 8
+#define VIRTIO_BLK_CONFIG_SEG_MAX 12
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+
+#define VIRTIO_BLK_S_OK 0
+
+#define VIRTIO_BLK_MAJOR 254
+
+#define REQUESTQ 0
+
+struct [[gnu::packed]] VirtIOBlockRequestHeader {
+    u32 type;
+    u32 reserved;
+    u64 sector;
+};
+
+NonnullRefPtrVector<VirtIOBlockDevice> VirtIOBlockDevice::detect()
+{
+    NonnullRefPtrVector<VirtIOBlockDevice> devices;
+    PCI::enumerate([&](const PCI::Address& address, PCI::ID id) {
+        if (address.is_null())
+            return;
+        if (id.vendor_id != VIRTIO_PCI_VENDOR_ID || id.device_id != VIRTIO_PCI_BLOCK_DEVICE_ID)
+            return;
+        auto device = adopt(*new VirtIOBlockDevice(address, VIRTIO_BLK_MAJOR, devices.size() * 16));
+        if (device->is_initialized())
+            devices.append(move(device));
+    });
+    return devices;
+}
+
+VirtIOBlockDevice::VirtIOBlockDevice(PCI::Address address, int major, int minor)
+    : BlockDevice(major, minor, 512)
+    , VirtIODevice(address, "VirtIOBlockDevice")
+{
+    m_initialized = initialize();
+    if (!m_initialized)
+        fail_initialization();
+}
+
+VirtIOBlockDevice::~VirtIOBlockDevice()
+{
+}
+
+const char* VirtIOBlockDevice::class_name() const
+{
+    return "VirtIOBlockDevice";
+}
+
+bool VirtIOBlockDevice::initialize()
+{
+    if (!negotiate_features(VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO | VIRTIO_RING_F_EVENT_IDX))
+        return false;
+    if (!setup_queue(REQUESTQ))
+        return false;
+
+    m_capacity = (u64)config_read32(VIRTIO_BLK_CONFIG_CAPACITY) | ((u64)config_read32(VIRTIO_BLK_CONFIG_CAPACITY + 4) << 32);
+    m_read_only = is_feature_accepted(VIRTIO_BLK_F_RO);
+
+    // Every request needs a descriptor for its header and one for its
+    // status on top of the data, and we want a few of them in flight.
+    size_t queue_size = queue(REQUESTQ).size();
+    m_max_segments = min((size_t)64, max((size_t)1, queue_size / 4 - 2));
+    if (is_feature_accepted(VIRTIO_BLK_F_SEG_MAX))
+        m_max_segments = max((size_t)1, min(m_max_segments, (size_t)config_read32(VIRTIO_BLK_CONFIG_SEG_MAX)));
+    // A buffer that doesn't start on a page boundary needs one more segment
+    // than the pages it covers. Make sure single requests always fit.
+    m_max_blocks_per_transfer = max((size_t)1, (m_max_segments - 1) * (PAGE_SIZE / block_size()));
+    if (is_feature_accepted(VIRTIO_BLK_F_SIZE_MAX)) {
+        size_t size_max = config_read32(VIRTIO_BLK_CONFIG_SIZE_MAX);
+        if (size_max < PAGE_SIZE) {
+            klog() << "VirtIOBlockDevice: Segments of at most " << size_max << " bytes aren't supported";
+            return false;
+        }
+    }
+
+    m_slot_count = min(max_slots, queue_size / (m_max_segments + 2));
+    m_slots_region = MM.allocate_contiguous_kernel_region(PAGE_ROUND_UP(m_slot_count * slot_size), "VirtIOBlockDevice Requests", Region::Access::Read | Region::Access::Write);
+    if (!m_slots_region || !m_slot_count)
+        return false;
+
+    klog() << "VirtIOBlockDevice: " << m_capacity << " sectors" << (m_read_only ? " (read-only)" : "") << ", " << m_slot_count << " requests in flight of up to " << m_max_segments << " segments";
+    finish_initialization();
+    return true;
+}
+
+void VirtIOBlockDevice::submit_requests(Span<NonnullRefPtr<AsyncBlockDeviceRequest>> requests)
+{
+    queue_requests(requests);
+    issue_transfers();
+}
+
+void VirtIOBlockDevice::issue_transfers()
+{
+    auto& request_queue = queue(REQUESTQ);
+    bool should_notify;
+    {
+        ScopedSpinLock lock(request_queue.lock());
+        for (size_t slot = 0; slot < m_slot_count; ++slot) {
+            if (m_busy_slots & (1u << slot))
+                continue;
+            if (request_queue.free_descriptor_count() < m_max_segments + 2)
+                break;
+            auto& transfer = m_slot_transfers[slot];
+            if (!take_next_transfer(transfer))
+                break;
+
+            auto& first = *transfer.first();
+            bool write = first.type() == AsyncBlockDeviceRequest::Type::Write;
+            auto* slot_data = m_slots_region->vaddr().offset(slot * slot_size).as_ptr();
+            auto slot_paddr = m_slots_region->physical_page(0)->paddr().offset(slot * slot_size);
+            auto& header = *reinterpret_cast<VirtIOBlockRequestHeader*>(slot_data);
+            header.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+            header.reserved = 0;
+            header.sector = first.block_index();
+            slot_data[sizeof(VirtIOBlockRequestHeader)] = 0xff;
+
+            Vector<VirtIOQueue::Buffer, 16> buffers;
+            buffers.append({ slot_paddr, sizeof(VirtIOBlockRequestHeader), false });
+            for (auto* request : transfer) {
+                for (auto& segment : request->segments()) {
+                    auto& last = buffers.last();
+                    if (buffers.size() > 1 && last.paddr.offset(last.length) == segment.paddr) {
+                        last.length += segment.size;
+                        continue;
+                    }
+                    buffers.append({ segment.paddr, segment.size, !write });
+                }
+            }
+            buffers.append({ slot_paddr.offset(sizeof(VirtIOBlockRequestHeader)), 1, true });
+
+            bool did_add = request_queue.add_buffers(buffers.span(), (void*)(FlatPtr)slot);
+            ASSERT(did_add);
+            m_busy_slots |= 1u << slot;
+#ifdef VIRTIO_BLOCK_DEBUG
+            klog() << "VirtIOBlockDevice: Slot " << slot << ": " << (write ? "write" : "read") << " at " << first.block_index() << " in " << buffers.size() << " descriptors";
+#endif
+        }
+        // Everything we just queued goes out with a single notification, if
+        // the device wants one at all.
+        should_notify = request_queue.publish();
+    }
+    if (should_notify)
+        notify_queue(REQUESTQ);
+}
+
+void VirtIOBlockDevice::handle_queue_update()
+{
+    auto& request_queue = queue(REQUESTQ);
+    for (;;) {
+        TransferRequests transfer;
+        bool success = false;
+        {
+            ScopedSpinLock lock(request_queue.lock());
+            request_queue.disable_interrupts();
+            void* token;
+            u32 length;
+            if (!request_queue.take_used(token, length)) {
+                // Only go back to waiting for an interrupt if nothing came in
+                // while we weren't looking.
+                if (request_queue.enable_interrupts())
+                    break;
+                continue;
+            }
+            size_t slot = (FlatPtr)token;
+            ASSERT(m_busy_slots & (1u << slot));
+            success = m_slots_region->vaddr().offset(slot * slot_size + sizeof(VirtIOBlockRequestHeader)).as_ptr()[0] == VIRTIO_BLK_S_OK;
+            transfer = move(m_slot_transfers[slot]);
+            m_slot_transfers[slot].clear_with_capacity();
+            m_busy_slots &= ~(1u << slot);
+        }
+        complete_transfer(transfer, success);
+    }
+    issue_transfers();
+}
+
+bool VirtIOBlockDevice::read_blocks(unsigned index, u16 count, u8* out)
+{
+    return transfer_blocks(AsyncBlockDeviceRequest::Type::Read, index, count, out);
+}
+
+bool VirtIOBlockDevice::write_blocks(unsigned index, u16 count, const u8* data)
+{
+    if (m_read_only)
+        return false;
+    return transfer_blocks(AsyncBlockDeviceRequest::Type::Write, index, count, const_cast<u8*>(data));
+}
+
+KResultOr<size_t> VirtIOBlockDevice::read(FileDescription&, size_t offset, u8* outbuf, size_t len)
+{
+    return read_with_requests(offset, outbuf, len);
+}
+
+bool VirtIOBlockDevice::can_read(const FileDescription&, size_t offset) const
+{
+    return offset < m_capacity * block_size();
+}
+
+KResultOr<size_t> VirtIOBlockDevice::write(FileDescription&, size_t offset, const u8* inbuf, size_t len)
+{
+    if (m_read_only)
+        return KResult(-EROFS);
+    return write_with_requests(offset, inbuf, len);
+}
+
+bool VirtIOBlockDevice::can_write(const FileDescription&, size_t offset) const
+{
+    return !m_read_only && offset < m_capacity * block_size();
+}
+
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <AK/NonnullRefPtrVector.h>
+#include <Kernel/Devices/BlockDevice.h>
+#include <Kernel/VirtIO/VirtIO.h>
+
+namespace Kernel {
+
+class VirtIOBlockDevice final : public BlockDevice
+    , public VirtIODevice {
+public:
+    static NonnullRefPtrVector<VirtIOBlockDevice> detect();
+
+    VirtIOBlockDevice(PCI::Address, int major, int minor);
+    virtual ~VirtIOBlockDevice() override;
+
+    // ^BlockDevice
+    virtual bool read_blocks(unsigned index, u16 count, u8*) override;
+    virtual bool write_blocks(unsigned index, u16 count, const u8*) override;
+    virtual void submit_requests(Span<NonnullRefPtr<AsyncBlockDeviceRequest>>) override;
+
+    virtual KResultOr<size_t> read(FileDescription&, size_t, u8*, size_t) override;
+    virtual bool can_read(const FileDescription&, size_t) const override;
+    virtual KResultOr<size_t> write(FileDescription&, size_t, const u8*, size_t) override;
+    virtual bool can_write(const FileDescription&, size_t) const override;
+
+    bool is_initialized() const { return m_initialized; }
+
+protected:
+    // ^BlockDevice
+    virtual size_t max_blocks_per_transfer() const override { return m_max_blocks_per_transfer; }
+    virtual size_t max_segments_per_transfer() const override { return m_max_segments; }
+
+private:
+    // ^DiskDevice
+    virtual const char* class_name() const override;
+
+    // ^VirtIODevice
+    virtual void handle_queue_update() override;
+
+    bool initialize();
+    void issue_transfers();
+
+    static constexpr size_t max_slots = 32;
+    static constexpr size_t slot_size = 32;
+
+    bool m_initialized { false };
+    bool m_read_only { false };
+    u64 m_capacity { 0 };
+    size_t m_max_segments { 0 };
+    size_t m_max_blocks_per_transfer { 0 };
+
+    // Each request in flight gets a slot holding its header and status byte.
+    OwnPtr<Region> m_slots_region;
+    size_t m_slot_count { 0 };
+    u32 m_busy_slots { 0 };
+    TransferRequests m_slot_transfers[max_slots];
+};
+
+}
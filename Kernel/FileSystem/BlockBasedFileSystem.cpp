@@ -24,89 +24,200 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <AK/HashMap.h>
+#include <AK/IntrusiveList.h>
+#include <AK/NonnullOwnPtrVector.h>
+#include <AK/QuickSort.h>
+#include <Kernel/Devices/BlockDevice.h>
 #include <Kernel/FileSystem/BlockBasedFileSystem.h>
 #include <Kernel/Process.h>
+#include <Kernel/VM/MemoryManager.h>
 
 //#define BBFS_DEBUG
 
 namespace Kernel {
 
 struct CacheEntry {
-    time_t timestamp { 0 };
+    IntrusiveListNode list_node;
     u32 block_index { 0 };
     u8* data { nullptr };
     bool has_data { false };
     bool is_dirty { false };
+    // File contents, as opposed to metadata that goes through the journal.
+    bool is_data { false };
+    // Metadata that's safely in the journal, but not in its place yet.
+    bool is_logged { false };
 };
 
 class DiskCache {
 public:
+    static constexpr size_t entries_per_chunk = 1024;
+    static constexpr size_t max_chunk_count = 64;
+    static constexpr size_t max_overflow_chunk_count = 16;
+    static constexpr size_t max_write_back_size = 64 * KiB;
+    static constexpr size_t max_prefetch_count = 64;
+
     explicit DiskCache(BlockBasedFS& fs)
         : m_fs(fs)
-        , m_cached_block_data(KBuffer::create_with_size(m_entry_count * m_fs.block_size()))
-        , m_entries(KBuffer::create_with_size(m_entry_count * sizeof(CacheEntry)))
     {
-        for (size_t i = 0; i < m_entry_count; ++i) {
-            entries()[i].data = m_cached_block_data.data() + i * m_fs.block_size();
-        }
+        bool did_grow = try_grow();
+        ASSERT(did_grow);
     }
 
     ~DiskCache() { }
 
-    bool is_dirty() const { return m_dirty; }
-    void set_dirty(bool b) { m_dirty = b; }
+    bool is_dirty() const { return m_dirty_count > 0; }
+    size_t dirty_count() const { return m_dirty_count; }
+    size_t unlogged_metadata_count() const { return m_unlogged_metadata_count; }
 
-    CacheEntry& get(u32 block_index) const
+    CacheEntry* find(u32 block_index)
     {
-        auto now = kgettimeofday().tv_sec;
-
-        CacheEntry* oldest_clean_entry = nullptr;
-        for (size_t i = 0; i < m_entry_count; ++i) {
-            auto& entry = const_cast<CacheEntry&>(entries()[i]);
-            if (entry.block_index == block_index) {
-                entry.timestamp = now;
-                return entry;
-            }
-            if (!entry.is_dirty) {
-                if (!oldest_clean_entry)
-                    oldest_clean_entry = &entry;
-                else if (entry.timestamp < oldest_clean_entry->timestamp)
-                    oldest_clean_entry = &entry;
-            }
+        auto it = m_entries_by_block.find(block_index);
+        if (it == m_entries_by_block.end())
+            return nullptr;
+        return it->value;
+    }
+
+    CacheEntry& get(u32 block_index)
+    {
+        if (auto* entry = find(block_index)) {
+            // Clean entries are kept in LRU order, most recently used last.
+            if (!entry->is_dirty)
+                m_clean_list.append(*entry);
+            return *entry;
         }
-        if (!oldest_clean_entry) {
+
+        auto* victim = m_clean_list.first();
+        if (!victim && try_grow())
+            victim = m_clean_list.first();
+        if (!victim) {
             // Not a single clean entry! Flush writes and try again.
             // NOTE: We want to make sure we only call FileBackedFS flush here,
             //       not some FileBackedFS subclass flush!
             m_fs.flush_writes_impl();
-            return get(block_index);
+            victim = m_clean_list.first();
+            // Whatever is still dirty has to be logged first, and we can't
+            // wait for that in here. Going a little over the limit beats
+            // writing it back unprotected, but running out of memory doesn't.
+            if (!victim && try_grow(true))
+                victim = m_clean_list.first();
+            if (!victim) {
+                m_fs.write_back_unlogged_metadata_in_place();
+                victim = m_clean_list.first();
+            }
+            ASSERT(victim);
         }
 
-        // Replace the oldest clean entry.
-        auto& new_entry = *oldest_clean_entry;
-        new_entry.timestamp = now;
-        new_entry.block_index = block_index;
-        new_entry.has_data = false;
-        new_entry.is_dirty = false;
-        return new_entry;
+        if (find(victim->block_index) == victim)
+            m_entries_by_block.remove(victim->block_index);
+        victim->block_index = block_index;
+        victim->has_data = false;
+        m_entries_by_block.set(block_index, victim);
+        m_clean_list.append(*victim);
+        return *victim;
     }
 
-    const CacheEntry* entries() const { return (const CacheEntry*)m_entries.data(); }
-    CacheEntry* entries() { return (CacheEntry*)m_entries.data(); }
+    void mark_dirty(CacheEntry& entry, bool is_data)
+    {
+        if (entry.is_dirty && !entry.is_data && !entry.is_logged)
+            --m_unlogged_metadata_count;
+        // Anything written since the block was logged has to be logged again.
+        entry.is_data = is_data;
+        entry.is_logged = false;
+        if (!is_data)
+            ++m_unlogged_metadata_count;
+        if (entry.is_dirty)
+            return;
+        entry.is_dirty = true;
+        m_dirty_list.append(entry);
+        ++m_dirty_count;
+    }
+
+    void mark_logged(CacheEntry& entry)
+    {
+        ASSERT(entry.is_dirty && !entry.is_data && !entry.is_logged);
+        entry.is_logged = true;
+        --m_unlogged_metadata_count;
+    }
+
+    void mark_clean(CacheEntry& entry)
+    {
+        if (!entry.is_dirty)
+            return;
+        if (!entry.is_data && !entry.is_logged)
+            --m_unlogged_metadata_count;
+        entry.is_dirty = false;
+        entry.is_data = false;
+        entry.is_logged = false;
+        m_clean_list.append(entry);
+        --m_dirty_count;
+    }
 
     template<typename Callback>
-    void for_each_entry(Callback callback)
+    void for_each_dirty_entry(Callback callback)
     {
-        for (size_t i = 0; i < m_entry_count; ++i)
-            callback(entries()[i]);
+        for (auto& entry : m_dirty_list)
+            callback(entry);
+    }
+
+    u8* write_back_buffer()
+    {
+        if (!m_write_back_buffer)
+            m_write_back_buffer = MM.allocate_kernel_region(max_write_back_size, "DiskCache write-back", Region::Access::Read | Region::Access::Write);
+        return m_write_back_buffer ? m_write_back_buffer->vaddr().as_ptr() : nullptr;
     }
 
 private:
+    struct Chunk {
+        NonnullOwnPtr<Region> region;
+        CacheEntry entries[entries_per_chunk];
+
+        explicit Chunk(NonnullOwnPtr<Region>&& region)
+            : region(move(region))
+        {
+        }
+    };
+
+    bool try_grow(bool over_limit = false)
+    {
+        if (m_chunks.size() >= max_chunk_count + (over_limit ? max_overflow_chunk_count : 0))
+            return false;
+
+        size_t chunk_size = PAGE_ROUND_UP(entries_per_chunk * m_fs.block_size());
+        if (!m_chunks.is_empty()) {
+            // Only grow while at least a quarter of physical memory stays free,
+            // or a sixteenth if the alternative is giving up on the journal.
+            size_t free_pages = MM.user_physical_pages() - MM.user_physical_pages_used();
+            if (free_pages < chunk_size / PAGE_SIZE + MM.user_physical_pages() / (over_limit ? 16 : 4))
+                return false;
+        }
+
+        auto region = MM.allocate_kernel_region(chunk_size, "DiskCache", Region::Access::Read | Region::Access::Write);
+        if (!region)
+            return false;
+
+        auto chunk = make<Chunk>(region.release_nonnull());
+        for (size_t i = 0; i < entries_per_chunk; ++i) {
+            auto& entry = chunk->entries[i];
+            entry.data = chunk->region->vaddr().as_ptr() + i * m_fs.block_size();
+            // Fresh entries go to the front so they're used before evicting anything.
+            m_clean_list.prepend(entry);
+        }
+        m_chunks.append(move(chunk));
+#ifdef BBFS_DEBUG
+        klog() << "DiskCache: Grew to " << m_chunks.size() * entries_per_chunk << " entries";
+#endif
+        return true;
+    }
+
     BlockBasedFS& m_fs;
-    size_t m_entry_count { 10000 };
-    KBuffer m_cached_block_data;
-    KBuffer m_entries;
-    bool m_dirty { false };
+    NonnullOwnPtrVector<Chunk> m_chunks;
+    HashMap<u32, CacheEntry*> m_entries_by_block;
+    IntrusiveList<CacheEntry, &CacheEntry::list_node> m_clean_list;
+    IntrusiveList<CacheEntry, &CacheEntry::list_node> m_dirty_list;
+    size_t m_dirty_count { 0 };
+    size_t m_unlogged_metadata_count { 0 };
+    OwnPtr<Region> m_write_back_buffer;
 };
 
 BlockBasedFS::BlockBasedFS(FileDescription& file_description)
@@ -119,7 +230,7 @@ BlockBasedFS::~BlockBasedFS()
 {
 }
 
-bool BlockBasedFS::write_block(unsigned index, const u8* data, size_t count, size_t offset, bool allow_cache)
+bool BlockBasedFS::write_block(unsigned index, const u8* data, size_t count, size_t offset, bool allow_cache, bool is_data)
 {
     ASSERT(m_logical_block_size);
     ASSERT(offset + count <= block_size());
@@ -130,32 +241,31 @@ bool BlockBasedFS::write_block(unsigned index, const u8* data, size_t count, siz
     if (!allow_cache) {
         flush_specific_block_if_needed(index);
         u32 base_offset = static_cast<u32>(index) * static_cast<u32>(block_size()) + offset;
-        file_description().seek(base_offset, SEEK_SET);
-        auto nwritten = file_description().write(data, count);
+        auto nwritten = file_description().pwrite(data, count, base_offset);
         if (nwritten.is_error())
             return false;
         ASSERT(nwritten.value() == count);
         return true;
     }
 
+    LOCKER(m_cache_lock);
     auto& entry = cache().get(index);
     if (count < block_size()) {
         // Fill the cache first.
         read_block(index, nullptr, block_size());
     }
     memcpy(entry.data + offset, data, count);
-    entry.is_dirty = true;
     entry.has_data = true;
-
-    cache().set_dirty(true);
+    cache().mark_dirty(entry, is_data);
+    if (m_max_unlogged_metadata_block_count && cache().unlogged_metadata_count() >= m_max_unlogged_metadata_block_count)
+        transaction_is_full();
     return true;
 }
 
 bool BlockBasedFS::raw_read(unsigned index, u8* buffer)
 {
     u32 base_offset = static_cast<u32>(index) * static_cast<u32>(m_logical_block_size);
-    file_description().seek(base_offset, SEEK_SET);
-    auto nread = file_description().read(buffer, m_logical_block_size);
+    auto nread = file_description().pread(buffer, m_logical_block_size, base_offset);
     ASSERT(!nread.is_error());
     ASSERT(nread.value() == m_logical_block_size);
     return true;
@@ -163,8 +273,7 @@ bool BlockBasedFS::raw_read(unsigned index, u8* buffer)
 bool BlockBasedFS::raw_write(unsigned index, const u8* buffer)
 {
     u32 base_offset = static_cast<u32>(index) * static_cast<u32>(m_logical_block_size);
-    file_description().seek(base_offset, SEEK_SET);
-    auto nwritten = file_description().write(buffer, m_logical_block_size);
+    auto nwritten = file_description().pwrite(buffer, m_logical_block_size, base_offset);
     ASSERT(!nwritten.is_error());
     ASSERT(nwritten.value() == m_logical_block_size);
     return true;
@@ -189,14 +298,25 @@ bool BlockBasedFS::raw_write_blocks(unsigned index, size_t count, const u8* buff
     return true;
 }
 
-bool BlockBasedFS::write_blocks(unsigned index, unsigned count, const u8* data, bool allow_cache)
+bool BlockBasedFS::write_blocks(unsigned index, unsigned count, const u8* data, bool allow_cache, bool is_data)
 {
     ASSERT(m_logical_block_size);
 #ifdef BBFS_DEBUG
     klog() << "BlockBasedFileSystem::write_blocks " << index << " x" << count;
 #endif
+    if (!allow_cache && count > 1) {
+        // Same as for uncached reads, consecutive blocks go out in a single write.
+        for (unsigned i = 0; i < count; ++i)
+            flush_specific_block_if_needed(index + i);
+        u32 base_offset = static_cast<u32>(index) * static_cast<u32>(block_size());
+        auto nwritten = file_description().pwrite(data, count * block_size(), base_offset);
+        if (nwritten.is_error())
+            return false;
+        ASSERT(nwritten.value() == count * block_size());
+        return true;
+    }
     for (unsigned i = 0; i < count; ++i)
-        write_block(index + i, data + i * block_size(), block_size(), 0, allow_cache);
+        write_block(index + i, data + i * block_size(), block_size(), 0, allow_cache, is_data);
     return true;
 }
 
@@ -211,19 +331,18 @@ bool BlockBasedFS::read_block(unsigned index, u8* buffer, size_t count, size_t o
     if (!allow_cache) {
         const_cast<BlockBasedFS*>(this)->flush_specific_block_if_needed(index);
         u32 base_offset = static_cast<u32>(index) * static_cast<u32>(block_size()) + static_cast<u32>(offset);
-        file_description().seek(base_offset, SEEK_SET);
-        auto nread = file_description().read(buffer, count);
+        auto nread = file_description().pread(buffer, count, base_offset);
         if (nread.is_error())
             return false;
         ASSERT(nread.value() == count);
         return true;
     }
 
+    LOCKER(m_cache_lock);
     auto& entry = cache().get(index);
     if (!entry.has_data) {
         u32 base_offset = static_cast<u32>(index) * static_cast<u32>(block_size());
-        file_description().seek(base_offset, SEEK_SET);
-        auto nread = file_description().read(entry.data, block_size());
+        auto nread = file_description().pread(entry.data, block_size(), base_offset);
         if (nread.is_error())
             return false;
         ASSERT(nread.value() == block_size());
@@ -243,7 +362,26 @@ bool BlockBasedFS::read_blocks(unsigned index, unsigned count, u8* buffer, bool
         return read_block(index, buffer, block_size(), 0, allow_cache);
     u8* out = buffer;
 
+    if (!allow_cache) {
+        // Uncached reads of consecutive blocks turn into a single read from
+        // the device, once it has seen whatever we still have dirty in the cache.
+        for (unsigned i = 0; i < count; ++i)
+            const_cast<BlockBasedFS*>(this)->flush_specific_block_if_needed(index + i);
+        u32 base_offset = static_cast<u32>(index) * static_cast<u32>(block_size());
+        auto nread = file_description().pread(buffer, count * block_size(), base_offset);
+        if (nread.is_error())
+            return false;
+        ASSERT(nread.value() == count * block_size());
+        return true;
+    }
+
     for (unsigned i = 0; i < count; ++i) {
+        if (i % DiskCache::max_prefetch_count == 0) {
+            Vector<unsigned, DiskCache::max_prefetch_count> indices;
+            for (unsigned j = i; j < min(count, i + (unsigned)DiskCache::max_prefetch_count); ++j)
+                indices.append(index + j);
+            prefetch_blocks(indices);
+        }
         if (!read_block(index + i, out, block_size(), 0, allow_cache))
             return false;
         out += block_size();
@@ -252,40 +390,242 @@ bool BlockBasedFS::read_blocks(unsigned index, unsigned count, u8* buffer, bool
     return true;
 }
 
+BlockDevice* BlockBasedFS::block_device() const
+{
+    auto& file = file_description().file();
+    if (!file.is_block_device())
+        return nullptr;
+    auto& device = static_cast<BlockDevice&>(file);
+    if (!device.block_size() || block_size() % device.block_size())
+        return nullptr;
+    return &device;
+}
+
+void BlockBasedFS::prefetch_blocks(Span<const unsigned> indices) const
+{
+    auto* device = block_device();
+    if (!device)
+        return;
+
+    LOCKER(m_cache_lock);
+    // Cache entries are handed out in LRU order, so entries we grab for this batch
+    // won't be reused by it as long as the batch is smaller than the cache.
+    size_t count = min(indices.size(), DiskCache::max_prefetch_count);
+    size_t device_blocks_per_block = block_size() / device->block_size();
+    Vector<NonnullRefPtr<AsyncBlockDeviceRequest>, DiskCache::max_prefetch_count> requests;
+    Vector<CacheEntry*, DiskCache::max_prefetch_count> entries;
+    for (size_t i = 0; i < count; ++i) {
+        auto& entry = cache().get(indices[i]);
+        if (entry.has_data || entries.contains_slow(&entry))
+            continue;
+        requests.append(AsyncBlockDeviceRequest::create(AsyncBlockDeviceRequest::Type::Read, indices[i] * device_blocks_per_block, device_blocks_per_block, entry.data));
+        entries.append(&entry);
+    }
+    if (requests.is_empty())
+        return;
+
+#ifdef BBFS_DEBUG
+    klog() << "BlockBasedFileSystem::prefetch_blocks: Reading " << requests.size() << " blocks";
+#endif
+    device->submit_requests(requests);
+    for (size_t i = 0; i < requests.size(); ++i) {
+        // Failed blocks stay uncached and get another chance through read_block().
+        if (requests[i]->wait() == AsyncBlockDeviceRequest::Result::Success)
+            entries[i]->has_data = true;
+    }
+}
+
+bool BlockBasedFS::write_back_async(Vector<CacheEntry*>& dirty_entries)
+{
+    auto* device = block_device();
+    if (!device)
+        return false;
+
+    // Every dirty block becomes its own request straight out of the cache; the
+    // device queue merges adjacent ones, so there's no need to copy runs together.
+    size_t device_blocks_per_block = block_size() / device->block_size();
+    Vector<NonnullRefPtr<AsyncBlockDeviceRequest>> requests;
+    requests.ensure_capacity(dirty_entries.size());
+    for (auto* entry : dirty_entries)
+        requests.unchecked_append(AsyncBlockDeviceRequest::create(AsyncBlockDeviceRequest::Type::Write, entry->block_index * device_blocks_per_block, device_blocks_per_block, entry->data));
+    device->submit_requests(requests);
+
+    for (size_t i = 0; i < requests.size(); ++i) {
+        // FIXME: Should this error path be surfaced somehow?
+        (void)requests[i]->wait();
+        cache().mark_clean(*dirty_entries[i]);
+    }
+    dbg() << class_name() << ": Flushed " << dirty_entries.size() << " blocks to disk in " << requests.size() << " requests";
+    return true;
+}
+
 void BlockBasedFS::flush_specific_block_if_needed(unsigned index)
 {
-    LOCKER(m_lock);
+    LOCKER(m_cache_lock);
     if (!cache().is_dirty())
         return;
-    cache().for_each_entry([&](CacheEntry& entry) {
-        if (entry.is_dirty && entry.block_index == index) {
-            u32 base_offset = static_cast<u32>(entry.block_index) * static_cast<u32>(block_size());
-            file_description().seek(base_offset, SEEK_SET);
-            // FIXME: Should this error path be surfaced somehow?
-            (void)file_description().write(entry.data, block_size());
-            entry.is_dirty = false;
-        }
-    });
+    auto* entry = cache().find(index);
+    if (!entry || !entry->is_dirty)
+        return;
+    u32 base_offset = static_cast<u32>(entry->block_index) * static_cast<u32>(block_size());
+    // FIXME: Should this error path be surfaced somehow?
+    (void)file_description().pwrite(entry->data, block_size(), base_offset);
+    cache().mark_clean(*entry);
+}
+
+size_t BlockBasedFS::write_back_run(CacheEntry** entries, size_t count)
+{
+    // Dirty runs are copied into one buffer so they go out as a single write.
+    const u8* data = entries[0]->data;
+    u8* buffer = count > 1 ? cache().write_back_buffer() : nullptr;
+    if (buffer) {
+        for (size_t i = 0; i < count; ++i)
+            memcpy(buffer + i * block_size(), entries[i]->data, block_size());
+        data = buffer;
+    } else {
+        count = 1;
+    }
+
+    u32 base_offset = static_cast<u32>(entries[0]->block_index) * static_cast<u32>(block_size());
+    // FIXME: Should this error path be surfaced somehow?
+    (void)file_description().pwrite(data, count * block_size(), base_offset);
+    for (size_t i = 0; i < count; ++i)
+        cache().mark_clean(*entries[i]);
+    return count;
 }
 
 void BlockBasedFS::flush_writes_impl()
 {
-    LOCKER(m_lock);
+    LOCKER(m_cache_lock);
     if (!cache().is_dirty())
         return;
-    u32 count = 0;
-    cache().for_each_entry([&](CacheEntry& entry) {
-        if (!entry.is_dirty)
-            return;
-        u32 base_offset = static_cast<u32>(entry.block_index) * static_cast<u32>(block_size());
-        file_description().seek(base_offset, SEEK_SET);
-        // FIXME: Should this error path be surfaced somehow?
-        (void)file_description().write(entry.data, block_size());
-        ++count;
-        entry.is_dirty = false;
+
+    will_write_back_in_place();
+
+    // With a journal, metadata can't go to its place before it's in the log.
+    bool is_journaled = this->is_journaled();
+    write_back_dirty_blocks([&](const CacheEntry& entry) {
+        return !is_journaled || entry.is_data || entry.is_logged;
+    });
+}
+
+template<typename Filter>
+Vector<unsigned> BlockBasedFS::write_back_dirty_blocks(Filter filter)
+{
+    LOCKER(m_cache_lock);
+    Vector<CacheEntry*> entries;
+    cache().for_each_dirty_entry([&](CacheEntry& entry) {
+        if (filter(entry))
+            entries.append(&entry);
     });
-    cache().set_dirty(false);
-    dbg() << class_name() << ": Flushed " << count << " blocks to disk";
+
+    Vector<unsigned> indices;
+    indices.ensure_capacity(entries.size());
+    for (auto* entry : entries)
+        indices.unchecked_append(entry->block_index);
+    if (!entries.is_empty())
+        write_back(entries);
+    return indices;
+}
+
+Vector<BlockBasedFS::DirtyBlock> BlockBasedFS::take_unlogged_metadata_blocks()
+{
+    LOCKER(m_cache_lock);
+    Vector<CacheEntry*> entries;
+    entries.ensure_capacity(cache().unlogged_metadata_count());
+    cache().for_each_dirty_entry([&](CacheEntry& entry) {
+        if (!entry.is_data && !entry.is_logged)
+            entries.append(&entry);
+    });
+    quick_sort(entries, [](auto* a, auto* b) {
+        return a->block_index < b->block_index;
+    });
+
+    Vector<DirtyBlock> blocks;
+    blocks.ensure_capacity(entries.size());
+    for (auto* entry : entries) {
+        cache().mark_logged(*entry);
+        blocks.unchecked_append({ entry->block_index, entry->data });
+    }
+    return blocks;
+}
+
+Vector<unsigned> BlockBasedFS::dirty_data_blocks() const
+{
+    LOCKER(m_cache_lock);
+    Vector<unsigned> indices;
+    cache().for_each_dirty_entry([&](CacheEntry& entry) {
+        if (entry.is_data)
+            indices.append(entry.block_index);
+    });
+    return indices;
+}
+
+Vector<unsigned> BlockBasedFS::write_back_data_blocks()
+{
+    return write_back_dirty_blocks([](const CacheEntry& entry) {
+        return entry.is_data;
+    });
+}
+
+void BlockBasedFS::write_back_logged_metadata_blocks()
+{
+    write_back_dirty_blocks([](const CacheEntry& entry) {
+        return entry.is_logged;
+    });
+}
+
+void BlockBasedFS::write_back_unlogged_metadata_blocks()
+{
+    write_back_dirty_blocks([](const CacheEntry& entry) {
+        return !entry.is_data && !entry.is_logged;
+    });
+}
+
+void BlockBasedFS::write_back_unlogged_metadata_in_place()
+{
+    LOCKER(m_cache_lock);
+    dbg() << class_name() << ": Cache is full of metadata that isn't logged yet, writing it back in place";
+    will_write_back_unlogged_metadata();
+    write_back_unlogged_metadata_blocks();
+}
+
+bool BlockBasedFS::has_unlogged_metadata(unsigned index) const
+{
+    LOCKER(m_cache_lock);
+    auto* entry = cache().find(index);
+    return entry && entry->is_dirty && !entry->is_data && !entry->is_logged;
+}
+
+size_t BlockBasedFS::unlogged_metadata_block_count() const
+{
+    LOCKER(m_cache_lock);
+    return cache().unlogged_metadata_count();
+}
+
+void BlockBasedFS::write_back(Vector<CacheEntry*>& dirty_entries)
+{
+    quick_sort(dirty_entries, [](auto* a, auto* b) {
+        return a->block_index < b->block_index;
+    });
+
+    if (write_back_async(dirty_entries))
+        return;
+
+    size_t max_run_length = max((size_t)1, DiskCache::max_write_back_size / block_size());
+    u32 count = 0;
+    u32 writes = 0;
+    for (size_t i = 0; i < dirty_entries.size();) {
+        size_t run_length = 1;
+        while (i + run_length < dirty_entries.size() && run_length < max_run_length
+            && dirty_entries[i + run_length]->block_index == dirty_entries[i]->block_index + run_length)
+            ++run_length;
+        size_t written = write_back_run(&dirty_entries[i], run_length);
+        i += written;
+        count += written;
+        ++writes;
+    }
+    dbg() << class_name() << ": Flushed " << count << " blocks to disk in " << writes << " writes";
 }
 
 void BlockBasedFS::flush_writes()
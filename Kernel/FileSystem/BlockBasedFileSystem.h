@@ -26,10 +26,14 @@
 
 #pragma once
 
+#include <AK/Span.h>
+#include <AK/Vector.h>
 #include <Kernel/FileSystem/FileBackedFileSystem.h>
 
 namespace Kernel {
 
+struct CacheEntry;
+
 class BlockBasedFS : public FileBackedFS {
 public:
     virtual ~BlockBasedFS() override;
@@ -38,6 +42,7 @@ public:
 
     virtual void flush_writes() override;
     void flush_writes_impl();
+    void write_back_unlogged_metadata_in_place();
 
 protected:
     explicit BlockBasedFS(FileDescription&);
@@ -51,16 +56,57 @@ protected:
     bool raw_read_blocks(unsigned index, size_t count, u8* buffer);
     bool raw_write_blocks(unsigned index, size_t count, const u8* buffer);
 
-    bool write_block(unsigned index, const u8* buffer, size_t count, size_t offset = 0, bool allow_cache = true);
-    bool write_blocks(unsigned index, unsigned count, const u8*, bool allow_cache = true);
+    bool write_block(unsigned index, const u8* buffer, size_t count, size_t offset = 0, bool allow_cache = true, bool is_data = false);
+    bool write_blocks(unsigned index, unsigned count, const u8*, bool allow_cache = true, bool is_data = false);
+
+    // Reads any of these blocks that aren't cached yet, keeping all the reads
+    // in flight at once so the device can merge and reorder them.
+    void prefetch_blocks(Span<const unsigned> indices) const;
+
+    // Journaling support. Dirty metadata blocks have to be logged before they
+    // may be written back in place, while dirty data blocks only have to hit
+    // the disk before the transaction that refers to them commits.
+    struct DirtyBlock {
+        unsigned index;
+        const u8* data;
+    };
+    Vector<DirtyBlock> take_unlogged_metadata_blocks();
+    Vector<unsigned> dirty_data_blocks() const;
+    Vector<unsigned> write_back_data_blocks();
+    void write_back_logged_metadata_blocks();
+    void write_back_unlogged_metadata_blocks();
+    bool has_unlogged_metadata(unsigned index) const;
+    size_t unlogged_metadata_block_count() const;
+    void set_max_unlogged_metadata_block_count(size_t count) { m_max_unlogged_metadata_block_count = count; }
+    bool is_journaled() const { return m_max_unlogged_metadata_block_count; }
+
+    // Called before writing dirty blocks back in place, which with a journal
+    // only includes metadata that's been logged already, and when too many
+    // metadata blocks are waiting to be logged.
+    virtual void will_write_back_in_place() { }
+    virtual void transaction_is_full() { }
+    // Called when the cache has no room left and metadata that hasn't been
+    // logged yet is about to be written back in place regardless.
+    virtual void will_write_back_unlogged_metadata() { }
 
     size_t m_logical_block_size { 512 };
 
+    // Guards the cache, so file systems don't have to hold their own locks
+    // around reading and writing blocks.
+    mutable Lock m_cache_lock { "BlockBasedFS" };
+
 private:
     DiskCache& cache() const;
+    BlockDevice* block_device() const;
+    bool write_back_async(Vector<CacheEntry*>&);
     void flush_specific_block_if_needed(unsigned index);
+    size_t write_back_run(CacheEntry**, size_t count);
+    void write_back(Vector<CacheEntry*>&);
+    template<typename Filter>
+    Vector<unsigned> write_back_dirty_blocks(Filter);
 
     mutable OwnPtr<DiskCache> m_cache;
+    size_t m_max_unlogged_metadata_block_count { 0 };
 };
 
 }
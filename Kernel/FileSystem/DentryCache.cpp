@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <AK/Singleton.h>
+#include <AK/StringImpl.h>
+#include <Kernel/FileSystem/Custody.h>
+#include <Kernel/FileSystem/DentryCache.h>
+#include <Kernel/FileSystem/Inode.h>
+
+namespace Kernel {
+
+static AK::Singleton<DentryCache> s_the;
+
+// Cached custodies keep their inodes (and every ancestor custody) alive, so
+// the cache is bounded and the least recently used entries make way for new ones.
+static constexpr size_t max_entries = 2048;
+
+DentryCache& DentryCache::the()
+{
+    return *s_the;
+}
+
+DentryCache::DentryCache()
+{
+}
+
+static unsigned hash_for_name(const StringView& name)
+{
+    // Must agree with StringImpl::hash(), which is what the String keys hash to.
+    if (name.is_empty())
+        return 0;
+    return string_hash(name.characters_without_null_termination(), name.length());
+}
+
+DentryCache::Entry* DentryCache::find_entry(InodeIdentifier directory, const StringView& name, unsigned name_hash)
+{
+    ASSERT(m_lock.is_locked());
+    auto it = m_directories.find(directory);
+    if (it == m_directories.end())
+        return nullptr;
+    auto entry_it = it->value.find(name_hash, [&](auto& entry) { return entry.key == name; });
+    if (entry_it == it->value.end())
+        return nullptr;
+    return entry_it->value.ptr();
+}
+
+void DentryCache::remove_entry(Entry& entry, NonnullOwnPtrVector<Entry>& entries_to_release)
+{
+    ASSERT(m_lock.is_locked());
+    // Dropping the last reference to a custody may drop the last reference
+    // to its inode, so the entries are released once the lock is dropped.
+    m_lru.remove(entry);
+    --m_entries;
+    if (!entry.child)
+        --m_negative_entries;
+
+    auto directory_it = m_directories.find(entry.directory);
+    ASSERT(directory_it != m_directories.end());
+    auto& entries = directory_it->value;
+    auto entry_it = entries.find(entry.name);
+    ASSERT(entry_it != entries.end());
+    entries_to_release.append(move(entry_it->value));
+    entries.remove(entry_it);
+    if (entries.is_empty())
+        m_directories.remove(directory_it);
+}
+
+DentryCache::LookupResult DentryCache::lookup(Custody& parent, const StringView& name, RefPtr<Custody>& child)
+{
+    ScopedSpinLock lock(m_lock);
+    auto* entry = find_entry(parent.inode().identifier(), name, hash_for_name(name));
+    if (!entry || entry->parent.ptr() != &parent) {
+        ++m_misses;
+        return LookupResult::Miss;
+    }
+    m_lru.append(*entry);
+    if (!entry->child) {
+        ++m_negative_hits;
+        return LookupResult::NegativeHit;
+    }
+    ++m_hits;
+    child = entry->child;
+    return LookupResult::Hit;
+}
+
+u32 DentryCache::generation() const
+{
+    ScopedSpinLock lock(m_lock);
+    return m_generation;
+}
+
+void DentryCache::add(Custody& parent, const StringView& name, Custody* child, u32 generation)
+{
+    NonnullOwnPtrVector<Entry> entries_to_release;
+    ScopedSpinLock lock(m_lock);
+    if (generation != m_generation)
+        return;
+
+    auto directory = parent.inode().identifier();
+    if (auto* entry = find_entry(directory, name, hash_for_name(name)))
+        remove_entry(*entry, entries_to_release);
+
+    while (m_entries >= max_entries) {
+        ++m_evictions;
+        remove_entry(*m_lru.first(), entries_to_release);
+    }
+
+    auto entry = make<Entry>(directory, name, parent, child);
+    auto& entry_ref = *entry;
+    m_lru.append(entry_ref);
+    ++m_entries;
+    if (!child)
+        ++m_negative_entries;
+    m_directories.ensure(directory).set(entry_ref.name, move(entry));
+}
+
+void DentryCache::invalidate(const Inode& directory, const StringView& name)
+{
+    NonnullOwnPtrVector<Entry> entries_to_release;
+    ScopedSpinLock lock(m_lock);
+    ++m_generation;
+    if (auto* entry = find_entry(directory.identifier(), name, hash_for_name(name))) {
+        ++m_invalidations;
+        remove_entry(*entry, entries_to_release);
+    }
+}
+
+void DentryCache::invalidate_directory(const Inode& directory)
+{
+    NonnullOwnPtrVector<Entry> entries_to_release;
+    ScopedSpinLock lock(m_lock);
+    ++m_generation;
+    auto it = m_directories.find(directory.identifier());
+    if (it == m_directories.end())
+        return;
+    for (auto& entry_it : it->value) {
+        auto& entry = *entry_it.value;
+        m_lru.remove(entry);
+        --m_entries;
+        if (!entry.child)
+            --m_negative_entries;
+        ++m_invalidations;
+        entries_to_release.append(move(entry_it.value));
+    }
+    m_directories.remove(it);
+}
+
+void DentryCache::invalidate_all()
+{
+    NonnullOwnPtrVector<Entry> entries_to_release;
+    ScopedSpinLock lock(m_lock);
+    ++m_generation;
+    for (auto& directory_it : m_directories) {
+        for (auto& entry_it : directory_it.value) {
+            m_lru.remove(*entry_it.value);
+            entries_to_release.append(move(entry_it.value));
+        }
+    }
+    m_invalidations += m_entries;
+    m_directories.clear();
+    m_entries = 0;
+    m_negative_entries = 0;
+}
+
+DentryCache::Statistics DentryCache::statistics() const
+{
+    ScopedSpinLock lock(m_lock);
+    Statistics statistics;
+    statistics.entries = m_entries;
+    statistics.negative_entries = m_negative_entries;
+    statistics.hits = m_hits;
+    statistics.negative_hits = m_negative_hits;
+    statistics.misses = m_misses;
+    statistics.invalidations = m_invalidations;
+    statistics.evictions = m_evictions;
+    return statistics;
+}
+
+}
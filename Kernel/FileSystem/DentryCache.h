@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <AK/HashMap.h>
+#include <AK/IntrusiveList.h>
+#include <AK/NonnullOwnPtr.h>
+#include <AK/NonnullOwnPtrVector.h>
+#include <AK/RefPtr.h>
+#include <AK/String.h>
+#include <Kernel/FileSystem/InodeIdentifier.h>
+#include <Kernel/Forward.h>
+#include <Kernel/SpinLock.h>
+
+namespace Kernel {
+
+// The dentry cache remembers the outcome of looking up a name in a directory
+// during path resolution: either the Custody that was built for the child,
+// or the fact that there was no such child (a negative entry). Entries are
+// keyed by the directory's inode and the name, and only hit when reached
+// through the same parent Custody, so cached custodies always chain up to
+// the right mount flags and absolute path.
+//
+// The VFS invalidates entries whenever it changes a directory, and drops
+// the whole cache when the mount table changes. Since lookups that race with
+// an invalidation could otherwise put back stale results, callers take a
+// generation number before looking up the inode, and add() ignores results
+// that were obtained before the last invalidation.
+class DentryCache {
+    AK_MAKE_NONCOPYABLE(DentryCache);
+    AK_MAKE_NONMOVABLE(DentryCache);
+
+public:
+    static DentryCache& the();
+
+    DentryCache();
+
+    struct Statistics {
+        size_t entries { 0 };
+        size_t negative_entries { 0 };
+        size_t hits { 0 };
+        size_t negative_hits { 0 };
+        size_t misses { 0 };
+        size_t invalidations { 0 };
+        size_t evictions { 0 };
+    };
+
+    enum class LookupResult {
+        Miss,
+        Hit,
+        NegativeHit,
+    };
+
+    LookupResult lookup(Custody& parent, const StringView& name, RefPtr<Custody>& child);
+    u32 generation() const;
+    void add(Custody& parent, const StringView& name, Custody* child, u32 generation);
+
+    void invalidate(const Inode& directory, const StringView& name);
+    void invalidate_directory(const Inode& directory);
+    void invalidate_all();
+
+    Statistics statistics() const;
+
+private:
+    struct Entry {
+        Entry(InodeIdentifier directory, const StringView& name, Custody& parent, Custody* child)
+            : directory(directory)
+            , name(name)
+            , parent(parent)
+            , child(child)
+        {
+        }
+
+        InodeIdentifier directory;
+        String name;
+        NonnullRefPtr<Custody> parent;
+        RefPtr<Custody> child;
+        IntrusiveListNode lru_node;
+    };
+
+    using DirectoryEntries = HashMap<String, NonnullOwnPtr<Entry>>;
+
+    Entry* find_entry(InodeIdentifier directory, const StringView& name, unsigned name_hash);
+    void remove_entry(Entry&, NonnullOwnPtrVector<Entry>& entries_to_release);
+
+    mutable SpinLock<u8> m_lock;
+    HashMap<InodeIdentifier, DirectoryEntries> m_directories;
+    IntrusiveList<Entry, &Entry::lru_node> m_lru;
+    u32 m_generation { 0 };
+    size_t m_entries { 0 };
+    size_t m_negative_entries { 0 };
+    size_t m_hits { 0 };
+    size_t m_negative_hits { 0 };
+    size_t m_misses { 0 };
+    size_t m_invalidations { 0 };
+    size_t m_evictions { 0 };
+};
+
+}
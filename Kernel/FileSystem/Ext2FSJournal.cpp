@@ -0,0 +1,528 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <AK/ByteBuffer.h>
+#include <AK/HashMap.h>
+#include <AK/ScopeGuard.h>
+#include <Kernel/FileSystem/Ext2FSJournal.h>
+#include <Kernel/FileSystem/Ext2FileSystem.h>
+#include <Kernel/KBuffer.h>
+#include <Kernel/Thread.h>
+#include <Kernel/Time/TimeManagement.h>
+
+//#define JOURNAL_DEBUG
+
+namespace Kernel {
+
+// Committed transactions older than this get checkpointed even if the log
+// has room left, so there's never much to replay after a crash.
+static constexpr time_t checkpoint_interval = 30;
+
+OwnPtr<Ext2FSJournal> Ext2FSJournal::try_create(Ext2FS& fs)
+{
+    auto& super_block = fs.super_block();
+    unsigned block_index;
+    unsigned offset;
+    if (!fs.find_block_containing_inode(super_block.s_journal_inum, block_index, offset))
+        return nullptr;
+    ext2_inode journal_inode;
+    if (!fs.read_block(block_index, reinterpret_cast<u8*>(&journal_inode), sizeof(ext2_inode), offset))
+        return nullptr;
+
+    auto journal = adopt_own(*new Ext2FSJournal(fs));
+    journal->m_physical_blocks = fs.block_list_for_inode(journal_inode);
+    if (journal->m_physical_blocks.is_empty())
+        return nullptr;
+
+    auto buffer = ByteBuffer::create_uninitialized(fs.block_size());
+    if (!journal->read_journal_block(0, buffer.data()))
+        return nullptr;
+    auto& journal_super_block = *reinterpret_cast<const jbd_superblock*>(buffer.data());
+    u32 type = journal_super_block.s_header.h_blocktype;
+    if (journal_super_block.s_header.h_magic != JBD_MAGIC_NUMBER || (type != JBD_SUPERBLOCK_V1 && type != JBD_SUPERBLOCK_V2)) {
+        klog() << "Ext2FSJournal: Bad journal super block";
+        return nullptr;
+    }
+    if (journal_super_block.s_blocksize != fs.block_size()
+        || journal_super_block.s_maxlen > journal->m_physical_blocks.size()
+        || !journal_super_block.s_first || journal_super_block.s_first >= journal_super_block.s_maxlen) {
+        klog() << "Ext2FSJournal: Journal geometry doesn't match the file system";
+        return nullptr;
+    }
+    if (type == JBD_SUPERBLOCK_V2 && ((journal_super_block.s_feature_incompat & ~JBD_FEATURE_INCOMPAT_REVOKE) || journal_super_block.s_feature_ro_compat)) {
+        klog() << "Ext2FSJournal: Journal uses unsupported features";
+        return nullptr;
+    }
+
+    journal->m_first = journal_super_block.s_first;
+    journal->m_last = journal_super_block.s_maxlen;
+    journal->m_start = journal_super_block.s_start;
+    journal->m_sequence = journal_super_block.s_sequence;
+    memcpy(journal->m_uuid, journal_super_block.s_uuid, sizeof(journal->m_uuid));
+    journal->m_max_transaction_blocks = (journal->m_last - journal->m_first) / 4;
+    if (!journal->m_max_transaction_blocks)
+        return nullptr;
+    return journal;
+}
+
+Ext2FSJournal::Ext2FSJournal(Ext2FS& fs)
+    : m_fs(fs)
+    , m_block_size(fs.block_size())
+{
+    memset(m_uuid, 0, sizeof(m_uuid));
+}
+
+bool Ext2FSJournal::read_journal_block(u32 journal_block, u8* buffer) const
+{
+    if (journal_block >= m_physical_blocks.size())
+        return false;
+    return m_fs.read_block(m_physical_blocks[journal_block], buffer, m_block_size, 0, false);
+}
+
+bool Ext2FSJournal::write_journal_blocks(u32 journal_block, u32 count, const u8* buffer)
+{
+    ASSERT(journal_block + count <= m_physical_blocks.size());
+    // The journal is usually in one piece on disk, which makes this one write.
+    for (u32 i = 0; i < count;) {
+        u32 run_length = 1;
+        while (i + run_length < count && m_physical_blocks[journal_block + i + run_length] == m_physical_blocks[journal_block + i] + run_length)
+            ++run_length;
+        if (!m_fs.write_blocks(m_physical_blocks[journal_block + i], run_length, buffer + i * m_block_size, false))
+            return false;
+        i += run_length;
+    }
+    return true;
+}
+
+bool Ext2FSJournal::write_journal_super_block(u32 start, u32 sequence)
+{
+    auto buffer = ByteBuffer::create_uninitialized(m_block_size);
+    if (!read_journal_block(0, buffer.data()))
+        return false;
+    auto& journal_super_block = *reinterpret_cast<jbd_superblock*>(buffer.data());
+    journal_super_block.s_start = start;
+    journal_super_block.s_sequence = sequence;
+    // We don't write commit block checksums.
+    if (journal_super_block.s_header.h_blocktype == JBD_SUPERBLOCK_V2)
+        journal_super_block.s_feature_compat = journal_super_block.s_feature_compat & ~JBD_FEATURE_COMPAT_CHECKSUM;
+    return write_journal_blocks(0, 1, buffer.data());
+}
+
+bool Ext2FSJournal::needs_recovery() const
+{
+    return m_start != 0;
+}
+
+bool Ext2FSJournal::recover()
+{
+    LOCKER(m_fs.m_cache_lock);
+    ASSERT(needs_recovery());
+
+    struct Tag {
+        u32 block_index;
+        u32 journal_block;
+        bool is_escaped;
+    };
+    struct Transaction {
+        u32 sequence;
+        Vector<Tag> tags;
+        Vector<u32> revoked_blocks;
+    };
+
+    // Find all transactions that made it into the log completely, i.e. have
+    // a commit block. The log ends at the first block that doesn't belong to
+    // the next transaction we expect.
+    Vector<Transaction> transactions;
+    Transaction transaction { m_sequence, {}, {} };
+    auto buffer = ByteBuffer::create_uninitialized(m_block_size);
+    u32 log_block = m_start;
+    size_t log_length = m_last - m_first;
+    bool is_end_of_log = false;
+    for (size_t scanned = 0; scanned < log_length && !is_end_of_log;) {
+        if (!read_journal_block(log_block, buffer.data()))
+            return false;
+        auto& header = *reinterpret_cast<const jbd_header*>(buffer.data());
+        if (header.h_magic != JBD_MAGIC_NUMBER || header.h_sequence != transaction.sequence)
+            break;
+        log_block = next_log_block(log_block);
+        ++scanned;
+
+        switch (header.h_blocktype) {
+        case JBD_DESCRIPTOR_BLOCK:
+            for (size_t offset = sizeof(jbd_header); offset + sizeof(jbd_block_tag) <= m_block_size;) {
+                auto& tag = *reinterpret_cast<const jbd_block_tag*>(buffer.data() + offset);
+                u32 flags = tag.t_flags;
+                transaction.tags.append({ tag.t_blocknr, log_block, (flags & JBD_FLAG_ESCAPE) != 0 });
+                log_block = next_log_block(log_block);
+                ++scanned;
+                offset += sizeof(jbd_block_tag);
+                if (!(flags & JBD_FLAG_SAME_UUID))
+                    offset += sizeof(m_uuid);
+                if (flags & JBD_FLAG_LAST_TAG)
+                    break;
+            }
+            break;
+        case JBD_REVOKE_BLOCK: {
+            auto& revoke_header = *reinterpret_cast<const jbd_revoke_header*>(buffer.data());
+            size_t count = min((size_t)revoke_header.r_count, m_block_size);
+            for (size_t offset = sizeof(jbd_revoke_header); offset + sizeof(u32) <= count; offset += sizeof(u32))
+                transaction.revoked_blocks.append(*reinterpret_cast<const BigEndian<u32>*>(buffer.data() + offset));
+            break;
+        }
+        case JBD_COMMIT_BLOCK: {
+            u32 next_sequence = transaction.sequence + 1;
+            transactions.append(move(transaction));
+            transaction = { next_sequence, {}, {} };
+            break;
+        }
+        default:
+            is_end_of_log = true;
+            break;
+        }
+    }
+
+    // A block revoked by a transaction must not be replayed from that one or any before it.
+    HashMap<u32, u32> revoked_blocks;
+    for (auto& committed_transaction : transactions) {
+        for (auto block_index : committed_transaction.revoked_blocks)
+            revoked_blocks.set(block_index, committed_transaction.sequence);
+    }
+
+    size_t replayed_count = 0;
+    size_t block_count = m_fs.super_block().s_blocks_count;
+    for (auto& committed_transaction : transactions) {
+        for (auto& tag : committed_transaction.tags) {
+            auto it = revoked_blocks.find(tag.block_index);
+            if (it != revoked_blocks.end() && (i32)((*it).value - committed_transaction.sequence) >= 0)
+                continue;
+            if (tag.block_index >= block_count)
+                continue;
+            if (!read_journal_block(tag.journal_block, buffer.data()))
+                return false;
+            if (tag.is_escaped)
+                *reinterpret_cast<BigEndian<u32>*>(buffer.data()) = JBD_MAGIC_NUMBER;
+            m_fs.write_block(tag.block_index, buffer.data(), m_block_size);
+            ++replayed_count;
+        }
+    }
+    m_fs.BlockBasedFS::flush_writes();
+
+    klog() << "Ext2FSJournal: Replayed " << replayed_count << " blocks from " << transactions.size() << " transactions";
+    m_sequence = transaction.sequence + 1;
+    m_start = 0;
+    return write_journal_super_block(0, m_sequence);
+}
+
+bool Ext2FSJournal::start()
+{
+    LOCKER(m_fs.m_cache_lock);
+    ASSERT(!needs_recovery());
+    m_head = m_first;
+    m_start = m_first;
+    return write_journal_super_block(m_start, m_sequence);
+}
+
+bool Ext2FSJournal::stop()
+{
+    LOCKER(m_fs.m_cache_lock);
+    // Only call this once everything has been checkpointed.
+    m_head = m_first;
+    m_start = 0;
+    return write_journal_super_block(0, m_sequence);
+}
+
+size_t Ext2FSJournal::blocks_needed_for_transaction(size_t block_count, size_t revoke_count) const
+{
+    // The first tag in every descriptor block carries the journal UUID.
+    size_t tags_per_descriptor = 1 + (m_block_size - sizeof(jbd_header) - sizeof(jbd_block_tag) - sizeof(m_uuid)) / sizeof(jbd_block_tag);
+    size_t revokes_per_block = (m_block_size - sizeof(jbd_revoke_header)) / sizeof(u32);
+    return ceil_div(block_count, tags_per_descriptor) + block_count + ceil_div(revoke_count, revokes_per_block) + 1;
+}
+
+bool Ext2FSJournal::commit_transaction(bool include_metadata)
+{
+    LOCKER(m_fs.m_cache_lock);
+    // Metadata may only be committed in between operations.
+    ASSERT(!include_metadata || is_committing());
+
+    if (include_metadata) {
+        // Ordered mode: file data goes to its place before any metadata that
+        // refers to it can commit.
+        revoke_data_blocks();
+        m_fs.write_back_data_blocks();
+    }
+
+    size_t block_count = include_metadata ? m_fs.unlogged_metadata_block_count() : 0;
+    if (!block_count && m_revoked_blocks.is_empty()) {
+        if (include_metadata)
+            ++m_commit_generation;
+        return true;
+    }
+    size_t blocks_needed = blocks_needed_for_transaction(block_count, m_revoked_blocks.size());
+    if (m_head + blocks_needed > m_last)
+        return false;
+
+    Vector<Ext2FS::DirtyBlock> blocks;
+    if (include_metadata)
+        blocks = m_fs.take_unlogged_metadata_blocks();
+    ASSERT(blocks.size() == block_count);
+    Vector<LoggedBlock> logged_blocks;
+    logged_blocks.ensure_capacity(blocks.size());
+
+    auto log = KBuffer::create_with_size(blocks_needed * m_block_size, Region::Access::Read | Region::Access::Write, "Ext2FSJournal: Transaction");
+    u8* out = log.data();
+    auto start_block = [&](u32 type) {
+        memset(out, 0, m_block_size);
+        auto& header = *reinterpret_cast<jbd_header*>(out);
+        header.h_magic = JBD_MAGIC_NUMBER;
+        header.h_blocktype = type;
+        header.h_sequence = m_sequence;
+        u8* block = out;
+        out += m_block_size;
+        return block;
+    };
+
+    for (size_t i = 0; i < m_revoked_blocks.size();) {
+        u8* revoke_block = start_block(JBD_REVOKE_BLOCK);
+        size_t offset = sizeof(jbd_revoke_header);
+        for (; i < m_revoked_blocks.size() && offset + sizeof(u32) <= m_block_size; ++i, offset += sizeof(u32))
+            *reinterpret_cast<BigEndian<u32>*>(revoke_block + offset) = m_revoked_blocks[i];
+        reinterpret_cast<jbd_revoke_header*>(revoke_block)->r_count = offset;
+    }
+
+    for (size_t i = 0; i < blocks.size();) {
+        u8* descriptor = start_block(JBD_DESCRIPTOR_BLOCK);
+        size_t offset = sizeof(jbd_header);
+        jbd_block_tag* last_tag = nullptr;
+        for (; i < blocks.size(); ++i) {
+            size_t tag_size = sizeof(jbd_block_tag) + (last_tag ? 0 : sizeof(m_uuid));
+            if (offset + tag_size > m_block_size)
+                break;
+            auto& tag = *reinterpret_cast<jbd_block_tag*>(descriptor + offset);
+            u32 flags = last_tag ? JBD_FLAG_SAME_UUID : 0;
+            if (!last_tag)
+                memcpy(descriptor + offset + sizeof(jbd_block_tag), m_uuid, sizeof(m_uuid));
+            offset += tag_size;
+
+            memcpy(out, blocks[i].data, m_block_size);
+            // A logged block that looks like a journal block would confuse recovery.
+            bool is_escaped = *reinterpret_cast<const BigEndian<u32>*>(out) == JBD_MAGIC_NUMBER;
+            if (is_escaped) {
+                memset(out, 0, sizeof(u32));
+                flags |= JBD_FLAG_ESCAPE;
+            }
+            logged_blocks.unchecked_append({ static_cast<u32>(m_head + (out - log.data()) / m_block_size), is_escaped });
+            out += m_block_size;
+
+            tag.t_blocknr = blocks[i].index;
+            tag.t_flags = flags;
+            last_tag = &tag;
+        }
+        ASSERT(last_tag);
+        last_tag->t_flags = last_tag->t_flags | JBD_FLAG_LAST_TAG;
+    }
+
+    auto& commit_block = *reinterpret_cast<jbd_commit_block*>(start_block(JBD_COMMIT_BLOCK));
+    auto now = TimeManagement::the().epoch_time();
+    commit_block.h_commit_sec = now.tv_sec;
+    commit_block.h_commit_nsec = now.tv_nsec;
+    ASSERT(out == log.data() + blocks_needed * m_block_size);
+
+    // The commit block may only hit the disk once everything before it has.
+    if (!write_journal_blocks(m_head, blocks_needed - 1, log.data()) || !write_journal_blocks(m_head + blocks_needed - 1, 1, out - m_block_size)) {
+        klog() << "Ext2FSJournal: Failed to write transaction " << m_sequence;
+        return false;
+    }
+
+#ifdef JOURNAL_DEBUG
+    dbg() << "Ext2FSJournal: Committed transaction " << m_sequence << " with " << blocks.size() << " blocks and " << m_revoked_blocks.size() << " revoked blocks at " << m_head;
+#endif
+
+    for (size_t i = 0; i < blocks.size(); ++i)
+        m_logged_blocks.set(blocks[i].index, logged_blocks[i]);
+    if (m_head == m_first)
+        m_oldest_transaction_time = TimeManagement::the().seconds_since_boot();
+    m_revoked_blocks.clear();
+    m_head += blocks_needed;
+    ++m_sequence;
+    if (include_metadata)
+        ++m_commit_generation;
+    return true;
+}
+
+void Ext2FSJournal::commit()
+{
+    // We'd be waiting for ourselves.
+    ASSERT(!current_thread_has_handle());
+    Locker gate_locker(m_commit_gate);
+    Locker handle_locker(m_handle_lock);
+    m_committing_thread = Thread::current();
+    ScopeGuard guard([&] { m_committing_thread = nullptr; });
+
+    // The super block, group descriptors and bitmaps are only written to
+    // the cache right before committing, so they always go in with whatever
+    // operations they've been changed by.
+    m_fs.write_cached_metadata();
+
+    LOCKER(m_fs.m_cache_lock);
+    if (!commit_transaction()) {
+        // Make room in the log, and try again.
+        checkpoint();
+        if (!commit_transaction()) {
+            dbg() << "Ext2FSJournal: Transaction doesn't fit in the log, writing back in place";
+            // Nothing is left in the log that could be replayed over these.
+            m_fs.write_back_unlogged_metadata_blocks();
+            ++m_commit_generation;
+            return;
+        }
+    }
+    // Make sure the largest transaction we allow will fit next time.
+    if (m_last - m_head < blocks_needed_for_transaction(m_max_transaction_blocks, m_logged_blocks.size()) || should_checkpoint())
+        checkpoint();
+}
+
+bool Ext2FSJournal::is_committing() const
+{
+    return m_committing_thread == Thread::current();
+}
+
+void Ext2FSJournal::start_handle()
+{
+    // A commit that's waiting for the handles already open holds the gate,
+    // so it doesn't have to wait for any new ones as well.
+    Locker gate_locker(m_commit_gate, Lock::Mode::Shared);
+    m_handle_lock.lock(Lock::Mode::Shared);
+}
+
+void Ext2FSJournal::stop_handle()
+{
+    m_handle_lock.unlock();
+}
+
+bool Ext2FSJournal::current_thread_has_handle() const
+{
+    for (auto* handle = Thread::current()->journal_handle(); handle; handle = handle->m_outer) {
+        if (handle->m_journal == this)
+            return true;
+    }
+    return false;
+}
+
+bool Ext2FSJournal::should_checkpoint() const
+{
+    if (m_head == m_first)
+        return false;
+    if ((m_head - m_first) * 2 >= m_last - m_first)
+        return true;
+    return TimeManagement::the().seconds_since_boot() - m_oldest_transaction_time >= checkpoint_interval;
+}
+
+void Ext2FSJournal::checkpoint()
+{
+    LOCKER(m_fs.m_cache_lock);
+    if (m_head == m_first && m_logged_blocks.is_empty())
+        return;
+
+    // Metadata that was changed again after it was logged only has its
+    // committed contents in the log, so that's where we take them from.
+    m_fs.write_back_logged_metadata_blocks();
+    auto buffer = ByteBuffer::create_uninitialized(m_block_size);
+    size_t logical_blocks_per_block = m_block_size / m_fs.logical_block_size();
+    for (auto& it : m_logged_blocks) {
+        if (!m_fs.has_unlogged_metadata(it.key))
+            continue;
+        if (!read_journal_block(it.value.journal_block, buffer.data())) {
+            klog() << "Ext2FSJournal: Failed to read block " << it.key << " back from the log";
+            return;
+        }
+        if (it.value.is_escaped)
+            *reinterpret_cast<BigEndian<u32>*>(buffer.data()) = JBD_MAGIC_NUMBER;
+        m_fs.raw_write_blocks(it.key * logical_blocks_per_block, logical_blocks_per_block, buffer.data());
+    }
+
+    // Everything in the log is in place now, so it can start over.
+    m_logged_blocks.clear();
+    m_revoked_blocks.clear();
+    m_head = m_first;
+    if (!write_journal_super_block(m_first, m_sequence)) {
+        klog() << "Ext2FSJournal: Failed to update the journal super block";
+        return;
+    }
+
+    // Data that has replaced logged metadata can only go in place now that
+    // the log is empty.
+    m_fs.write_back_data_blocks();
+}
+
+void Ext2FSJournal::revoke_data_blocks()
+{
+    LOCKER(m_fs.m_cache_lock);
+    for (auto block_index : m_fs.dirty_data_blocks()) {
+        if (m_logged_blocks.remove(block_index))
+            m_revoked_blocks.append(block_index);
+    }
+    if (m_revoked_blocks.is_empty())
+        return;
+    // This may well happen in the middle of an operation, so only the revocations go into the log.
+    if (!commit_transaction(false))
+        checkpoint();
+}
+
+void Ext2FSJournal::will_write_in_place(u32 block_index)
+{
+    LOCKER(m_fs.m_cache_lock);
+    if (!m_logged_blocks.remove(block_index))
+        return;
+    m_revoked_blocks.append(block_index);
+    if (!commit_transaction(false))
+        checkpoint();
+}
+
+Ext2FSJournalHandle::Ext2FSJournalHandle(Ext2FSJournal* journal)
+    : m_journal(journal)
+{
+    if (!m_journal)
+        return;
+    m_is_outermost = !m_journal->current_thread_has_handle();
+    if (m_is_outermost)
+        m_journal->start_handle();
+    auto* current_thread = Thread::current();
+    m_outer = current_thread->journal_handle();
+    current_thread->set_journal_handle(this);
+}
+
+Ext2FSJournalHandle::~Ext2FSJournalHandle()
+{
+    if (!m_journal)
+        return;
+    auto* current_thread = Thread::current();
+    ASSERT(current_thread->journal_handle() == this);
+    current_thread->set_journal_handle(m_outer);
+    if (m_is_outermost)
+        m_journal->stop_handle();
+}
+
+}
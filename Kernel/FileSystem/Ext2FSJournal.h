@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <AK/Endian.h>
+#include <AK/HashMap.h>
+#include <AK/Noncopyable.h>
+#include <AK/OwnPtr.h>
+#include <AK/Vector.h>
+#include <Kernel/Lock.h>
+#include <Kernel/UnixTypes.h>
+
+namespace Kernel {
+
+class Ext2FS;
+
+// On-disk structures of the JBD journal used by ext3. Only the subset of
+// features that ext3 itself uses is supported, which is also what JBD2
+// understands when none of its newer features are enabled.
+// Everything in the journal is stored big endian.
+
+#define JBD_MAGIC_NUMBER 0xc03b3998U
+
+#define JBD_DESCRIPTOR_BLOCK 1
+#define JBD_COMMIT_BLOCK 2
+#define JBD_SUPERBLOCK_V1 3
+#define JBD_SUPERBLOCK_V2 4
+#define JBD_REVOKE_BLOCK 5
+
+#define JBD_FLAG_ESCAPE 1    /* on-disk block is escaped */
+#define JBD_FLAG_SAME_UUID 2 /* block has same uuid as previous */
+#define JBD_FLAG_DELETED 4   /* block deleted by this transaction */
+#define JBD_FLAG_LAST_TAG 8  /* last tag in this descriptor block */
+
+#define JBD_FEATURE_COMPAT_CHECKSUM 0x00000001
+#define JBD_FEATURE_INCOMPAT_REVOKE 0x00000001
+
+struct [[gnu::packed]] jbd_header {
+    BigEndian<u32> h_magic;
+    BigEndian<u32> h_blocktype;
+    BigEndian<u32> h_sequence;
+};
+
+struct [[gnu::packed]] jbd_superblock {
+    jbd_header s_header;
+
+    /* Static information describing the journal */
+    BigEndian<u32> s_blocksize; /* journal device blocksize */
+    BigEndian<u32> s_maxlen;    /* total blocks in journal file */
+    BigEndian<u32> s_first;     /* first block of log information */
+
+    /* Dynamic information describing the current state of the log */
+    BigEndian<u32> s_sequence; /* first commit ID expected in log */
+    BigEndian<u32> s_start;    /* blocknr of start of log, 0 if clean */
+    BigEndian<u32> s_errno;
+
+    /* Remaining fields are only valid in a version-2 superblock */
+    BigEndian<u32> s_feature_compat;
+    BigEndian<u32> s_feature_incompat;
+    BigEndian<u32> s_feature_ro_compat;
+    u8 s_uuid[16];
+};
+
+struct [[gnu::packed]] jbd_block_tag {
+    BigEndian<u32> t_blocknr; /* the on-disk block number */
+    BigEndian<u32> t_flags;   /* See below */
+};
+
+struct [[gnu::packed]] jbd_revoke_header {
+    jbd_header r_header;
+    BigEndian<u32> r_count; /* Count of bytes used in the block */
+};
+
+struct [[gnu::packed]] jbd_commit_block {
+    jbd_header h_header;
+    u8 h_chksum_type;
+    u8 h_chksum_size;
+    u8 h_padding[2];
+    BigEndian<u32> h_chksum[8];
+    BigEndian<u64> h_commit_sec;
+    BigEndian<u32> h_commit_nsec;
+};
+
+// The journal logs every metadata block Ext2FS dirties, so that the file
+// system can always be brought back to the state of the last commit.
+// File data is written in place before the transaction referring to it
+// commits ("ordered" mode), so it never has to go through the log.
+//
+// All dirty metadata is committed as one transaction at a time, which turns
+// a flush of scattered metadata into a single sequential write, and lets any
+// number of concurrent fsync() calls share a commit. Blocks are only
+// written back in place (checkpointed) once the log fills up or gets old,
+// after which the log starts over at its first block.
+//
+// Every operation that changes metadata holds a handle (see below) while it
+// runs, and a transaction only commits while no handle is open, so it never
+// contains half an operation.
+class Ext2FSJournal {
+    friend class Ext2FSJournalHandle;
+
+public:
+    static OwnPtr<Ext2FSJournal> try_create(Ext2FS&);
+
+    bool needs_recovery() const;
+    bool recover();
+    bool start();
+    bool stop();
+
+    // Returns false if the transaction didn't fit in the log, in which case
+    // the caller has to write everything back in place unprotected. Without
+    // metadata, only the revoked blocks are committed, which is fine to do
+    // in the middle of an operation.
+    bool commit_transaction(bool include_metadata = true);
+    // Waits for the operations in progress to finish, and keeps new ones from
+    // starting until everything they've done is committed.
+    void commit();
+    bool is_committing() const;
+    // Anything dirtied before next_commit_generation() was taken is safely
+    // in the log once that generation has committed.
+    u32 next_commit_generation() const { return m_commit_generation + 1; }
+    bool has_committed(u32 generation) const { return (i32)(m_commit_generation - generation) >= 0; }
+
+    bool should_checkpoint() const;
+    // Writes everything in the log back in place and empties it. Works just
+    // as well with operations in progress, since nothing gets committed.
+    void checkpoint();
+
+    // The block is about to be written in place without going through the
+    // cache, so no older copy of it may be replayed from the log anymore.
+    void will_write_in_place(u32 block_index);
+    // Same for all dirty data blocks, before they're written back in place.
+    void revoke_data_blocks();
+
+    size_t max_transaction_blocks() const { return m_max_transaction_blocks; }
+
+private:
+    explicit Ext2FSJournal(Ext2FS&);
+
+    void start_handle();
+    void stop_handle();
+    bool current_thread_has_handle() const;
+
+    bool read_journal_block(u32 journal_block, u8* buffer) const;
+    bool write_journal_blocks(u32 journal_block, u32 count, const u8* buffer);
+    bool write_journal_super_block(u32 start, u32 sequence);
+    size_t blocks_needed_for_transaction(size_t block_count, size_t revoke_count) const;
+    u32 next_log_block(u32 journal_block) const { return journal_block + 1 == m_last ? m_first : journal_block + 1; }
+
+    Ext2FS& m_fs;
+    size_t m_block_size { 0 };
+    Vector<u32> m_physical_blocks;
+    u8 m_uuid[16];
+
+    u32 m_first { 0 };
+    u32 m_last { 0 };
+    u32 m_start { 0 };
+    u32 m_head { 0 };
+    u32 m_sequence { 0 };
+    size_t m_max_transaction_blocks { 0 };
+    u32 m_commit_generation { 0 };
+    time_t m_oldest_transaction_time { 0 };
+
+    // Blocks with a copy in the log, where their newest copy is, and the
+    // blocks that are rewritten elsewhere and must no longer be replayed.
+    struct LoggedBlock {
+        u32 journal_block { 0 };
+        bool is_escaped { false };
+    };
+    HashMap<u32, LoggedBlock> m_logged_blocks;
+    Vector<u32> m_revoked_blocks;
+
+    // Open handles hold this shared, and a commit holds it exclusively. The
+    // gate keeps new handles from being opened while a commit is waiting.
+    Lock m_handle_lock { "Ext2FSJournal: Handles" };
+    Lock m_commit_gate { "Ext2FSJournal: Commit" };
+    Thread* m_committing_thread { nullptr };
+};
+
+// Keeps the running transaction from committing for as long as it lives.
+// Operations nest: only the outermost handle of a thread counts.
+class Ext2FSJournalHandle {
+    AK_MAKE_NONCOPYABLE(Ext2FSJournalHandle);
+    AK_MAKE_NONMOVABLE(Ext2FSJournalHandle);
+    friend class Ext2FSJournal;
+
+public:
+    explicit Ext2FSJournalHandle(Ext2FSJournal*);
+    ~Ext2FSJournalHandle();
+
+private:
+    Ext2FSJournal* m_journal { nullptr };
+    Ext2FSJournalHandle* m_outer { nullptr };
+    bool m_is_outermost { false };
+};
+
+}
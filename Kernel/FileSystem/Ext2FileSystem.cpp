@@ -27,6 +27,7 @@
 #include <AK/Bitmap.h>
 #include <AK/BufferStream.h>
 #include <AK/HashMap.h>
+#include <AK/QuickSort.h>
 #include <AK/StdLibExtras.h>
 #include <AK/StringView.h>
 #include <Kernel/Devices/BlockDevice.h>
@@ -34,6 +35,7 @@
 #include <Kernel/FileSystem/FileDescription.h>
 #include <Kernel/FileSystem/ext2_fs.h>
 #include <Kernel/Process.h>
+#include <Kernel/Tasks/SyncTask.h>
 #include <Kernel/UnixTypes.h>
 #include <LibC/errno_numbers.h>
 
@@ -44,6 +46,9 @@ namespace Kernel {
 static const size_t max_link_count = 65535;
 static const size_t max_block_size = 4096;
 static const ssize_t max_inline_symlink_length = 60;
+static const size_t max_prefetch_blocks = 32;
+static const size_t max_delayed_allocation_size = 256 * KiB;
+static const size_t preallocation_window_blocks = 32;
 
 struct Ext2FSDirectoryEntry {
     String name;
@@ -86,7 +91,11 @@ Ext2FS::~Ext2FS()
 
 bool Ext2FS::flush_super_block()
 {
-    LOCKER(m_lock);
+    LOCKER(m_super_block_lock);
+    if (m_journal) {
+        // The super block has to go through the journal like any other metadata.
+        return write_block(EXT2_MIN_BLOCK_SIZE / block_size(), reinterpret_cast<const u8*>(&m_super_block), sizeof(ext2_super_block), EXT2_MIN_BLOCK_SIZE % block_size());
+    }
     ASSERT((sizeof(ext2_super_block) % logical_block_size()) == 0);
     bool success = raw_write_blocks(2, (sizeof(ext2_super_block) / logical_block_size()), (const u8*)&m_super_block);
     ASSERT(success);
@@ -136,6 +145,10 @@ bool Ext2FS::initialize()
         return false;
     }
 
+    m_block_groups.ensure_capacity(m_block_group_count);
+    for (unsigned i = 0; i < m_block_group_count; ++i)
+        m_block_groups.append(make<BlockGroup>());
+
     unsigned blocks_to_read = ceil_div(m_block_group_count * sizeof(ext2_group_desc), block_size());
     BlockIndex first_block_of_bgdt = block_size() == 1024 ? 2 : 1;
     m_cached_group_descriptor_table = KBuffer::create_with_size(block_size() * blocks_to_read, Region::Access::Read | Region::Access::Write, "Ext2FS: Block group descriptors");
@@ -148,9 +161,70 @@ bool Ext2FS::initialize()
     }
 #endif
 
+    if (super_block.s_feature_compat & EXT3_FEATURE_COMPAT_HAS_JOURNAL)
+        return initialize_journal();
+
+    return true;
+}
+
+bool Ext2FS::initialize_journal()
+{
+    bool needs_recovery = super_block().s_feature_incompat & EXT3_FEATURE_INCOMPAT_RECOVER;
+    if ((super_block().s_feature_incompat & EXT3_FEATURE_INCOMPAT_JOURNAL_DEV) || !super_block().s_journal_inum) {
+        klog() << "Ext2FS: External journals are not supported";
+        return !needs_recovery;
+    }
+
+    auto journal = Ext2FSJournal::try_create(*this);
+    if (!journal) {
+        klog() << "Ext2FS: Couldn't load the journal";
+        return !needs_recovery;
+    }
+
+    if (journal->needs_recovery()) {
+        klog() << "Ext2FS: Recovering from the journal";
+        if (!journal->recover())
+            return false;
+        // The log may well have had newer copies of these.
+        bool success = raw_read_blocks(2, (sizeof(ext2_super_block) / logical_block_size()), (u8*)&m_super_block);
+        ASSERT(success);
+        unsigned blocks_to_read = ceil_div(m_block_group_count * sizeof(ext2_group_desc), block_size());
+        BlockIndex first_block_of_bgdt = block_size() == 1024 ? 2 : 1;
+        read_blocks(first_block_of_bgdt, blocks_to_read, m_cached_group_descriptor_table.value().data());
+    }
+
+    // Anybody looking at the file system from now on has to check the journal first.
+    m_super_block.s_feature_incompat |= EXT3_FEATURE_INCOMPAT_RECOVER;
+    flush_super_block();
+    if (!journal->start())
+        return false;
+
+    m_journal = move(journal);
+    set_max_unlogged_metadata_block_count(m_journal->max_transaction_blocks());
     return true;
 }
 
+void Ext2FS::will_write_back_in_place()
+{
+    if (m_journal)
+        m_journal->revoke_data_blocks();
+}
+
+void Ext2FS::transaction_is_full()
+{
+    // We're most likely in the middle of an operation, so leave the commit to the SyncTask.
+    if (m_journal)
+        SyncTask::request_sync();
+}
+
+void Ext2FS::will_write_back_unlogged_metadata()
+{
+    // Same as when a transaction doesn't fit in the log: nothing may be left
+    // in there that could be replayed over what we're about to write.
+    if (m_journal)
+        m_journal->checkpoint();
+}
+
 const char* Ext2FS::class_name() const
 {
     return "Ext2FS";
@@ -163,10 +237,10 @@ NonnullRefPtr<Inode> Ext2FS::root_inode() const
 
 bool Ext2FS::find_block_containing_inode(unsigned inode, unsigned& block_index, unsigned& offset) const
 {
-    LOCKER(m_lock);
+    // This only looks at parts of the super block and group descriptors that never change.
     auto& super_block = this->super_block();
 
-    if (inode != EXT2_ROOT_INO && inode < EXT2_FIRST_INO(&super_block))
+    if (inode != EXT2_ROOT_INO && inode != super_block.s_journal_inum && inode < EXT2_FIRST_INO(&super_block))
         return false;
 
     if (inode > super_block.s_inodes_count)
@@ -220,20 +294,29 @@ Ext2FS::BlockListShape Ext2FS::compute_block_list_shape(unsigned blocks)
     return {};
 }
 
-bool Ext2FS::write_block_list_for_inode(InodeIndex inode_index, ext2_inode& e2inode, const Vector<BlockIndex>& blocks)
+bool Ext2FS::write_block_list_for_inode(InodeIndex inode_index, ext2_inode& e2inode, const Vector<BlockIndex>& blocks, size_t reserved_count)
 {
-    LOCKER(m_lock);
-
+    // The caller holds the inode's lock (or the inode doesn't exist yet),
+    // the allocator and the block cache take care of themselves.
     // NOTE: There is a mismatch between i_blocks and blocks.size() since i_blocks includes meta blocks and blocks.size() does not.
     auto old_block_count = ceil_div(static_cast<size_t>(e2inode.i_size), block_size());
 
     auto old_shape = compute_block_list_shape(old_block_count);
     auto new_shape = compute_block_list_shape(blocks.size());
 
+    // Whatever the caller reserved for block pointer arrays is used up or
+    // given back here, unless we fail, in which case the caller keeps it.
     Vector<BlockIndex> new_meta_blocks;
-    if (new_shape.meta_blocks > old_shape.meta_blocks) {
-        new_meta_blocks = allocate_blocks(group_index_from_inode(inode_index), new_shape.meta_blocks - old_shape.meta_blocks);
+    size_t needed_meta_blocks = new_shape.meta_blocks > old_shape.meta_blocks ? new_shape.meta_blocks - old_shape.meta_blocks : 0;
+    size_t unneeded_reserved_count = reserved_count > needed_meta_blocks ? reserved_count - needed_meta_blocks : 0;
+    if (needed_meta_blocks) {
+        auto meta_blocks_or_error = allocate_blocks(group_index_from_inode(inode_index), needed_meta_blocks, 0, reserved_count - unneeded_reserved_count);
+        if (meta_blocks_or_error.is_error())
+            return false;
+        new_meta_blocks = meta_blocks_or_error.release_value();
     }
+    if (unneeded_reserved_count)
+        unreserve_blocks(unneeded_reserved_count);
 
     e2inode.i_blocks = (blocks.size() + new_shape.meta_blocks) * (block_size() / 512);
 
@@ -411,7 +494,6 @@ Vector<Ext2FS::BlockIndex> Ext2FS::block_list_for_inode(const ext2_inode& e2inod
 
 Vector<Ext2FS::BlockIndex> Ext2FS::block_list_for_inode_impl(const ext2_inode& e2inode, bool include_block_list_blocks) const
 {
-    LOCKER(m_lock);
     unsigned entries_per_block = EXT2_ADDR_PER_BLOCK(&super_block());
 
     unsigned block_count = ceil_div(static_cast<size_t>(e2inode.i_size), block_size());
@@ -498,12 +580,15 @@ Vector<Ext2FS::BlockIndex> Ext2FS::block_list_for_inode_impl(const ext2_inode& e
 
 void Ext2FS::free_inode(Ext2FSInode& inode)
 {
-    LOCKER(m_lock);
+    Ext2FSJournalHandle handle(m_journal.ptr());
     ASSERT(inode.m_raw_inode.i_links_count == 0);
 #ifdef EXT2_DEBUG
     dbg() << "Ext2FS: Inode " << inode.identifier() << " has no more links, time to delete!";
 #endif
 
+    inode.discard_delayed_blocks();
+    inode.discard_preallocated_blocks();
+
     struct timeval now;
     kgettimeofday(now);
     inode.m_raw_inode.i_dtime = now.tv_sec;
@@ -519,17 +604,25 @@ void Ext2FS::free_inode(Ext2FSInode& inode)
 
     set_inode_allocation_state(inode.index(), false);
 
-    if (inode.is_directory()) {
-        auto& bgd = const_cast<ext2_group_desc&>(group_descriptor(group_index_from_inode(inode.index())));
-        --bgd.bg_used_dirs_count;
-        dbg() << "Ext2FS: Decremented bg_used_dirs_count to " << bgd.bg_used_dirs_count;
-        m_block_group_descriptors_dirty = true;
-    }
+    if (inode.is_directory())
+        adjust_used_directory_count(group_index_from_inode(inode.index()), -1);
+}
+
+void Ext2FS::adjust_used_directory_count(GroupIndex group_index, int delta)
+{
+    Locker group_locker(block_group(group_index).lock);
+    Locker super_block_locker(m_super_block_lock);
+    auto& bgd = const_cast<ext2_group_desc&>(group_descriptor(group_index));
+    bgd.bg_used_dirs_count += delta;
+#ifdef EXT2_DEBUG
+    dbg() << "Ext2FS: Adjusted bg_used_dirs_count of group " << group_index << " to " << bgd.bg_used_dirs_count;
+#endif
+    m_block_group_descriptors_dirty = true;
 }
 
 void Ext2FS::flush_block_group_descriptor_table()
 {
-    LOCKER(m_lock);
+    LOCKER(m_super_block_lock);
     unsigned blocks_to_write = ceil_div(m_block_group_count * sizeof(ext2_group_desc), block_size());
     unsigned first_block_of_bgdt = block_size() == 1024 ? 2 : 1;
     write_blocks(first_block_of_bgdt, blocks_to_write, (const u8*)block_group_descriptors());
@@ -538,16 +631,68 @@ void Ext2FS::flush_block_group_descriptor_table()
 void Ext2FS::flush_writes()
 {
     LOCKER(m_lock);
-    if (m_super_block_dirty) {
-        flush_super_block();
-        m_super_block_dirty = false;
+
+    // Uncache Inodes that are only kept alive by the index-to-inode lookup cache.
+    // We don't uncache Inodes that are being watched by at least one InodeWatcher,
+    // or that still have data that hasn't been given a place on disk.
+
+    // FIXME: It would be better to keep a capped number of Inodes around.
+    //        The problem is that they are quite heavy objects, and use a lot of heap memory
+    //        for their (child name lookup) and (block map) caches.
+    auto is_unused = [](const Ext2FSInode& inode) {
+        return inode.ref_count() == 1 && !inode.has_watchers() && !inode.m_delayed_block_count;
+    };
+
+    Vector<InodeIndex> unused_inodes;
+    {
+        Ext2FSJournalHandle handle(m_journal.ptr());
+        LOCKER(m_inode_cache_lock);
+        for (auto& it : m_inode_cache) {
+            if (!is_unused(*it.value))
+                continue;
+            // Nobody is going to extend the file any time soon.
+            it.value->discard_preallocated_blocks();
+            unused_inodes.append(it.key);
+        }
+    }
+
+    if (m_journal) {
+        // Blocks only get written back in place once the log fills up or gets old.
+        m_journal->commit();
+    } else {
+        write_cached_metadata();
+        BlockBasedFS::flush_writes();
+    }
+
+    // get_inode() only takes the cache lock, so somebody may have picked up one of
+    // these while we were committing. Check again before letting go of them.
+    Locker inode_cache_locker(m_inode_cache_lock);
+    for (auto index : unused_inodes) {
+        auto it = m_inode_cache.find(index);
+        if (it == m_inode_cache.end() || !is_unused(*it->value))
+            continue;
+        m_inode_cache.remove(it);
     }
-    if (m_block_group_descriptors_dirty) {
-        flush_block_group_descriptor_table();
-        m_block_group_descriptors_dirty = false;
+}
+
+void Ext2FS::write_cached_metadata()
+{
+    {
+        LOCKER(m_super_block_lock);
+        if (m_super_block_dirty) {
+            flush_super_block();
+            m_super_block_dirty = false;
+        }
+        if (m_block_group_descriptors_dirty) {
+            flush_block_group_descriptor_table();
+            m_block_group_descriptors_dirty = false;
+        }
     }
-    for (auto& cached_bitmap : m_cached_bitmaps) {
-        if (cached_bitmap->dirty) {
+    for (auto& group : m_block_groups) {
+        LOCKER(group.lock);
+        for (auto* cached_bitmap : { group.block_bitmap.ptr(), group.inode_bitmap.ptr() }) {
+            if (!cached_bitmap || !cached_bitmap->dirty)
+                continue;
             write_block(cached_bitmap->bitmap_block_index, cached_bitmap->buffer.data(), block_size());
             cached_bitmap->dirty = false;
 #ifdef EXT2_DEBUG
@@ -555,25 +700,15 @@ void Ext2FS::flush_writes()
 #endif
         }
     }
+}
 
-    BlockBasedFS::flush_writes();
-
-    // Uncache Inodes that are only kept alive by the index-to-inode lookup cache.
-    // We don't uncache Inodes that are being watched by at least one InodeWatcher.
-
-    // FIXME: It would be better to keep a capped number of Inodes around.
-    //        The problem is that they are quite heavy objects, and use a lot of heap memory
-    //        for their (child name lookup) and (block list) caches.
-    Vector<InodeIndex> unused_inodes;
-    for (auto& it : m_inode_cache) {
-        if (it.value->ref_count() != 1)
-            continue;
-        if (it.value->has_watchers())
-            continue;
-        unused_inodes.append(it.key);
-    }
-    for (auto index : unused_inodes)
-        uncache_inode(index);
+void Ext2FS::commit_writes(u32 generation)
+{
+    LOCKER(m_lock);
+    ASSERT(m_journal);
+    if (m_journal->has_committed(generation))
+        return;
+    flush_writes();
 }
 
 Ext2FSInode::Ext2FSInode(Ext2FS& fs, unsigned index)
@@ -616,10 +751,27 @@ InodeMetadata Ext2FSInode::metadata() const
 
 void Ext2FSInode::flush_metadata()
 {
+    auto result = write_metadata();
+    if (result.is_error())
+        dbg() << "Ext2FS: Couldn't allocate delayed blocks for inode " << identifier() << ": " << result.error();
+}
+
+KResult Ext2FSInode::write_metadata()
+{
+    Ext2FSJournalHandle handle(fs().m_journal.ptr());
     LOCKER(m_lock);
 #ifdef EXT2_DEBUG
     dbg() << "Ext2FS: flush_metadata for inode " << identifier();
 #endif
+    auto result = allocate_delayed_blocks();
+    if (result.is_error()) {
+        // The disk must not claim blocks the file doesn't have yet. Write out
+        // what it does have, and stay dirty (and reserved) so we try again.
+        ext2_inode raw_inode = m_raw_inode;
+        raw_inode.i_size = static_cast<u64>(allocated_block_count()) * fs().block_size();
+        fs().write_ext2_inode(index(), raw_inode);
+        return result;
+    }
     fs().write_ext2_inode(index(), m_raw_inode);
     if (is_directory()) {
         // Unless we're about to go away permanently, invalidate the lookup cache.
@@ -629,11 +781,12 @@ void Ext2FSInode::flush_metadata()
         }
     }
     set_metadata_dirty(false);
+    return KSuccess;
 }
 
 RefPtr<Inode> Ext2FS::get_inode(InodeIdentifier inode) const
 {
-    LOCKER(m_lock);
+    LOCKER(m_inode_cache_lock);
     ASSERT(inode.fsid() == fsid());
 
     {
@@ -658,12 +811,125 @@ RefPtr<Inode> Ext2FS::get_inode(InodeIdentifier inode) const
     return new_inode;
 }
 
+Optional<Ext2FSInode::BlockRun> Ext2FSInode::block_run_at(u32 logical_index) const
+{
+    ASSERT(m_lock.is_locked());
+    for (;;) {
+        // Find the last run that starts at or before the block we're after.
+        size_t low = 0;
+        size_t high = m_block_map.size();
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            if (m_block_map[middle].logical_index <= logical_index)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        if (low) {
+            auto& run = m_block_map[low - 1];
+            if (logical_index < run.logical_index + run.count) {
+                u32 skip = logical_index - run.logical_index;
+                return BlockRun { logical_index, run.physical_index ? run.physical_index + skip : 0, run.count - skip };
+            }
+        }
+        if (!populate_block_map(logical_index))
+            return {};
+    }
+}
+
+bool Ext2FSInode::populate_block_map(u32 logical_index) const
+{
+    u32 block_count = allocated_block_count();
+    if (logical_index >= block_count)
+        return false;
+
+    if (logical_index < EXT2_NDIR_BLOCKS) {
+        insert_block_runs(0, m_raw_inode.i_block, min(block_count, (u32)EXT2_NDIR_BLOCKS));
+        return true;
+    }
+
+    // Walk down the indirect blocks to the block pointer array that covers
+    // this logical block, which we then map in its entirety.
+    u32 entries_per_block = EXT2_ADDR_PER_BLOCK(&fs().super_block());
+    auto read_entry = [&](u32 array_block_index, u32 entry_index, u32& entry) {
+        entry = 0;
+        if (!array_block_index)
+            return true;
+        return fs().read_block(array_block_index, reinterpret_cast<u8*>(&entry), sizeof(entry), entry_index * sizeof(entry));
+    };
+
+    u32 index = logical_index - EXT2_NDIR_BLOCKS;
+    u32 first_logical_index = EXT2_NDIR_BLOCKS;
+    u32 array_block_index = 0;
+    if (index < entries_per_block) {
+        array_block_index = m_raw_inode.i_block[EXT2_IND_BLOCK];
+    } else if ((index -= entries_per_block) < entries_per_block * entries_per_block) {
+        first_logical_index += entries_per_block + (index / entries_per_block) * entries_per_block;
+        if (!read_entry(m_raw_inode.i_block[EXT2_DIND_BLOCK], index / entries_per_block, array_block_index))
+            return false;
+    } else {
+        index -= entries_per_block * entries_per_block;
+        first_logical_index += entries_per_block + entries_per_block * entries_per_block + (index / entries_per_block) * entries_per_block;
+        u32 doubly_indirect_block_index;
+        if (!read_entry(m_raw_inode.i_block[EXT2_TIND_BLOCK], index / (entries_per_block * entries_per_block), doubly_indirect_block_index))
+            return false;
+        if (!read_entry(doubly_indirect_block_index, (index / entries_per_block) % entries_per_block, array_block_index))
+            return false;
+    }
+
+    u32 count = min(entries_per_block, block_count - first_logical_index);
+    auto array_block = ByteBuffer::create_zeroed(count * sizeof(u32));
+    if (array_block_index && !fs().read_block(array_block_index, array_block.data(), array_block.size()))
+        return false;
+    insert_block_runs(first_logical_index, reinterpret_cast<const u32*>(array_block.data()), count);
+    return true;
+}
+
+void Ext2FSInode::insert_block_runs(u32 logical_index, const u32* physical_indices, size_t count) const
+{
+    size_t insertion_index = 0;
+    while (insertion_index < m_block_map.size() && m_block_map[insertion_index].logical_index < logical_index)
+        ++insertion_index;
+
+    auto can_extend = [](const BlockRun& run, u32 physical_index) {
+        if (!run.physical_index)
+            return !physical_index;
+        return physical_index && physical_index == run.physical_index + run.count;
+    };
+
+    Vector<BlockRun> runs;
+    for (size_t i = 0; i < count; ++i) {
+        if (!runs.is_empty() && can_extend(runs.last(), physical_indices[i])) {
+            ++runs.last().count;
+            continue;
+        }
+        runs.append({ logical_index + (u32)i, physical_indices[i], 1 });
+    }
+    if (runs.is_empty())
+        return;
+
+    // The parts of the map we fill in never overlap, but they can continue
+    // a run that's already in there.
+    if (insertion_index) {
+        auto& previous = m_block_map[insertion_index - 1];
+        if (previous.logical_index + previous.count == runs.first().logical_index && can_extend(previous, runs.first().physical_index)) {
+            previous.count += runs.first().count;
+            runs.remove(0);
+        }
+    }
+    m_block_map.ensure_capacity(m_block_map.size() + runs.size());
+    for (size_t i = 0; i < runs.size(); ++i)
+        m_block_map.insert(insertion_index + i, runs[i]);
+}
+
 ssize_t Ext2FSInode::read_bytes(off_t offset, ssize_t count, u8* buffer, FileDescription* description) const
 {
     Locker inode_locker(m_lock);
     ASSERT(offset >= 0);
     if (m_raw_inode.i_size == 0)
         return 0;
+    if (static_cast<u64>(offset) >= size())
+        return 0;
 
     // Symbolic links shorter than 60 characters are store inline inside the i_block array.
     // This avoids wasting an entire block on short links. (Most links are short.)
@@ -674,45 +940,88 @@ ssize_t Ext2FSInode::read_bytes(off_t offset, ssize_t count, u8* buffer, FileDes
         return nread;
     }
 
-    Locker fs_locker(fs().m_lock);
-
-    if (m_block_list.is_empty())
-        m_block_list = fs().block_list_for_inode(m_raw_inode);
-
-    if (m_block_list.is_empty()) {
-        klog() << "ext2fs: read_bytes: empty block list for inode " << index();
-        return -EIO;
-    }
+    // Only the inode is locked here. The block cache takes care of its own
+    // locking, so reads of different files don't get in each other's way.
 
     bool allow_cache = !description || !description->is_direct();
 
-    const int block_size = fs().block_size();
+    const size_t block_size = fs().block_size();
 
+    size_t remaining_count = min((off_t)count, (off_t)size() - offset);
+    if (!remaining_count)
+        return 0;
     size_t first_block_logical_index = offset / block_size;
-    size_t last_block_logical_index = (offset + count) / block_size;
-    if (last_block_logical_index >= m_block_list.size())
-        last_block_logical_index = m_block_list.size() - 1;
+    size_t last_block_logical_index = (offset + remaining_count - 1) / block_size;
 
-    int offset_into_first_block = offset % block_size;
+    size_t offset_into_block = offset % block_size;
 
     ssize_t nread = 0;
-    size_t remaining_count = min((off_t)count, (off_t)size() - offset);
     u8* out = buffer;
 
 #ifdef EXT2_DEBUG
     dbg() << "Ext2FS: Reading up to " << count << " bytes " << offset << " bytes into inode " << identifier() << " to " << (const void*)buffer;
 #endif
 
-    for (size_t bi = first_block_logical_index; remaining_count && bi <= last_block_logical_index; ++bi) {
-        auto block_index = m_block_list[bi];
-        ASSERT(block_index);
-        size_t offset_into_block = (bi == first_block_logical_index) ? offset_into_first_block : 0;
-        size_t num_bytes_to_copy = min(block_size - offset_into_block, remaining_count);
-        bool success = fs().read_block(block_index, out, num_bytes_to_copy, offset_into_block, allow_cache);
-        if (!success) {
-            klog() << "ext2fs: read_bytes: read_block(" << block_index << ") failed (lbi: " << bi << ")";
+    // Multi-block reads get their blocks in flight in batches, even when the
+    // file is fragmented, before copying them out run by run.
+    bool should_prefetch = allow_cache && last_block_logical_index > first_block_logical_index;
+    size_t next_prefetch_logical_index = first_block_logical_index;
+
+    size_t bi = first_block_logical_index;
+    while (remaining_count) {
+        if (should_prefetch && bi >= next_prefetch_logical_index) {
+            Vector<unsigned, max_prefetch_blocks> block_indices;
+            size_t pi = bi;
+            while (pi <= last_block_logical_index && block_indices.size() < max_prefetch_blocks) {
+                auto run = block_run_at(pi);
+                if (!run.has_value())
+                    break;
+                size_t run_count = min((size_t)run.value().count, last_block_logical_index - pi + 1);
+                run_count = min(run_count, max_prefetch_blocks - block_indices.size());
+                for (size_t i = 0; run.value().physical_index && i < run_count; ++i)
+                    block_indices.append(run.value().physical_index + i);
+                pi += run_count;
+            }
+            fs().prefetch_blocks(block_indices);
+            next_prefetch_logical_index = pi;
+        }
+
+        if (bi >= allocated_block_count()) {
+            // The rest of the file hasn't been allocated yet, so it's all in memory.
+            size_t delayed_offset = (bi - allocated_block_count()) * block_size + offset_into_block;
+            memcpy(out, m_delayed_data.value().data() + delayed_offset, remaining_count);
+            nread += remaining_count;
+            break;
+        }
+
+        auto run = block_run_at(bi);
+        if (!run.has_value()) {
+            klog() << "ext2fs: read_bytes: couldn't map block " << bi << " of inode " << index();
             return -EIO;
         }
+        size_t run_bytes = (size_t)run.value().count * block_size - offset_into_block;
+        size_t num_bytes_to_copy = min(run_bytes, remaining_count);
+
+        if (!run.value().physical_index) {
+            memset(out, 0, num_bytes_to_copy);
+        } else if (offset_into_block || num_bytes_to_copy < block_size) {
+            num_bytes_to_copy = min(block_size - offset_into_block, num_bytes_to_copy);
+            if (!fs().read_block(run.value().physical_index, out, num_bytes_to_copy, offset_into_block, allow_cache)) {
+                klog() << "ext2fs: read_bytes: read_block(" << run.value().physical_index << ") failed (lbi: " << bi << ")";
+                return -EIO;
+            }
+        } else {
+            // Read all the whole blocks in this run in one go.
+            size_t block_count = num_bytes_to_copy / block_size;
+            num_bytes_to_copy = block_count * block_size;
+            if (!fs().read_blocks(run.value().physical_index, block_count, out, allow_cache)) {
+                klog() << "ext2fs: read_bytes: read_blocks(" << run.value().physical_index << ", " << block_count << ") failed (lbi: " << bi << ")";
+                return -EIO;
+            }
+        }
+
+        bi += (offset_into_block + num_bytes_to_copy) / block_size;
+        offset_into_block = (offset_into_block + num_bytes_to_copy) % block_size;
         remaining_count -= num_bytes_to_copy;
         nread += num_bytes_to_copy;
         out += num_bytes_to_copy;
@@ -727,6 +1036,10 @@ KResult Ext2FSInode::resize(u64 new_size)
     if (old_size == new_size)
         return KSuccess;
 
+    auto result = allocate_delayed_blocks();
+    if (result.is_error())
+        return result;
+
     u64 block_size = fs().block_size();
     size_t blocks_needed_before = ceil_div(old_size, block_size);
     size_t blocks_needed_after = ceil_div(new_size, block_size);
@@ -736,17 +1049,30 @@ KResult Ext2FSInode::resize(u64 new_size)
     dbg() << "Ext2FSInode::resize(): blocks needed after  (size is  " << new_size << "): " << blocks_needed_after;
 #endif
 
+    // Other files may be growing at the same time, so make sure the space
+    // (including any new block pointer arrays) stays ours until it's allocated.
+    size_t reserved_block_count = 0;
     if (blocks_needed_after > blocks_needed_before) {
-        u32 additional_blocks_needed = blocks_needed_after - blocks_needed_before;
-        if (additional_blocks_needed > fs().super_block().s_free_blocks_count)
+        size_t meta_blocks = fs().compute_block_list_shape(blocks_needed_after).meta_blocks - fs().compute_block_list_shape(blocks_needed_before).meta_blocks;
+        reserved_block_count = blocks_needed_after - blocks_needed_before + meta_blocks;
+        if (!fs().reserve_blocks(reserved_block_count))
             return KResult(-ENOSPC);
     }
 
     auto block_list = fs().block_list_for_inode(m_raw_inode);
+    Vector<u32> new_blocks;
     if (blocks_needed_after > blocks_needed_before) {
-        auto new_blocks = fs().allocate_blocks(fs().group_index_from_inode(index()), blocks_needed_after - blocks_needed_before);
-        block_list.append(move(new_blocks));
+        size_t data_block_count = blocks_needed_after - blocks_needed_before;
+        auto new_blocks_or_error = allocate_data_blocks(data_block_count, block_list.is_empty() ? 0 : block_list.last() + 1, data_block_count);
+        if (new_blocks_or_error.is_error()) {
+            fs().unreserve_blocks(reserved_block_count);
+            return new_blocks_or_error.error();
+        }
+        reserved_block_count -= data_block_count;
+        new_blocks = new_blocks_or_error.release_value();
+        block_list.append(new_blocks.data(), new_blocks.size());
     } else if (blocks_needed_after < blocks_needed_before) {
+        discard_preallocated_blocks();
 #ifdef EXT2_DEBUG
         dbg() << "Ext2FS: Shrinking inode " << identifier() << ". Old block list is " << block_list.size() << " entries:";
         for (auto block_index : block_list) {
@@ -760,24 +1086,229 @@ KResult Ext2FSInode::resize(u64 new_size)
         }
     }
 
-    bool success = fs().write_block_list_for_inode(index(), m_raw_inode, block_list);
-    if (!success)
-        return KResult(-EIO);
+    // This takes care of what's left of the reservation.
+    bool success = fs().write_block_list_for_inode(index(), m_raw_inode, block_list, reserved_block_count);
+    if (!success) {
+        fs().unreserve_blocks(reserved_block_count);
+        for (auto block_index : new_blocks)
+            fs().set_block_allocation_state(block_index, false);
+        return KResult(-ENOSPC);
+    }
+
+    m_raw_inode.i_size = new_size;
+    set_metadata_dirty(true);
+
+    m_block_map.clear();
+    return KSuccess;
+}
+
+u32 Ext2FSInode::allocated_block_count() const
+{
+    if (is_symlink() && m_raw_inode.i_blocks == 0)
+        return 0;
+    return ceil_div(static_cast<size_t>(m_raw_inode.i_size), fs().block_size()) - m_delayed_block_count;
+}
+
+KResult Ext2FSInode::delay_allocation(u64 new_size)
+{
+    const size_t block_size = fs().block_size();
+    const size_t max_delayed_blocks = max_delayed_allocation_size / block_size;
+    size_t blocks_before = ceil_div(size(), (size_t)block_size);
+    size_t blocks_after = ceil_div(new_size, (u64)block_size);
+    size_t new_blocks = blocks_after - blocks_before;
+
+    if (m_delayed_block_count + new_blocks > max_delayed_blocks) {
+        auto result = allocate_delayed_blocks();
+        if (result.is_error())
+            return result;
+        if (new_blocks > max_delayed_blocks)
+            return resize(new_size);
+    }
+
+    if (new_blocks) {
+        // Set aside enough space for the blocks themselves, and for the block
+        // pointer arrays the file is going to need on top of what it has.
+        size_t meta_blocks = fs().compute_block_list_shape(blocks_after).meta_blocks - fs().compute_block_list_shape(blocks_before).meta_blocks;
+        if (!fs().reserve_blocks(new_blocks + meta_blocks))
+            return KResult(-ENOSPC);
+        m_reserved_block_count += new_blocks + meta_blocks;
+
+        // The buffer starts out as small as it can and doubles as the file
+        // grows, so that lots of files growing a little don't each pin the
+        // maximum.
+        size_t needed_size = (m_delayed_block_count + new_blocks) * block_size;
+        if (!m_delayed_data.has_value() || m_delayed_data.value().capacity() < needed_size) {
+            size_t new_capacity = m_delayed_data.has_value() ? m_delayed_data.value().capacity() * 2 : 0;
+            new_capacity = min(max(new_capacity, PAGE_ROUND_UP(needed_size)), max_delayed_allocation_size);
+            auto new_data = KBuffer::create_with_size(new_capacity, Region::Access::Read | Region::Access::Write, "Ext2FS: Delayed allocation");
+            if (m_delayed_data.has_value())
+                memcpy(new_data.data(), m_delayed_data.value().data(), m_delayed_block_count * block_size);
+            m_delayed_data = move(new_data);
+        }
+        memset(m_delayed_data.value().data() + m_delayed_block_count * block_size, 0, new_blocks * block_size);
+        m_delayed_block_count += new_blocks;
+    }
 
     m_raw_inode.i_size = new_size;
     set_metadata_dirty(true);
+    return KSuccess;
+}
+
+KResult Ext2FSInode::allocate_delayed_blocks()
+{
+    ASSERT(m_lock.is_locked());
+    if (!m_delayed_block_count)
+        return KSuccess;
+
+    const size_t block_size = fs().block_size();
+    u32 first_delayed_block = allocated_block_count();
+
+    // As far as the disk is concerned, the file ends with its last allocated
+    // block until the new block list is in place.
+    u64 size = m_raw_inode.i_size;
+    m_raw_inode.i_size = static_cast<u64>(first_delayed_block) * block_size;
+    auto block_list = fs().block_list_for_inode(m_raw_inode);
+    u32 goal = block_list.is_empty() ? 0 : block_list.last() + 1;
+    // Trailing holes don't make it into the list, but we still have to skip them.
+    while (block_list.size() < first_delayed_block)
+        block_list.append(0);
+
+    // The space we reserved is handed to the allocator along with the
+    // request, so nobody else can take it in the meantime. If we fail, it
+    // stays ours, so the data we're holding on to still has a place to go.
+    size_t reserved_count = m_reserved_block_count;
+    size_t reserved_data_block_count = min(reserved_count, (size_t)m_delayed_block_count);
+    auto new_blocks_or_error = allocate_data_blocks(m_delayed_block_count, goal, reserved_data_block_count);
+    if (new_blocks_or_error.is_error()) {
+        m_raw_inode.i_size = size;
+        return new_blocks_or_error.error();
+    }
+    auto new_blocks = new_blocks_or_error.release_value();
+    block_list.append(new_blocks.data(), new_blocks.size());
+    bool success = fs().write_block_list_for_inode(index(), m_raw_inode, block_list, reserved_count - reserved_data_block_count);
+    m_raw_inode.i_size = size;
+    if (!success) {
+        // Only the blocks that were reserved go back into the reservation,
+        // anything beyond that came from the preallocation window.
+        for (size_t i = 0; i < new_blocks.size(); ++i)
+            fs().set_block_allocation_state(new_blocks[i], false, i < reserved_data_block_count);
+        return KResult(-ENOSPC);
+    }
+    m_reserved_block_count = 0;
+
+#ifdef EXT2_DEBUG
+    dbg() << "Ext2FS: Allocated " << new_blocks.size() << " delayed blocks for inode " << identifier() << " starting at " << new_blocks.first();
+#endif
 
-    m_block_list = move(block_list);
+    const u8* data = m_delayed_data.value().data();
+    for (size_t i = 0; i < new_blocks.size();) {
+        size_t run_length = 1;
+        while (i + run_length < new_blocks.size() && new_blocks[i + run_length] == new_blocks[i] + run_length)
+            ++run_length;
+        fs().write_blocks(new_blocks[i], run_length, data + i * block_size, true, true);
+        i += run_length;
+    }
+
+    m_delayed_block_count = 0;
+    m_delayed_data.clear();
+    m_block_map.clear();
+    set_metadata_dirty(true);
     return KSuccess;
 }
 
+void Ext2FSInode::discard_delayed_blocks()
+{
+    if (!m_delayed_block_count)
+        return;
+    fs().unreserve_blocks(m_reserved_block_count);
+    m_reserved_block_count = 0;
+    m_raw_inode.i_size = static_cast<u64>(allocated_block_count()) * fs().block_size();
+    m_delayed_block_count = 0;
+    m_delayed_data.clear();
+    m_block_map.clear();
+}
+
+KResultOr<Vector<u32>> Ext2FSInode::allocate_data_blocks(size_t count, u32 goal, size_t reserved_count)
+{
+    ASSERT(reserved_count <= count);
+    Vector<u32> blocks;
+    blocks.ensure_capacity(count);
+
+    if (m_preallocated_block_count && m_preallocated_block != goal)
+        discard_preallocated_blocks();
+    while (blocks.size() < count && m_preallocated_block_count) {
+        blocks.unchecked_append(m_preallocated_block++);
+        --m_preallocated_block_count;
+    }
+
+    // Preallocated blocks are ours already, so they don't need any of the reservation.
+    size_t needed = count - blocks.size();
+    size_t unneeded_reserved_count = reserved_count > needed ? reserved_count - needed : 0;
+    reserved_count -= unneeded_reserved_count;
+    if (!needed) {
+        if (unneeded_reserved_count)
+            fs().unreserve_blocks(unneeded_reserved_count);
+        return blocks;
+    }
+
+    // Grab a few more blocks than we need while there's plenty of space, so
+    // the file can keep growing in place even with other files growing
+    // alongside it. Reserving them makes sure that there still is.
+    size_t window = 0;
+    size_t window_reserved_count = 0;
+    if (Kernel::is_regular_file(m_raw_inode.i_mode) && fs().reserve_blocks(needed - reserved_count + preallocation_window_blocks, preallocation_window_blocks)) {
+        window = preallocation_window_blocks;
+        window_reserved_count = needed - reserved_count + window;
+    }
+    auto new_blocks_or_error = fs().allocate_blocks(fs().group_index_from_inode(index()), needed + window, blocks.is_empty() ? goal : blocks.last() + 1, reserved_count + window_reserved_count);
+    if (new_blocks_or_error.is_error()) {
+        // Leave everything the way the caller found it. The blocks we took
+        // came off the front of the preallocation window, so they go back there.
+        m_preallocated_block -= blocks.size();
+        m_preallocated_block_count += blocks.size();
+        if (window_reserved_count)
+            fs().unreserve_blocks(window_reserved_count);
+        return new_blocks_or_error.error();
+    }
+    if (unneeded_reserved_count)
+        fs().unreserve_blocks(unneeded_reserved_count);
+    auto new_blocks = new_blocks_or_error.release_value();
+    for (size_t i = 0; i < needed; ++i)
+        blocks.unchecked_append(new_blocks[i]);
+
+    size_t i = needed;
+    if (window) {
+        m_preallocated_block = blocks.last() + 1;
+        while (i < new_blocks.size() && new_blocks[i] == m_preallocated_block + m_preallocated_block_count) {
+            ++m_preallocated_block_count;
+            ++i;
+        }
+    }
+    for (; i < new_blocks.size(); ++i)
+        fs().set_block_allocation_state(new_blocks[i], false);
+    return blocks;
+}
+
+void Ext2FSInode::discard_preallocated_blocks()
+{
+    if (!m_preallocated_block_count)
+        return;
+    for (size_t i = 0; i < m_preallocated_block_count; ++i)
+        fs().set_block_allocation_state(m_preallocated_block + i, false);
+    m_preallocated_block = 0;
+    m_preallocated_block_count = 0;
+}
+
 ssize_t Ext2FSInode::write_bytes(off_t offset, ssize_t count, const u8* data, FileDescription* description)
 {
     ASSERT(offset >= 0);
     ASSERT(count >= 0);
 
+    // Only the inode is locked here, so writing one file doesn't hold up
+    // anybody else on the file system. Allocation locks the block groups it
+    // allocates from, and the block cache takes care of its own locking.
+    Ext2FSJournalHandle handle(fs().m_journal.ptr());
     Locker inode_locker(m_lock);
-    Locker fs_locker(fs().m_lock);
 
     auto result = prepare_to_write_data();
     if (result.is_error())
@@ -803,23 +1334,14 @@ ssize_t Ext2FSInode::write_bytes(off_t offset, ssize_t count, const u8* data, Fi
     u64 old_size = size();
     u64 new_size = max(static_cast<u64>(offset) + count, (u64)size());
 
-    auto resize_result = resize(new_size);
+    // Regular files growing through the cache get their new blocks later,
+    // when we know how much they've really grown.
+    bool should_delay_allocation = allow_cache && new_size > old_size && Kernel::is_regular_file(m_raw_inode.i_mode);
+    auto resize_result = should_delay_allocation ? delay_allocation(new_size) : resize(new_size);
     if (resize_result.is_error())
         return resize_result;
 
-    if (m_block_list.is_empty())
-        m_block_list = fs().block_list_for_inode(m_raw_inode);
-
-    if (m_block_list.is_empty()) {
-        dbg() << "Ext2FSInode::write_bytes(): empty block list for inode " << index();
-        return -EIO;
-    }
-
     size_t first_block_logical_index = offset / block_size;
-    size_t last_block_logical_index = (offset + count) / block_size;
-    if (last_block_logical_index >= m_block_list.size())
-        last_block_logical_index = m_block_list.size() - 1;
-
     size_t offset_into_first_block = offset % block_size;
 
     ssize_t nwritten = 0;
@@ -830,15 +1352,31 @@ ssize_t Ext2FSInode::write_bytes(off_t offset, ssize_t count, const u8* data, Fi
     dbg() << "Ext2FS: Writing " << count << " bytes " << offset << " bytes into inode " << identifier() << " from " << (const void*)data;
 #endif
 
-    for (size_t bi = first_block_logical_index; remaining_count && bi <= last_block_logical_index; ++bi) {
+    for (size_t bi = first_block_logical_index; remaining_count; ++bi) {
         size_t offset_into_block = (bi == first_block_logical_index) ? offset_into_first_block : 0;
+        if (bi >= allocated_block_count()) {
+            size_t delayed_offset = (bi - allocated_block_count()) * block_size + offset_into_block;
+            memcpy(m_delayed_data.value().data() + delayed_offset, in, remaining_count);
+            nwritten += remaining_count;
+            break;
+        }
+
+        auto run = block_run_at(bi);
+        if (!run.has_value() || !run.value().physical_index) {
+            dbg() << "Ext2FSInode::write_bytes(): no block " << bi << " in inode " << index();
+            return -EIO;
+        }
+        auto block_index = run.value().physical_index;
         size_t num_bytes_to_copy = min(block_size - offset_into_block, remaining_count);
 #ifdef EXT2_DEBUG
-        dbg() << "Ext2FS: Writing block " << m_block_list[bi] << " (offset_into_block: " << offset_into_block << ")";
+        dbg() << "Ext2FS: Writing block " << block_index << " (offset_into_block: " << offset_into_block << ")";
 #endif
-        bool success = fs().write_block(m_block_list[bi], in, num_bytes_to_copy, offset_into_block, allow_cache);
+        bool is_data = Kernel::is_regular_file(m_raw_inode.i_mode);
+        if (is_data && !allow_cache && fs().m_journal)
+            fs().m_journal->will_write_in_place(block_index);
+        bool success = fs().write_block(block_index, in, num_bytes_to_copy, offset_into_block, allow_cache, is_data);
         if (!success) {
-            dbg() << "Ext2FS: write_block(" << m_block_list[bi] << ") failed (bi: " << bi << ")";
+            dbg() << "Ext2FS: write_block(" << block_index << ") failed (bi: " << bi << ")";
             ASSERT_NOT_REACHED();
             return -EIO;
         }
@@ -848,7 +1386,7 @@ ssize_t Ext2FSInode::write_bytes(off_t offset, ssize_t count, const u8* data, Fi
     }
 
 #ifdef EXT2_DEBUG
-    dbg() << "Ext2FS: After write, i_size=" << m_raw_inode.i_size << ", i_blocks=" << m_raw_inode.i_blocks << " (" << m_block_list.size() << " blocks in list)";
+    dbg() << "Ext2FS: After write, i_size=" << m_raw_inode.i_size << ", i_blocks=" << m_raw_inode.i_blocks << " (" << m_block_map.size() << " runs in block map)";
 #endif
 
     if (old_size != new_size)
@@ -961,12 +1499,18 @@ bool Ext2FSInode::write_directory(const Vector<Ext2FSDirectoryEntry>& entries)
     ssize_t nwritten = write_bytes(0, directory_data.size(), directory_data.data(), nullptr);
     if (nwritten < 0)
         return false;
+    m_raw_inode.i_flags &= ~EXT2_INDEX_FL;
     set_metadata_dirty(true);
     return static_cast<size_t>(nwritten) == directory_data.size();
 }
 
 KResultOr<NonnullRefPtr<Inode>> Ext2FSInode::create_child(const String& name, mode_t mode, dev_t dev, uid_t uid, gid_t gid)
 {
+    // Holding our lock throughout keeps two threads from creating the same name in here.
+    Ext2FSJournalHandle handle(fs().m_journal.ptr());
+    LOCKER(m_lock);
+    if (lookup(name))
+        return KResult(-EEXIST);
     if (mode & S_IFDIR)
         return fs().create_directory(identifier(), name, mode, uid, gid);
     return fs().create_inode(identifier(), name, mode, 0, dev, uid, gid);
@@ -974,6 +1518,7 @@ KResultOr<NonnullRefPtr<Inode>> Ext2FSInode::create_child(const String& name, mo
 
 KResult Ext2FSInode::add_child(Inode& child, const StringView& name, mode_t mode)
 {
+    Ext2FSJournalHandle handle(fs().m_journal.ptr());
     LOCKER(m_lock);
     ASSERT(is_directory());
 
@@ -984,6 +1529,33 @@ KResult Ext2FSInode::add_child(Inode& child, const StringView& name, mode_t mode
     dbg() << "Ext2FSInode::add_child(): Adding inode " << child.index() << " with name '" << name << "' and mode " << mode << " to directory " << index();
 #endif
 
+    if (is_indexed_directory()) {
+        DirectoryIndexFrames frames;
+        ByteBuffer leaf;
+        size_t offset = 0;
+        Optional<size_t> previous_offset;
+        auto result = find_in_directory_index(name, frames, leaf, offset, previous_offset);
+        if (!result.is_error()) {
+            dbg() << "Ext2FSInode::add_child(): Name '" << name << "' already exists in inode " << index();
+            return KResult(-EEXIST);
+        }
+        if (result.error() == -ENOENT)
+            result = add_to_directory_index(name, child.index(), to_ext2_file_type(mode));
+        if (!result.is_error()) {
+            result = child.increment_link_count();
+            if (result.is_error())
+                return result;
+            if (!m_lookup_cache.is_empty())
+                m_lookup_cache.set(name, child.index());
+            did_add_child(name);
+            return KSuccess;
+        }
+        if (result.error() != -EIO)
+            return result;
+        // The index is broken, fall back to rewriting the directory linearly.
+        dbg() << "Ext2FSInode::add_child(): Dropping broken index of directory " << index();
+    }
+
     Vector<Ext2FSDirectoryEntry> entries;
     bool name_already_exists = false;
     KResult result = traverse_as_directory([&](auto& entry) {
@@ -1008,7 +1580,19 @@ KResult Ext2FSInode::add_child(Inode& child, const StringView& name, mode_t mode
         return result;
 
     entries.empend(name, child.identifier(), to_ext2_file_type(mode));
-    bool success = write_directory(entries);
+
+    // Once a directory outgrows its first block, switch it over to an index
+    // so that it doesn't have to be scanned and rewritten as a whole anymore.
+    bool success = false;
+    if (fs().has_directory_index()) {
+        size_t directory_size = 0;
+        for (auto& entry : entries)
+            directory_size += EXT2_DIR_REC_LEN(entry.name.length());
+        if (directory_size > fs().block_size())
+            success = build_directory_index(entries);
+    }
+    if (!success)
+        success = write_directory(entries);
     if (success)
         m_lookup_cache.set(name, child.index());
 
@@ -1016,14 +1600,39 @@ KResult Ext2FSInode::add_child(Inode& child, const StringView& name, mode_t mode
     return KSuccess;
 }
 
+// "." and ".." live in the fake entries at the start of the index root, not in
+// any of the hashed leaves, so they can only be found by a linear scan.
+static bool is_dot_or_dot_dot(const StringView& name)
+{
+    return name == "." || name == "..";
+}
+
 KResult Ext2FSInode::remove_child(const StringView& name)
 {
+    Ext2FSJournalHandle handle(fs().m_journal.ptr());
     LOCKER(m_lock);
 #ifdef EXT2_DEBUG
     dbg() << "Ext2FSInode::remove_child(" << name << ") in inode " << index();
 #endif
     ASSERT(is_directory());
 
+    if (is_indexed_directory() && !is_dot_or_dot_dot(name)) {
+        unsigned child_inode_index = 0;
+        auto result = remove_from_directory_index(name, child_inode_index);
+        if (!result.is_error()) {
+            m_lookup_cache.remove(name);
+            auto child_inode = fs().get_inode({ fsid(), child_inode_index });
+            result = child_inode->decrement_link_count();
+            if (result.is_error())
+                return result;
+            did_remove_child(name);
+            return KSuccess;
+        }
+        if (result.error() != -EIO)
+            return result;
+        populate_lookup_cache();
+    }
+
     auto it = m_lookup_cache.find(name);
     if (it == m_lookup_cache.end())
         return KResult(-ENOENT);
@@ -1061,107 +1670,920 @@ KResult Ext2FSInode::remove_child(const StringView& name)
     return KSuccess;
 }
 
-unsigned Ext2FS::inodes_per_block() const
-{
-    return EXT2_INODES_PER_BLOCK(&super_block());
+// The directory hash functions below follow the on-disk format shared with
+// every other ext2/3/4 implementation, so they have to produce the exact
+// same values, signedness quirks and all.
+static u32 dx_hack_hash(const char* name, size_t length, bool is_unsigned)
+{
+    u32 hash0 = 0x12a3fe2d;
+    u32 hash1 = 0x37abe8f9;
+    for (size_t i = 0; i < length; ++i) {
+        int c = is_unsigned ? (int)(u8)name[i] : (int)(i8)name[i];
+        u32 hash = hash1 + (hash0 ^ (u32)(c * 7152373));
+        if (hash & 0x80000000)
+            hash -= 0x7fffffff;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
 }
 
-unsigned Ext2FS::inodes_per_group() const
+static void string_to_hash_buffer(const char* message, int length, u32* buffer, int count, bool is_unsigned)
 {
-    return EXT2_INODES_PER_GROUP(&super_block());
+    u32 pad = (u32)length | ((u32)length << 8);
+    pad |= pad << 16;
+
+    u32 value = pad;
+    if (length > count * 4)
+        length = count * 4;
+    for (int i = 0; i < length; ++i) {
+        int c = is_unsigned ? (int)(u8)message[i] : (int)(i8)message[i];
+        value = (u32)c + (value << 8);
+        if ((i % 4) == 3) {
+            *buffer++ = value;
+            value = pad;
+            --count;
+        }
+    }
+    if (--count >= 0)
+        *buffer++ = value;
+    while (--count >= 0)
+        *buffer++ = pad;
+}
+
+static inline u32 rotate_left(u32 value, unsigned shift)
+{
+    return (value << shift) | (value >> (32 - shift));
+}
+
+static void half_md4_transform(u32 buffer[4], const u32 input[8])
+{
+    u32 a = buffer[0];
+    u32 b = buffer[1];
+    u32 c = buffer[2];
+    u32 d = buffer[3];
+
+    auto f = [](u32 x, u32 y, u32 z) { return z ^ (x & (y ^ z)); };
+    auto g = [](u32 x, u32 y, u32 z) { return (x & y) + ((x ^ y) & z); };
+    auto h = [](u32 x, u32 y, u32 z) { return x ^ y ^ z; };
+
+    constexpr u32 k1 = 0;
+    constexpr u32 k2 = 013240474631;
+    constexpr u32 k3 = 015666365641;
+
+#define ROUND(function, a, b, c, d, x, s) \
+    a += function(b, c, d) + (x);         \
+    a = rotate_left(a, s);
+
+    ROUND(f, a, b, c, d, input[0] + k1, 3);
+    ROUND(f, d, a, b, c, input[1] + k1, 7);
+    ROUND(f, c, d, a, b, input[2] + k1, 11);
+    ROUND(f, b, c, d, a, input[3] + k1, 19);
+    ROUND(f, a, b, c, d, input[4] + k1, 3);
+    ROUND(f, d, a, b, c, input[5] + k1, 7);
+    ROUND(f, c, d, a, b, input[6] + k1, 11);
+    ROUND(f, b, c, d, a, input[7] + k1, 19);
+
+    ROUND(g, a, b, c, d, input[1] + k2, 3);
+    ROUND(g, d, a, b, c, input[3] + k2, 5);
+    ROUND(g, c, d, a, b, input[5] + k2, 9);
+    ROUND(g, b, c, d, a, input[7] + k2, 13);
+    ROUND(g, a, b, c, d, input[0] + k2, 3);
+    ROUND(g, d, a, b, c, input[2] + k2, 5);
+    ROUND(g, c, d, a, b, input[4] + k2, 9);
+    ROUND(g, b, c, d, a, input[6] + k2, 13);
+
+    ROUND(h, a, b, c, d, input[3] + k3, 3);
+    ROUND(h, d, a, b, c, input[7] + k3, 9);
+    ROUND(h, c, d, a, b, input[2] + k3, 11);
+    ROUND(h, b, c, d, a, input[6] + k3, 15);
+    ROUND(h, a, b, c, d, input[1] + k3, 3);
+    ROUND(h, d, a, b, c, input[5] + k3, 9);
+    ROUND(h, c, d, a, b, input[0] + k3, 11);
+    ROUND(h, b, c, d, a, input[4] + k3, 15);
+
+#undef ROUND
+
+    buffer[0] += a;
+    buffer[1] += b;
+    buffer[2] += c;
+    buffer[3] += d;
+}
+
+static void tea_transform(u32 buffer[4], const u32 input[4])
+{
+    u32 sum = 0;
+    u32 b0 = buffer[0];
+    u32 b1 = buffer[1];
+    for (int i = 0; i < 16; ++i) {
+        sum += 0x9e3779b9;
+        b0 += ((b1 << 4) + input[0]) ^ (b1 + sum) ^ ((b1 >> 5) + input[1]);
+        b1 += ((b0 << 4) + input[2]) ^ (b0 + sum) ^ ((b0 >> 5) + input[3]);
+    }
+    buffer[0] += b0;
+    buffer[1] += b1;
 }
 
-unsigned Ext2FS::inode_size() const
+bool Ext2FS::has_directory_index() const
 {
-    return EXT2_INODE_SIZE(&super_block());
+    return super_block().s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX;
 }
-unsigned Ext2FS::blocks_per_group() const
+
+u8 Ext2FS::directory_hash_version(u8 stored_version) const
 {
-    return EXT2_BLOCKS_PER_GROUP(&super_block());
+    if (stored_version <= EXT2_HASH_TEA && (super_block().s_flags & EXT2_FLAGS_UNSIGNED_HASH))
+        return stored_version + 3;
+    return stored_version;
 }
 
-bool Ext2FS::write_ext2_inode(unsigned inode, const ext2_inode& e2inode)
+u32 Ext2FS::directory_hash(const StringView& name, u8 hash_version) const
 {
-    LOCKER(m_lock);
-    unsigned block_index;
-    unsigned offset;
+    u32 buffer[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    auto& seed = super_block().s_hash_seed;
+    if (seed[0] || seed[1] || seed[2] || seed[3])
+        memcpy(buffer, seed, sizeof(buffer));
+
+    const char* characters = name.characters_without_null_termination();
+    int length = name.length();
+    u32 input[8];
+    u32 hash = 0;
+
+    switch (hash_version) {
+    case EXT2_HASH_LEGACY:
+    case EXT2_HASH_LEGACY_UNSIGNED:
+        hash = dx_hack_hash(characters, length, hash_version == EXT2_HASH_LEGACY_UNSIGNED);
+        break;
+    case EXT2_HASH_HALF_MD4:
+    case EXT2_HASH_HALF_MD4_UNSIGNED:
+        for (; length > 0; length -= 32, characters += 32) {
+            string_to_hash_buffer(characters, length, input, 8, hash_version == EXT2_HASH_HALF_MD4_UNSIGNED);
+            half_md4_transform(buffer, input);
+        }
+        hash = buffer[1];
+        break;
+    case EXT2_HASH_TEA:
+    case EXT2_HASH_TEA_UNSIGNED:
+        for (; length > 0; length -= 16, characters += 16) {
+            string_to_hash_buffer(characters, length, input, 4, hash_version == EXT2_HASH_TEA_UNSIGNED);
+            tea_transform(buffer, input);
+        }
+        hash = buffer[0];
+        break;
+    default:
+        dbg() << "Ext2FS: Unknown directory hash version " << (int)hash_version;
+        break;
+    }
+
+    // The lowest bit is used to mark hash collisions in the index, and the
+    // largest hash value is reserved to mean end-of-directory.
+    hash &= ~1u;
+    if (hash == (0x7fffffffu << 1))
+        hash = (0x7fffffffu - 1) << 1;
+    return hash;
+}
+
+// The root block starts with fake "." and ".." entries, the latter of which
+// spans the rest of the block and hides the index from linear readers.
+static constexpr size_t directory_index_root_info_offset = 24;
+// Interior index nodes hide behind a single empty entry covering the block.
+static constexpr size_t directory_index_node_entries_offset = 8;
+
+static inline ext2_dx_root_info& directory_index_root_info(ByteBuffer& root)
+{
+    return *reinterpret_cast<ext2_dx_root_info*>(root.data() + directory_index_root_info_offset);
+}
+
+static Optional<size_t> find_directory_entry_in_block(const ByteBuffer& block, const StringView& name, Optional<size_t>& previous_offset)
+{
+    previous_offset.clear();
+    size_t offset = 0;
+    while (offset + 8 <= block.size()) {
+        auto& entry = *reinterpret_cast<const ext2_dir_entry_2*>(block.data() + offset);
+        if (entry.rec_len < 8 || offset + entry.rec_len > block.size())
+            break;
+        if (entry.inode && entry.name_len == name.length() && !memcmp(entry.name, name.characters_without_null_termination(), name.length()))
+            return offset;
+        previous_offset = offset;
+        offset += entry.rec_len;
+    }
+    return {};
+}
+
+static bool insert_directory_entry_into_block(ByteBuffer& block, const StringView& name, unsigned inode_index, u8 file_type)
+{
+    size_t needed = EXT2_DIR_REC_LEN(name.length());
+    size_t offset = 0;
+    while (offset + 8 <= block.size()) {
+        auto& entry = *reinterpret_cast<ext2_dir_entry_2*>(block.data() + offset);
+        if (entry.rec_len < 8 || offset + entry.rec_len > block.size())
+            return false;
+        size_t used = entry.inode ? EXT2_DIR_REC_LEN(entry.name_len) : 0;
+        if (entry.rec_len >= used + needed) {
+            size_t new_offset = offset + used;
+            u16 new_record_length = entry.rec_len - used;
+            if (used)
+                entry.rec_len = used;
+            auto& new_entry = *reinterpret_cast<ext2_dir_entry_2*>(block.data() + new_offset);
+            new_entry.inode = inode_index;
+            new_entry.rec_len = new_record_length;
+            new_entry.name_len = name.length();
+            new_entry.file_type = file_type;
+            memcpy(new_entry.name, name.characters_without_null_termination(), name.length());
+            memset(new_entry.name + name.length(), 0, needed - 8 - name.length());
+            return true;
+        }
+        offset += entry.rec_len;
+    }
+    return false;
+}
+
+static void write_directory_entry(ByteBuffer& block, size_t offset, unsigned inode_index, u16 record_length, const StringView& name, u8 file_type)
+{
+    auto& entry = *reinterpret_cast<ext2_dir_entry_2*>(block.data() + offset);
+    entry.inode = inode_index;
+    entry.rec_len = record_length;
+    entry.name_len = name.length();
+    entry.file_type = file_type;
+    memcpy(entry.name, name.characters_without_null_termination(), name.length());
+}
+
+static ByteBuffer create_directory_index_node(size_t block_size)
+{
+    auto node = ByteBuffer::create_zeroed(block_size);
+    auto& fake_entry = *reinterpret_cast<ext2_dir_entry_2*>(node.data());
+    fake_entry.rec_len = block_size;
+    return node;
+}
+
+bool Ext2FSInode::is_indexed_directory() const
+{
+    return is_directory() && (m_raw_inode.i_flags & EXT2_INDEX_FL) && fs().has_directory_index();
+}
+
+bool Ext2FSInode::read_directory_block(u32 logical_index, ByteBuffer& buffer) const
+{
+    size_t block_size = fs().block_size();
+    buffer = ByteBuffer::create_uninitialized(block_size);
+    return read_bytes((off_t)logical_index * block_size, block_size, buffer.data(), nullptr) == (ssize_t)block_size;
+}
+
+bool Ext2FSInode::write_directory_block(u32 logical_index, const ByteBuffer& buffer)
+{
+    size_t block_size = fs().block_size();
+    ASSERT(buffer.size() == block_size);
+    return write_bytes((off_t)logical_index * block_size, block_size, buffer.data(), nullptr) == (ssize_t)block_size;
+}
+
+u32 Ext2FSInode::hash_for_directory_index(DirectoryIndexFrame& root, const StringView& name) const
+{
+    auto hash_version = fs().directory_hash_version(directory_index_root_info(root.data).hash_version);
+    return fs().directory_hash(name, hash_version);
+}
+
+KResult Ext2FSInode::probe_directory_index(const StringView& name, u32& hash, DirectoryIndexFrames& frames) const
+{
+    ASSERT(m_lock.is_locked());
+    size_t block_size = fs().block_size();
+    frames.clear();
+
+    DirectoryIndexFrame root;
+    if (!read_directory_block(0, root.data))
+        return KResult(-EIO);
+    auto& info = directory_index_root_info(root.data);
+    if (info.reserved_zero || info.info_length < 8 || info.indirect_levels > 1) {
+        dbg() << "Ext2FS: Directory " << identifier() << " has an unsupported index";
+        return KResult(-EIO);
+    }
+    root.entries_offset = directory_index_root_info_offset + info.info_length;
+    unsigned levels = info.indirect_levels;
+    hash = hash_for_directory_index(root, name);
+    frames.append(move(root));
+
+    for (;;) {
+        auto& frame = frames.last();
+        auto& countlimit = frame.countlimit();
+        if (!countlimit.count || countlimit.count > countlimit.limit || frame.entries_offset + countlimit.limit * sizeof(ext2_dx_entry) > block_size) {
+            dbg() << "Ext2FS: Directory " << identifier() << " has a corrupt index block " << frame.block;
+            return KResult(-EIO);
+        }
+
+        // The first entry has no hash of its own, it covers everything below the second one.
+        auto* entries = frame.entries();
+        size_t low = 1;
+        size_t high = countlimit.count;
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            if (entries[middle].hash > hash)
+                high = middle;
+            else
+                low = middle + 1;
+        }
+        frame.position = low - 1;
+
+        if (frames.size() > levels)
+            return KSuccess;
+
+        DirectoryIndexFrame node;
+        node.block = frame.child_block();
+        node.entries_offset = directory_index_node_entries_offset;
+        if (!read_directory_block(node.block, node.data))
+            return KResult(-EIO);
+        frames.append(move(node));
+    }
+}
+
+bool Ext2FSInode::advance_to_next_index_leaf(u32 hash, DirectoryIndexFrames& frames) const
+{
+    // Entries with the same hash may spill over into the next leaf, which is
+    // then marked by the collision bit in the index entry pointing to it.
+    size_t level = frames.size();
+    while (level > 0 && frames[level - 1].position + 1 >= frames[level - 1].countlimit().count)
+        --level;
+    if (!level)
+        return false;
+
+    auto& frame = frames[level - 1];
+    ++frame.position;
+    if ((frame.entries()[frame.position].hash & ~1u) != hash)
+        return false;
+
+    for (size_t i = level; i < frames.size(); ++i) {
+        frames[i].block = frames[i - 1].child_block();
+        frames[i].position = 0;
+        if (!read_directory_block(frames[i].block, frames[i].data))
+            return false;
+    }
+    return true;
+}
+
+KResult Ext2FSInode::find_in_directory_index(const StringView& name, DirectoryIndexFrames& frames, ByteBuffer& leaf, size_t& offset, Optional<size_t>& previous_offset) const
+{
+    u32 hash = 0;
+    auto result = probe_directory_index(name, hash, frames);
+    if (result.is_error())
+        return result;
+
+    for (;;) {
+        if (!read_directory_block(frames.last().child_block(), leaf))
+            return KResult(-EIO);
+        auto found_offset = find_directory_entry_in_block(leaf, name, previous_offset);
+        if (found_offset.has_value()) {
+            offset = found_offset.value();
+            return KSuccess;
+        }
+        if (!advance_to_next_index_leaf(hash, frames))
+            return KResult(-ENOENT);
+    }
+}
+
+KResult Ext2FSInode::remove_from_directory_index(const StringView& name, unsigned& inode_index)
+{
+    DirectoryIndexFrames frames;
+    ByteBuffer leaf;
+    size_t offset = 0;
+    Optional<size_t> previous_offset;
+    auto result = find_in_directory_index(name, frames, leaf, offset, previous_offset);
+    if (result.is_error())
+        return result;
+
+    auto& entry = *reinterpret_cast<ext2_dir_entry_2*>(leaf.data() + offset);
+    inode_index = entry.inode;
+    if (previous_offset.has_value())
+        reinterpret_cast<ext2_dir_entry_2*>(leaf.data() + previous_offset.value())->rec_len += entry.rec_len;
+    else
+        entry.inode = 0;
+
+    if (!write_directory_block(frames.last().child_block(), leaf))
+        return KResult(-EIO);
+    return KSuccess;
+}
+
+KResult Ext2FSInode::add_to_directory_index(const StringView& name, unsigned inode_index, u8 file_type)
+{
+    u32 hash = 0;
+    DirectoryIndexFrames frames;
+    auto result = probe_directory_index(name, hash, frames);
+    if (result.is_error())
+        return result;
+
+    ByteBuffer leaf;
+    if (!read_directory_block(frames.last().child_block(), leaf))
+        return KResult(-EIO);
+
+    if (!insert_directory_entry_into_block(leaf, name, inode_index, file_type)) {
+        result = split_directory_index_leaf(frames, leaf, hash);
+        if (result.is_error())
+            return result;
+        if (!insert_directory_entry_into_block(leaf, name, inode_index, file_type))
+            return KResult(-ENOSPC);
+    }
+
+    if (!write_directory_block(frames.last().child_block(), leaf))
+        return KResult(-EIO);
+    return KSuccess;
+}
+
+void Ext2FSInode::insert_directory_index_entry(DirectoryIndexFrame& frame, u32 hash, u32 block)
+{
+    auto& countlimit = frame.countlimit();
+    ASSERT(countlimit.count < countlimit.limit);
+    auto* entries = frame.entries();
+    size_t at = frame.position + 1;
+    memmove(&entries[at + 1], &entries[at], (countlimit.count - at) * sizeof(ext2_dx_entry));
+    entries[at].hash = hash;
+    entries[at].block = block;
+    ++countlimit.count;
+}
+
+KResult Ext2FSInode::make_room_in_directory_index(DirectoryIndexFrames& frames)
+{
+    size_t block_size = fs().block_size();
+    auto& node = frames.last();
+    if (node.countlimit().count < node.countlimit().limit)
+        return KSuccess;
+
+    if (frames.size() == 1) {
+        // The root is full, so move all of its entries down into a new index
+        // node and make that the only child of the root.
+        auto& root = frames[0];
+        auto& info = directory_index_root_info(root.data);
+        if (info.indirect_levels >= 1)
+            return KResult(-ENOSPC);
+
+        u32 new_block = size() / block_size;
+        auto new_node_data = create_directory_index_node(block_size);
+        u16 count = root.countlimit().count;
+        memcpy(new_node_data.data() + directory_index_node_entries_offset, root.entries(), count * sizeof(ext2_dx_entry));
+        auto& new_countlimit = *reinterpret_cast<ext2_dx_countlimit*>(new_node_data.data() + directory_index_node_entries_offset);
+        new_countlimit.limit = (block_size - directory_index_node_entries_offset) / sizeof(ext2_dx_entry);
+        new_countlimit.count = count;
+        if (!write_directory_block(new_block, new_node_data))
+            return KResult(-EIO);
+
+        root.countlimit().count = 1;
+        root.entries()[0].block = new_block;
+        info.indirect_levels = 1;
+        if (!write_directory_block(0, root.data))
+            return KResult(-EIO);
+
+        DirectoryIndexFrame new_node;
+        new_node.block = new_block;
+        new_node.data = move(new_node_data);
+        new_node.entries_offset = directory_index_node_entries_offset;
+        new_node.position = root.position;
+        root.position = 0;
+        frames.append(move(new_node));
+        return KSuccess;
+    }
+
+    // An index node below the root is full, so split it in half and hook the
+    // upper half up to the parent.
+    auto& parent = frames[frames.size() - 2];
+    if (parent.countlimit().count >= parent.countlimit().limit) {
+        dbg() << "Ext2FS: Directory index of " << identifier() << " is full";
+        return KResult(-ENOSPC);
+    }
+
+    u16 count = node.countlimit().count;
+    u16 half = count / 2;
+    u32 split_hash = node.entries()[half].hash;
+
+    u32 new_block = size() / block_size;
+    auto new_node_data = create_directory_index_node(block_size);
+    memcpy(new_node_data.data() + directory_index_node_entries_offset, &node.entries()[half], (count - half) * sizeof(ext2_dx_entry));
+    auto& new_countlimit = *reinterpret_cast<ext2_dx_countlimit*>(new_node_data.data() + directory_index_node_entries_offset);
+    new_countlimit.limit = node.countlimit().limit;
+    new_countlimit.count = count - half;
+    node.countlimit().count = half;
+
+    if (!write_directory_block(new_block, new_node_data) || !write_directory_block(node.block, node.data))
+        return KResult(-EIO);
+
+    insert_directory_index_entry(parent, split_hash, new_block);
+    if (!write_directory_block(parent.block, parent.data))
+        return KResult(-EIO);
+
+    if (node.position >= half) {
+        node.block = new_block;
+        node.data = move(new_node_data);
+        node.position -= half;
+        ++parent.position;
+    }
+    return KSuccess;
+}
+
+KResult Ext2FSInode::split_directory_index_leaf(DirectoryIndexFrames& frames, ByteBuffer& leaf, u32 hash)
+{
+    size_t block_size = fs().block_size();
+
+    auto result = make_room_in_directory_index(frames);
+    if (result.is_error())
+        return result;
+
+    struct HashedEntry {
+        u32 hash;
+        size_t offset;
+    };
+    Vector<HashedEntry> entries;
+    size_t total_size = 0;
+    for (size_t offset = 0; offset + 8 <= block_size;) {
+        auto& entry = *reinterpret_cast<const ext2_dir_entry_2*>(leaf.data() + offset);
+        if (entry.rec_len < 8 || offset + entry.rec_len > block_size)
+            return KResult(-EIO);
+        if (entry.inode) {
+            entries.append({ hash_for_directory_index(frames[0], StringView(entry.name, entry.name_len)), offset });
+            total_size += EXT2_DIR_REC_LEN(entry.name_len);
+        }
+        offset += entry.rec_len;
+    }
+    if (entries.size() < 2)
+        return KResult(-ENOSPC);
+
+    quick_sort(entries, [](auto& a, auto& b) { return a.hash < b.hash; });
+
+    size_t split = 0;
+    for (size_t size_so_far = 0; split < entries.size() - 1 && size_so_far < total_size / 2; ++split) {
+        auto& entry = *reinterpret_cast<const ext2_dir_entry_2*>(leaf.data() + entries[split].offset);
+        size_so_far += EXT2_DIR_REC_LEN(entry.name_len);
+    }
+    if (!split)
+        split = 1;
+    u32 split_hash = entries[split].hash;
+    bool continued = entries[split - 1].hash == split_hash;
+
+    auto pack_entries = [&](size_t first, size_t last) {
+        auto block = ByteBuffer::create_zeroed(block_size);
+        size_t offset = 0;
+        for (size_t i = first; i < last; ++i) {
+            auto& entry = *reinterpret_cast<const ext2_dir_entry_2*>(leaf.data() + entries[i].offset);
+            size_t record_length = i == last - 1 ? block_size - offset : EXT2_DIR_REC_LEN(entry.name_len);
+            write_directory_entry(block, offset, entry.inode, record_length, StringView(entry.name, entry.name_len), entry.file_type);
+            offset += record_length;
+        }
+        return block;
+    };
+    auto lower_leaf = pack_entries(0, split);
+    auto upper_leaf = pack_entries(split, entries.size());
+
+    u32 new_block = size() / block_size;
+    if (!write_directory_block(new_block, upper_leaf) || !write_directory_block(frames.last().child_block(), lower_leaf))
+        return KResult(-EIO);
+
+    auto& node = frames.last();
+    insert_directory_index_entry(node, split_hash | (continued ? 1 : 0), new_block);
+    if (!write_directory_block(node.block, node.data))
+        return KResult(-EIO);
+
+    if (hash >= split_hash) {
+        ++node.position;
+        leaf = move(upper_leaf);
+    } else {
+        leaf = move(lower_leaf);
+    }
+    return KSuccess;
+}
+
+bool Ext2FSInode::build_directory_index(const Vector<Ext2FSDirectoryEntry>& entries)
+{
+    LOCKER(m_lock);
+    ASSERT(fs().has_directory_index());
+    size_t block_size = fs().block_size();
+
+    const Ext2FSDirectoryEntry* dot = nullptr;
+    const Ext2FSDirectoryEntry* dot_dot = nullptr;
+    struct HashedEntry {
+        u32 hash;
+        const Ext2FSDirectoryEntry* entry;
+    };
+    Vector<HashedEntry> hashed_entries;
+
+    u8 stored_hash_version = fs().super_block().s_def_hash_version;
+    u8 hash_version = fs().directory_hash_version(stored_hash_version);
+    for (auto& entry : entries) {
+        if (entry.name == ".")
+            dot = &entry;
+        else if (entry.name == "..")
+            dot_dot = &entry;
+        else
+            hashed_entries.append({ fs().directory_hash(entry.name, hash_version), &entry });
+    }
+    if (!dot || !dot_dot || hashed_entries.is_empty())
+        return false;
+
+    quick_sort(hashed_entries, [](auto& a, auto& b) { return a.hash < b.hash; });
+
+    // Pack the entries into leaves in hash order, remembering the hash at
+    // which each leaf starts.
+    Vector<ByteBuffer> leaves;
+    Vector<u32> leaf_hashes;
+    size_t offset = 0;
+    size_t last_entry_offset = 0;
+    for (size_t i = 0; i < hashed_entries.size(); ++i) {
+        auto& entry = *hashed_entries[i].entry;
+        size_t record_length = EXT2_DIR_REC_LEN(entry.name.length());
+        if (leaves.is_empty() || offset + record_length > block_size) {
+            if (!leaves.is_empty())
+                reinterpret_cast<ext2_dir_entry_2*>(leaves.last().data() + last_entry_offset)->rec_len += block_size - offset;
+            leaves.append(ByteBuffer::create_zeroed(block_size));
+            bool continued = i && hashed_entries[i - 1].hash == hashed_entries[i].hash;
+            leaf_hashes.append(hashed_entries[i].hash | (continued ? 1 : 0));
+            offset = 0;
+        }
+        write_directory_entry(leaves.last(), offset, entry.inode.index(), record_length, entry.name, entry.file_type);
+        last_entry_offset = offset;
+        offset += record_length;
+    }
+    reinterpret_cast<ext2_dir_entry_2*>(leaves.last().data() + last_entry_offset)->rec_len += block_size - offset;
+
+    size_t root_entries_offset = directory_index_root_info_offset + sizeof(ext2_dx_root_info);
+    size_t root_limit = (block_size - root_entries_offset) / sizeof(ext2_dx_entry);
+    size_t node_limit = (block_size - directory_index_node_entries_offset) / sizeof(ext2_dx_entry);
+    if (leaves.size() > root_limit * node_limit)
+        return false;
+    size_t node_count = leaves.size() > root_limit ? ceil_div(leaves.size(), node_limit) : 0;
+
+    // Block 0 is the root, followed by the leaves and then the index nodes (if any).
+    size_t block_count = 1 + leaves.size() + node_count;
+    auto directory_data = ByteBuffer::create_zeroed(block_count * block_size);
+
+    DirectoryIndexFrame root;
+    root.data = ByteBuffer::create_zeroed(block_size);
+    root.entries_offset = root_entries_offset;
+    write_directory_entry(root.data, 0, dot->inode.index(), 12, ".", EXT2_FT_DIR);
+    write_directory_entry(root.data, 12, dot_dot->inode.index(), block_size - 12, "..", EXT2_FT_DIR);
+    auto& info = directory_index_root_info(root.data);
+    info.hash_version = stored_hash_version;
+    info.info_length = sizeof(ext2_dx_root_info);
+    info.indirect_levels = node_count ? 1 : 0;
+    root.countlimit().limit = root_limit;
+
+    auto fill_index = [](DirectoryIndexFrame& frame, const Vector<u32>& hashes, size_t first, size_t count, u32 first_block) {
+        for (size_t i = 0; i < count; ++i) {
+            frame.entries()[i].block = first_block + i;
+            if (i)
+                frame.entries()[i].hash = hashes[first + i];
+        }
+        frame.countlimit().count = count;
+    };
+
+    if (!node_count) {
+        fill_index(root, leaf_hashes, 0, leaves.size(), 1);
+    } else {
+        Vector<u32> node_hashes;
+        for (size_t i = 0; i < node_count; ++i) {
+            DirectoryIndexFrame node;
+            node.data = create_directory_index_node(block_size);
+            node.entries_offset = directory_index_node_entries_offset;
+            node.countlimit().limit = node_limit;
+            size_t first_leaf = i * node_limit;
+            fill_index(node, leaf_hashes, first_leaf, min(node_limit, leaves.size() - first_leaf), 1 + first_leaf);
+            node_hashes.append(leaf_hashes[first_leaf]);
+            memcpy(directory_data.data() + (1 + leaves.size() + i) * block_size, node.data.data(), block_size);
+        }
+        fill_index(root, node_hashes, 0, node_count, 1 + leaves.size());
+    }
+
+    memcpy(directory_data.data(), root.data.data(), block_size);
+    for (size_t i = 0; i < leaves.size(); ++i)
+        memcpy(directory_data.data() + (1 + i) * block_size, leaves[i].data(), block_size);
+
+    size_t old_size = size();
+    ssize_t nwritten = write_bytes(0, directory_data.size(), directory_data.data(), nullptr);
+    if (nwritten < 0 || static_cast<size_t>(nwritten) != directory_data.size())
+        return false;
+    if (old_size > directory_data.size() && resize(directory_data.size()).is_error())
+        return false;
+
+    m_raw_inode.i_flags |= EXT2_INDEX_FL;
+    set_metadata_dirty(true);
+    return true;
+}
+
+unsigned Ext2FS::inodes_per_block() const
+{
+    return EXT2_INODES_PER_BLOCK(&super_block());
+}
+
+unsigned Ext2FS::inodes_per_group() const
+{
+    return EXT2_INODES_PER_GROUP(&super_block());
+}
+
+unsigned Ext2FS::inode_size() const
+{
+    return EXT2_INODE_SIZE(&super_block());
+}
+unsigned Ext2FS::blocks_per_group() const
+{
+    return EXT2_BLOCKS_PER_GROUP(&super_block());
+}
+
+bool Ext2FS::write_ext2_inode(unsigned inode, const ext2_inode& e2inode)
+{
+    unsigned block_index;
+    unsigned offset;
     if (!find_block_containing_inode(inode, block_index, offset))
         return false;
     return write_block(block_index, reinterpret_cast<const u8*>(&e2inode), inode_size(), offset);
 }
 
-Vector<Ext2FS::BlockIndex> Ext2FS::allocate_blocks(GroupIndex preferred_group_index, size_t count)
+Ext2FS::BlockIndex Ext2FS::first_block_in_group(GroupIndex group_index) const
 {
-    LOCKER(m_lock);
+    return (group_index - 1) * blocks_per_group() + first_block_index();
+}
+
+size_t Ext2FS::blocks_in_group(GroupIndex group_index) const
+{
+    return min(blocks_per_group(), super_block().s_blocks_count - first_block_in_group(group_index));
+}
+
+Bitmap Ext2FS::block_bitmap(GroupIndex group_index)
+{
+    auto& cached_bitmap = get_block_bitmap(group_index);
+    return Bitmap::wrap(cached_bitmap.buffer.data(), blocks_in_group(group_index));
+}
+
+void Ext2FS::allocate_block_run(GroupIndex group_index, size_t first_bit, size_t length, Vector<BlockIndex>& blocks)
+{
+    ASSERT(length);
+    auto& bgd = const_cast<ext2_group_desc&>(group_descriptor(group_index));
+    auto& cached_bitmap = get_block_bitmap(group_index);
+    auto bitmap = cached_bitmap.bitmap(blocks_per_group());
+    BlockIndex first_block = first_block_in_group(group_index) + first_bit;
 #ifdef EXT2_DEBUG
-    dbg() << "Ext2FS: allocate_blocks(preferred group: " << preferred_group_index << ", count: " << count << ")";
+    dbg() << "Ext2FS: allocating " << length << " blocks at " << first_block << " [" << group_index << "]";
 #endif
-    if (count == 0)
-        return {};
+    for (size_t i = 0; i < length; ++i) {
+        ASSERT(!bitmap.get(first_bit + i));
+        bitmap.set(first_bit + i, true);
+        blocks.unchecked_append(first_block + i);
+    }
+    cached_bitmap.dirty = true;
 
-    Vector<BlockIndex> blocks;
+    // Account for the whole run at once rather than block by block. The
+    // blocks were reserved by allocate_blocks(), so they stop being reserved
+    // as they stop being free.
+    LOCKER(m_super_block_lock);
+    ASSERT(bgd.bg_free_blocks_count >= length);
+    ASSERT(m_reserved_block_count >= length);
+    bgd.bg_free_blocks_count -= length;
+    m_super_block.s_free_blocks_count -= length;
+    m_reserved_block_count -= length;
+    m_block_group_descriptors_dirty = true;
+    m_super_block_dirty = true;
+}
+
+KResultOr<Vector<Ext2FS::BlockIndex>> Ext2FS::allocate_blocks(GroupIndex preferred_group_index, size_t count, BlockIndex goal, size_t reserved_count)
+{
 #ifdef EXT2_DEBUG
-    dbg() << "Ext2FS: allocate_blocks:";
+    dbg() << "Ext2FS: allocate_blocks(preferred group: " << preferred_group_index << ", count: " << count << ", goal: " << goal << ", reserved: " << reserved_count << ")";
 #endif
-    blocks.ensure_capacity(count);
+    ASSERT(reserved_count <= count);
+    if (count == 0)
+        return Vector<BlockIndex> {};
 
-    GroupIndex group_index = preferred_group_index;
+    // Claim the space up front, so that the free blocks we go looking for
+    // can't have been promised to somebody else in the meantime.
+    if (!reserve_blocks(count - reserved_count))
+        return KResult(-ENOSPC);
+
+    Vector<BlockIndex> blocks;
+    blocks.ensure_capacity(count);
 
-    if (!group_descriptor(preferred_group_index).bg_free_blocks_count) {
-        group_index = 1;
+    if (!preferred_group_index || preferred_group_index > m_block_group_count)
+        preferred_group_index = 1;
+
+    // Only one group is locked at a time, so allocations in different groups
+    // can go on in parallel. Whatever we learn about a group is only good for
+    // as long as we hold its lock.
+
+    // If we're extending something, try to continue right where it ends.
+    if (goal >= first_block_index() && goal < super_block().s_blocks_count) {
+        GroupIndex group_index = (goal - first_block_index()) / blocks_per_group() + 1;
+        LOCKER(block_group(group_index).lock);
+        auto bitmap = block_bitmap(group_index);
+        size_t first_bit = goal - first_block_in_group(group_index);
+        size_t length = 0;
+        while (length < count && first_bit + length < bitmap.size() && !bitmap.get(first_bit + length))
+            ++length;
+        if (length)
+            allocate_block_run(group_index, first_bit, length, blocks);
     }
 
     while (blocks.size() < count) {
-
-        bool found_a_group = false;
-        if (group_descriptor(group_index).bg_free_blocks_count) {
-            found_a_group = true;
-        } else {
-            if (group_index == preferred_group_index)
-                group_index = 1;
-            for (; group_index < m_block_group_count; ++group_index) {
-                if (group_descriptor(group_index).bg_free_blocks_count) {
-                    found_a_group = true;
-                    break;
-                }
-            }
+        size_t needed = count - blocks.size();
+        bool allocated = false;
+
+        // Take the first free run that fits everything we still need, looking
+        // through the groups starting with the preferred one.
+        for (GroupIndex i = 0; i < m_block_group_count && !allocated; ++i) {
+            GroupIndex group_index = (preferred_group_index - 1 + i) % m_block_group_count + 1;
+            LOCKER(block_group(group_index).lock);
+            if (group_descriptor(group_index).bg_free_blocks_count < needed)
+                continue;
+            auto first_bit = block_bitmap(group_index).find_first_fit(needed);
+            if (!first_bit.has_value())
+                continue;
+            allocate_block_run(group_index, first_bit.value(), needed, blocks);
+            allocated = true;
         }
+        if (allocated)
+            continue;
 
-        ASSERT(found_a_group);
-        auto& bgd = group_descriptor(group_index);
-        auto& cached_bitmap = get_bitmap_block(bgd.bg_block_bitmap);
-
-        int blocks_in_group = min(blocks_per_group(), super_block().s_blocks_count);
-        auto block_bitmap = Bitmap::wrap(cached_bitmap.buffer.data(), blocks_in_group);
+        // Free space is too fragmented for that, so settle for the longest run there is.
+        GroupIndex found_group_index = 0;
+        size_t found_length = 0;
+        for (GroupIndex group_index = 1; group_index <= m_block_group_count; ++group_index) {
+            LOCKER(block_group(group_index).lock);
+            if (!group_descriptor(group_index).bg_free_blocks_count)
+                continue;
+            size_t length = 0;
+            auto first_bit = block_bitmap(group_index).find_longest_range_of_unset_bits(needed, length);
+            if (!first_bit.has_value() || length <= found_length)
+                continue;
+            found_group_index = group_index;
+            found_length = length;
+        }
 
-        BlockIndex first_block_in_group = (group_index - 1) * blocks_per_group() + first_block_index();
-        size_t free_region_size = 0;
-        auto first_unset_bit_index = block_bitmap.find_longest_range_of_unset_bits(count - blocks.size(), free_region_size);
-        ASSERT(first_unset_bit_index.has_value());
-#ifdef EXT2_DEBUG
-        dbg() << "Ext2FS: allocating free region of size: " << free_region_size << "[" << group_index << "]";
-#endif
-        for (size_t i = 0; i < free_region_size; ++i) {
-            BlockIndex block_index = (first_unset_bit_index.value() + i) + first_block_in_group;
-            set_block_allocation_state(block_index, true);
-            blocks.unchecked_append(block_index);
-#ifdef EXT2_DEBUG
-            dbg() << "  allocated > " << block_index;
-#endif
+        if (!found_group_index) {
+            // Only happens if the free block counters don't match the bitmaps.
+            klog() << "Ext2FS: allocate_blocks: No free blocks left, even though " << needed << " should have been";
+            // Put the reservation back the way the caller handed it to us.
+            for (auto block_index : blocks)
+                set_block_allocation_state(block_index, false, true);
+            unreserve_blocks(count - reserved_count);
+            return KResult(-ENOSPC);
         }
+        // Somebody may have allocated from the group since we looked, in which case we just go around again.
+        LOCKER(block_group(found_group_index).lock);
+        size_t length = 0;
+        auto first_bit = block_bitmap(found_group_index).find_longest_range_of_unset_bits(needed, length);
+        if (first_bit.has_value() && length)
+            allocate_block_run(found_group_index, first_bit.value(), min(length, needed), blocks);
     }
 
     ASSERT(blocks.size() == count);
+
+    LOCKER(m_super_block_lock);
+    m_allocated_block_count += count;
+    for (size_t i = 0; i < count; ++i) {
+        BlockIndex previous = i ? blocks[i - 1] + 1 : goal;
+        if (blocks[i] != previous)
+            ++m_allocated_extent_count;
+    }
     return blocks;
 }
 
-unsigned Ext2FS::find_a_free_inode(GroupIndex preferred_group, off_t expected_size)
+bool Ext2FS::reserve_blocks(size_t count, size_t headroom)
+{
+    LOCKER(m_super_block_lock);
+    ASSERT(m_reserved_block_count <= super_block().s_free_blocks_count);
+    if (count + headroom > super_block().s_free_blocks_count - m_reserved_block_count)
+        return false;
+    m_reserved_block_count += count;
+    return true;
+}
+
+void Ext2FS::unreserve_blocks(size_t count)
+{
+    LOCKER(m_super_block_lock);
+    ASSERT(count <= m_reserved_block_count);
+    m_reserved_block_count -= count;
+}
+
+Optional<FS::FragmentationStatistics> Ext2FS::fragmentation_statistics() const
+{
+    FragmentationStatistics statistics;
+    {
+        Locker locker(m_super_block_lock, Lock::Mode::Shared);
+        statistics.allocated_block_count = m_allocated_block_count;
+        statistics.allocated_extent_count = m_allocated_extent_count;
+    }
+    for (GroupIndex group_index = 1; group_index <= m_block_group_count; ++group_index) {
+        auto& group = const_cast<Ext2FS&>(*this).block_group(group_index);
+        LOCKER(group.lock);
+        if (!group_descriptor(group_index).bg_free_blocks_count)
+            continue;
+        auto bitmap = const_cast<Ext2FS&>(*this).block_bitmap(group_index);
+        size_t start = 0;
+        for (;;) {
+            auto length = bitmap.find_next_range_of_unset_bits(start);
+            if (!length.has_value())
+                break;
+            ++statistics.free_extent_count;
+            statistics.largest_free_extent = max(statistics.largest_free_extent, (u64)length.value());
+            start += length.value();
+        }
+    }
+    return statistics;
+}
+
+unsigned Ext2FS::allocate_inode(GroupIndex preferred_group, off_t expected_size)
 {
     ASSERT(expected_size >= 0);
 
-    LOCKER(m_lock);
 #ifdef EXT2_DEBUG
-    dbg() << "Ext2FS: find_a_free_inode(preferred_group: " << preferred_group << ", expected_size: " << expected_size << ")";
+    dbg() << "Ext2FS: allocate_inode(preferred_group: " << preferred_group << ", expected_size: " << expected_size << ")";
 #endif
 
     unsigned needed_blocks = ceil_div(static_cast<size_t>(expected_size), block_size());
@@ -1170,8 +2592,6 @@ unsigned Ext2FS::find_a_free_inode(GroupIndex preferred_group, off_t expected_si
     dbg() << "Ext2FS: minimum needed blocks: " << needed_blocks;
 #endif
 
-    unsigned group_index = 0;
-
     // FIXME: We shouldn't refuse to allocate an inode if there is no group that can house the whole thing.
     //        In those cases we should just spread it across multiple groups.
     auto is_suitable_group = [this, needed_blocks](GroupIndex group_index) {
@@ -1179,51 +2599,49 @@ unsigned Ext2FS::find_a_free_inode(GroupIndex preferred_group, off_t expected_si
         return bgd.bg_free_inodes_count && bgd.bg_free_blocks_count >= needed_blocks;
     };
 
-    if (preferred_group && is_suitable_group(preferred_group)) {
-        group_index = preferred_group;
-    } else {
-        for (unsigned i = 1; i <= m_block_group_count; ++i) {
-            if (is_suitable_group(i))
-                group_index = i;
-        }
-    }
-
-    if (!group_index) {
-        klog() << "Ext2FS: find_a_free_inode: no suitable group found for new inode with " << needed_blocks << " blocks needed :(";
-        return 0;
-    }
+    // Finding a free inode and marking it as used happens under the group's
+    // lock, so two new files can't end up with the same inode.
+    auto try_allocate_in_group = [&](GroupIndex group_index) -> InodeIndex {
+        LOCKER(block_group(group_index).lock);
+        if (!is_suitable_group(group_index))
+            return 0;
 
 #ifdef EXT2_DEBUG
-    dbg() << "Ext2FS: find_a_free_inode: found suitable group [" << group_index << "] for new inode with " << needed_blocks << " blocks needed :^)";
+        dbg() << "Ext2FS: allocate_inode: found suitable group [" << group_index << "] for new inode with " << needed_blocks << " blocks needed :^)";
 #endif
 
-    auto& bgd = group_descriptor(group_index);
-    unsigned inodes_in_group = min(inodes_per_group(), super_block().s_inodes_count);
-    unsigned first_free_inode_in_group = 0;
-
-    unsigned first_inode_in_group = (group_index - 1) * inodes_per_group() + 1;
+        unsigned inodes_in_group = min(inodes_per_group(), super_block().s_inodes_count);
+        unsigned first_inode_in_group = (group_index - 1) * inodes_per_group() + 1;
 
-    auto& cached_bitmap = get_bitmap_block(bgd.bg_inode_bitmap);
-    auto inode_bitmap = Bitmap::wrap(cached_bitmap.buffer.data(), inodes_in_group);
-    for (size_t i = 0; i < inode_bitmap.size(); ++i) {
-        if (inode_bitmap.get(i))
-            continue;
-        first_free_inode_in_group = first_inode_in_group + i;
-        break;
-    }
+        auto& cached_bitmap = get_inode_bitmap(group_index);
+        auto inode_bitmap = Bitmap::wrap(cached_bitmap.buffer.data(), inodes_in_group);
+        for (size_t i = 0; i < inode_bitmap.size(); ++i) {
+            if (inode_bitmap.get(i))
+                continue;
+            InodeIndex inode = first_inode_in_group + i;
+#ifdef EXT2_DEBUG
+            dbg() << "Ext2FS: found suitable inode " << inode;
+#endif
+            bool success = set_inode_allocation_state(inode, true);
+            ASSERT(success);
+            return inode;
+        }
 
-    if (!first_free_inode_in_group) {
-        klog() << "Ext2FS: first_free_inode_in_group returned no inode, despite bgd claiming there are inodes :(";
+        klog() << "Ext2FS: allocate_inode: no free inode in group " << group_index << ", despite bgd claiming there are inodes :(";
         return 0;
-    }
+    };
 
-    unsigned inode = first_free_inode_in_group;
-#ifdef EXT2_DEBUG
-    dbg() << "Ext2FS: found suitable inode " << inode;
-#endif
+    if (preferred_group) {
+        if (auto inode = try_allocate_in_group(preferred_group))
+            return inode;
+    }
+    for (GroupIndex group_index = m_block_group_count; group_index >= 1; --group_index) {
+        if (auto inode = try_allocate_in_group(group_index))
+            return inode;
+    }
 
-    ASSERT(get_inode_allocation_state(inode) == false);
-    return inode;
+    klog() << "Ext2FS: allocate_inode: no suitable group found for new inode with " << needed_blocks << " blocks needed :(";
+    return 0;
 }
 
 Ext2FS::GroupIndex Ext2FS::group_index_from_block_index(BlockIndex block_index) const
@@ -1242,27 +2660,27 @@ unsigned Ext2FS::group_index_from_inode(unsigned inode) const
 
 bool Ext2FS::get_inode_allocation_state(InodeIndex index) const
 {
-    LOCKER(m_lock);
     if (index == 0)
         return true;
     unsigned group_index = group_index_from_inode(index);
-    auto& bgd = group_descriptor(group_index);
     unsigned index_in_group = index - ((group_index - 1) * inodes_per_group());
     unsigned bit_index = (index_in_group - 1) % inodes_per_group();
 
-    auto& cached_bitmap = const_cast<Ext2FS&>(*this).get_bitmap_block(bgd.bg_inode_bitmap);
+    auto& group = const_cast<Ext2FS&>(*this).block_group(group_index);
+    LOCKER(group.lock);
+    auto& cached_bitmap = const_cast<Ext2FS&>(*this).get_inode_bitmap(group_index);
     return cached_bitmap.bitmap(inodes_per_group()).get(bit_index);
 }
 
 bool Ext2FS::set_inode_allocation_state(InodeIndex inode_index, bool new_state)
 {
-    LOCKER(m_lock);
     unsigned group_index = group_index_from_inode(inode_index);
     auto& bgd = group_descriptor(group_index);
     unsigned index_in_group = inode_index - ((group_index - 1) * inodes_per_group());
     unsigned bit_index = (index_in_group - 1) % inodes_per_group();
 
-    auto& cached_bitmap = get_bitmap_block(bgd.bg_inode_bitmap);
+    Locker group_locker(block_group(group_index).lock);
+    auto& cached_bitmap = get_inode_bitmap(group_index);
 
     bool current_state = cached_bitmap.bitmap(inodes_per_group()).get(bit_index);
 #ifdef EXT2_DEBUG
@@ -1277,6 +2695,8 @@ bool Ext2FS::set_inode_allocation_state(InodeIndex inode_index, bool new_state)
     cached_bitmap.bitmap(inodes_per_group()).set(bit_index, new_state);
     cached_bitmap.dirty = true;
 
+    Locker super_block_locker(m_super_block_lock);
+
     // Update superblock
 #ifdef EXT2_DEBUG
     dbg() << "Ext2FS: superblock free inode count " << m_super_block.s_free_inodes_count << " -> " << (m_super_block.s_free_inodes_count - 1);
@@ -1306,24 +2726,35 @@ Ext2FS::BlockIndex Ext2FS::first_block_index() const
     return block_size() == 1024 ? 1 : 0;
 }
 
-Ext2FS::CachedBitmap& Ext2FS::get_bitmap_block(BlockIndex bitmap_block_index)
+NonnullOwnPtr<Ext2FS::CachedBitmap> Ext2FS::read_bitmap_block(BlockIndex bitmap_block_index)
 {
-    for (auto& cached_bitmap : m_cached_bitmaps) {
-        if (cached_bitmap->bitmap_block_index == bitmap_block_index)
-            return *cached_bitmap;
-    }
-
     auto block = KBuffer::create_with_size(block_size(), Region::Access::Read | Region::Access::Write, "Ext2FS: Cached bitmap block");
     bool success = read_block(bitmap_block_index, block.data(), block_size());
     ASSERT(success);
-    m_cached_bitmaps.append(make<CachedBitmap>(bitmap_block_index, move(block)));
-    return *m_cached_bitmaps.last();
+    return make<CachedBitmap>(bitmap_block_index, move(block));
+}
+
+Ext2FS::CachedBitmap& Ext2FS::get_block_bitmap(GroupIndex group_index)
+{
+    auto& group = block_group(group_index);
+    ASSERT(group.lock.is_locked());
+    if (!group.block_bitmap)
+        group.block_bitmap = read_bitmap_block(group_descriptor(group_index).bg_block_bitmap);
+    return *group.block_bitmap;
+}
+
+Ext2FS::CachedBitmap& Ext2FS::get_inode_bitmap(GroupIndex group_index)
+{
+    auto& group = block_group(group_index);
+    ASSERT(group.lock.is_locked());
+    if (!group.inode_bitmap)
+        group.inode_bitmap = read_bitmap_block(group_descriptor(group_index).bg_inode_bitmap);
+    return *group.inode_bitmap;
 }
 
-bool Ext2FS::set_block_allocation_state(BlockIndex block_index, bool new_state)
+bool Ext2FS::set_block_allocation_state(BlockIndex block_index, bool new_state, bool keep_reserved)
 {
     ASSERT(block_index != 0);
-    LOCKER(m_lock);
 #ifdef EXT2_DEBUG
     dbg() << "Ext2FS: set_block_allocation_state(block=" << block_index << ", state=" << String::format("%u", new_state) << ")";
 #endif
@@ -1333,7 +2764,8 @@ bool Ext2FS::set_block_allocation_state(BlockIndex block_index, bool new_state)
     BlockIndex index_in_group = (block_index - first_block_index()) - ((group_index - 1) * blocks_per_group());
     unsigned bit_index = index_in_group % blocks_per_group();
 
-    auto& cached_bitmap = get_bitmap_block(bgd.bg_block_bitmap);
+    Locker group_locker(block_group(group_index).lock);
+    auto& cached_bitmap = get_block_bitmap(group_index);
 
     bool current_state = cached_bitmap.bitmap(blocks_per_group()).get(bit_index);
 #ifdef EXT2_DEBUG
@@ -1348,6 +2780,8 @@ bool Ext2FS::set_block_allocation_state(BlockIndex block_index, bool new_state)
     cached_bitmap.bitmap(blocks_per_group()).set(bit_index, new_state);
     cached_bitmap.dirty = true;
 
+    Locker super_block_locker(m_super_block_lock);
+
     // Update superblock
 #ifdef EXT2_DEBUG
     dbg() << "Ext2FS: superblock free block count " << m_super_block.s_free_blocks_count << " -> " << (m_super_block.s_free_blocks_count - 1);
@@ -1358,6 +2792,12 @@ bool Ext2FS::set_block_allocation_state(BlockIndex block_index, bool new_state)
         ++m_super_block.s_free_blocks_count;
     m_super_block_dirty = true;
 
+    // Freeing a block straight back into a reservation, so nobody else can take it in between.
+    if (keep_reserved) {
+        ASSERT(!new_state);
+        ++m_reserved_block_count;
+    }
+
     // Update BGD
     auto& mutable_bgd = const_cast<ext2_group_desc&>(bgd);
     if (new_state)
@@ -1374,8 +2814,8 @@ bool Ext2FS::set_block_allocation_state(BlockIndex block_index, bool new_state)
 
 KResult Ext2FS::create_directory(InodeIdentifier parent_id, const String& name, mode_t mode, uid_t uid, gid_t gid)
 {
-    LOCKER(m_lock);
     ASSERT(parent_id.fsid() == fsid());
+    Ext2FSJournalHandle handle(m_journal.ptr());
 
     // Fix up the mode to definitely be a directory.
     // FIXME: This is a bit on the hackish side.
@@ -1406,22 +2846,15 @@ KResult Ext2FS::create_directory(InodeIdentifier parent_id, const String& name,
     if (result.is_error())
         return result;
 
-    auto& bgd = const_cast<ext2_group_desc&>(group_descriptor(group_index_from_inode(inode->identifier().index())));
-    ++bgd.bg_used_dirs_count;
-#ifdef EXT2_DEBUG
-    dbg() << "Ext2FS: incremented bg_used_dirs_count " << bgd.bg_used_dirs_count - 1 << " -> " << bgd.bg_used_dirs_count;
-#endif
-
-    m_block_group_descriptors_dirty = true;
-
+    adjust_used_directory_count(group_index_from_inode(inode->identifier().index()), 1);
     return KSuccess;
 }
 
 KResultOr<NonnullRefPtr<Inode>> Ext2FS::create_inode(InodeIdentifier parent_id, const String& name, mode_t mode, off_t size, dev_t dev, uid_t uid, gid_t gid)
 {
-    LOCKER(m_lock);
     ASSERT(size >= 0);
     ASSERT(parent_id.fsid() == fsid());
+    Ext2FSJournalHandle handle(m_journal.ptr());
     auto parent_inode = get_inode(parent_id);
     ASSERT(parent_inode);
 
@@ -1433,24 +2866,25 @@ KResultOr<NonnullRefPtr<Inode>> Ext2FS::create_inode(InodeIdentifier parent_id,
 #endif
 
     size_t needed_blocks = ceil_div(static_cast<size_t>(size), block_size());
-    if ((size_t)needed_blocks > super_block().s_free_blocks_count) {
+    if (!reserve_blocks(needed_blocks)) {
         dbg() << "Ext2FS: create_inode: not enough free blocks";
         return KResult(-ENOSPC);
     }
 
-    // NOTE: This doesn't commit the inode allocation just yet!
-    auto inode_id = find_a_free_inode(0, size);
+    auto inode_id = allocate_inode(0, size);
     if (!inode_id) {
         klog() << "Ext2FS: create_inode: allocate_inode failed";
+        unreserve_blocks(needed_blocks);
         return KResult(-ENOSPC);
     }
 
-    auto blocks = allocate_blocks(group_index_from_inode(inode_id), needed_blocks);
-    ASSERT(blocks.size() == needed_blocks);
-
-    // Looks like we're good, time to update the inode bitmap and group+global inode counters.
-    bool success = set_inode_allocation_state(inode_id, true);
-    ASSERT(success);
+    auto blocks_or_error = allocate_blocks(group_index_from_inode(inode_id), needed_blocks, 0, needed_blocks);
+    if (blocks_or_error.is_error()) {
+        unreserve_blocks(needed_blocks);
+        set_inode_allocation_state(inode_id, false);
+        return blocks_or_error.error();
+    }
+    auto blocks = blocks_or_error.release_value();
 
     struct timeval now;
     kgettimeofday(now);
@@ -1473,7 +2907,7 @@ KResultOr<NonnullRefPtr<Inode>> Ext2FS::create_inode(InodeIdentifier parent_id,
     else if (is_block_device(mode))
         e2inode.i_block[1] = dev;
 
-    success = write_block_list_for_inode(inode_id, e2inode, blocks);
+    bool success = write_block_list_for_inode(inode_id, e2inode, blocks);
     ASSERT(success);
 
 #ifdef EXT2_DEBUG
@@ -1483,15 +2917,25 @@ KResultOr<NonnullRefPtr<Inode>> Ext2FS::create_inode(InodeIdentifier parent_id,
     success = write_ext2_inode(inode_id, e2inode);
     ASSERT(success);
 
-    // We might have cached the fact that this inode didn't exist. Wipe the slate.
-    m_inode_cache.remove(inode_id);
+    {
+        // We might have cached the fact that this inode didn't exist. Wipe the slate.
+        LOCKER(m_inode_cache_lock);
+        m_inode_cache.remove(inode_id);
+    }
 
     auto inode = get_inode({ fsid(), inode_id });
     // If we've already computed a block list, no sense in throwing it away.
-    static_cast<Ext2FSInode&>(*inode).m_block_list = move(blocks);
+    if (!blocks.is_empty()) {
+        auto& ext2_inode = static_cast<Ext2FSInode&>(*inode);
+        LOCKER(ext2_inode.m_lock);
+        ext2_inode.insert_block_runs(0, blocks.data(), blocks.size());
+    }
 
     auto result = parent_inode->add_child(*inode, name, mode);
-    ASSERT(result.is_success());
+    if (result.is_error()) {
+        // Nothing links to the new inode, so it goes away along with our reference.
+        return result;
+    }
 
     return inode.release_nonnull();
 }
@@ -1518,6 +2962,19 @@ void Ext2FSInode::populate_lookup_cache() const
 RefPtr<Inode> Ext2FSInode::lookup(StringView name)
 {
     ASSERT(is_directory());
+    if (is_indexed_directory() && !is_dot_or_dot_dot(name)) {
+        LOCKER(m_lock);
+        DirectoryIndexFrames frames;
+        ByteBuffer leaf;
+        size_t offset = 0;
+        Optional<size_t> previous_offset;
+        auto result = find_in_directory_index(name, frames, leaf, offset, previous_offset);
+        if (!result.is_error())
+            return fs().get_inode({ fsid(), reinterpret_cast<const ext2_dir_entry_2*>(leaf.data() + offset)->inode });
+        if (result.error() == -ENOENT)
+            return {};
+        // The index is broken, but the entries can still be found by scanning the leaves.
+    }
     populate_lookup_cache();
     LOCKER(m_lock);
     auto it = m_lookup_cache.find(name.hash(), [&](auto& entry) { return entry.key == name; });
@@ -1588,7 +3045,7 @@ KResult Ext2FSInode::decrement_link_count()
 
 void Ext2FS::uncache_inode(InodeIndex index)
 {
-    LOCKER(m_lock);
+    LOCKER(m_inode_cache_lock);
     m_inode_cache.remove(index);
 }
 
@@ -1623,37 +3080,57 @@ KResult Ext2FSInode::chown(uid_t uid, gid_t gid)
 
 KResult Ext2FSInode::truncate(u64 size)
 {
+    Ext2FSJournalHandle handle(fs().m_journal.ptr());
     LOCKER(m_lock);
     if (static_cast<u64>(m_raw_inode.i_size) == size)
         return KSuccess;
+    u64 old_size = m_raw_inode.i_size;
     auto result = resize(size);
     if (result.is_error())
         return result;
     set_metadata_dirty(true);
+    inode_size_changed(old_size, size);
     return KSuccess;
 }
 
+KResult Ext2FSInode::fsync()
+{
+    KResult result = KSuccess;
+    {
+        Ext2FSJournalHandle handle(fs().m_journal.ptr());
+        LOCKER(m_lock);
+        if (is_metadata_dirty())
+            result = write_metadata();
+    }
+    if (!fs().m_journal) {
+        fs().flush_writes();
+        return result;
+    }
+    // Everything we've written is covered by the next commit to start. If
+    // another fsync() gets there first, we don't have to commit at all.
+    fs().commit_writes(fs().m_journal->next_commit_generation());
+    return result;
+}
+
 unsigned Ext2FS::total_block_count() const
 {
-    LOCKER(m_lock);
     return super_block().s_blocks_count;
 }
 
 unsigned Ext2FS::free_block_count() const
 {
-    LOCKER(m_lock);
-    return super_block().s_free_blocks_count;
+    Locker locker(m_super_block_lock, Lock::Mode::Shared);
+    return super_block().s_free_blocks_count - m_reserved_block_count;
 }
 
 unsigned Ext2FS::total_inode_count() const
 {
-    LOCKER(m_lock);
     return super_block().s_inodes_count;
 }
 
 unsigned Ext2FS::free_inode_count() const
 {
-    LOCKER(m_lock);
+    Locker locker(m_super_block_lock, Lock::Mode::Shared);
     return super_block().s_free_inodes_count;
 }
 
@@ -1661,11 +3138,27 @@ KResult Ext2FS::prepare_to_unmount() const
 {
     LOCKER(m_lock);
 
-    for (auto& it : m_inode_cache) {
-        if (it.value->ref_count() > 1)
-            return KResult(-EBUSY);
+    {
+        LOCKER(m_inode_cache_lock);
+        for (auto& it : m_inode_cache) {
+            if (it.value->ref_count() > 1)
+                return KResult(-EBUSY);
+        }
+    }
+
+    if (m_journal) {
+        // Leave the file system in a state that doesn't need recovery.
+        auto& fs = const_cast<Ext2FS&>(*this);
+        fs.flush_writes();
+        fs.m_journal->checkpoint();
+        fs.m_journal->stop();
+        fs.m_journal = nullptr;
+        fs.set_max_unlogged_metadata_block_count(0);
+        m_super_block.s_feature_incompat &= ~EXT3_FEATURE_INCOMPAT_RECOVER;
+        fs.flush_super_block();
     }
 
+    Locker inode_cache_locker(m_inode_cache_lock);
     m_inode_cache.clear();
     return KSuccess;
 }
@@ -27,8 +27,12 @@
 #pragma once
 
 #include <AK/Bitmap.h>
+#include <AK/ByteBuffer.h>
 #include <AK/HashMap.h>
+#include <AK/NonnullOwnPtrVector.h>
+#include <AK/Optional.h>
 #include <Kernel/FileSystem/BlockBasedFileSystem.h>
+#include <Kernel/FileSystem/Ext2FSJournal.h>
 #include <Kernel/FileSystem/Inode.h>
 #include <Kernel/FileSystem/ext2_fs.h>
 #include <Kernel/KBuffer.h>
@@ -76,24 +80,92 @@ private:
     virtual KResult chmod(mode_t) override;
     virtual KResult chown(uid_t, gid_t) override;
     virtual KResult truncate(u64) override;
+    virtual KResult fsync() override;
 
     bool write_directory(const Vector<Ext2FSDirectoryEntry>&);
     void populate_lookup_cache() const;
+
+    // Hash-indexed (htree) directories keep their entries in leaf blocks
+    // sorted by the hash of their name, with a one or two level index on
+    // top, so a lookup or modification only ever touches a few blocks.
+    struct DirectoryIndexFrame {
+        u32 block { 0 };
+        ByteBuffer data;
+        size_t entries_offset { 0 };
+        size_t position { 0 };
+
+        ext2_dx_countlimit& countlimit() { return *reinterpret_cast<ext2_dx_countlimit*>(data.data() + entries_offset); }
+        ext2_dx_entry* entries() { return reinterpret_cast<ext2_dx_entry*>(data.data() + entries_offset); }
+        u32 child_block() { return entries()[position].block; }
+    };
+    typedef Vector<DirectoryIndexFrame, 3> DirectoryIndexFrames;
+
+    bool is_indexed_directory() const;
+    bool read_directory_block(u32 logical_index, ByteBuffer&) const;
+    bool write_directory_block(u32 logical_index, const ByteBuffer&);
+    u32 hash_for_directory_index(DirectoryIndexFrame& root, const StringView& name) const;
+    KResult probe_directory_index(const StringView& name, u32& hash, DirectoryIndexFrames&) const;
+    bool advance_to_next_index_leaf(u32 hash, DirectoryIndexFrames&) const;
+    KResult find_in_directory_index(const StringView& name, DirectoryIndexFrames&, ByteBuffer& leaf, size_t& offset, Optional<size_t>& previous_offset) const;
+    KResult add_to_directory_index(const StringView& name, unsigned inode_index, u8 file_type);
+    KResult remove_from_directory_index(const StringView& name, unsigned& inode_index);
+    static void insert_directory_index_entry(DirectoryIndexFrame&, u32 hash, u32 block);
+    KResult make_room_in_directory_index(DirectoryIndexFrames&);
+    KResult split_directory_index_leaf(DirectoryIndexFrames&, ByteBuffer& leaf, u32 hash);
+    bool build_directory_index(const Vector<Ext2FSDirectoryEntry>&);
     KResult resize(u64);
 
+    // A run of logically consecutive blocks that are also consecutive on
+    // disk. Holes are runs with a physical index of 0.
+    struct BlockRun {
+        u32 logical_index { 0 };
+        u32 physical_index { 0 };
+        u32 count { 0 };
+    };
+
+    // The block map is filled in lazily, one block pointer array at a time,
+    // so only the parts of a file that get accessed are ever looked up.
+    Optional<BlockRun> block_run_at(u32 logical_index) const;
+    bool populate_block_map(u32 logical_index) const;
+    void insert_block_runs(u32 logical_index, const u32* physical_indices, size_t count) const;
+
+    // Blocks appended to a regular file only get a place on disk once they're
+    // flushed, so that a file growing a little at a time still ends up in one
+    // piece. Until then, they only count against the free space.
+    u32 allocated_block_count() const;
+    KResult delay_allocation(u64 new_size);
+    KResult allocate_delayed_blocks();
+    void discard_delayed_blocks();
+    // flush_metadata(), but fsync() gets to hear about delayed blocks that couldn't be allocated.
+    KResult write_metadata();
+
+    // reserved_count of the blocks were set aside with Ext2FS::reserve_blocks()
+    // beforehand. The reservation is used up on success, and stays with the
+    // caller if this fails.
+    KResultOr<Vector<u32>> allocate_data_blocks(size_t count, u32 goal, size_t reserved_count);
+    void discard_preallocated_blocks();
+
     static u8 file_type_for_directory_entry(const ext2_dir_entry_2&);
 
     Ext2FS& fs();
     const Ext2FS& fs() const;
     Ext2FSInode(Ext2FS&, unsigned index);
 
-    mutable Vector<unsigned> m_block_list;
+    mutable Vector<BlockRun> m_block_map;
+    Optional<KBuffer> m_delayed_data;
+    u32 m_delayed_block_count { 0 };
+    u32 m_reserved_block_count { 0 };
+    // Blocks set aside on disk right behind the end of the file, so that the
+    // next allocation can continue where the last one left off.
+    u32 m_preallocated_block { 0 };
+    u32 m_preallocated_block_count { 0 };
     mutable HashMap<String, unsigned> m_lookup_cache;
     ext2_inode m_raw_inode;
 };
 
 class Ext2FS final : public BlockBasedFS {
     friend class Ext2FSInode;
+    friend class Ext2FSJournal;
 
 public:
     static NonnullRefPtr<Ext2FS> create(FileDescription&);
@@ -105,10 +177,13 @@ public:
     virtual unsigned free_block_count() const override;
     virtual unsigned total_inode_count() const override;
     virtual unsigned free_inode_count() const override;
+    virtual Optional<FragmentationStatistics> fragmentation_statistics() const override;
 
     virtual KResult prepare_to_unmount() const override;
 
     virtual bool supports_watchers() const override { return true; }
+    virtual bool supports_page_cache() const override { return true; }
+    virtual bool supports_dentry_cache() const override { return true; }
 
     virtual u8 internal_file_type_to_directory_entry_type(const DirectoryEntryView& entry) const override;
 
@@ -132,6 +207,18 @@ private:
     bool find_block_containing_inode(InodeIndex inode, BlockIndex& block_index, unsigned& offset) const;
 
     bool flush_super_block();
+    void write_cached_metadata();
+    bool initialize_journal();
+    void commit_writes(u32 generation);
+
+    // ^BlockBasedFS
+    virtual void will_write_back_in_place() override;
+    virtual void transaction_is_full() override;
+    virtual void will_write_back_unlogged_metadata() override;
+
+    bool has_directory_index() const;
+    u8 directory_hash_version(u8 stored_version) const;
+    u32 directory_hash(const StringView& name, u8 hash_version) const;
 
     virtual const char* class_name() const override;
     virtual NonnullRefPtr<Inode> root_inode() const override;
@@ -141,18 +228,27 @@ private:
     virtual void flush_writes() override;
 
     BlockIndex first_block_index() const;
-    InodeIndex find_a_free_inode(GroupIndex preferred_group, off_t expected_size);
-    Vector<BlockIndex> allocate_blocks(GroupIndex preferred_group_index, size_t count);
+    InodeIndex allocate_inode(GroupIndex preferred_group, off_t expected_size);
+    // Like allocate_data_blocks(), reserved_count of the blocks come out of an
+    // earlier reservation. Fails with ENOSPC rather than overcommitting.
+    KResultOr<Vector<BlockIndex>> allocate_blocks(GroupIndex preferred_group_index, size_t count, BlockIndex goal = 0, size_t reserved_count = 0);
+    void allocate_block_run(GroupIndex, size_t first_bit, size_t length, Vector<BlockIndex>&);
+    BlockIndex first_block_in_group(GroupIndex) const;
+    size_t blocks_in_group(GroupIndex) const;
+    Bitmap block_bitmap(GroupIndex);
+    // Only succeeds if there are still headroom blocks left for everybody else afterwards.
+    bool reserve_blocks(size_t count, size_t headroom = 0);
+    void unreserve_blocks(size_t count);
     GroupIndex group_index_from_inode(InodeIndex) const;
     GroupIndex group_index_from_block_index(BlockIndex) const;
 
     Vector<BlockIndex> block_list_for_inode_impl(const ext2_inode&, bool include_block_list_blocks = false) const;
     Vector<BlockIndex> block_list_for_inode(const ext2_inode&, bool include_block_list_blocks = false) const;
-    bool write_block_list_for_inode(InodeIndex, ext2_inode&, const Vector<BlockIndex>&);
+    bool write_block_list_for_inode(InodeIndex, ext2_inode&, const Vector<BlockIndex>&, size_t reserved_count = 0);
 
     bool get_inode_allocation_state(InodeIndex) const;
     bool set_inode_allocation_state(InodeIndex, bool);
-    bool set_block_allocation_state(BlockIndex, bool);
+    bool set_block_allocation_state(BlockIndex, bool, bool keep_reserved = false);
 
     void uncache_inode(InodeIndex);
     void free_inode(Ext2FSInode&);
@@ -172,8 +268,23 @@ private:
     mutable ext2_super_block m_super_block;
     mutable Optional<KBuffer> m_cached_group_descriptor_table;
 
+    // Lock order: FS::m_lock, a journal handle (or a commit), Inode::m_lock,
+    // m_inode_cache_lock, one block group's lock, m_super_block_lock, and
+    // finally the block cache's lock. FS::m_lock itself only serializes
+    // flushing and committing to the journal.
+    mutable Lock m_inode_cache_lock { "Ext2FS: Inode cache" };
     mutable HashMap<InodeIndex, RefPtr<Ext2FSInode>> m_inode_cache;
 
+    OwnPtr<Ext2FSJournal> m_journal;
+
+    // The super block and group descriptors don't change after mounting,
+    // except for their counters. Updating those takes this lock exclusively
+    // (and, for a group's counters, the group's lock as well).
+    mutable Lock m_super_block_lock { "Ext2FS: Super block" };
+    unsigned m_reserved_block_count { 0 };
+    u64 m_allocated_block_count { 0 };
+    u64 m_allocated_extent_count { 0 };
+
     bool m_super_block_dirty { false };
     bool m_block_group_descriptors_dirty { false };
 
@@ -189,9 +300,21 @@ private:
         Bitmap bitmap(u32 blocks_per_group) { return Bitmap::wrap(buffer.data(), blocks_per_group); }
     };
 
-    CachedBitmap& get_bitmap_block(BlockIndex);
+    // Everything that is specific to one block group: its bitmaps, and the
+    // lock that allocation within the group takes.
+    struct BlockGroup {
+        Lock lock { "Ext2FS: Block group" };
+        OwnPtr<CachedBitmap> block_bitmap;
+        OwnPtr<CachedBitmap> inode_bitmap;
+    };
+
+    BlockGroup& block_group(GroupIndex group_index) { return m_block_groups[group_index - 1]; }
+    NonnullOwnPtr<CachedBitmap> read_bitmap_block(BlockIndex);
+    CachedBitmap& get_block_bitmap(GroupIndex);
+    CachedBitmap& get_inode_bitmap(GroupIndex);
+    void adjust_used_directory_count(GroupIndex, int delta);
 
-    Vector<OwnPtr<CachedBitmap>> m_cached_bitmaps;
+    NonnullOwnPtrVector<BlockGroup> m_block_groups;
 };
 
 inline Ext2FS& Ext2FSInode::fs()
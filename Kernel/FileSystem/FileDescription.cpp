@@ -144,6 +144,34 @@ KResultOr<size_t> FileDescription::write(const u8* data, size_t size)
     return nwritten_or_error;
 }
 
+KResultOr<size_t> FileDescription::pread(u8* buffer, size_t count, off_t offset)
+{
+    if (!m_file->is_seekable())
+        return -ESPIPE;
+    if (offset < 0)
+        return -EINVAL;
+    Checked<size_t> new_offset = offset;
+    new_offset += count;
+    if (new_offset.has_overflow())
+        return -EOVERFLOW;
+    SmapDisabler disabler;
+    return m_file->read(*this, offset, buffer, count);
+}
+
+KResultOr<size_t> FileDescription::pwrite(const u8* data, size_t size, off_t offset)
+{
+    if (!m_file->is_seekable())
+        return -ESPIPE;
+    if (offset < 0)
+        return -EINVAL;
+    Checked<size_t> new_offset = offset;
+    new_offset += size;
+    if (new_offset.has_overflow())
+        return -EOVERFLOW;
+    SmapDisabler disabler;
+    return m_file->write(*this, offset, data, size);
+}
+
 bool FileDescription::can_write() const
 {
     return m_file->can_write(*this, offset());
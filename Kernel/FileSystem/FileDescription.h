@@ -62,6 +62,10 @@ public:
     off_t seek(off_t, int whence);
     KResultOr<size_t> read(u8*, size_t);
     KResultOr<size_t> write(const u8* data, size_t);
+    // Like read() and write(), but at the given offset, which leaves the
+    // current offset alone. Only seekable files support this.
+    KResultOr<size_t> pread(u8*, size_t, off_t);
+    KResultOr<size_t> pwrite(const u8* data, size_t, off_t);
     KResult stat(::stat&);
 
     KResult chmod(mode_t);
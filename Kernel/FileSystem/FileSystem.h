@@ -26,6 +26,7 @@
 
 #pragma once
 
+#include <AK/Optional.h>
 #include <AK/RefCounted.h>
 #include <AK/RefPtr.h>
 #include <AK/String.h>
@@ -59,6 +60,10 @@ public:
     virtual const char* class_name() const = 0;
     virtual NonnullRefPtr<Inode> root_inode() const = 0;
     virtual bool supports_watchers() const { return false; }
+    virtual bool supports_page_cache() const { return false; }
+    // Only file systems whose directories change nowhere but through the VFS
+    // may have their lookups cached.
+    virtual bool supports_dentry_cache() const { return false; }
 
     bool is_readonly() const { return m_readonly; }
 
@@ -67,6 +72,14 @@ public:
     virtual unsigned total_inode_count() const { return 0; }
     virtual unsigned free_inode_count() const { return 0; }
 
+    struct FragmentationStatistics {
+        u64 free_extent_count { 0 };
+        u64 largest_free_extent { 0 };
+        u64 allocated_block_count { 0 };
+        u64 allocated_extent_count { 0 };
+    };
+    virtual Optional<FragmentationStatistics> fragmentation_statistics() const { return {}; }
+
     virtual KResult prepare_to_unmount() const { return KSuccess; }
 
     struct DirectoryEntryView {
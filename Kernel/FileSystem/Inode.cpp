@@ -34,6 +34,7 @@
 #include <Kernel/FileSystem/VirtualFileSystem.h>
 #include <Kernel/KBufferBuilder.h>
 #include <Kernel/Net/LocalSocket.h>
+#include <Kernel/VM/PageCache.h>
 #include <Kernel/VM/SharedInodeVMObject.h>
 
 namespace Kernel {
@@ -65,6 +66,14 @@ void Inode::sync()
     }
 }
 
+KResult Inode::fsync()
+{
+    if (is_metadata_dirty())
+        flush_metadata();
+    fs().flush_writes();
+    return KSuccess;
+}
+
 KResultOr<KBuffer> Inode::read_entire(FileDescription* descriptor) const
 {
     KBufferBuilder builder;
@@ -114,8 +123,17 @@ Inode::Inode(FS& fs, unsigned index)
 
 Inode::~Inode()
 {
-    ScopedSpinLock all_inodes_lock(s_all_inodes_lock);
-    all_with_lock().remove(this);
+    {
+        ScopedSpinLock all_inodes_lock(s_all_inodes_lock);
+        all_with_lock().remove(this);
+    }
+    if (fs().supports_page_cache())
+        PageCache::the().evict_inode(*this);
+}
+
+bool Inode::is_page_cacheable() const
+{
+    return fs().supports_page_cache() && metadata().is_regular_file();
 }
 
 void Inode::will_be_destroyed()
@@ -126,12 +144,16 @@ void Inode::will_be_destroyed()
 
 void Inode::inode_contents_changed(off_t offset, ssize_t size, const u8* data)
 {
+    if (fs().supports_page_cache())
+        PageCache::the().inode_contents_changed(*this, offset, size, data);
     if (m_shared_vmobject)
         m_shared_vmobject->inode_contents_changed({}, offset, size, data);
 }
 
 void Inode::inode_size_changed(size_t old_size, size_t new_size)
 {
+    if (fs().supports_page_cache())
+        PageCache::the().inode_size_changed(*this, old_size, new_size);
     if (m_shared_vmobject)
         m_shared_vmobject->inode_size_changed({}, old_size, new_size);
 }
@@ -62,6 +62,7 @@ public:
     bool is_symlink() const { return metadata().is_symlink(); }
     bool is_directory() const { return metadata().is_directory(); }
     bool is_character_device() const { return metadata().is_character_device(); }
+    bool is_page_cacheable() const;
     mode_t mode() const { return metadata().mode; }
 
     InodeIdentifier identifier() const { return { fsid(), index() }; }
@@ -98,6 +99,7 @@ public:
     virtual KResult decrement_link_count();
 
     virtual void flush_metadata() = 0;
+    virtual KResult fsync();
 
     void will_be_destroyed();
 
@@ -30,6 +30,7 @@
 #include <Kernel/FileSystem/InodeFile.h>
 #include <Kernel/FileSystem/VirtualFileSystem.h>
 #include <Kernel/Process.h>
+#include <Kernel/VM/PageCache.h>
 #include <Kernel/VM/PrivateInodeVMObject.h>
 #include <Kernel/VM/SharedInodeVMObject.h>
 
@@ -46,7 +47,11 @@ InodeFile::~InodeFile()
 
 KResultOr<size_t> InodeFile::read(FileDescription& description, size_t offset, u8* buffer, size_t count)
 {
-    ssize_t nread = m_inode->read_bytes(offset, count, buffer, &description);
+    ssize_t nread;
+    if (!description.is_direct() && m_inode->is_page_cacheable())
+        nread = PageCache::the().read(*m_inode, offset, count, buffer);
+    else
+        nread = m_inode->read_bytes(offset, count, buffer, &description);
     if (nread > 0)
         Thread::current()->did_file_read(nread);
     if (nread < 0)
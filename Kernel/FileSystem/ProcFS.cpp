@@ -35,6 +35,7 @@
 #include <Kernel/Devices/BlockDevice.h>
 #include <Kernel/Devices/KeyboardDevice.h>
 #include <Kernel/FileSystem/Custody.h>
+#include <Kernel/FileSystem/DentryCache.h>
 #include <Kernel/FileSystem/FileBackedFileSystem.h>
 #include <Kernel/FileSystem/FileDescription.h>
 #include <Kernel/FileSystem/ProcFS.h>
@@ -57,6 +58,7 @@
 #include <Kernel/StdLib.h>
 #include <Kernel/TTY/TTY.h>
 #include <Kernel/VM/MemoryManager.h>
+#include <Kernel/VM/PageCache.h>
 #include <Kernel/VM/PurgeableVMObject.h>
 #include <LibC/errno_numbers.h>
 
@@ -328,6 +330,7 @@ static Optional<KBuffer> procfs$pid_vm(InodeIdentifier identifier)
             region_object.add("executable", region.is_executable());
             region_object.add("stack", region.is_stack());
             region_object.add("shared", region.is_shared());
+            region_object.add("large_pages", region.wants_large_pages());
             region_object.add("user_accessible", region.is_user_accessible());
             region_object.add("purgeable", region.vmobject().is_purgeable());
             if (region.vmobject().is_purgeable()) {
@@ -339,6 +342,9 @@ static Optional<KBuffer> procfs$pid_vm(InodeIdentifier identifier)
             region_object.add("amount_resident", region.amount_resident());
             region_object.add("amount_dirty", region.amount_dirty());
             region_object.add("cow_pages", region.cow_pages());
+            region_object.add("inode_faults", region.inode_fault_count());
+            region_object.add("inode_fault_misses", region.inode_fault_miss_count());
+            region_object.add("fault_around_pages", region.fault_around_count());
             region_object.add("name", region.name());
             region_object.add("vmobject", region.vmobject().class_name());
 
@@ -417,9 +423,17 @@ static Optional<KBuffer> procfs$devices(InodeIdentifier)
         obj.add("minor", device.minor());
         obj.add("class_name", device.class_name());
 
-        if (device.is_block_device())
+        if (device.is_block_device()) {
             obj.add("type", "block");
-        else if (device.is_character_device())
+            auto statistics = static_cast<BlockDevice&>(device).request_queue_statistics();
+            obj.add("submitted_requests", statistics.submitted_requests);
+            obj.add("merged_requests", statistics.merged_requests);
+            obj.add("transfers", statistics.transfers);
+            obj.add("failed_requests", statistics.failed_requests);
+            obj.add("max_queue_depth", statistics.max_queue_depth);
+            obj.add("blocks_read", statistics.blocks_read);
+            obj.add("blocks_written", statistics.blocks_written);
+        } else if (device.is_character_device())
             obj.add("type", "character");
         else
             ASSERT_NOT_REACHED();
@@ -514,6 +528,12 @@ static Optional<KBuffer> procfs$net_adapters(InodeIdentifier)
         obj.add("bytes_in", adapter.bytes_in());
         obj.add("packets_out", adapter.packets_out());
         obj.add("bytes_out", adapter.bytes_out());
+        obj.add("packets_dropped", adapter.packets_dropped());
+        obj.add("receive_queues", adapter.receive_queue_count());
+        auto batches = adapter.batches_processed();
+        obj.add("batches", batches);
+        obj.add("average_latency", batches ? (u32)(adapter.total_processing_latency() / batches) : 0);
+        obj.add("max_latency", adapter.max_processing_latency());
         obj.add("link_up", adapter.link_up());
         obj.add("mtu", adapter.mtu());
     });
@@ -552,6 +572,19 @@ static Optional<KBuffer> procfs$net_tcp(InodeIdentifier)
         obj.add("bytes_in", socket.bytes_in());
         obj.add("packets_out", socket.packets_out());
         obj.add("bytes_out", socket.bytes_out());
+        obj.add("bytes_copied", socket.bytes_copied());
+        obj.add("max_segment_size", socket.max_segment_size());
+        obj.add("congestion_window", socket.congestion_window());
+        obj.add("slow_start_threshold", socket.slow_start_threshold());
+        obj.add("send_window", socket.send_window());
+        obj.add("receive_window", socket.receive_window());
+        obj.add("smoothed_rtt", socket.smoothed_rtt());
+        obj.add("rtt_variance", socket.rtt_variance());
+        obj.add("retransmission_timeout", socket.retransmission_timeout());
+        obj.add("retransmissions", socket.retransmissions());
+        obj.add("fast_retransmissions", socket.fast_retransmissions());
+        obj.add("retransmission_timeouts", socket.retransmission_timeouts());
+        obj.add("sack", socket.is_sack_enabled());
     });
     array.finish();
     return builder.build();
@@ -567,6 +600,7 @@ static Optional<KBuffer> procfs$net_udp(InodeIdentifier)
         obj.add("local_port", socket.local_port());
         obj.add("peer_address", socket.peer_address().to_string());
         obj.add("peer_port", socket.peer_port());
+        obj.add("bytes_copied", socket.bytes_copied());
     });
     array.finish();
     return builder.build();
@@ -760,6 +794,14 @@ static Optional<KBuffer> procfs$df(InodeIdentifier)
         fs_object.add("readonly", fs.is_readonly());
         fs_object.add("mount_flags", mount.flags());
 
+        auto statistics = fs.fragmentation_statistics();
+        if (statistics.has_value()) {
+            fs_object.add("free_extent_count", statistics.value().free_extent_count);
+            fs_object.add("largest_free_extent", statistics.value().largest_free_extent);
+            fs_object.add("allocated_block_count", statistics.value().allocated_block_count);
+            fs_object.add("allocated_extent_count", statistics.value().allocated_extent_count);
+        }
+
         if (fs.is_file_backed())
             fs_object.add("source", static_cast<const FileBackedFS&>(fs).file_description().absolute_path());
         else
@@ -788,6 +830,11 @@ static Optional<KBuffer> procfs$cpuinfo(InodeIdentifier)
             obj.add("stepping", info.stepping());
             obj.add("type", info.type());
             obj.add("brandstr", info.brandstr());
+            auto scheduler_statistics = Scheduler::processor_statistics(proc.id());
+            obj.add("context_switches", scheduler_statistics.context_switches);
+            obj.add("thread_steals", scheduler_statistics.steals);
+            obj.add("thread_migrations", scheduler_statistics.migrations);
+            obj.add("ready_threads", scheduler_statistics.ready_threads);
             return IterationDecision::Continue;
         });
     array.finish();
@@ -810,13 +857,50 @@ Optional<KBuffer> procfs$memstat(InodeIdentifier)
     json.add("user_physical_available", MM.user_physical_pages() - MM.user_physical_pages_used());
     json.add("super_physical_allocated", MM.super_physical_pages_used());
     json.add("super_physical_available", MM.super_physical_pages() - MM.super_physical_pages_used());
+    json.add("user_physical_zeroed", MM.zeroed_user_physical_pages());
+    json.add("zeroed_page_pool_hits", MM.m_zeroed_page_pool_hits);
+    json.add("zeroed_page_pool_misses", MM.m_zeroed_page_pool_misses);
+    auto tlb_stats = Processor::tlb_shootdown_statistics();
+    json.add("tlb_shootdowns", tlb_stats.shootdowns);
+    json.add("tlb_shootdown_ipis", tlb_stats.ipis);
+    json.add("tlb_shootdown_skipped_cpus", tlb_stats.skipped_cpus);
+    json.add("tlb_full_flushes", tlb_stats.full_flushes);
+    json.add("tlb_batched_ranges", tlb_stats.batched_ranges);
     json.add("kmalloc_call_count", stats.kmalloc_call_count);
     json.add("kfree_call_count", stats.kfree_call_count);
+    auto page_cache_stats = PageCache::the().statistics();
+    json.add("page_cache_pages", page_cache_stats.cached_pages);
+    json.add("page_cache_hits", page_cache_stats.hits);
+    json.add("page_cache_misses", page_cache_stats.misses);
+    json.add("page_cache_evictions", page_cache_stats.evictions);
+    json.add("page_cache_readahead_pages", page_cache_stats.readahead_pages);
+    auto dentry_cache_stats = DentryCache::the().statistics();
+    json.add("dentry_cache_entries", dentry_cache_stats.entries);
+    json.add("dentry_cache_negative_entries", dentry_cache_stats.negative_entries);
+    json.add("dentry_cache_hits", dentry_cache_stats.hits);
+    json.add("dentry_cache_negative_hits", dentry_cache_stats.negative_hits);
+    json.add("dentry_cache_misses", dentry_cache_stats.misses);
+    json.add("dentry_cache_invalidations", dentry_cache_stats.invalidations);
+    json.add("dentry_cache_evictions", dentry_cache_stats.evictions);
     slab_alloc_stats([&json](size_t slab_size, size_t num_allocated, size_t num_free) {
         auto prefix = String::format("slab_%zu", slab_size);
         json.add(String::format("%s_num_allocated", prefix.characters()), num_allocated);
         json.add(String::format("%s_num_free", prefix.characters()), num_free);
     });
+    slab_alloc_cache_stats([&json](size_t slab_size, const SlabCacheStatistics& cache_stats) {
+        auto prefix = String::format("slab_%zu", slab_size);
+        json.add(String::format("%s_magazine_hits", prefix.characters()), cache_stats.hits);
+        json.add(String::format("%s_magazine_misses", prefix.characters()), cache_stats.misses);
+        json.add(String::format("%s_magazine_contention", prefix.characters()), cache_stats.depot_contention);
+        json.add(String::format("%s_magazine_cached", prefix.characters()), cache_stats.cached);
+    });
+    get_kmalloc_cache_stats([&json](size_t max_size, const kmalloc_cache_stats& cache_stats) {
+        auto prefix = String::format("kmalloc_%zu", max_size);
+        json.add(String::format("%s_magazine_hits", prefix.characters()), cache_stats.hits);
+        json.add(String::format("%s_magazine_misses", prefix.characters()), cache_stats.misses);
+        json.add(String::format("%s_magazine_contention", prefix.characters()), cache_stats.depot_contention);
+        json.add(String::format("%s_magazine_cached", prefix.characters()), cache_stats.cached);
+    });
     json.finish();
     return builder.build();
 }
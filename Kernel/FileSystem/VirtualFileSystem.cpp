@@ -29,6 +29,7 @@
 #include <AK/StringBuilder.h>
 #include <Kernel/Devices/BlockDevice.h>
 #include <Kernel/FileSystem/Custody.h>
+#include <Kernel/FileSystem/DentryCache.h>
 #include <Kernel/FileSystem/FileBackedFileSystem.h>
 #include <Kernel/FileSystem/FileDescription.h>
 #include <Kernel/FileSystem/FileSystem.h>
@@ -81,6 +82,7 @@ KResult VFS::mount(FS& file_system, Custody& mount_point, int flags)
     // FIXME: check that this is not already a mount point
     Mount mount { file_system, &mount_point, flags };
     m_mounts.append(move(mount));
+    DentryCache::the().invalidate_all();
     return KSuccess;
 }
 
@@ -92,6 +94,7 @@ KResult VFS::bind_mount(Custody& source, Custody& mount_point, int flags)
     // FIXME: check that this is not already a mount point
     Mount mount { source.inode(), mount_point, flags };
     m_mounts.append(move(mount));
+    DentryCache::the().invalidate_all();
     return KSuccess;
 }
 
@@ -106,6 +109,8 @@ KResult VFS::remount(Custody& mount_point, int new_flags)
         return KResult(-ENODEV);
 
     mount->set_flags(new_flags);
+    // Cached custodies carry the mount flags they were created with.
+    DentryCache::the().invalidate_all();
     return KSuccess;
 }
 
@@ -114,6 +119,9 @@ KResult VFS::unmount(Inode& guest_inode)
     LOCKER(m_lock);
     dbg() << "VFS: unmount called with inode " << guest_inode.identifier();
 
+    // Cached custodies hold references to inodes, which would keep the file system busy.
+    DentryCache::the().invalidate_all();
+
     for (size_t i = 0; i < m_mounts.size(); ++i) {
         auto& mount = m_mounts.at(i);
         if (&mount.guest() == &guest_inode) {
@@ -366,7 +374,9 @@ KResult VFS::mknod(StringView path, mode_t mode, dev_t dev, Custody& base)
 
     LexicalPath p(path);
     dbg() << "VFS::mknod: '" << p.basename() << "' mode=" << mode << " dev=" << dev << " in " << parent_inode.identifier();
-    return parent_inode.create_child(p.basename(), mode, dev, current_process->uid(), current_process->gid()).result();
+    auto result = parent_inode.create_child(p.basename(), mode, dev, current_process->uid(), current_process->gid()).result();
+    DentryCache::the().invalidate(parent_inode, p.basename());
+    return result;
 }
 
 KResultOr<NonnullRefPtr<FileDescription>> VFS::create(StringView path, int options, mode_t mode, Custody& parent_custody, Optional<UidAndGid> owner)
@@ -394,6 +404,7 @@ KResultOr<NonnullRefPtr<FileDescription>> VFS::create(StringView path, int optio
     uid_t uid = owner.has_value() ? owner.value().uid : current_process->uid();
     gid_t gid = owner.has_value() ? owner.value().gid : current_process->gid();
     auto inode_or_error = parent_inode.create_child(p.basename(), mode, 0, uid, gid);
+    DentryCache::the().invalidate(parent_inode, p.basename());
     if (inode_or_error.is_error())
         return inode_or_error.error();
 
@@ -433,7 +444,9 @@ KResult VFS::mkdir(StringView path, mode_t mode, Custody& base)
 #ifdef VFS_DEBUG
     dbg() << "VFS::mkdir: '" << p.basename() << "' in " << parent_inode.identifier();
 #endif
-    return parent_inode.create_child(p.basename(), S_IFDIR | mode, 0, current_process->uid(), current_process->gid()).result();
+    auto mkdir_result = parent_inode.create_child(p.basename(), S_IFDIR | mode, 0, current_process->uid(), current_process->gid()).result();
+    DentryCache::the().invalidate(parent_inode, p.basename());
+    return mkdir_result;
 }
 
 KResult VFS::access(StringView path, int mode, Custody& base)
@@ -552,15 +565,21 @@ KResult VFS::rename(StringView old_path, StringView new_path, Custody& base)
         if (new_inode.is_directory() && !old_inode.is_directory())
             return KResult(-EISDIR);
         auto result = new_parent_inode.remove_child(new_basename);
+        DentryCache::the().invalidate(new_parent_inode, new_basename);
+        if (new_inode.is_directory())
+            DentryCache::the().invalidate_directory(new_inode);
         if (result.is_error())
             return result;
     }
 
     auto result = new_parent_inode.add_child(old_inode, new_basename, old_inode.mode());
+    DentryCache::the().invalidate(new_parent_inode, new_basename);
     if (result.is_error())
         return result;
 
-    result = old_parent_inode.remove_child(LexicalPath(old_path).basename());
+    auto old_basename = LexicalPath(old_path).basename();
+    result = old_parent_inode.remove_child(old_basename);
+    DentryCache::the().invalidate(old_parent_inode, old_basename);
     if (result.is_error())
         return result;
 
@@ -644,7 +663,10 @@ KResult VFS::link(StringView old_path, StringView new_path, Custody& base)
     if (parent_custody->is_readonly())
         return KResult(-EROFS);
 
-    return parent_inode.add_child(old_inode, LexicalPath(new_path).basename(), old_inode.mode());
+    auto new_basename = LexicalPath(new_path).basename();
+    auto result = parent_inode.add_child(old_inode, new_basename, old_inode.mode());
+    DentryCache::the().invalidate(parent_inode, new_basename);
+    return result;
 }
 
 KResult VFS::unlink(StringView path, Custody& base)
@@ -677,7 +699,9 @@ KResult VFS::unlink(StringView path, Custody& base)
     if (parent_custody->is_readonly())
         return KResult(-EROFS);
 
-    auto result = parent_inode.remove_child(LexicalPath(path).basename());
+    auto basename = LexicalPath(path).basename();
+    auto result = parent_inode.remove_child(basename);
+    DentryCache::the().invalidate(parent_inode, basename);
     if (result.is_error())
         return result;
 
@@ -704,6 +728,7 @@ KResult VFS::symlink(StringView target, StringView linkpath, Custody& base)
     LexicalPath p(linkpath);
     dbg() << "VFS::symlink: '" << p.basename() << "' (-> '" << target << "') in " << parent_inode.identifier();
     auto inode_or_error = parent_inode.create_child(p.basename(), S_IFLNK | 0644, 0, current_process->uid(), current_process->gid());
+    DentryCache::the().invalidate(parent_inode, p.basename());
     if (inode_or_error.is_error())
         return inode_or_error.error();
     auto& inode = inode_or_error.value();
@@ -755,7 +780,11 @@ KResult VFS::rmdir(StringView path, Custody& base)
     if (result.is_error())
         return result;
 
-    return parent_inode.remove_child(LexicalPath(path).basename());
+    auto basename = LexicalPath(path).basename();
+    result = parent_inode.remove_child(basename);
+    DentryCache::the().invalidate(parent_inode, basename);
+    DentryCache::the().invalidate_directory(inode);
+    return result;
 }
 
 VFS::Mount::Mount(FS& guest_fs, Custody* host_custody, int flags)
@@ -929,37 +958,54 @@ KResultOr<NonnullRefPtr<Custody>> VFS::resolve_path_without_veil(StringView path
             continue;
         }
 
-        // Okay, let's look up this part.
-        auto child_inode = parent.inode().lookup(part);
-        if (!child_inode) {
-            if (out_parent) {
-                // ENOENT with a non-null parent custody signals to caller that
-                // we found the immediate parent of the file, but the file itself
-                // does not exist yet.
-                *out_parent = have_more_parts ? nullptr : &parent;
+        // Okay, let's look up this part, going to the dentry cache first.
+        auto& dentry_cache = DentryCache::the();
+        bool use_dentry_cache = parent.inode().fs().supports_dentry_cache();
+        RefPtr<Custody> cached_child;
+        auto cache_result = use_dentry_cache ? dentry_cache.lookup(parent, part, cached_child) : DentryCache::LookupResult::Miss;
+
+        if (cache_result == DentryCache::LookupResult::Hit) {
+            custody = cached_child.release_nonnull();
+        } else {
+            auto cache_generation = use_dentry_cache ? dentry_cache.generation() : 0;
+            RefPtr<Inode> child_inode;
+            if (cache_result == DentryCache::LookupResult::Miss)
+                child_inode = parent.inode().lookup(part);
+            if (!child_inode) {
+                if (use_dentry_cache && cache_result == DentryCache::LookupResult::Miss)
+                    dentry_cache.add(parent, part, nullptr, cache_generation);
+                if (out_parent) {
+                    // ENOENT with a non-null parent custody signals to caller that
+                    // we found the immediate parent of the file, but the file itself
+                    // does not exist yet.
+                    *out_parent = have_more_parts ? nullptr : &parent;
+                }
+                return KResult(-ENOENT);
             }
-            return KResult(-ENOENT);
-        }
 
-        int mount_flags_for_child = parent.mount_flags();
+            int mount_flags_for_child = parent.mount_flags();
 
-        // See if there's something mounted on the child; in that case
-        // we would need to return the guest inode, not the host inode.
-        if (auto mount = find_mount_for_host(*child_inode)) {
-            child_inode = mount->guest();
-            mount_flags_for_child = mount->flags();
-        }
+            // See if there's something mounted on the child; in that case
+            // we would need to return the guest inode, not the host inode.
+            if (auto mount = find_mount_for_host(*child_inode)) {
+                child_inode = mount->guest();
+                mount_flags_for_child = mount->flags();
+            }
 
-        custody = Custody::create(&parent, part, *child_inode, mount_flags_for_child);
+            custody = Custody::create(&parent, part, *child_inode, mount_flags_for_child);
+            if (use_dentry_cache)
+                dentry_cache.add(parent, part, custody.ptr(), cache_generation);
+        }
 
-        if (child_inode->metadata().is_symlink()) {
+        auto& child_inode = custody->inode();
+        if (child_inode.metadata().is_symlink()) {
             if (!have_more_parts) {
                 if (options & O_NOFOLLOW)
                     return KResult(-ELOOP);
                 if (options & O_NOFOLLOW_NOERROR)
                     break;
             }
-            auto symlink_target = child_inode->resolve_as_link(parent, out_parent, options, symlink_recursion_level + 1);
+            auto symlink_target = child_inode.resolve_as_link(parent, out_parent, options, symlink_recursion_level + 1);
             if (symlink_target.is_error() || !have_more_parts)
                 return symlink_target;
 
@@ -34,8 +34,11 @@ class Custody;
 class Device;
 class DiskCache;
 class DoubleBuffer;
+class Ext2FSJournalHandle;
 class File;
 class FileDescription;
+struct FutexKey;
+class FutexQueue;
 class IPv4Socket;
 class Inode;
 class InodeIdentifier;
@@ -66,6 +69,7 @@ class RecursiveSpinLock;
 template<typename LockType>
 class ScopedSpinLock;
 class TCPSocket;
+class TLBFlushBatch;
 class TTY;
 class Thread;
 class UDPSocket;
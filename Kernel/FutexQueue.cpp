@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <Kernel/FutexQueue.h>
+#include <Kernel/Scheduler.h>
+#include <Kernel/Thread.h>
+
+namespace Kernel {
+
+FutexQueue::FutexQueue(const FutexKey& key)
+    : m_key(key)
+{
+}
+
+FutexQueue::~FutexQueue()
+{
+}
+
+u32 FutexQueue::wake_matching(u32 wake_count, u32 bitset)
+{
+    // Take the scheduler lock first, in the same order as Thread::wait_on()
+    ScopedSpinLock sched_lock(g_scheduler_lock);
+    ScopedSpinLock queue_lock(m_lock);
+    u32 woken = 0;
+    for (auto it = m_threads.begin(); it != m_threads.end() && woken < wake_count;) {
+        auto& thread = *it;
+        ++it;
+        if (!(thread.futex_wake_bitset() & bitset))
+            continue;
+        m_threads.remove(thread);
+        thread.wake_from_queue();
+        ++woken;
+    }
+    return woken;
+}
+
+u32 FutexQueue::requeue_to(FutexQueue& target, u32 requeue_count)
+{
+    ASSERT(&target != this);
+    ScopedSpinLock sched_lock(g_scheduler_lock);
+
+    // Always lock the two queues in address order so that two concurrent
+    // requeue operations in opposite directions can't deadlock.
+    auto& first = this < &target ? *this : target;
+    auto& second = this < &target ? target : *this;
+    ScopedSpinLock first_lock(first.m_lock);
+    ScopedSpinLock second_lock(second.m_lock);
+
+    u32 moved = 0;
+    while (moved < requeue_count) {
+        auto* thread = m_threads.take_first();
+        if (!thread)
+            break;
+        target.m_threads.append(*thread);
+        thread->m_wait_queue = &target;
+        ++moved;
+    }
+    return moved;
+}
+
+}
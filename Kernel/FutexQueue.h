@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <AK/HashFunctions.h>
+#include <AK/Traits.h>
+#include <Kernel/WaitQueue.h>
+
+namespace Kernel {
+
+// Identifies the memory a futex word lives in. Futexes in private mappings
+// are keyed by the owning process and virtual address; futexes in shared
+// mappings are keyed by the backing VMObject and the offset into it, so
+// every process mapping the same memory agrees on the key.
+struct FutexKey {
+    FlatPtr object { 0 };
+    FlatPtr offset { 0 };
+
+    bool operator==(const FutexKey& other) const { return object == other.object && offset == other.offset; }
+};
+
+class FutexQueue final : public WaitQueue {
+public:
+    explicit FutexQueue(const FutexKey&);
+    ~FutexQueue();
+
+    const FutexKey& key() const { return m_key; }
+
+    // Wakes up to wake_count threads whose wait bitset intersects bitset.
+    u32 wake_matching(u32 wake_count, u32 bitset);
+
+    // Moves up to requeue_count waiting threads onto target without waking them.
+    u32 requeue_to(FutexQueue& target, u32 requeue_count);
+
+    // Number of threads that are using this queue, either because they're
+    // waiting on it or because they're about to leave it.
+    u32 user_count() const { return m_user_count; }
+    void add_users(u32 count) { m_user_count += count; }
+    void remove_users(u32 count)
+    {
+        ASSERT(m_user_count >= count);
+        m_user_count -= count;
+    }
+
+private:
+    FutexKey m_key;
+    u32 m_user_count { 0 };
+};
+
+}
+
+namespace AK {
+
+template<>
+struct Traits<Kernel::FutexKey> : public GenericTraits<Kernel::FutexKey> {
+    static unsigned hash(const Kernel::FutexKey& key) { return pair_int_hash(ptr_hash(key.object), ptr_hash(key.offset)); }
+};
+
+}
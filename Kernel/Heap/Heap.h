@@ -64,15 +64,30 @@ public:
 
     static size_t calculate_memory_for_bytes(size_t bytes)
     {
-        size_t needed_chunks = (sizeof(AllocationHeader) + bytes + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        size_t needed_chunks = calculate_chunks_for_allocation(bytes);
         return needed_chunks * CHUNK_SIZE + (needed_chunks + 7) / 8;
     }
 
+    static size_t calculate_chunks_for_allocation(size_t size)
+    {
+        return (sizeof(AllocationHeader) + size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    }
+
+    static size_t allocation_size_in_chunks(const void* ptr)
+    {
+        auto* a = (const AllocationHeader*)((((const u8*)ptr) - sizeof(AllocationHeader)));
+        return a->allocation_size_in_chunks;
+    }
+
+    static constexpr size_t allocation_data_size(size_t chunks)
+    {
+        return chunks * CHUNK_SIZE - sizeof(AllocationHeader);
+    }
+
     void* allocate(size_t size)
     {
         // We need space for the AllocationHeader at the head of the block.
-        size_t real_size = size + sizeof(AllocationHeader);
-        size_t chunks_needed = (real_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        size_t chunks_needed = calculate_chunks_for_allocation(size);
 
         if (chunks_needed > free_chunks())
             return nullptr;
@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <AK/StdLibExtras.h>
+#include <AK/Types.h>
+#include <Kernel/Arch/i386/CPU.h>
+#include <Kernel/Heap/kmalloc.h>
+#include <Kernel/SpinLock.h>
+
+namespace Kernel {
+
+// A per-processor cache of free objects of a single size, sitting in front of
+// a shared allocator. Each processor owns two magazines (small stacks of free
+// objects) that it allocates from and frees into without taking any locks.
+// Only when both are empty (or both are full) does it exchange one with the
+// shared depot, so the backing allocator and its lock see a fraction of the
+// traffic. All functions must be called inside a critical section.
+template<size_t magazine_capacity = 15, size_t max_full_magazines_in_depot = 8>
+class MagazineCache {
+    AK_MAKE_NONCOPYABLE(MagazineCache);
+    AK_MAKE_NONMOVABLE(MagazineCache);
+
+public:
+    struct Statistics {
+        size_t allocation_hits { 0 };
+        size_t allocation_misses { 0 };
+        size_t deallocation_hits { 0 };
+        size_t deallocation_misses { 0 };
+        size_t depot_contention { 0 };
+        size_t cached_objects { 0 };
+    };
+
+    MagazineCache() { }
+
+    // Returns nullptr if the caller should allocate from the backing allocator.
+    void* allocate()
+    {
+        ASSERT(Processor::current().in_critical());
+        auto& cache = m_processor_caches[Processor::current().id()];
+        if (!cache.loaded || cache.loaded->is_empty()) {
+            if (cache.previous && !cache.previous->is_empty()) {
+                swap(cache.loaded, cache.previous);
+            } else if (!exchange_for_full_magazine(cache)) {
+                cache.allocation_misses++;
+                return nullptr;
+            }
+        }
+        cache.allocation_hits++;
+        return cache.loaded->pop();
+    }
+
+    // Returns false if the caller should free the object to the backing allocator.
+    bool deallocate(void* ptr)
+    {
+        ASSERT(Processor::current().in_critical());
+        auto& cache = m_processor_caches[Processor::current().id()];
+        if (!cache.loaded || cache.loaded->is_full()) {
+            if (cache.previous && !cache.previous->is_full()) {
+                swap(cache.loaded, cache.previous);
+            } else if (!exchange_for_empty_magazine(cache)) {
+                cache.deallocation_misses++;
+                return false;
+            }
+        }
+        cache.deallocation_hits++;
+        cache.loaded->push(ptr);
+        return true;
+    }
+
+    // Hands every object sitting in a full depot magazine back to the caller,
+    // e.g. to return them to the backing allocator under memory pressure.
+    // Objects in the per-processor magazines are left alone.
+    template<typename Callback>
+    size_t drain_depot(Callback callback)
+    {
+        Magazine* full_magazines;
+        {
+            ScopedSpinLock lock(m_depot_lock);
+            full_magazines = m_full_magazines;
+            m_full_magazines = nullptr;
+            m_full_magazine_count = 0;
+        }
+        size_t drained = 0;
+        while (full_magazines) {
+            auto* magazine = full_magazines;
+            full_magazines = magazine->next;
+            while (!magazine->is_empty()) {
+                callback(magazine->pop());
+                drained++;
+            }
+            ScopedSpinLock lock(m_depot_lock);
+            push_magazine(m_empty_magazines, magazine);
+        }
+        return drained;
+    }
+
+    Statistics statistics() const
+    {
+        Statistics statistics;
+        for (auto& cache : m_processor_caches) {
+            statistics.allocation_hits += cache.allocation_hits;
+            statistics.allocation_misses += cache.allocation_misses;
+            statistics.deallocation_hits += cache.deallocation_hits;
+            statistics.deallocation_misses += cache.deallocation_misses;
+            if (auto* loaded = cache.loaded)
+                statistics.cached_objects += loaded->count;
+            if (auto* previous = cache.previous)
+                statistics.cached_objects += previous->count;
+        }
+        statistics.depot_contention = m_depot_contention;
+        statistics.cached_objects += m_full_magazine_count * magazine_capacity;
+        return statistics;
+    }
+
+private:
+    struct Magazine {
+        Magazine* next { nullptr };
+        size_t count { 0 };
+        void* rounds[magazine_capacity];
+
+        bool is_empty() const { return count == 0; }
+        bool is_full() const { return count == magazine_capacity; }
+        void push(void* ptr) { rounds[count++] = ptr; }
+        void* pop() { return rounds[--count]; }
+    };
+
+    struct ProcessorCache {
+        Magazine* loaded { nullptr };
+        Magazine* previous { nullptr };
+        size_t allocation_hits { 0 };
+        size_t allocation_misses { 0 };
+        size_t deallocation_hits { 0 };
+        size_t deallocation_misses { 0 };
+    };
+
+    static void push_magazine(Magazine*& list, Magazine* magazine)
+    {
+        magazine->next = list;
+        list = magazine;
+    }
+
+    static Magazine* pop_magazine(Magazine*& list)
+    {
+        auto* magazine = list;
+        list = magazine->next;
+        magazine->next = nullptr;
+        return magazine;
+    }
+
+    void note_depot_contention()
+    {
+        if (m_depot_lock.is_locked())
+            m_depot_contention++;
+    }
+
+    bool exchange_for_full_magazine(ProcessorCache& cache)
+    {
+        note_depot_contention();
+        ScopedSpinLock lock(m_depot_lock);
+        if (!m_full_magazines)
+            return false;
+        if (cache.previous)
+            push_magazine(m_empty_magazines, cache.previous);
+        cache.previous = cache.loaded;
+        cache.loaded = pop_magazine(m_full_magazines);
+        m_full_magazine_count--;
+        return true;
+    }
+
+    bool exchange_for_empty_magazine(ProcessorCache& cache)
+    {
+        auto* empty_magazine = take_empty_magazine();
+        if (!empty_magazine)
+            return false;
+        note_depot_contention();
+        ScopedSpinLock lock(m_depot_lock);
+        if (cache.previous) {
+            if (m_full_magazine_count >= max_full_magazines_in_depot) {
+                push_magazine(m_empty_magazines, empty_magazine);
+                return false;
+            }
+            push_magazine(m_full_magazines, cache.previous);
+            m_full_magazine_count++;
+        }
+        cache.previous = cache.loaded;
+        cache.loaded = empty_magazine;
+        return true;
+    }
+
+    Magazine* take_empty_magazine()
+    {
+        {
+            note_depot_contention();
+            ScopedSpinLock lock(m_depot_lock);
+            if (m_empty_magazines)
+                return pop_magazine(m_empty_magazines);
+            // Two magazines per processor plus whatever the depot may hold
+            if (m_magazine_count >= 2 * Processor::count() + max_full_magazines_in_depot)
+                return nullptr;
+            m_magazine_count++;
+        }
+        // Allocate outside of the depot lock, as the backing allocator
+        // may itself be draining this cache while holding its own lock.
+        return new (kmalloc_eternal(sizeof(Magazine))) Magazine;
+    }
+
+    ProcessorCache m_processor_caches[Processor::max_count];
+    Magazine* m_full_magazines { nullptr };
+    Magazine* m_empty_magazines { nullptr };
+    size_t m_full_magazine_count { 0 };
+    size_t m_magazine_count { 0 };
+    size_t m_depot_contention { 0 };
+    SpinLock<u8> m_depot_lock;
+};
+
+}
@@ -26,6 +26,7 @@
 
 #include <AK/Assertions.h>
 #include <AK/Memory.h>
+#include <Kernel/Heap/MagazineCache.h>
 #include <Kernel/Heap/SlabAllocator.h>
 #include <Kernel/Heap/kmalloc.h>
 #include <Kernel/SpinLock.h>
@@ -63,17 +64,20 @@ public:
         {
             // We want to avoid being swapped out in the middle of this
             ScopedCritical critical;
-            FreeSlab* next_free;
-            free_slab = m_freelist.load(AK::memory_order_consume);
-            do {
-                if (!free_slab)
-                    return kmalloc(slab_size());
-                // It's possible another processor is doing the same thing at
-                // the same time, so next_free *can* be a bogus pointer. However,
-                // in that case compare_exchange_strong would fail and we would
-                // try again.
-                next_free = free_slab->next;
-            } while (!m_freelist.compare_exchange_strong(free_slab, next_free, AK::memory_order_acq_rel));
+            free_slab = (FreeSlab*)m_magazine_cache.allocate();
+            if (!free_slab) {
+                FreeSlab* next_free;
+                free_slab = m_freelist.load(AK::memory_order_consume);
+                do {
+                    if (!free_slab)
+                        return kmalloc(slab_size());
+                    // It's possible another processor is doing the same thing at
+                    // the same time, so next_free *can* be a bogus pointer. However,
+                    // in that case compare_exchange_strong would fail and we would
+                    // try again.
+                    next_free = free_slab->next;
+                } while (!m_freelist.compare_exchange_strong(free_slab, next_free, AK::memory_order_acq_rel));
+            }
 
             m_num_allocated.fetch_add(1, AK::MemoryOrder::memory_order_acq_rel);
         }
@@ -99,16 +103,19 @@ public:
 
         // We want to avoid being swapped out in the middle of this
         ScopedCritical critical;
+        m_num_allocated.fetch_sub(1, AK::MemoryOrder::memory_order_acq_rel);
+        if (m_magazine_cache.deallocate(free_slab))
+            return;
+
         FreeSlab* next_free = m_freelist.load(AK::memory_order_consume);
         do {
             free_slab->next = next_free;
         } while (!m_freelist.compare_exchange_strong(next_free, free_slab, AK::memory_order_acq_rel));
-
-        m_num_allocated.fetch_sub(1, AK::MemoryOrder::memory_order_acq_rel);
     }
 
     size_t num_allocated() const { return m_num_allocated.load(AK::MemoryOrder::memory_order_consume); }
     size_t num_free() const { return m_slab_count - m_num_allocated.load(AK::MemoryOrder::memory_order_consume); }
+    auto magazine_statistics() const { return m_magazine_cache.statistics(); }
 
 private:
     struct FreeSlab {
@@ -116,6 +123,7 @@ private:
         char padding[templated_slab_size - sizeof(FreeSlab*)];
     };
 
+    MagazineCache<> m_magazine_cache;
     Atomic<FreeSlab*> m_freelist { nullptr };
     Atomic<ssize_t> m_num_allocated;
     size_t m_slab_count;
@@ -184,4 +192,17 @@ void slab_alloc_stats(Function<void(size_t slab_size, size_t allocated, size_t f
     });
 }
 
+void slab_alloc_cache_stats(Function<void(size_t slab_size, const SlabCacheStatistics&)> callback)
+{
+    for_each_allocator([&](auto& allocator) {
+        auto magazine_statistics = allocator.magazine_statistics();
+        SlabCacheStatistics statistics;
+        statistics.hits = magazine_statistics.allocation_hits + magazine_statistics.deallocation_hits;
+        statistics.misses = magazine_statistics.allocation_misses + magazine_statistics.deallocation_misses;
+        statistics.depot_contention = magazine_statistics.depot_contention;
+        statistics.cached = magazine_statistics.cached_objects;
+        callback(allocator.slab_size(), statistics);
+    });
+}
+
 }
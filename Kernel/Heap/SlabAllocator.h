@@ -39,6 +39,15 @@ void slab_dealloc(void*, size_t slab_size);
 void slab_alloc_init();
 void slab_alloc_stats(Function<void(size_t slab_size, size_t allocated, size_t free)>);
 
+struct SlabCacheStatistics {
+    size_t hits { 0 };
+    size_t misses { 0 };
+    size_t depot_contention { 0 };
+    size_t cached { 0 };
+};
+
+void slab_alloc_cache_stats(Function<void(size_t slab_size, const SlabCacheStatistics&)>);
+
 #define MAKE_SLAB_ALLOCATED(type)                                        \
 public:                                                                  \
     void* operator new(size_t) { return slab_alloc(sizeof(type)); }      \
@@ -36,6 +36,7 @@
 #include <AK/Types.h>
 #include <Kernel/Arch/i386/CPU.h>
 #include <Kernel/Heap/Heap.h>
+#include <Kernel/Heap/MagazineCache.h>
 #include <Kernel/Heap/kmalloc.h>
 #include <Kernel/KSyms.h>
 #include <Kernel/Process.h>
@@ -50,6 +51,13 @@
 #define POOL_SIZE (2 * MiB)
 #define ETERNAL_RANGE_SIZE (2 * MiB)
 
+// Allocations of up to this many chunks are served from per-processor
+// magazines first, and only fall back to the global heap (and s_lock)
+// when the magazines run dry or overflow.
+#define MAGAZINE_CACHED_CHUNKS 8
+
+static size_t drain_magazine_depots();
+
 struct KmallocGlobalHeap {
     struct ExpandGlobalHeap {
         KmallocGlobalHeap& m_global_heap;
@@ -65,6 +73,12 @@ struct KmallocGlobalHeap {
                 klog() << "kmalloc(): Cannot expand heap before MM is initialized!";
                 return false;
             }
+            // Before pulling in more memory, give back whatever the
+            // magazine depots are holding on to. If that returned anything
+            // the allocation will be retried before we get called again.
+            if (drain_magazine_depots() > 0)
+                return true;
+
             // At this point we have very little memory left. Any attempt to
             // kmalloc() could fail, so use our backup memory first, so we
             // can't really reliably allocate even a new region of memory.
@@ -169,6 +183,20 @@ static u8* s_end_of_eternal_range;
 
 static RecursiveSpinLock s_lock; // needs to be recursive because of dump_backtrace()
 
+static MagazineCache<> s_magazine_caches[MAGAZINE_CACHED_CHUNKS];
+
+static size_t drain_magazine_depots()
+{
+    ASSERT(s_lock.own_lock());
+    size_t drained = 0;
+    for (auto& cache : s_magazine_caches) {
+        drained += cache.drain_depot([](void* ptr) {
+            g_kmalloc_global->m_heap.deallocate(ptr);
+        });
+    }
+    return drained;
+}
+
 void kmalloc_enable_expand()
 {
     g_kmalloc_global->allocate_backup_memory();
@@ -197,14 +225,26 @@ void* kmalloc_eternal(size_t size)
 
 void* kmalloc_impl(size_t size)
 {
-    ScopedSpinLock lock(s_lock);
-    ++g_kmalloc_call_count;
-
     if (g_dump_kmalloc_stacks && Kernel::g_kernel_symbols_available) {
+        ScopedSpinLock lock(s_lock);
         dbg() << "kmalloc(" << size << ")";
         Kernel::dump_backtrace();
     }
 
+    size_t chunks = KmallocGlobalHeap::HeapType::HeapType::calculate_chunks_for_allocation(size);
+    if (chunks <= MAGAZINE_CACHED_CHUNKS) {
+        ScopedCritical critical;
+        if (void* ptr = s_magazine_caches[chunks - 1].allocate()) {
+#ifdef SANITIZE_KMALLOC
+            memset(ptr, KMALLOC_SCRUB_BYTE, KmallocGlobalHeap::HeapType::HeapType::allocation_data_size(chunks));
+#endif
+            return ptr;
+        }
+    }
+
+    ScopedSpinLock lock(s_lock);
+    ++g_kmalloc_call_count;
+
     void* ptr = g_kmalloc_global->m_heap.allocate(size);
     if (!ptr) {
         klog() << "kmalloc(): PANIC! Out of memory (no suitable block for size " << size << ")";
@@ -220,6 +260,18 @@ void kfree(void* ptr)
     if (!ptr)
         return;
 
+    // The allocation header is ours until the memory is handed back, so
+    // it's safe to look at without holding the lock.
+    size_t chunks = KmallocGlobalHeap::HeapType::HeapType::allocation_size_in_chunks(ptr);
+    if (chunks <= MAGAZINE_CACHED_CHUNKS) {
+#ifdef SANITIZE_KMALLOC
+        memset(ptr, KFREE_SCRUB_BYTE, KmallocGlobalHeap::HeapType::HeapType::allocation_data_size(chunks));
+#endif
+        ScopedCritical critical;
+        if (s_magazine_caches[chunks - 1].deallocate(ptr))
+            return;
+    }
+
     ScopedSpinLock lock(s_lock);
     ++g_kfree_call_count;
 
@@ -250,4 +302,22 @@ void get_kmalloc_stats(kmalloc_stats& stats)
     stats.bytes_eternal = g_kmalloc_bytes_eternal;
     stats.kmalloc_call_count = g_kmalloc_call_count;
     stats.kfree_call_count = g_kfree_call_count;
+    for (auto& cache : s_magazine_caches) {
+        auto cache_statistics = cache.statistics();
+        stats.kmalloc_call_count += cache_statistics.allocation_hits;
+        stats.kfree_call_count += cache_statistics.deallocation_hits;
+    }
+}
+
+void get_kmalloc_cache_stats(Function<void(size_t max_size, const kmalloc_cache_stats&)> callback)
+{
+    for (size_t i = 0; i < MAGAZINE_CACHED_CHUNKS; i++) {
+        auto cache_statistics = s_magazine_caches[i].statistics();
+        kmalloc_cache_stats stats;
+        stats.hits = cache_statistics.allocation_hits + cache_statistics.deallocation_hits;
+        stats.misses = cache_statistics.allocation_misses + cache_statistics.deallocation_misses;
+        stats.depot_contention = cache_statistics.depot_contention;
+        stats.cached = cache_statistics.cached_objects;
+        callback(KmallocGlobalHeap::HeapType::HeapType::allocation_data_size(i + 1), stats);
+    }
 }
@@ -26,6 +26,7 @@
 
 #pragma once
 
+#include <AK/Forward.h>
 #include <AK/Types.h>
 
 //#define KMALLOC_DEBUG_LARGE_ALLOCATIONS
@@ -49,6 +50,14 @@ struct kmalloc_stats {
 };
 void get_kmalloc_stats(kmalloc_stats&);
 
+struct kmalloc_cache_stats {
+    size_t hits;
+    size_t misses;
+    size_t depot_contention;
+    size_t cached;
+};
+void get_kmalloc_cache_stats(Function<void(size_t max_size, const kmalloc_cache_stats&)>);
+
 extern bool g_dump_kmalloc_stacks;
 
 inline void* operator new(size_t, void* p) { return p; }
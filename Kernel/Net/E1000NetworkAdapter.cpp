@@ -284,10 +284,9 @@ void E1000NetworkAdapter::initialize_rx_descriptors()
     auto* rx_descriptors = (e1000_tx_desc*)m_rx_descriptors_region->vaddr().as_ptr();
     for (size_t i = 0; i < number_of_rx_descriptors; ++i) {
         auto& descriptor = rx_descriptors[i];
-        auto region = MM.allocate_contiguous_kernel_region(8192, "E1000 RX buffer", Region::Access::Read | Region::Access::Write);
-        ASSERT(region);
-        m_rx_buffers_regions.append(region.release_nonnull());
-        descriptor.addr = m_rx_buffers_regions[i].physical_page(0)->paddr().get();
+        m_rx_buffers[i] = PacketBuffer::create(rx_buffer_size);
+        ASSERT(m_rx_buffers[i]);
+        descriptor.addr = m_rx_buffers[i]->physical_address().get();
         descriptor.status = 0;
     }
 
@@ -297,7 +296,7 @@ void E1000NetworkAdapter::initialize_rx_descriptors()
     out32(REG_RXDESCHEAD, 0);
     out32(REG_RXDESCTAIL, number_of_rx_descriptors - 1);
 
-    out32(REG_RCTRL, RCTL_EN | RCTL_SBP | RCTL_UPE | RCTL_MPE | RCTL_LBM_NONE | RTCL_RDMTS_HALF | RCTL_BAM | RCTL_SECRC | RCTL_BSIZE_8192);
+    out32(REG_RCTRL, RCTL_EN | RCTL_SBP | RCTL_UPE | RCTL_MPE | RCTL_LBM_NONE | RTCL_RDMTS_HALF | RCTL_BAM | RCTL_SECRC | RCTL_BSIZE_2048);
 }
 
 void E1000NetworkAdapter::initialize_tx_descriptors()
@@ -436,13 +435,22 @@ void E1000NetworkAdapter::receive()
         rx_current = (rx_current + 1) % number_of_rx_descriptors;
         if (!(rx_descriptors[rx_current].status & 1))
             break;
-        auto* buffer = m_rx_buffers_regions[rx_current].vaddr().as_ptr();
+        auto& buffer = m_rx_buffers[rx_current];
         u16 length = rx_descriptors[rx_current].length;
-        ASSERT(length <= 8192);
+        ASSERT(length <= rx_buffer_size);
 #ifdef E1000_DEBUG
-        klog() << "E1000: Received 1 packet @ " << buffer << " (" << length << ") bytes!";
+        klog() << "E1000: Received 1 packet @ " << buffer->data() << " (" << length << ") bytes!";
 #endif
-        did_receive({ buffer, length });
+        // Hand the buffer up the stack and put a fresh one in its place.
+        // If there is none to be had, copying the frame out will have to do.
+        if (auto replacement = PacketBuffer::create(rx_buffer_size)) {
+            buffer->set_size(length);
+            did_receive(buffer.release_nonnull());
+            buffer = move(replacement);
+            rx_descriptors[rx_current].addr = buffer->physical_address().get();
+        } else {
+            did_receive({ buffer->data(), length });
+        }
         rx_descriptors[rx_current].status = 0;
         out32(REG_RXDESCTAIL, rx_current);
     }
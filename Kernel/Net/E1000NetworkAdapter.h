@@ -98,7 +98,6 @@ private:
     VirtualAddress m_mmio_base;
     OwnPtr<Region> m_rx_descriptors_region;
     OwnPtr<Region> m_tx_descriptors_region;
-    NonnullOwnPtrVector<Region> m_rx_buffers_regions;
     NonnullOwnPtrVector<Region> m_tx_buffers_regions;
     OwnPtr<Region> m_mmio_region;
     u8 m_interrupt_line { 0 };
@@ -108,6 +107,11 @@ private:
 
     static const size_t number_of_rx_descriptors = 32;
     static const size_t number_of_tx_descriptors = 8;
+    static const size_t rx_buffer_size = 2048;
+
+    // Received frames are DMA'd straight into packet buffers, which are
+    // handed to the network stack as they are.
+    RefPtr<PacketBuffer> m_rx_buffers[number_of_rx_descriptors];
 
     WaitQueue m_wait_queue;
 };
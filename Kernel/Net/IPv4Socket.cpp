@@ -66,14 +66,12 @@ KResultOr<NonnullRefPtr<Socket>> IPv4Socket::create(int type, int protocol)
 
 IPv4Socket::IPv4Socket(int type, int protocol)
     : Socket(AF_INET, type, protocol)
+    , m_receive_buffer(type == SOCK_STREAM ? stream_receive_buffer_size : 65536)
 {
 #ifdef IPV4_SOCKET_DEBUG
     dbg() << "IPv4Socket{" << this << "} created with type=" << type << ", protocol=" << protocol;
 #endif
     m_buffer_mode = type == SOCK_STREAM ? BufferMode::Bytes : BufferMode::Packets;
-    if (m_buffer_mode == BufferMode::Bytes) {
-        m_scratch_buffer = KBuffer::create_with_size(65536);
-    }
     LOCKER(all_sockets().lock());
     all_sockets().resource().set(this);
 }
@@ -263,14 +261,16 @@ KResultOr<size_t> IPv4Socket::receive_byte_buffered(FileDescription& description
 
     ASSERT(!m_receive_buffer.is_empty());
     int nreceived = m_receive_buffer.read((u8*)buffer, buffer_length);
-    if (nreceived > 0)
+    if (nreceived > 0) {
+        m_bytes_copied += nreceived;
         Thread::current()->did_ipv4_socket_read((size_t)nreceived);
+    }
 
     m_can_read = !m_receive_buffer.is_empty();
     return nreceived;
 }
 
-KResultOr<size_t> IPv4Socket::receive_packet_buffered(FileDescription& description, void* buffer, size_t buffer_length, int flags, Userspace<sockaddr*> addr, Userspace<socklen_t*> addr_length)
+KResultOr<size_t> IPv4Socket::receive_packet_buffered(FileDescription& description, void* buffer, size_t buffer_length, int, Userspace<sockaddr*> addr, Userspace<socklen_t*> addr_length)
 {
     Locker locker(lock());
     ReceivedPacket packet;
@@ -288,11 +288,11 @@ KResultOr<size_t> IPv4Socket::receive_packet_buffered(FileDescription& descripti
             packet = m_receive_queue.take_first();
             m_can_read = !m_receive_queue.is_empty();
 #ifdef IPV4_SOCKET_DEBUG
-            dbg() << "IPv4Socket(" << this << "): recvfrom without blocking " << packet.data.value().size() << " bytes, packets in queue: " << m_receive_queue.size();
+            dbg() << "IPv4Socket(" << this << "): recvfrom without blocking " << packet.data->size() << " bytes, packets in queue: " << m_receive_queue.size();
 #endif
         }
     }
-    if (!packet.data.has_value()) {
+    if (!packet.data) {
         if (protocol_is_disconnected()) {
             dbg() << "IPv4Socket{" << this << "} is protocol-disconnected, returning 0 in recvfrom!";
             return 0;
@@ -314,11 +314,10 @@ KResultOr<size_t> IPv4Socket::receive_packet_buffered(FileDescription& descripti
         packet = m_receive_queue.take_first();
         m_can_read = !m_receive_queue.is_empty();
 #ifdef IPV4_SOCKET_DEBUG
-        dbg() << "IPv4Socket(" << this << "): recvfrom with blocking " << packet.data.value().size() << " bytes, packets in queue: " << m_receive_queue.size();
+        dbg() << "IPv4Socket(" << this << "): recvfrom with blocking " << packet.data->size() << " bytes, packets in queue: " << m_receive_queue.size();
 #endif
     }
-    ASSERT(packet.data.has_value());
-    auto& ipv4_packet = *(const IPv4Packet*)(packet.data.value().data());
+    ASSERT(packet.data);
 
     if (addr) {
 #ifdef IPV4_SOCKET_DEBUG
@@ -337,13 +336,18 @@ KResultOr<size_t> IPv4Socket::receive_packet_buffered(FileDescription& descripti
         copy_to_user(addr_length, &out_length);
     }
 
-    if (type() == SOCK_RAW) {
-        ASSERT(buffer_length >= ipv4_packet.payload_size());
-        memcpy(buffer, ipv4_packet.payload(), ipv4_packet.payload_size());
-        return ipv4_packet.payload_size();
-    }
+    // Whatever doesn't fit is discarded, like with any datagram.
+    auto payload = protocol_payload(*packet.data);
+    size_t nreceived = min(buffer_length, payload.size());
+    memcpy(buffer, payload.data(), nreceived);
+    m_bytes_copied += nreceived;
+    return nreceived;
+}
 
-    return protocol_receive(packet.data.value(), buffer, buffer_length, flags);
+ReadonlyBytes IPv4Socket::protocol_payload(const PacketBuffer& packet_buffer) const
+{
+    auto& ipv4_packet = *(const IPv4Packet*)(packet_buffer.data());
+    return { (const u8*)ipv4_packet.payload(), ipv4_packet.payload_size() };
 }
 
 KResultOr<size_t> IPv4Socket::recvfrom(FileDescription& description, void* buffer, size_t buffer_length, int flags, Userspace<sockaddr*> user_addr, Userspace<socklen_t*> user_addr_length)
@@ -371,26 +375,29 @@ KResultOr<size_t> IPv4Socket::recvfrom(FileDescription& description, void* buffe
     return nreceived;
 }
 
-bool IPv4Socket::did_receive(const IPv4Address& source_address, u16 source_port, KBuffer&& packet)
+bool IPv4Socket::did_receive(const IPv4Address& source_address, u16 source_port, NonnullRefPtr<PacketBuffer> packet)
 {
     LOCKER(lock());
 
     if (is_shut_down_for_reading())
         return false;
 
-    auto packet_size = packet.size();
+    auto packet_size = packet->size();
+    auto payload = protocol_payload(*packet);
+    auto packet_copy_count = packet->copy_count();
 
     if (buffer_mode() == BufferMode::Bytes) {
-        size_t space_in_receive_buffer = m_receive_buffer.space_for_writing();
-        if (packet_size > space_in_receive_buffer) {
+        // Only the payload has to fit, so a peer can fill up the whole window we advertised.
+        if (payload.size() > m_receive_buffer.space_for_writing()) {
             dbg() << "IPv4Socket(" << this << "): did_receive refusing packet since buffer is full.";
             ASSERT(m_can_read);
             return false;
         }
-        auto nreceived_or_error = protocol_receive(packet, m_scratch_buffer.value().data(), m_scratch_buffer.value().size(), 0);
-        if (nreceived_or_error.is_error())
-            return false;
-        m_receive_buffer.write(m_scratch_buffer.value().data(), nreceived_or_error.value());
+        // Stream data is still copied into the receive buffer, since keeping
+        // a whole packet buffer around for every segment would make the
+        // window cost several times as much memory as it holds data.
+        m_receive_buffer.write(payload.data(), payload.size());
+        m_bytes_copied += payload.size();
         m_can_read = !m_receive_buffer.is_empty();
     } else {
         if (m_receive_queue.size() > 2000) {
@@ -400,6 +407,7 @@ bool IPv4Socket::did_receive(const IPv4Address& source_address, u16 source_port,
         m_receive_queue.append({ source_address, source_port, move(packet) });
         m_can_read = true;
     }
+    m_bytes_copied += payload.size() * packet_copy_count;
     m_bytes_received += packet_size;
 #ifdef IPV4_SOCKET_DEBUG
     if (buffer_mode() == BufferMode::Bytes)
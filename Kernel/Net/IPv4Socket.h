@@ -33,6 +33,7 @@
 #include <Kernel/Lock.h>
 #include <Kernel/Net/IPv4.h>
 #include <Kernel/Net/IPv4SocketTuple.h>
+#include <Kernel/Net/PacketBuffer.h>
 #include <Kernel/Net/Socket.h>
 
 namespace Kernel {
@@ -65,7 +66,9 @@ public:
 
     virtual int ioctl(FileDescription&, unsigned request, FlatPtr arg) override;
 
-    bool did_receive(const IPv4Address& peer_address, u16 peer_port, KBuffer&&);
+    // The buffer holds the whole IPv4 packet; the socket keeps a reference to
+    // it rather than copying the payload, where it can.
+    bool did_receive(const IPv4Address& peer_address, u16 peer_port, NonnullRefPtr<PacketBuffer>);
 
     const IPv4Address& local_address() const { return m_local_address; }
     u16 local_port() const { return m_local_port; }
@@ -82,6 +85,10 @@ public:
 
     u8 ttl() const { return m_ttl; }
 
+    // How many bytes of received data have been copied around on their way
+    // from the network adapter to userspace, including the final copy.
+    u64 bytes_copied() const { return m_bytes_copied; }
+
     enum class BufferMode {
         Packets,
         Bytes,
@@ -96,7 +103,7 @@ protected:
 
     virtual KResult protocol_bind() { return KSuccess; }
     virtual KResult protocol_listen() { return KSuccess; }
-    virtual KResultOr<size_t> protocol_receive(const KBuffer&, void*, size_t, int) { return -ENOTIMPL; }
+    virtual ReadonlyBytes protocol_payload(const PacketBuffer&) const;
     virtual KResultOr<size_t> protocol_send(const void*, size_t) { return -ENOTIMPL; }
     virtual KResult protocol_connect(FileDescription&, ShouldBlock) { return KSuccess; }
     virtual int protocol_allocate_local_port() { return 0; }
@@ -107,6 +114,11 @@ protected:
     void set_local_address(IPv4Address address) { m_local_address = address; }
     void set_peer_address(IPv4Address address) { m_peer_address = address; }
 
+    // Stream sockets get a large receive buffer, so TCP can keep a window
+    // big enough for fast links open. It's only backed by memory once used.
+    static constexpr size_t stream_receive_buffer_size = 256 * KiB;
+    size_t receive_buffer_space() const { return m_receive_buffer.space_for_writing(); }
+
 private:
     virtual bool is_ipv4() const override { return true; }
 
@@ -119,7 +131,7 @@ private:
     struct ReceivedPacket {
         IPv4Address peer_address;
         u16 peer_port;
-        Optional<KBuffer> data;
+        RefPtr<PacketBuffer> data;
     };
 
     SinglyLinkedListWithCount<ReceivedPacket> m_receive_queue;
@@ -130,14 +142,13 @@ private:
     u16 m_peer_port { 0 };
 
     u32 m_bytes_received { 0 };
+    u64 m_bytes_copied { 0 };
 
     u8 m_ttl { 64 };
 
     bool m_can_read { false };
 
     BufferMode m_buffer_mode { BufferMode::Packets };
-
-    Optional<KBuffer> m_scratch_buffer;
 };
 
 }
@@ -25,7 +25,11 @@
  */
 
 #include <AK/Singleton.h>
+#include <Kernel/FileSystem/ProcFS.h>
 #include <Kernel/Net/LoopbackAdapter.h>
+#include <Kernel/Random.h>
+
+//#define LOOPBACK_DEBUG
 
 namespace Kernel {
 
@@ -41,6 +45,12 @@ LoopbackAdapter::LoopbackAdapter()
     set_interface_name("loop");
     set_mtu(65536);
     set_mac_address({ 19, 85, 2, 9, 0x55, 0xaa });
+
+    ProcFS::add_sys_string("loopback_drop_rate", m_drop_rate_string, [this] {
+        LOCKER(m_drop_rate_string.lock(), Lock::Mode::Shared);
+        auto drop_rate = m_drop_rate_string.resource().trim_whitespace().to_uint();
+        m_drop_rate = min(drop_rate.value_or(0), 100u);
+    });
 }
 
 LoopbackAdapter::~LoopbackAdapter()
@@ -49,7 +59,17 @@ LoopbackAdapter::~LoopbackAdapter()
 
 void LoopbackAdapter::send_raw(ReadonlyBytes payload)
 {
+    u32 drop_rate = m_drop_rate;
+    if (drop_rate && get_fast_random<u32>() % 100 < drop_rate) {
+#ifdef LOOPBACK_DEBUG
+        dbg() << "LoopbackAdapter: Dropping " << payload.size() << " byte(s).";
+#endif
+        did_drop_packet();
+        return;
+    }
+#ifdef LOOPBACK_DEBUG
     dbg() << "LoopbackAdapter: Sending " << payload.size() << " byte(s) to myself.";
+#endif
     did_receive(payload);
 }
 
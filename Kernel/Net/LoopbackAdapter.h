@@ -26,6 +26,9 @@
 
 #pragma once
 
+#include <AK/Atomic.h>
+#include <AK/String.h>
+#include <Kernel/Lock.h>
 #include <Kernel/Net/NetworkAdapter.h>
 
 namespace Kernel {
@@ -40,6 +43,13 @@ public:
 
     virtual void send_raw(ReadonlyBytes) override;
     virtual const char* class_name() const override { return "LoopbackAdapter"; }
+
+private:
+    // Percentage of packets that are thrown away instead of delivered, to
+    // see how the protocols above cope with loss. Set via the
+    // loopback_drop_rate sysctl.
+    Lockable<String> m_drop_rate_string { "0" };
+    Atomic<u32> m_drop_rate { 0 };
 };
 
 }
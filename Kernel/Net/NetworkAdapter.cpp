@@ -24,6 +24,7 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <AK/HashFunctions.h>
 #include <AK/HashTable.h>
 #include <AK/Singleton.h>
 #include <AK/StringBuilder.h>
@@ -34,6 +35,7 @@
 #include <Kernel/Net/LoopbackAdapter.h>
 #include <Kernel/Net/NetworkAdapter.h>
 #include <Kernel/Random.h>
+#include <Kernel/Scheduler.h>
 #include <Kernel/StdLib.h>
 
 namespace Kernel {
@@ -168,47 +170,110 @@ void NetworkAdapter::send_ipv4_fragmented(const MACAddress& destination_mac, con
     }
 }
 
+// Packets of the same flow always end up in the same queue, so they're
+// processed in order.
+static size_t flow_hash(ReadonlyBytes frame)
+{
+    if (frame.size() < sizeof(EthernetFrameHeader) + sizeof(IPv4Packet))
+        return 0;
+    auto& eth = *(const EthernetFrameHeader*)frame.data();
+    if (eth.ether_type() != EtherType::IPv4)
+        return 0;
+    auto& ipv4 = *(const IPv4Packet*)eth.payload();
+    u32 hash = pair_int_hash(ipv4.source().to_u32(), ipv4.destination().to_u32());
+
+    // Only the first fragment carries the ports.
+    bool is_fragment = ipv4.fragment_offset() || (ipv4.flags() & (u16)IPv4PacketFlags::MoreFragments);
+    bool has_ports = ipv4.protocol() == (u8)IPv4Protocol::TCP || ipv4.protocol() == (u8)IPv4Protocol::UDP;
+    if (!is_fragment && has_ports && frame.size() >= sizeof(EthernetFrameHeader) + sizeof(IPv4Packet) + sizeof(u32))
+        hash = pair_int_hash(hash, *(const u32*)ipv4.payload());
+    return hash;
+}
+
+void NetworkAdapter::set_receive_queue_count(size_t count)
+{
+    ASSERT(count >= 1 && count <= max_receive_queues);
+    m_receive_queue_count = count;
+}
+
 void NetworkAdapter::did_receive(ReadonlyBytes payload)
 {
-    InterruptDisabler disabler;
+    auto buffer = PacketBuffer::copy(payload);
+    if (!buffer) {
+        m_packets_in++;
+        m_bytes_in += payload.size();
+        m_packets_dropped++;
+        return;
+    }
+    did_receive(buffer.release_nonnull());
+}
+
+void NetworkAdapter::did_receive(NonnullRefPtr<PacketBuffer> buffer)
+{
+    static constexpr size_t max_queued_packets = 1024;
+
     m_packets_in++;
-    m_bytes_in += payload.size();
-
-    Optional<KBuffer> buffer;
-
-    if (m_unused_packet_buffers.is_empty()) {
-        buffer = KBuffer::copy(payload.data(), payload.size());
-    } else {
-        buffer = m_unused_packet_buffers.take_first();
-        --m_unused_packet_buffers_count;
-        if (payload.size() <= buffer.value().size()) {
-            memcpy(buffer.value().data(), payload.data(), payload.size());
-            buffer.value().set_size(payload.size());
-        } else {
-            buffer = KBuffer::copy(payload.data(), payload.size());
+    m_bytes_in += buffer->size();
+
+    auto now = Scheduler::time_since_boot();
+    size_t queue_index = m_receive_queue_count > 1 ? flow_hash(buffer->bytes()) % m_receive_queue_count : 0;
+    auto& queue = m_receive_queues[queue_index];
+    bool was_empty;
+    {
+        ScopedSpinLock lock(queue.lock);
+        if (queue.size >= max_queued_packets) {
+            m_packets_dropped++;
+            return;
         }
+        was_empty = queue.packets.is_empty();
+        queue.packets.append({ move(buffer), (u64)now.tv_sec * 1000000 + now.tv_usec });
+        queue.size++;
     }
 
-    m_packet_queue.append(buffer.value());
+    // Whoever processes the queue takes everything that's in it at once,
+    // so they only need to be woken up for the first packet.
+    if (was_empty && on_receive)
+        on_receive(queue_index);
+}
 
-    if (on_receive)
-        on_receive();
+NetworkAdapter::ReceivedPackets NetworkAdapter::take_received_packets(size_t queue_index)
+{
+    auto& queue = m_receive_queues[queue_index];
+    ScopedSpinLock lock(queue.lock);
+    queue.size = 0;
+    return move(queue.packets);
 }
 
-size_t NetworkAdapter::dequeue_packet(u8* buffer, size_t buffer_size)
+void NetworkAdapter::did_process_packets(size_t queue_index, u64 total_latency, u32 max_latency)
 {
-    InterruptDisabler disabler;
-    if (m_packet_queue.is_empty())
-        return 0;
-    auto packet = m_packet_queue.take_first();
-    size_t packet_size = packet.size();
-    ASSERT(packet_size <= buffer_size);
-    memcpy(buffer, packet.data(), packet_size);
-    if (m_unused_packet_buffers_count < 100) {
-        m_unused_packet_buffers.append(packet);
-        ++m_unused_packet_buffers_count;
-    }
-    return packet_size;
+    auto& queue = m_receive_queues[queue_index];
+    queue.batches++;
+    queue.total_latency += total_latency;
+    queue.max_latency = max(queue.max_latency, max_latency);
+}
+
+u32 NetworkAdapter::batches_processed() const
+{
+    u32 batches = 0;
+    for (size_t i = 0; i < m_receive_queue_count; ++i)
+        batches += m_receive_queues[i].batches;
+    return batches;
+}
+
+u64 NetworkAdapter::total_processing_latency() const
+{
+    u64 latency = 0;
+    for (size_t i = 0; i < m_receive_queue_count; ++i)
+        latency += m_receive_queues[i].total_latency;
+    return latency;
+}
+
+u32 NetworkAdapter::max_processing_latency() const
+{
+    u32 latency = 0;
+    for (size_t i = 0; i < m_receive_queue_count; ++i)
+        latency = max(latency, m_receive_queues[i].max_latency);
+    return latency;
 }
 
 void NetworkAdapter::set_ipv4_address(const IPv4Address& address)
@@ -26,6 +26,7 @@
 
 #pragma once
 
+#include <AK/Atomic.h>
 #include <AK/ByteBuffer.h>
 #include <AK/Function.h>
 #include <AK/MACAddress.h>
@@ -37,6 +38,8 @@
 #include <Kernel/Net/ARP.h>
 #include <Kernel/Net/ICMP.h>
 #include <Kernel/Net/IPv4.h>
+#include <Kernel/Net/PacketBuffer.h>
+#include <Kernel/SpinLock.h>
 
 namespace Kernel {
 
@@ -66,19 +69,40 @@ public:
     void send_ipv4(const MACAddress&, const IPv4Address&, IPv4Protocol, ReadonlyBytes payload, u8 ttl);
     void send_ipv4_fragmented(const MACAddress&, const IPv4Address&, IPv4Protocol, ReadonlyBytes payload, u8 ttl);
 
-    size_t dequeue_packet(u8* buffer, size_t buffer_size);
+    // Received packets are spread over several queues by flow, so that they
+    // can be processed in parallel without reordering any connection's packets.
+    static constexpr size_t max_receive_queues = 4;
 
-    bool has_queued_packets() const { return !m_packet_queue.is_empty(); }
+    struct ReceivedPacket {
+        NonnullRefPtr<PacketBuffer> buffer;
+        u64 received_at { 0 }; // Microseconds since boot.
+    };
+    typedef SinglyLinkedList<ReceivedPacket> ReceivedPackets;
+
+    size_t receive_queue_count() const { return m_receive_queue_count; }
+    void set_receive_queue_count(size_t);
+
+    // Takes all the packets waiting in a queue at once.
+    ReceivedPackets take_received_packets(size_t queue);
+    void did_process_packets(size_t queue, u64 total_latency, u32 max_latency);
 
     u32 mtu() const { return m_mtu; }
     void set_mtu(u32 mtu) { m_mtu = mtu; }
 
-    u32 packets_in() const { return m_packets_in; }
-    u32 bytes_in() const { return m_bytes_in; }
-    u32 packets_out() const { return m_packets_out; }
-    u32 bytes_out() const { return m_bytes_out; }
+    u32 packets_in() const { return m_packets_in.load(); }
+    u32 bytes_in() const { return m_bytes_in.load(); }
+    u32 packets_out() const { return m_packets_out.load(); }
+    u32 bytes_out() const { return m_bytes_out.load(); }
+    u32 packets_dropped() const { return m_packets_dropped.load(); }
+
+    // How long received packets waited in the queues before they were
+    // processed, in microseconds, and in how many batches they were processed.
+    u32 batches_processed() const;
+    u64 total_processing_latency() const;
+    u32 max_processing_latency() const;
 
-    Function<void()> on_receive;
+    // Called with the number of the queue that went from empty to non-empty.
+    Function<void(size_t queue)> on_receive;
 
 protected:
     NetworkAdapter();
@@ -86,20 +110,36 @@ protected:
     void set_mac_address(const MACAddress& mac_address) { m_mac_address = mac_address; }
     virtual void send_raw(ReadonlyBytes) = 0;
     void did_receive(ReadonlyBytes);
+    // Adapters that can receive directly into a PacketBuffer hand it over
+    // with this, so it doesn't have to be copied.
+    void did_receive(NonnullRefPtr<PacketBuffer>);
+    void did_drop_packet() { m_packets_dropped++; }
 
 private:
     MACAddress m_mac_address;
     IPv4Address m_ipv4_address;
     IPv4Address m_ipv4_netmask;
     IPv4Address m_ipv4_gateway;
-    SinglyLinkedList<KBuffer> m_packet_queue;
-    SinglyLinkedList<KBuffer> m_unused_packet_buffers;
-    size_t m_unused_packet_buffers_count { 0 };
+
+    struct ReceiveQueue {
+        SpinLock<u8> lock;
+        ReceivedPackets packets;
+        size_t size { 0 };
+
+        // Only touched by the thread processing this queue.
+        u32 batches { 0 };
+        u64 total_latency { 0 };
+        u32 max_latency { 0 };
+    };
+    ReceiveQueue m_receive_queues[max_receive_queues];
+    size_t m_receive_queue_count { 1 };
+
     String m_name;
-    u32 m_packets_in { 0 };
-    u32 m_bytes_in { 0 };
-    u32 m_packets_out { 0 };
-    u32 m_bytes_out { 0 };
+    Atomic<u32> m_packets_in { 0 };
+    Atomic<u32> m_bytes_in { 0 };
+    Atomic<u32> m_packets_out { 0 };
+    Atomic<u32> m_bytes_out { 0 };
+    Atomic<u32> m_packets_dropped { 0 };
     u32 m_mtu { 1500 };
 };
 
@@ -24,6 +24,7 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <AK/Atomic.h>
 #include <Kernel/Lock.h>
 #include <Kernel/Net/ARP.h>
 #include <Kernel/Net/EtherType.h>
@@ -39,6 +40,7 @@
 #include <Kernel/Net/UDP.h>
 #include <Kernel/Net/UDPSocket.h>
 #include <Kernel/Process.h>
+#include <Kernel/Scheduler.h>
 
 //#define NETWORK_TASK_DEBUG
 //#define ETHERNET_DEBUG
@@ -52,24 +54,34 @@
 namespace Kernel {
 
 static void handle_arp(const EthernetFrameHeader&, size_t frame_size);
-static void handle_ipv4(const EthernetFrameHeader&, size_t frame_size);
-static void handle_icmp(const EthernetFrameHeader&, const IPv4Packet&);
-static void handle_udp(const IPv4Packet&);
-static void handle_tcp(const IPv4Packet&);
+static void handle_ipv4(PacketBuffer&);
+static void handle_icmp(const EthernetFrameHeader&, const IPv4Packet&, PacketBuffer&);
+static void handle_udp(const IPv4Packet&, PacketBuffer&);
+static void handle_tcp(const IPv4Packet&, PacketBuffer&);
+
+static void handle_frame(PacketBuffer&);
 
 [[noreturn]] static void NetworkTask_main();
 
+// One of these processes the packets of each receive queue of each adapter.
+struct NetworkWorker {
+    NetworkAdapter* adapter { nullptr };
+    size_t queue { 0 };
+    u32 affinity { THREAD_AFFINITY_DEFAULT };
+    Atomic<bool> claimed { false };
+    WaitQueue wait_queue;
+};
+
+static NetworkWorker* s_workers;
+static size_t s_worker_count;
+static Atomic<bool> s_timer_expired;
+
 void NetworkTask::spawn()
 {
-    Thread* thread = nullptr;
-    Process::create_kernel_process(thread, "NetworkTask", NetworkTask_main);
-}
+    size_t queue_count = min(Processor::count(), NetworkAdapter::max_receive_queues);
 
-void NetworkTask_main()
-{
-    WaitQueue packet_wait_queue;
     u8 octet = 15;
-    int pending_packets = 0;
+    Vector<NetworkAdapter*> adapters;
     NetworkAdapter::for_each([&](auto& adapter) {
         if (String(adapter.class_name()) == "LoopbackAdapter") {
             adapter.set_ipv4_address({ 127, 0, 0, 1 });
@@ -83,82 +95,157 @@ void NetworkTask_main()
 
         klog() << "NetworkTask: " << adapter.class_name() << " network adapter found: hw=" << adapter.mac_address().to_string().characters() << " address=" << adapter.ipv4_address().to_string().characters() << " netmask=" << adapter.ipv4_netmask().to_string().characters() << " gateway=" << adapter.ipv4_gateway().to_string().characters();
 
-        adapter.on_receive = [&]() {
-            pending_packets++;
-            packet_wait_queue.wake_all();
-        };
+        adapter.set_receive_queue_count(queue_count);
+        adapters.append(&adapter);
     });
 
-    auto dequeue_packet = [&pending_packets](u8* buffer, size_t buffer_size) -> size_t {
-        if (pending_packets == 0)
-            return 0;
-        size_t packet_size = 0;
-        NetworkAdapter::for_each([&](auto& adapter) {
-            if (packet_size || !adapter.has_queued_packets())
-                return;
-            packet_size = adapter.dequeue_packet(buffer, buffer_size);
-            pending_packets--;
+    // Process timers even if there are no adapters at all.
+    s_worker_count = max<size_t>(adapters.size() * queue_count, 1);
+    s_workers = new NetworkWorker[s_worker_count];
+
+    // Keep each queue on its own CPU, so that a flow's packets are always
+    // processed on the same one.
+    for (size_t i = 0; i < s_worker_count; ++i) {
+        if (queue_count > 1)
+            s_workers[i].affinity = 1u << (i % queue_count);
+    }
+
+    for (size_t i = 0; i < adapters.size(); ++i) {
+        for (size_t queue = 0; queue < queue_count; ++queue) {
+            auto& worker = s_workers[i * queue_count + queue];
+            worker.adapter = adapters[i];
+            worker.queue = queue;
+        }
+        size_t first_worker = i * queue_count;
+        adapters[i]->on_receive = [first_worker](size_t queue) {
+            s_workers[first_worker + queue].wait_queue.wake_all();
+        };
+    }
+
+    Thread* thread = nullptr;
+    auto process = Process::create_kernel_process(thread, "NetworkTask", NetworkTask_main, s_workers[0].affinity);
+    for (size_t i = 1; i < s_worker_count; ++i)
+        process->create_kernel_thread(NetworkTask_main, THREAD_PRIORITY_NORMAL, String::format("NetworkTask [%zu]", i), s_workers[i].affinity, false);
+}
+
+// Kernel thread entry points don't take an argument, so every thread picks
+// the first unclaimed worker that was meant for the CPUs it is pinned to.
+// Since there is exactly one thread per worker, created with that worker's
+// affinity, this always finds one, and the queue ends up on the right CPU
+// no matter in which order the threads get to run.
+static size_t claim_worker()
+{
+    u32 affinity = Thread::current()->affinity();
+    for (size_t i = 0; i < s_worker_count; ++i) {
+        if (s_workers[i].affinity != affinity)
+            continue;
+        bool expected = false;
+        if (s_workers[i].claimed.compare_exchange_strong(expected, true))
+            return i;
+    }
+    ASSERT_NOT_REACHED();
+}
+
+void NetworkTask::did_expire_timer()
+{
+    s_timer_expired.store(true);
+    if (s_workers)
+        s_workers[0].wait_queue.wake_all();
+}
+
+void NetworkTask_main()
+{
+    size_t worker_index = claim_worker();
+    auto& worker = s_workers[worker_index];
+
 #ifdef NETWORK_TASK_DEBUG
-            klog() << "NetworkTask: Dequeued packet from " << adapter.name().characters() << " (" << packet_size << " bytes)";
+    if (worker.adapter)
+        klog() << "NetworkTask: Worker " << worker_index << " processing queue " << worker.queue << " of " << worker.adapter->name().characters();
 #endif
-        });
-        return packet_size;
-    };
-
-    size_t buffer_size = 64 * KiB;
-    auto buffer_region = MM.allocate_kernel_region(buffer_size, "Kernel Packet Buffer", Region::Access::Read | Region::Access::Write, false, true);
-    auto buffer = (u8*)buffer_region->vaddr().get();
 
     klog() << "NetworkTask: Enter main loop.";
     for (;;) {
-        size_t packet_size = dequeue_packet(buffer, buffer_size);
-        if (!packet_size) {
-            Thread::current()->wait_on(packet_wait_queue, "NetworkTask");
+        if (worker_index == 0 && s_timer_expired.exchange(false))
+            TCPSocket::process_expired_timers();
+
+        if (!worker.adapter) {
+            Thread::current()->wait_on(worker.wait_queue, "NetworkTask");
             continue;
         }
-        if (packet_size < sizeof(EthernetFrameHeader)) {
-            klog() << "NetworkTask: Packet is too small to be an Ethernet packet! (" << packet_size << ")";
+
+        // Process everything that arrived since we last looked in one go.
+        auto packets = worker.adapter->take_received_packets(worker.queue);
+        if (packets.is_empty()) {
+            Thread::current()->wait_on(worker.wait_queue, "NetworkTask");
             continue;
         }
-        auto& eth = *(const EthernetFrameHeader*)buffer;
-#ifdef ETHERNET_DEBUG
-        klog() << "NetworkTask: From " << eth.source().to_string().characters() << " to " << eth.destination().to_string().characters() << ", ether_type=" << String::format("%w", eth.ether_type()) << ", packet_length=" << packet_size;
-#endif
 
-#ifdef ETHERNET_VERY_DEBUG
-        for (size_t i = 0; i < packet_size; i++) {
-            klog() << String::format("%b", buffer[i]);
-
-            switch (i % 16) {
-            case 7:
-                klog() << "  ";
-                break;
-            case 15:
-                klog() << "";
-                break;
-            default:
-                klog() << " ";
-                break;
-            }
+        auto now = Scheduler::time_since_boot();
+        u64 now_us = (u64)now.tv_sec * 1000000 + now.tv_usec;
+        size_t count = 0;
+        u64 total_latency = 0;
+        u32 max_latency = 0;
+        for (auto& packet : packets) {
+            u32 latency = now_us > packet.received_at ? now_us - packet.received_at : 0;
+            total_latency += latency;
+            max_latency = max(max_latency, latency);
+            ++count;
+
+            handle_frame(packet.buffer);
         }
+#ifdef NETWORK_TASK_DEBUG
+        klog() << "NetworkTask: Processed " << count << " packets from " << worker.adapter->name().characters() << " queue " << worker.queue;
+#endif
+        worker.adapter->did_process_packets(worker.queue, total_latency, max_latency);
+    }
+}
+
+void handle_frame(PacketBuffer& buffer)
+{
+    size_t packet_size = buffer.size();
+    if (packet_size < sizeof(EthernetFrameHeader)) {
+        klog() << "NetworkTask: Packet is too small to be an Ethernet packet! (" << packet_size << ")";
+        return;
+    }
+    auto& eth = *(const EthernetFrameHeader*)buffer.data();
 
-        klog() << "";
+#ifdef ETHERNET_DEBUG
+    klog() << "NetworkTask: From " << eth.source().to_string().characters() << " to " << eth.destination().to_string().characters() << ", ether_type=" << String::format("%w", eth.ether_type()) << ", packet_length=" << packet_size;
 #endif
 
-        switch (eth.ether_type()) {
-        case EtherType::ARP:
-            handle_arp(eth, packet_size);
-            break;
-        case EtherType::IPv4:
-            handle_ipv4(eth, packet_size);
+#ifdef ETHERNET_VERY_DEBUG
+    for (size_t i = 0; i < packet_size; i++) {
+        klog() << String::format("%b", buffer.data()[i]);
+
+        switch (i % 16) {
+        case 7:
+            klog() << "  ";
             break;
-        case EtherType::IPv6:
-            // ignore
+        case 15:
+            klog() << "";
             break;
         default:
-            klog() << "NetworkTask: Unknown ethernet type 0x" << String::format("%x", eth.ether_type());
+            klog() << " ";
+            break;
         }
     }
+
+    klog() << "";
+#endif
+
+    switch (eth.ether_type()) {
+    case EtherType::ARP:
+        handle_arp(eth, packet_size);
+        break;
+    case EtherType::IPv4:
+        handle_ipv4(buffer);
+        break;
+    case EtherType::IPv6:
+        // ignore
+        break;
+    default:
+        klog() << "NetworkTask: Unknown ethernet type 0x" << String::format("%x", eth.ether_type());
+    }
 }
 
 void handle_arp(const EthernetFrameHeader& eth, size_t frame_size)
@@ -213,8 +300,10 @@ void handle_arp(const EthernetFrameHeader& eth, size_t frame_size)
     }
 }
 
-void handle_ipv4(const EthernetFrameHeader& eth, size_t frame_size)
+void handle_ipv4(PacketBuffer& buffer)
 {
+    auto& eth = *(const EthernetFrameHeader*)buffer.data();
+    size_t frame_size = buffer.size();
     constexpr size_t minimum_ipv4_frame_size = sizeof(EthernetFrameHeader) + sizeof(IPv4Packet);
     if (frame_size < minimum_ipv4_frame_size) {
         klog() << "handle_ipv4: Frame too small (" << frame_size << ", need " << minimum_ipv4_frame_size << ")";
@@ -237,20 +326,25 @@ void handle_ipv4(const EthernetFrameHeader& eth, size_t frame_size)
     klog() << "handle_ipv4: source=" << packet.source().to_string().characters() << ", target=" << packet.destination().to_string().characters();
 #endif
 
+    // From here on the buffer holds just the IPv4 packet, which is what
+    // sockets keep a reference to. The Ethernet header stays where it is.
+    buffer.pull(sizeof(EthernetFrameHeader));
+    buffer.set_size(packet.length());
+
     switch ((IPv4Protocol)packet.protocol()) {
     case IPv4Protocol::ICMP:
-        return handle_icmp(eth, packet);
+        return handle_icmp(eth, packet, buffer);
     case IPv4Protocol::UDP:
-        return handle_udp(packet);
+        return handle_udp(packet, buffer);
     case IPv4Protocol::TCP:
-        return handle_tcp(packet);
+        return handle_tcp(packet, buffer);
     default:
         klog() << "handle_ipv4: Unhandled protocol " << packet.protocol();
         break;
     }
 }
 
-void handle_icmp(const EthernetFrameHeader& eth, const IPv4Packet& ipv4_packet)
+void handle_icmp(const EthernetFrameHeader& eth, const IPv4Packet& ipv4_packet, PacketBuffer& buffer)
 {
     auto& icmp_header = *static_cast<const ICMPHeader*>(ipv4_packet.payload());
 #ifdef ICMP_DEBUG
@@ -263,7 +357,7 @@ void handle_icmp(const EthernetFrameHeader& eth, const IPv4Packet& ipv4_packet)
             LOCKER(socket->lock());
             if (socket->protocol() != (unsigned)IPv4Protocol::ICMP)
                 continue;
-            socket->did_receive(ipv4_packet.source(), 0, KBuffer::copy(&ipv4_packet, sizeof(IPv4Packet) + ipv4_packet.payload_size()));
+            socket->did_receive(ipv4_packet.source(), 0, buffer);
         }
     }
 
@@ -275,8 +369,8 @@ void handle_icmp(const EthernetFrameHeader& eth, const IPv4Packet& ipv4_packet)
         auto& request = reinterpret_cast<const ICMPEchoPacket&>(icmp_header);
         klog() << "handle_icmp: EchoRequest from " << ipv4_packet.source().to_string().characters() << ": id=" << (u16)request.identifier << ", seq=" << (u16)request.sequence_number;
         size_t icmp_packet_size = ipv4_packet.payload_size();
-        auto buffer = ByteBuffer::create_zeroed(icmp_packet_size);
-        auto& response = *(ICMPEchoPacket*)buffer.data();
+        auto response_buffer = ByteBuffer::create_zeroed(icmp_packet_size);
+        auto& response = *(ICMPEchoPacket*)response_buffer.data();
         response.header.set_type(ICMPType::EchoReply);
         response.header.set_code(0);
         response.identifier = request.identifier;
@@ -285,11 +379,11 @@ void handle_icmp(const EthernetFrameHeader& eth, const IPv4Packet& ipv4_packet)
             memcpy(response.payload(), request.payload(), icmp_payload_size);
         response.header.set_checksum(internet_checksum(&response, icmp_packet_size));
         // FIXME: What is the right TTL value here? Is 64 ok? Should we use the same TTL as the echo request?
-        adapter->send_ipv4(eth.source(), ipv4_packet.source(), IPv4Protocol::ICMP, buffer, 64);
+        adapter->send_ipv4(eth.source(), ipv4_packet.source(), IPv4Protocol::ICMP, response_buffer, 64);
     }
 }
 
-void handle_udp(const IPv4Packet& ipv4_packet)
+void handle_udp(const IPv4Packet& ipv4_packet, PacketBuffer& buffer)
 {
     if (ipv4_packet.payload_size() < sizeof(UDPPacket)) {
         klog() << "handle_udp: Packet too small (" << ipv4_packet.payload_size() << ", need " << sizeof(UDPPacket) << ")";
@@ -315,10 +409,10 @@ void handle_udp(const IPv4Packet& ipv4_packet)
 
     ASSERT(socket->type() == SOCK_DGRAM);
     ASSERT(socket->local_port() == udp_packet.destination_port());
-    socket->did_receive(ipv4_packet.source(), udp_packet.source_port(), KBuffer::copy(&ipv4_packet, sizeof(IPv4Packet) + ipv4_packet.payload_size()));
+    socket->did_receive(ipv4_packet.source(), udp_packet.source_port(), buffer);
 }
 
-void handle_tcp(const IPv4Packet& ipv4_packet)
+void handle_tcp(const IPv4Packet& ipv4_packet, PacketBuffer& buffer)
 {
     if (ipv4_packet.payload_size() < sizeof(TCPPacket)) {
         klog() << "handle_tcp: IPv4 payload is too small to be a TCP packet (" << ipv4_packet.payload_size() << ", need " << sizeof(TCPPacket) << ")";
@@ -370,6 +464,10 @@ void handle_tcp(const IPv4Packet& ipv4_packet)
     klog() << "handle_tcp: got socket; state=" << socket->tuple().to_string().characters() << " " << TCPSocket::to_string(socket->state());
 #endif
 
+    // Packets of one connection are always processed by the same thread, but
+    // a listening socket sees packets from all of them.
+    LOCKER(socket->lock());
+
     socket->receive_tcp_packet(tcp_packet, ipv4_packet.payload_size());
 
     switch (socket->state()) {
@@ -400,6 +498,7 @@ void handle_tcp(const IPv4Packet& ipv4_packet)
 #endif
             client->set_sequence_number(1000);
             client->set_ack_number(tcp_packet.sequence_number() + payload_size + 1);
+            client->process_syn_options(tcp_packet);
             client->send_tcp_packet(TCPFlags::SYN | TCPFlags::ACK);
             client->set_state(TCPSocket::State::SynReceived);
             return;
@@ -413,11 +512,13 @@ void handle_tcp(const IPv4Packet& ipv4_packet)
         switch (tcp_packet.flags()) {
         case TCPFlags::SYN:
             socket->set_ack_number(tcp_packet.sequence_number() + payload_size + 1);
+            socket->process_syn_options(tcp_packet);
             socket->send_tcp_packet(TCPFlags::ACK);
             socket->set_state(TCPSocket::State::SynReceived);
             return;
         case TCPFlags::ACK | TCPFlags::SYN:
             socket->set_ack_number(tcp_packet.sequence_number() + payload_size + 1);
+            socket->process_syn_options(tcp_packet);
             socket->send_tcp_packet(TCPFlags::ACK);
             socket->set_state(TCPSocket::State::Established);
             socket->set_setup_state(Socket::SetupState::Completed);
@@ -447,6 +548,9 @@ void handle_tcp(const IPv4Packet& ipv4_packet)
         }
     case TCPSocket::State::SynReceived:
         switch (tcp_packet.flags()) {
+        case TCPFlags::SYN:
+            // The peer didn't get our SYN|ACK yet. It's retransmitted on a timer.
+            return;
         case TCPFlags::ACK:
             socket->set_ack_number(tcp_packet.sequence_number() + payload_size);
 
@@ -494,7 +598,8 @@ void handle_tcp(const IPv4Packet& ipv4_packet)
         switch (tcp_packet.flags()) {
         case TCPFlags::ACK:
             socket->set_ack_number(tcp_packet.sequence_number() + payload_size);
-            socket->set_state(TCPSocket::State::Closed);
+            if (!socket->has_unacknowledged_data())
+                socket->set_state(TCPSocket::State::Closed);
             return;
         default:
             klog() << "handle_tcp: unexpected flags in LastAck state";
@@ -506,11 +611,18 @@ void handle_tcp(const IPv4Packet& ipv4_packet)
         switch (tcp_packet.flags()) {
         case TCPFlags::ACK:
             socket->set_ack_number(tcp_packet.sequence_number() + payload_size);
-            socket->set_state(TCPSocket::State::FinWait2);
+            // This may just be acknowledging data we sent before our FIN.
+            if (!socket->has_unacknowledged_data())
+                socket->set_state(TCPSocket::State::FinWait2);
             return;
         case TCPFlags::FIN:
+        case TCPFlags::FIN | TCPFlags::ACK:
             socket->set_ack_number(tcp_packet.sequence_number() + payload_size + 1);
-            socket->set_state(TCPSocket::State::Closing);
+            socket->send_tcp_packet(TCPFlags::ACK);
+            if (tcp_packet.has_ack() && !socket->has_unacknowledged_data())
+                socket->set_state(TCPSocket::State::TimeWait);
+            else
+                socket->set_state(TCPSocket::State::Closing);
             return;
         default:
             klog() << "handle_tcp: unexpected flags in FinWait1 state";
@@ -520,8 +632,13 @@ void handle_tcp(const IPv4Packet& ipv4_packet)
         }
     case TCPSocket::State::FinWait2:
         switch (tcp_packet.flags()) {
+        case TCPFlags::ACK:
+            // Window updates and the like are fine, we're only waiting for a FIN.
+            return;
         case TCPFlags::FIN:
+        case TCPFlags::FIN | TCPFlags::ACK:
             socket->set_ack_number(tcp_packet.sequence_number() + payload_size + 1);
+            socket->send_tcp_packet(TCPFlags::ACK);
             socket->set_state(TCPSocket::State::TimeWait);
             return;
         case TCPFlags::ACK | TCPFlags::RST:
@@ -537,7 +654,8 @@ void handle_tcp(const IPv4Packet& ipv4_packet)
         switch (tcp_packet.flags()) {
         case TCPFlags::ACK:
             socket->set_ack_number(tcp_packet.sequence_number() + payload_size);
-            socket->set_state(TCPSocket::State::TimeWait);
+            if (!socket->has_unacknowledged_data())
+                socket->set_state(TCPSocket::State::TimeWait);
             return;
         default:
             klog() << "handle_tcp: unexpected flags in Closing state";
@@ -546,10 +664,26 @@ void handle_tcp(const IPv4Packet& ipv4_packet)
             return;
         }
     case TCPSocket::State::Established:
-        if (tcp_packet.has_fin()) {
-            if (payload_size != 0)
-                socket->did_receive(ipv4_packet.source(), tcp_packet.source_port(), KBuffer::copy(&ipv4_packet, sizeof(IPv4Packet) + ipv4_packet.payload_size()));
+        if ((payload_size || tcp_packet.has_fin()) && tcp_packet.sequence_number() != socket->ack_number()) {
+            // Keep segments from beyond a gap around for later, and let the
+            // peer know what we're still waiting for with a duplicate ACK.
+#ifdef TCP_DEBUG
+            klog() << "handle_tcp: out-of-order segment seq_no=" << tcp_packet.sequence_number() << ", expected " << socket->ack_number();
+#endif
+            socket->queue_out_of_order_segment(buffer, tcp_packet, payload_size);
+            socket->send_tcp_packet(TCPFlags::ACK);
+            return;
+        }
+
+        if (payload_size) {
+            if (!socket->did_receive(ipv4_packet.source(), tcp_packet.source_port(), buffer)) {
+                // No room for it; the peer will have to send it again.
+                socket->send_tcp_packet(TCPFlags::ACK);
+                return;
+            }
+        }
 
+        if (tcp_packet.has_fin()) {
             socket->set_ack_number(tcp_packet.sequence_number() + payload_size + 1);
             socket->send_tcp_packet(TCPFlags::ACK);
             socket->set_state(TCPSocket::State::CloseWait);
@@ -557,16 +691,25 @@ void handle_tcp(const IPv4Packet& ipv4_packet)
             return;
         }
 
+        if (!payload_size) {
+            // A SYN|ACK showing up again means our ACK of it got lost.
+            if (tcp_packet.has_syn())
+                socket->send_tcp_packet(TCPFlags::ACK);
+            return;
+        }
+
         socket->set_ack_number(tcp_packet.sequence_number() + payload_size);
+        bool did_fill_gap = socket->deliver_out_of_order_segments();
 
 #ifdef TCP_DEBUG
         klog() << "Got packet with ack_no=" << tcp_packet.ack_number() << ", seq_no=" << tcp_packet.sequence_number() << ", payload_size=" << payload_size << ", acking it with new ack_no=" << socket->ack_number() << ", seq_no=" << socket->sequence_number();
 #endif
 
-        if (payload_size) {
-            if (socket->did_receive(ipv4_packet.source(), tcp_packet.source_port(), KBuffer::copy(&ipv4_packet, sizeof(IPv4Packet) + ipv4_packet.payload_size())))
-                socket->send_tcp_packet(TCPFlags::ACK);
-        }
+        // The peer is in loss recovery if we had a gap, so it gets its ACK right away.
+        if (did_fill_gap)
+            socket->send_tcp_packet(TCPFlags::ACK);
+        else
+            socket->delay_ack();
     }
 }
 
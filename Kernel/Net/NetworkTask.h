@@ -30,5 +30,9 @@ namespace Kernel {
 class NetworkTask {
 public:
     static void spawn();
+
+    // Wakes NetworkTask up to deal with expired protocol timers. This is
+    // safe to call from IRQ context, i.e. from a TimerQueue callback.
+    static void did_expire_timer();
 };
 }
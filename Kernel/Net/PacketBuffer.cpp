@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <AK/NonnullOwnPtrVector.h>
+#include <AK/Singleton.h>
+#include <AK/StringView.h>
+#include <Kernel/Net/PacketBuffer.h>
+#include <Kernel/SpinLock.h>
+#include <Kernel/StdLib.h>
+#include <Kernel/VM/MemoryManager.h>
+
+namespace Kernel {
+
+// Enough to refill a few receive rings a couple of times over.
+static constexpr size_t max_pooled_buffers = 256;
+
+struct PacketBufferPool {
+    PacketBufferPool()
+    {
+        free_regions.ensure_capacity(max_pooled_buffers);
+    }
+
+    SpinLock<u8> lock;
+    NonnullOwnPtrVector<Region> free_regions;
+};
+
+static AK::Singleton<PacketBufferPool> s_pool;
+
+RefPtr<PacketBuffer> PacketBuffer::create(size_t capacity)
+{
+    if (capacity > pooled_capacity) {
+        auto region = MM.allocate_kernel_region(PAGE_ROUND_UP(headroom + capacity), "Packet Buffer", Region::Access::Read | Region::Access::Write);
+        if (!region)
+            return nullptr;
+        return adopt(*new PacketBuffer(region.release_nonnull(), false));
+    }
+
+    {
+        ScopedSpinLock lock(s_pool->lock);
+        if (!s_pool->free_regions.is_empty())
+            return adopt(*new PacketBuffer(s_pool->free_regions.take_last(), true));
+    }
+
+    auto region = MM.allocate_contiguous_kernel_region(PAGE_SIZE, "Packet Buffer", Region::Access::Read | Region::Access::Write);
+    if (!region)
+        return nullptr;
+    return adopt(*new PacketBuffer(region.release_nonnull(), true));
+}
+
+RefPtr<PacketBuffer> PacketBuffer::copy(ReadonlyBytes bytes)
+{
+    auto buffer = create(bytes.size());
+    if (!buffer)
+        return nullptr;
+    memcpy(buffer->data(), bytes.data(), bytes.size());
+    buffer->set_size(bytes.size());
+    buffer->m_copy_count = 1;
+    return buffer;
+}
+
+PacketBuffer::PacketBuffer(NonnullOwnPtr<Region>&& region, bool pooled)
+    : m_region(move(region))
+    , m_pooled(pooled)
+{
+}
+
+PhysicalAddress PacketBuffer::physical_address() const
+{
+    ASSERT(m_pooled);
+    return m_region->physical_page(0)->paddr().offset(m_offset);
+}
+
+PacketBuffer::~PacketBuffer()
+{
+    if (!m_pooled)
+        return;
+    ScopedSpinLock lock(s_pool->lock);
+    if (s_pool->free_regions.size() < max_pooled_buffers)
+        s_pool->free_regions.append(move(m_region));
+}
+
+}
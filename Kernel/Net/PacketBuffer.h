@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <AK/RefCounted.h>
+#include <AK/RefPtr.h>
+#include <AK/Span.h>
+#include <Kernel/PhysicalAddress.h>
+#include <Kernel/VM/Region.h>
+
+namespace Kernel {
+
+// A PacketBuffer holds one packet on its way through the network stack.
+// Everyone who needs to hang on to the packet (a receive queue, a socket,
+// TCP's out-of-order queue, ...) holds a reference to the same buffer
+// instead of making a copy of it.
+//
+// Buffers of up to pooled_capacity bytes are a single page, which network
+// adapters can DMA received frames into directly. They're kept in a pool
+// when they're no longer referenced, so refilling an adapter's receive
+// ring doesn't have to go through the memory manager.
+class PacketBuffer : public RefCounted<PacketBuffer> {
+public:
+    // Room in front of the data, so headers can be put in front of it
+    // without moving what's there already.
+    static constexpr size_t headroom = 128;
+    static constexpr size_t pooled_capacity = PAGE_SIZE - headroom;
+
+    static RefPtr<PacketBuffer> create(size_t capacity);
+    static RefPtr<PacketBuffer> copy(ReadonlyBytes);
+
+    ~PacketBuffer();
+
+    u8* data() { return m_region->vaddr().offset(m_offset).as_ptr(); }
+    const u8* data() const { return m_region->vaddr().offset(m_offset).as_ptr(); }
+    size_t size() const { return m_size; }
+    size_t capacity() const { return m_region->size() - m_offset; }
+    ReadonlyBytes bytes() const { return { data(), size() }; }
+
+    void set_size(size_t size)
+    {
+        ASSERT(size <= capacity());
+        m_size = size;
+    }
+
+    // Removes a header from the front of the data.
+    void pull(size_t size)
+    {
+        ASSERT(size <= m_size);
+        m_offset += size;
+        m_size -= size;
+    }
+
+    // Makes room for a header in front of the data.
+    void push(size_t size)
+    {
+        ASSERT(size <= m_offset);
+        m_offset -= size;
+        m_size += size;
+    }
+
+    // Where to DMA into data(). Only pooled buffers are physically contiguous.
+    PhysicalAddress physical_address() const;
+
+    // How many times the data was copied to get into this buffer; zero if an
+    // adapter received it here directly.
+    u8 copy_count() const { return m_copy_count; }
+
+private:
+    PacketBuffer(NonnullOwnPtr<Region>&&, bool pooled);
+
+    NonnullOwnPtr<Region> m_region;
+    size_t m_offset { headroom };
+    size_t m_size { 0 };
+    bool m_pooled { false };
+    u8 m_copy_count { 0 };
+};
+
+}
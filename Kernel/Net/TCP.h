@@ -41,6 +41,18 @@ struct TCPFlags {
     };
 };
 
+enum class TCPOptionKind : u8 {
+    End = 0,
+    NoOperation = 1,
+    MaximumSegmentSize = 2,
+    WindowScale = 3,
+    SACKPermitted = 4,
+    SACK = 5,
+    Timestamp = 8,
+};
+
+static constexpr size_t tcp_maximum_window_scale = 14;
+
 class [[gnu::packed]] TCPPacket
 {
 public:
@@ -81,6 +93,10 @@ public:
     u16 urgent() const { return m_urgent; }
     void set_urgent(u16 urgent) { m_urgent = urgent; }
 
+    const u8* options() const { return ((const u8*)this) + sizeof(TCPPacket); }
+    u8* options() { return ((u8*)this) + sizeof(TCPPacket); }
+    size_t options_size() const { return header_size() - sizeof(TCPPacket); }
+
     const void* payload() const { return ((const u8*)this) + header_size(); }
     void* payload() { return ((u8*)this) + header_size(); }
 
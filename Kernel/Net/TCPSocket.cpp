@@ -24,21 +24,156 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <AK/NumericLimits.h>
+#include <AK/Optional.h>
 #include <AK/Singleton.h>
 #include <AK/Time.h>
 #include <Kernel/Devices/RandomDevice.h>
 #include <Kernel/FileSystem/FileDescription.h>
+#include <Kernel/Net/EthernetFrameHeader.h>
 #include <Kernel/Net/NetworkAdapter.h>
+#include <Kernel/Net/NetworkTask.h>
 #include <Kernel/Net/Routing.h>
 #include <Kernel/Net/TCP.h>
 #include <Kernel/Net/TCPSocket.h>
 #include <Kernel/Process.h>
 #include <Kernel/Random.h>
+#include <Kernel/Scheduler.h>
 
 //#define TCP_SOCKET_DEBUG
 
 namespace Kernel {
 
+static constexpr size_t send_buffer_size = 256 * KiB;
+static constexpr u32 initial_receive_window = 64 * KiB;
+static constexpr size_t default_max_segment_size = 536;
+static constexpr size_t timestamp_option_size = 12;
+
+// Bounds for the retransmission timeout, in milliseconds. RFC 6298 asks for
+// at least a second, but like most stacks we go lower so that losses on
+// short paths (and loopback) don't stall a connection for that long.
+static constexpr u32 minimum_retransmission_timeout = 200;
+static constexpr u32 maximum_retransmission_timeout = 60 * 1000;
+static constexpr u32 duplicate_ack_threshold = 3;
+
+// How long we hold back an ACK, in milliseconds, hoping to combine it with
+// another one or with data going the other way. RFC 1122 allows up to 500.
+static constexpr u32 delayed_ack_timeout = 40;
+static constexpr size_t maximum_sack_blocks = 4;
+
+// The receive window is resized at most this often (in milliseconds), even
+// if the round trip time is shorter.
+static constexpr u32 minimum_receive_window_interval = 10;
+
+static u32 current_time_ms()
+{
+    auto now = Scheduler::time_since_boot();
+    return now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+// Sequence numbers wrap around, so they have to be compared modulo 2^32.
+static bool sequence_less_than(u32 a, u32 b)
+{
+    return (i32)(a - b) < 0;
+}
+
+static bool sequence_less_or_equal(u32 a, u32 b)
+{
+    return (i32)(a - b) <= 0;
+}
+
+// The same goes for our millisecond clock.
+static bool time_is_before(u32 a, u32 b)
+{
+    return (i32)(a - b) < 0;
+}
+
+static u32 read_u32(const u8* data)
+{
+    return ((u32)data[0] << 24) | ((u32)data[1] << 16) | ((u32)data[2] << 8) | data[3];
+}
+
+static void write_u32(u8* data, u32 value)
+{
+    data[0] = value >> 24;
+    data[1] = value >> 16;
+    data[2] = value >> 8;
+    data[3] = value;
+}
+
+struct TCPOptions {
+    Optional<u16> maximum_segment_size;
+    Optional<u8> window_scale;
+    bool has_timestamp { false };
+    u32 timestamp_value { 0 };
+    u32 timestamp_echo_reply { 0 };
+    bool sack_permitted { false };
+    u32 sack_blocks[maximum_sack_blocks * 2];
+    size_t sack_block_count { 0 };
+};
+
+static TCPOptions parse_options(const TCPPacket& packet)
+{
+    TCPOptions options;
+    auto* data = packet.options();
+    size_t size = packet.options_size();
+    size_t offset = 0;
+    while (offset < size) {
+        auto kind = (TCPOptionKind)data[offset];
+        if (kind == TCPOptionKind::End)
+            break;
+        if (kind == TCPOptionKind::NoOperation) {
+            ++offset;
+            continue;
+        }
+        if (offset + 1 >= size)
+            break;
+        size_t length = data[offset + 1];
+        if (length < 2 || offset + length > size)
+            break;
+        auto* value = data + offset + 2;
+        switch (kind) {
+        case TCPOptionKind::MaximumSegmentSize:
+            if (length == 4)
+                options.maximum_segment_size = (value[0] << 8) | value[1];
+            break;
+        case TCPOptionKind::WindowScale:
+            if (length == 3)
+                options.window_scale = min(value[0], (u8)tcp_maximum_window_scale);
+            break;
+        case TCPOptionKind::Timestamp:
+            if (length == 10) {
+                options.has_timestamp = true;
+                options.timestamp_value = read_u32(value);
+                options.timestamp_echo_reply = read_u32(value + 4);
+            }
+            break;
+        case TCPOptionKind::SACKPermitted:
+            if (length == 2)
+                options.sack_permitted = true;
+            break;
+        case TCPOptionKind::SACK:
+            for (size_t i = 0; i + 8 <= length - 2 && options.sack_block_count < maximum_sack_blocks; i += 8) {
+                options.sack_blocks[2 * options.sack_block_count] = read_u32(value + i);
+                options.sack_blocks[2 * options.sack_block_count + 1] = read_u32(value + i + 4);
+                options.sack_block_count++;
+            }
+            break;
+        default:
+            break;
+        }
+        offset += length;
+    }
+    return options;
+}
+
+static size_t max_segment_size_for(const NetworkAdapter& adapter)
+{
+    // Frames have to fit in the 64 KiB buffers the adapters and NetworkTask use.
+    size_t mtu = min<size_t>(adapter.mtu(), 64 * KiB - sizeof(EthernetFrameHeader));
+    return mtu - sizeof(IPv4Packet) - sizeof(TCPPacket);
+}
+
 void TCPSocket::for_each(Function<void(const TCPSocket&)> callback)
 {
     LOCKER(sockets_by_tuple().lock(), Lock::Mode::Shared);
@@ -58,6 +193,9 @@ void TCPSocket::set_state(State new_state)
         m_role = Role::Connected;
 
     if (new_state == State::Closed) {
+        m_retransmission_deadline = 0;
+        m_delayed_ack_deadline = 0;
+        m_persist_deadline = 0;
         LOCKER(closing_sockets().lock());
         closing_sockets().resource().remove(tuple());
     }
@@ -135,6 +273,9 @@ void TCPSocket::release_to_originator()
 
 void TCPSocket::release_for_accept(RefPtr<TCPSocket> socket)
 {
+    // This runs with the client's lock held, but the pending set belongs to
+    // us and create_client() fills it under our lock.
+    LOCKER(lock());
     ASSERT(m_pending_release_for_accept.contains(socket->tuple()));
     m_pending_release_for_accept.remove(socket->tuple());
     // FIXME: Should we observe this error somehow?
@@ -144,10 +285,18 @@ void TCPSocket::release_for_accept(RefPtr<TCPSocket> socket)
 TCPSocket::TCPSocket(int protocol)
     : IPv4Socket(SOCK_STREAM, protocol)
 {
+    while ((stream_receive_buffer_size >> m_receive_window_scale) > NumericLimits<u16>::max())
+        ++m_receive_window_scale;
+    m_receive_window_limit = initial_receive_window;
 }
 
 TCPSocket::~TCPSocket()
 {
+    if (m_timer_id) {
+        ScopedSpinLock lock(g_scheduler_lock);
+        TimerQueue::the().cancel_timer(m_timer_id);
+    }
+
     LOCKER(sockets_by_tuple().lock());
     sockets_by_tuple().resource().remove(tuple());
 
@@ -161,60 +310,223 @@ NonnullRefPtr<TCPSocket> TCPSocket::create(int protocol)
     return adopt(*new TCPSocket(protocol));
 }
 
-KResultOr<size_t> TCPSocket::protocol_receive(const KBuffer& packet_buffer, void* buffer, size_t buffer_size, int flags)
+ReadonlyBytes TCPSocket::protocol_payload(const PacketBuffer& packet_buffer) const
 {
-    (void)flags;
     auto& ipv4_packet = *(const IPv4Packet*)(packet_buffer.data());
     auto& tcp_packet = *static_cast<const TCPPacket*>(ipv4_packet.payload());
     size_t payload_size = packet_buffer.size() - sizeof(IPv4Packet) - tcp_packet.header_size();
-#ifdef TCP_SOCKET_DEBUG
-    klog() << "payload_size " << payload_size << ", will it fit in " << buffer_size << "?";
-#endif
-    ASSERT(buffer_size >= payload_size);
-    memcpy(buffer, tcp_packet.payload(), payload_size);
-    return payload_size;
+    return { (const u8*)tcp_packet.payload(), payload_size };
 }
 
 KResultOr<size_t> TCPSocket::protocol_send(const void* data, size_t data_length)
 {
-    send_tcp_packet(TCPFlags::PUSH | TCPFlags::ACK, data, data_length);
-    return data_length;
+    LOCKER(m_send_lock);
+    size_t queued_size = m_unsent_size + m_not_acked_size;
+    if (queued_size >= send_buffer_size)
+        return KResult(-EAGAIN);
+    size_t nqueued = min(data_length, send_buffer_size - queued_size);
+    m_unsent.append(ByteBuffer::copy(data, nqueued));
+    m_unsent_size += nqueued;
+    send_data();
+    return nqueued;
 }
 
-void TCPSocket::send_tcp_packet(u16 flags, const void* payload, size_t payload_size)
+bool TCPSocket::can_write(const FileDescription& description, size_t size) const
+{
+    if (!IPv4Socket::can_write(description, size))
+        return false;
+    return m_unsent_size + m_not_acked_size < send_buffer_size;
+}
+
+KResultOr<size_t> TCPSocket::recvfrom(FileDescription& description, void* buffer, size_t buffer_length, int flags, Userspace<sockaddr*> addr, Userspace<socklen_t*> addr_length)
+{
+    auto nreceived_or_error = IPv4Socket::recvfrom(description, buffer, buffer_length, flags, addr, addr_length);
+    if (nreceived_or_error.is_error() || !nreceived_or_error.value())
+        return nreceived_or_error;
+
+    LOCKER(m_send_lock);
+    auto now = current_time_ms();
+    m_bytes_read_in_interval += nreceived_or_error.value();
+    if (now - m_read_interval_start >= max(m_smoothed_rtt, minimum_receive_window_interval)) {
+        // Let the peer send twice what the application took in during the
+        // last round trip, so the window keeps up with the sender's slow start.
+        m_receive_window_limit = min<u32>(max(2 * m_bytes_read_in_interval, m_receive_window_limit), stream_receive_buffer_size);
+        m_bytes_read_in_interval = 0;
+        m_read_interval_start = now;
+    }
+
+    // Let the peer know about the room we just made, if there's enough of it
+    // to be worth a packet.
+    if (m_state == State::Established) {
+        u32 threshold = min<u32>(2 * m_max_segment_size, m_receive_window_limit / 2);
+        if (advertised_window() >= m_last_advertised_window + threshold)
+            send_tcp_packet(TCPFlags::ACK);
+    }
+    return nreceived_or_error;
+}
+
+KResult TCPSocket::setsockopt(int level, int option, Userspace<const void*> user_value, socklen_t user_value_size)
+{
+    if (level != IPPROTO_TCP)
+        return IPv4Socket::setsockopt(level, option, user_value, user_value_size);
+
+    switch (option) {
+    case TCP_NODELAY:
+    case TCP_CORK: {
+        if (user_value_size < sizeof(int))
+            return KResult(-EINVAL);
+        int value;
+        if (!Process::current()->validate_read_and_copy_typed(&value, static_ptr_cast<const int*>(user_value)))
+            return KResult(-EFAULT);
+
+        LOCKER(m_send_lock);
+        if (option == TCP_NODELAY)
+            m_no_delay = value;
+        else
+            m_corked = value;
+        // Whatever was held back may be allowed to go out now.
+        send_data();
+        return KSuccess;
+    }
+    default:
+        return KResult(-ENOPROTOOPT);
+    }
+}
+
+KResult TCPSocket::getsockopt(FileDescription& description, int level, int option, Userspace<void*> value, Userspace<socklen_t*> value_size)
+{
+    if (level != IPPROTO_TCP)
+        return IPv4Socket::getsockopt(description, level, option, value, value_size);
+
+    socklen_t size;
+    if (!Process::current()->validate_read_and_copy_typed(&size, value_size))
+        return KResult(-EFAULT);
+
+    switch (option) {
+    case TCP_NODELAY:
+    case TCP_CORK: {
+        if (size < sizeof(int))
+            return KResult(-EINVAL);
+        int option_value = option == TCP_NODELAY ? m_no_delay : m_corked;
+        copy_to_user(static_ptr_cast<int*>(value), &option_value);
+        size = sizeof(int);
+        copy_to_user(value_size, &size);
+        return KSuccess;
+    }
+    default:
+        return KResult(-ENOPROTOOPT);
+    }
+}
+
+u32 TCPSocket::advertised_window() const
 {
-    auto buffer = ByteBuffer::create_zeroed(sizeof(TCPPacket) + payload_size);
+    return min<u32>(receive_buffer_space(), m_receive_window_limit);
+}
+
+ByteBuffer TCPSocket::build_packet(u16 flags, u32 sequence_number, const void* payload, size_t payload_size)
+{
+    u8 options[40];
+    size_t options_size = 0;
+    auto add_timestamp_option = [&] {
+        options[options_size++] = (u8)TCPOptionKind::NoOperation;
+        options[options_size++] = (u8)TCPOptionKind::NoOperation;
+        options[options_size++] = (u8)TCPOptionKind::Timestamp;
+        options[options_size++] = 10;
+        write_u32(&options[options_size], current_time_ms());
+        write_u32(&options[options_size + 4], m_timestamp_recent);
+        options_size += 8;
+    };
+
+    bool is_syn = flags & TCPFlags::SYN;
+    if (is_syn) {
+        auto routing_decision = route_to(peer_address(), local_address(), bound_interface());
+        size_t max_segment_size = routing_decision.is_zero() ? default_max_segment_size : max_segment_size_for(*routing_decision.adapter);
+        options[options_size++] = (u8)TCPOptionKind::MaximumSegmentSize;
+        options[options_size++] = 4;
+        options[options_size++] = max_segment_size >> 8;
+        options[options_size++] = max_segment_size & 0xff;
+
+        // We offer window scaling and timestamps when connecting, and
+        // agree to them when the peer offered them to us.
+        bool is_connecting = !(flags & TCPFlags::ACK);
+        if (is_connecting || m_window_scaling_enabled) {
+            options[options_size++] = (u8)TCPOptionKind::NoOperation;
+            options[options_size++] = (u8)TCPOptionKind::WindowScale;
+            options[options_size++] = 3;
+            options[options_size++] = m_receive_window_scale;
+        }
+        if (is_connecting || m_timestamps_enabled)
+            add_timestamp_option();
+        if (is_connecting || m_sack_enabled) {
+            options[options_size++] = (u8)TCPOptionKind::NoOperation;
+            options[options_size++] = (u8)TCPOptionKind::NoOperation;
+            options[options_size++] = (u8)TCPOptionKind::SACKPermitted;
+            options[options_size++] = 2;
+        }
+    } else {
+        if (m_timestamps_enabled)
+            add_timestamp_option();
+        // Segments carrying data were sized without room for SACK blocks,
+        // so they only go out with pure ACKs.
+        if (m_sack_enabled && !payload_size && !m_out_of_order.is_empty())
+            options_size += build_sack_option(&options[options_size], sizeof(options) - options_size);
+    }
+    ASSERT(options_size % sizeof(u32) == 0);
+
+    size_t header_size = sizeof(TCPPacket) + options_size;
+    auto buffer = ByteBuffer::create_zeroed(header_size + payload_size);
     auto& tcp_packet = *(TCPPacket*)(buffer.data());
     ASSERT(local_port());
     tcp_packet.set_source_port(local_port());
     tcp_packet.set_destination_port(peer_port());
-    tcp_packet.set_window_size(1024);
-    tcp_packet.set_sequence_number(m_sequence_number);
-    tcp_packet.set_data_offset(sizeof(TCPPacket) / sizeof(u32));
+    tcp_packet.set_sequence_number(sequence_number);
+    tcp_packet.set_data_offset(header_size / sizeof(u32));
     tcp_packet.set_flags(flags);
 
-    if (flags & TCPFlags::ACK)
-        tcp_packet.set_ack_number(m_ack_number);
+    // The window in a SYN is never scaled.
+    u32 window = advertised_window();
+    if (!is_syn && m_window_scaling_enabled)
+        window >>= m_receive_window_scale;
+    window = min<u32>(window, NumericLimits<u16>::max());
+    tcp_packet.set_window_size(window);
+    m_last_advertised_window = (!is_syn && m_window_scaling_enabled) ? window << m_receive_window_scale : window;
 
-    if (flags & TCPFlags::SYN) {
-        ++m_sequence_number;
-    } else {
-        m_sequence_number += payload_size;
+    if (flags & TCPFlags::ACK) {
+        tcp_packet.set_ack_number(m_ack_number);
+        m_segments_since_ack = 0;
+        m_delayed_ack_deadline = 0;
     }
 
-    memcpy(tcp_packet.payload(), payload, payload_size);
+    memcpy(tcp_packet.options(), options, options_size);
+    if (payload_size)
+        memcpy(tcp_packet.payload(), payload, payload_size);
     tcp_packet.set_checksum(compute_tcp_checksum(local_address(), peer_address(), tcp_packet, payload_size));
+    return buffer;
+}
 
-    if (tcp_packet.has_syn() || payload_size > 0) {
-        LOCKER(m_not_acked_lock);
-        m_not_acked.append({ m_sequence_number, move(buffer) });
-        send_outgoing_packets();
+void TCPSocket::send_tcp_packet(u16 flags, const void* payload, size_t payload_size)
+{
+    LOCKER(m_send_lock);
+
+    if ((flags & (TCPFlags::SYN | TCPFlags::FIN)) || payload_size) {
+        if ((flags & TCPFlags::FIN) && m_unsent_size) {
+            // The FIN has to go out after everything that's still queued.
+            m_fin_pending = true;
+            send_data();
+            return;
+        }
+        m_not_acked.append({ m_sequence_number, flags, ByteBuffer::copy(payload, payload_size) });
+        auto& packet = m_not_acked.last();
+        m_sequence_number += packet.sequence_length();
+        m_not_acked_size += payload_size;
+        transmit(packet);
         return;
     }
 
     auto routing_decision = route_to(peer_address(), local_address(), bound_interface());
     ASSERT(!routing_decision.is_zero());
 
+    auto buffer = build_packet(flags, m_sequence_number, nullptr, 0);
     routing_decision.adapter->send_ipv4(
         routing_decision.next_hop, peer_address(), IPv4Protocol::TCP,
         buffer, ttl());
@@ -223,37 +535,569 @@ void TCPSocket::send_tcp_packet(u16 flags, const void* payload, size_t payload_s
     m_bytes_out += buffer.size();
 }
 
-void TCPSocket::send_outgoing_packets()
+void TCPSocket::transmit(OutgoingPacket& packet)
 {
     auto routing_decision = route_to(peer_address(), local_address(), bound_interface());
-    ASSERT(!routing_decision.is_zero());
+    if (routing_decision.is_zero())
+        return;
+
+    // The header is built anew every time, so retransmissions carry our
+    // current ACK number and window.
+    auto buffer = build_packet(packet.flags, packet.sequence_number, packet.payload.data(), packet.payload.size());
+    packet.tx_time = current_time_ms();
+    packet.tx_counter++;
+
+#ifdef TCP_SOCKET_DEBUG
+    auto& tcp_packet = *(TCPPacket*)(buffer.data());
+    klog() << "sending tcp packet from " << local_address().to_string().characters() << ":" << local_port() << " to " << peer_address().to_string().characters() << ":" << peer_port() << " with (" << (tcp_packet.has_syn() ? "SYN " : "") << (tcp_packet.has_ack() ? "ACK " : "") << (tcp_packet.has_fin() ? "FIN " : "") << (tcp_packet.has_rst() ? "RST " : "") << ") seq_no=" << tcp_packet.sequence_number() << ", ack_no=" << tcp_packet.ack_number() << ", tx_counter=" << packet.tx_counter;
+#endif
+    routing_decision.adapter->send_ipv4(
+        routing_decision.next_hop, peer_address(), IPv4Protocol::TCP,
+        buffer, ttl());
+
+    m_packets_out++;
+    m_bytes_out += buffer.size();
+
+    if (!m_retransmission_deadline)
+        start_retransmission_timer();
+}
+
+void TCPSocket::retransmit(OutgoingPacket& packet)
+{
+    if (packet.lost) {
+        packet.lost = false;
+        m_bytes_lost -= packet.sequence_length();
+    }
+    packet.retransmitted = true;
+    m_retransmissions++;
+    transmit(packet);
+}
+
+u32 TCPSocket::bytes_in_flight() const
+{
+    // What's outstanding, minus what the peer has told us it got out of
+    // order, and what we think got lost on the way and isn't resent yet.
+    u32 outstanding = m_sequence_number - m_send_unacknowledged;
+    u32 left_the_network = m_bytes_sacked + m_bytes_lost;
+    return outstanding > left_the_network ? outstanding - left_the_network : 0;
+}
+
+void TCPSocket::send_data()
+{
+    LOCKER(m_send_lock);
+
+    // Whatever we think got lost goes out before any new data.
+    if (m_bytes_lost) {
+        for (auto& packet : m_not_acked) {
+            if (!packet.lost)
+                continue;
+            u32 in_flight = bytes_in_flight();
+            if (in_flight && in_flight + packet.sequence_length() > m_congestion_window)
+                return;
+            retransmit(packet);
+        }
+    }
+
+    while (m_unsent_size || m_fin_pending) {
+        if (!m_unsent_size) {
+            m_fin_pending = false;
+            send_tcp_packet(TCPFlags::FIN | TCPFlags::ACK);
+            return;
+        }
+
+        // The congestion window limits what's in the network, the peer's
+        // window limits how far beyond what it acknowledged we may go.
+        u32 in_flight = bytes_in_flight();
+        u32 outstanding = m_sequence_number - m_send_unacknowledged;
+        u32 congestion_space = m_congestion_window > in_flight ? m_congestion_window - in_flight : 0;
+        u32 receive_space = m_send_window > outstanding ? m_send_window - outstanding : 0;
+        u32 available = min(congestion_space, receive_space);
+        size_t segment_size = min(m_unsent_size, m_max_segment_size);
+
+        // Segments smaller than the MSS wait while we're corked, and as long
+        // as earlier data is unacknowledged (Nagle's algorithm) unless
+        // TCP_NODELAY is set. A pending FIN flushes everything.
+        if (segment_size < m_max_segment_size && !m_fin_pending) {
+            if (m_corked || (!m_no_delay && outstanding))
+                return;
+        }
+
+        if (segment_size > available) {
+            // Wait for ACKs to open the window up, unless nothing is in
+            // flight and a smaller segment is all we'll ever be allowed.
+            // With nothing in flight there are no ACKs coming though, so if
+            // the peer closed its window we have to ask for updates.
+            if (!outstanding && !available)
+                start_persist_timer();
+            if (outstanding || !available)
+                return;
+            segment_size = available;
+        }
+
+        auto payload = ByteBuffer::create_uninitialized(segment_size);
+        size_t ncopied = 0;
+        while (ncopied < segment_size) {
+            auto& chunk = m_unsent.first();
+            size_t nchunk = min(segment_size - ncopied, chunk.size() - m_unsent_offset);
+            memcpy(payload.data() + ncopied, chunk.data() + m_unsent_offset, nchunk);
+            ncopied += nchunk;
+            m_unsent_offset += nchunk;
+            if (m_unsent_offset == chunk.size()) {
+                m_unsent.take_first();
+                m_unsent_offset = 0;
+            }
+        }
+        m_unsent_size -= segment_size;
+
+        u16 flags = TCPFlags::ACK;
+        if (!m_unsent_size)
+            flags |= TCPFlags::PUSH;
+        m_not_acked.append({ m_sequence_number, flags, move(payload) });
+        auto& packet = m_not_acked.last();
+        m_sequence_number += segment_size;
+        m_not_acked_size += segment_size;
+        transmit(packet);
+    }
+}
+
+void TCPSocket::update_rtt(u32 sample)
+{
+    // Loopback round trips are often shorter than our clock resolution.
+    sample = max(sample, 1u);
+    if (!m_smoothed_rtt) {
+        m_smoothed_rtt = sample;
+        m_rtt_variance = sample / 2;
+    } else {
+        u32 delta = m_smoothed_rtt > sample ? m_smoothed_rtt - sample : sample - m_smoothed_rtt;
+        m_rtt_variance = (3 * m_rtt_variance + delta) / 4;
+        m_smoothed_rtt = (7 * m_smoothed_rtt + sample) / 8;
+    }
+
+    // Our clock granularity is a millisecond.
+    u32 timeout = m_smoothed_rtt + max(1u, 4 * m_rtt_variance);
+    m_retransmission_timeout = min(max(timeout, minimum_retransmission_timeout), maximum_retransmission_timeout);
+}
+
+void TCPSocket::update_congestion_window(size_t acked_bytes)
+{
+    static constexpr u32 maximum_congestion_window = 1 * GiB;
+
+    if (m_congestion_window < m_slow_start_threshold) {
+        // Slow start, with appropriate byte counting (RFC 3465).
+        m_congestion_window += min(acked_bytes, 2 * m_max_segment_size);
+    } else {
+        // Congestion avoidance: one more segment for every window's worth of ACKs.
+        m_bytes_acked_in_congestion_avoidance += acked_bytes;
+        if (m_bytes_acked_in_congestion_avoidance >= m_congestion_window) {
+            m_bytes_acked_in_congestion_avoidance -= m_congestion_window;
+            m_congestion_window += m_max_segment_size;
+        }
+    }
+    m_congestion_window = min(m_congestion_window, maximum_congestion_window);
+}
 
-    auto now = kgettimeofday();
+void TCPSocket::process_sack_blocks(const u32* blocks, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        u32 left = blocks[2 * i];
+        u32 right = blocks[2 * i + 1];
+        // Ignore blocks that don't fall into what we have outstanding.
+        if (!sequence_less_than(left, right) || !sequence_less_than(m_send_unacknowledged, right) || sequence_less_than(m_sequence_number, right))
+            continue;
+        for (auto& packet : m_not_acked) {
+            if (sequence_less_or_equal(right, packet.sequence_number))
+                break;
+            u32 end = packet.sequence_number + packet.sequence_length();
+            if (packet.sacked || sequence_less_than(packet.sequence_number, left) || sequence_less_than(right, end))
+                continue;
+            packet.sacked = true;
+            m_bytes_sacked += packet.sequence_length();
+            if (packet.lost) {
+                packet.lost = false;
+                m_bytes_lost -= packet.sequence_length();
+            }
+            if (sequence_less_than(m_highest_sacked, end))
+                m_highest_sacked = end;
+        }
+    }
+}
 
-    LOCKER(m_not_acked_lock, Lock::Mode::Shared);
+void TCPSocket::mark_lost_segments()
+{
+    // The first unacknowledged segment is considered lost whenever we get
+    // here (NewReno). With SACK, so is everything below the highest SACKed
+    // sequence number that the peer didn't SACK (much like FACK).
+    bool is_first = true;
     for (auto& packet : m_not_acked) {
-        timeval diff;
-        timeval_sub(packet.tx_time, now, diff);
-        if (diff.tv_sec == 0 && diff.tv_usec <= 500000)
+        if (!is_first && !(m_sack_enabled && sequence_less_than(packet.sequence_number, m_highest_sacked)))
+            break;
+        is_first = false;
+        if (packet.sacked || packet.lost || packet.retransmitted)
             continue;
-        packet.tx_time = now;
-        packet.tx_counter++;
+        packet.lost = true;
+        m_bytes_lost += packet.sequence_length();
+    }
+}
+
+void TCPSocket::enter_fast_recovery()
+{
+#ifdef TCP_SOCKET_DEBUG
+    dbg() << "TCPSocket: fast retransmit of " << m_send_unacknowledged;
+#endif
+    m_fast_retransmissions++;
+
+    u32 flight_size = m_sequence_number - m_send_unacknowledged;
+    m_slow_start_threshold = max<u32>(flight_size / 2, 2 * m_max_segment_size);
+    m_bytes_acked_in_congestion_avoidance = 0;
+    // Without SACK, the window is inflated by the segments the duplicate
+    // ACKs told us have left the network (RFC 6582).
+    m_congestion_window = m_slow_start_threshold;
+    if (!m_sack_enabled)
+        m_congestion_window += duplicate_ack_threshold * m_max_segment_size;
+
+    m_in_recovery = true;
+    m_recovery_point = m_sequence_number;
+    for (auto& packet : m_not_acked)
+        packet.retransmitted = false;
+    mark_lost_segments();
+
+    // The first segment goes out right away, whatever the window says.
+    retransmit(m_not_acked.first());
+}
+
+void TCPSocket::did_retransmission_timeout()
+{
+    if (m_not_acked.is_empty()) {
+        m_retransmission_deadline = 0;
+        return;
+    }
 
 #ifdef TCP_SOCKET_DEBUG
-        auto& tcp_packet = *(TCPPacket*)(packet.buffer.data());
-        klog() << "sending tcp packet from " << local_address().to_string().characters() << ":" << local_port() << " to " << peer_address().to_string().characters() << ":" << peer_port() << " with (" << (tcp_packet.has_syn() ? "SYN " : "") << (tcp_packet.has_ack() ? "ACK " : "") << (tcp_packet.has_fin() ? "FIN " : "") << (tcp_packet.has_rst() ? "RST " : "") << ") seq_no=" << tcp_packet.sequence_number() << ", ack_no=" << tcp_packet.ack_number() << ", tx_counter=" << packet.tx_counter;
+    dbg() << "TCPSocket: retransmission timeout for " << m_send_unacknowledged << ", rto=" << m_retransmission_timeout;
 #endif
-        routing_decision.adapter->send_ipv4(
-            routing_decision.next_hop, peer_address(), IPv4Protocol::TCP,
-            packet.buffer, ttl());
+    m_retransmission_timeouts++;
+
+    u32 flight_size = m_sequence_number - m_send_unacknowledged;
+    m_slow_start_threshold = max<u32>(flight_size / 2, 2 * m_max_segment_size);
+    m_congestion_window = m_max_segment_size;
+    m_bytes_acked_in_congestion_avoidance = 0;
+
+    // Everything outstanding is resent as the window opens up again. The
+    // peer is allowed to drop data it SACKed (RFC 2018), so that's included.
+    m_in_recovery = false;
+    m_recovery_point = m_sequence_number;
+    m_duplicate_ack_count = 0;
+    m_highest_sacked = m_send_unacknowledged;
+    m_bytes_sacked = 0;
+    m_bytes_lost = 0;
+    for (auto& packet : m_not_acked) {
+        packet.sacked = false;
+        packet.lost = true;
+        packet.retransmitted = false;
+        m_bytes_lost += packet.sequence_length();
+    }
+
+    m_retransmission_timeout = min(m_retransmission_timeout * 2, maximum_retransmission_timeout);
+    retransmit(m_not_acked.first());
+    start_retransmission_timer();
+}
+
+void TCPSocket::start_persist_timer()
+{
+    if (m_persist_deadline)
+        return;
+    // Probes back off just like retransmissions, but never give up.
+    u32 timeout = m_retransmission_timeout;
+    for (u32 i = 0; i < m_persist_backoff && timeout < maximum_retransmission_timeout; ++i)
+        timeout *= 2;
+    m_persist_deadline = max(current_time_ms() + min(timeout, maximum_retransmission_timeout), 1u);
+    arm_timer();
+}
+
+void TCPSocket::send_window_probe()
+{
+    // A segment below the window makes the peer answer with an ACK that
+    // carries its current window, without us committing any data to it.
+    auto routing_decision = route_to(peer_address(), local_address(), bound_interface());
+    if (routing_decision.is_zero())
+        return;
+
+    auto buffer = build_packet(TCPFlags::ACK, m_send_unacknowledged - 1, nullptr, 0);
+    routing_decision.adapter->send_ipv4(
+        routing_decision.next_hop, peer_address(), IPv4Protocol::TCP,
+        buffer, ttl());
+
+    m_packets_out++;
+    m_bytes_out += buffer.size();
+}
+
+void TCPSocket::start_retransmission_timer()
+{
+    // 0 means the timer is stopped.
+    m_retransmission_deadline = max(current_time_ms() + m_retransmission_timeout, 1u);
+    arm_timer();
+}
+
+void TCPSocket::stop_retransmission_timer()
+{
+    // A TimerQueue timer that's still pending just goes off for nothing.
+    m_retransmission_deadline = 0;
+}
+
+u32 TCPSocket::next_timer_deadline() const
+{
+    u32 next_deadline = 0;
+    for (u32 deadline : { m_retransmission_deadline, m_delayed_ack_deadline, m_persist_deadline }) {
+        if (deadline && (!next_deadline || time_is_before(deadline, next_deadline)))
+            next_deadline = deadline;
+    }
+    return next_deadline;
+}
+
+void TCPSocket::arm_timer()
+{
+    auto now = current_time_ms();
+    auto next_deadline = next_timer_deadline();
+    if (!next_deadline)
+        return;
+
+    // Most ACKs only push the deadline further out. A pending timer that
+    // goes off before the deadline is good enough, it's re-armed then.
+    if (m_timer_id && time_is_before(now, m_timer_expiry) && !time_is_before(next_deadline, m_timer_expiry))
+        return;
+
+    u32 timeout = time_is_before(now, next_deadline) ? next_deadline - now : 0;
+    timeval deadline { (time_t)(timeout / 1000), (suseconds_t)((timeout % 1000) * 1000) };
+
+    // The timer goes off in IRQ context, so all it does is wake NetworkTask,
+    // which then looks for sockets whose deadline has passed.
+    ScopedSpinLock lock(g_scheduler_lock);
+    if (m_timer_id)
+        TimerQueue::the().cancel_timer(m_timer_id);
+    m_timer_id = TimerQueue::the().add_timer(deadline, [] {
+        NetworkTask::did_expire_timer();
+    });
+    m_timer_expiry = now + timeout;
+}
+
+void TCPSocket::check_timers()
+{
+    // The timers are checked on whichever thread noticed that they expired,
+    // which might not be the one processing this socket's packets.
+    Locker locker(lock());
+    Locker send_locker(m_send_lock);
+    auto now = current_time_ms();
+
+    // Sending the ACK clears the deadline.
+    if (m_delayed_ack_deadline && !time_is_before(now, m_delayed_ack_deadline))
+        send_tcp_packet(TCPFlags::ACK);
+
+    if (m_retransmission_deadline && !time_is_before(now, m_retransmission_deadline)) {
+        did_retransmission_timeout();
+        send_data();
+    }
+
+    if (m_persist_deadline && !time_is_before(now, m_persist_deadline)) {
+        m_persist_deadline = 0;
+        ++m_persist_backoff;
+        send_window_probe();
+        start_persist_timer();
+    }
+
+    arm_timer();
+}
+
+void TCPSocket::process_expired_timers()
+{
+    NonnullRefPtrVector<TCPSocket> sockets;
+    {
+        LOCKER(sockets_by_tuple().lock(), Lock::Mode::Shared);
+        for (auto& it : sockets_by_tuple().resource()) {
+            if (it.value->next_timer_deadline())
+                sockets.append(*it.value);
+        }
+    }
+    for (auto& socket : sockets)
+        socket.check_timers();
+}
+
+void TCPSocket::process_syn_options(const TCPPacket& packet)
+{
+    auto options = parse_options(packet);
+
+    LOCKER(m_send_lock);
+    size_t max_segment_size = options.maximum_segment_size.value_or(default_max_segment_size);
+    auto routing_decision = route_to(peer_address(), local_address(), bound_interface());
+    if (!routing_decision.is_zero())
+        max_segment_size = min(max_segment_size, max_segment_size_for(*routing_decision.adapter));
+
+    m_window_scaling_enabled = options.window_scale.has_value();
+    if (m_window_scaling_enabled) {
+        m_send_window_scale = options.window_scale.value();
+    } else {
+        m_send_window_scale = 0;
+        m_receive_window_scale = 0;
+    }
+
+    m_timestamps_enabled = options.has_timestamp;
+    if (m_timestamps_enabled) {
+        m_timestamp_recent = options.timestamp_value;
+        max_segment_size -= timestamp_option_size;
+    }
+
+    m_sack_enabled = options.sack_permitted;
+
+    m_max_segment_size = max_segment_size;
+    m_send_window = packet.window_size();
+
+    // Initial window as per RFC 6928.
+    m_congestion_window = min(10 * max_segment_size, max<size_t>(2 * max_segment_size, 14600));
+    m_slow_start_threshold = NumericLimits<u32>::max();
+}
+
+size_t TCPSocket::build_sack_option(u8* options, size_t space) const
+{
+    size_t max_blocks = space >= 12 ? min((space - 4) / 8, maximum_sack_blocks) : 0;
+    if (!max_blocks)
+        return 0;
+
+    // Walks the contiguous ranges of data we have queued.
+    auto for_each_range = [this](auto callback) {
+        Optional<u32> left;
+        u32 right = 0;
+        for (auto& segment : m_out_of_order) {
+            if (left.has_value() && segment.sequence_number == right) {
+                right += segment.size;
+                continue;
+            }
+            if (left.has_value())
+                callback(left.value(), right);
+            left = segment.sequence_number;
+            right = segment.sequence_number + segment.size;
+        }
+        if (left.has_value())
+            callback(left.value(), right);
+    };
+    auto contains_latest = [this](u32 left, u32 right) {
+        return sequence_less_or_equal(left, m_last_out_of_order_sequence) && sequence_less_than(m_last_out_of_order_sequence, right);
+    };
+
+    // The block with the segment we got most recently goes first (RFC 2018).
+    size_t block_count = 0;
+    u8* block = options + 4;
+    auto add_block = [&](u32 left, u32 right) {
+        if (block_count == max_blocks)
+            return;
+        write_u32(block, left);
+        write_u32(block + 4, right);
+        block += 8;
+        block_count++;
+    };
+    for_each_range([&](u32 left, u32 right) {
+        if (contains_latest(left, right))
+            add_block(left, right);
+    });
+    for_each_range([&](u32 left, u32 right) {
+        if (!contains_latest(left, right))
+            add_block(left, right);
+    });
+
+    options[0] = (u8)TCPOptionKind::NoOperation;
+    options[1] = (u8)TCPOptionKind::NoOperation;
+    options[2] = (u8)TCPOptionKind::SACK;
+    options[3] = 2 + block_count * 8;
+    return 4 + block_count * 8;
+}
+
+void TCPSocket::queue_out_of_order_segment(PacketBuffer& packet_buffer, const TCPPacket& packet, size_t payload_size)
+{
+    // FINs are left for the peer to send again, as are segments that don't
+    // fit into the window we advertised.
+    u32 sequence_number = packet.sequence_number();
+    if (!payload_size || packet.has_fin() || !sequence_less_than(m_ack_number, sequence_number))
+        return;
+    if (sequence_number + payload_size - m_ack_number > m_last_advertised_window)
+        return;
+
+    LOCKER(m_send_lock);
+    auto it = m_out_of_order.begin();
+    for (; !it.is_end(); ++it) {
+        if (sequence_less_or_equal(sequence_number + payload_size, it->sequence_number))
+            break;
+        // We have (some of) this already.
+        if (sequence_less_than(sequence_number, it->sequence_number + it->size))
+            return;
+    }
+
+    OutOfOrderSegment segment { sequence_number, payload_size, packet_buffer };
+    if (it.is_end())
+        m_out_of_order.append(move(segment));
+    else
+        m_out_of_order.insert_before(it, move(segment));
+    m_out_of_order_size += payload_size;
+    m_last_out_of_order_sequence = sequence_number;
+}
+
+bool TCPSocket::deliver_out_of_order_segments()
+{
+    {
+        LOCKER(m_send_lock);
+        if (m_out_of_order.is_empty())
+            return false;
+    }
+
+    for (;;) {
+        Optional<OutOfOrderSegment> segment;
+        {
+            LOCKER(m_send_lock);
+            if (m_out_of_order.is_empty() || sequence_less_than(m_ack_number, m_out_of_order.first().sequence_number))
+                return true;
+            segment = m_out_of_order.take_first();
+            m_out_of_order_size -= segment.value().size;
+        }
+
+        // Segments that overlap what we already have are dropped; if the
+        // peer repacketized its retransmissions, it'll send the rest again.
+        if (segment.value().sequence_number != m_ack_number)
+            continue;
+        // The receive buffer lock is taken outside of m_send_lock, just like
+        // on the sending side.
+        if (!did_receive(peer_address(), peer_port(), move(segment.value().packet)))
+            return true;
+        m_ack_number += segment.value().size;
+    }
+}
+
+void TCPSocket::delay_ack()
+{
+    LOCKER(m_send_lock);
+
+    // At least every second segment is acknowledged right away (RFC 5681).
+    if (++m_segments_since_ack >= 2) {
+        send_tcp_packet(TCPFlags::ACK);
+        return;
+    }
 
-        m_packets_out++;
-        m_bytes_out += packet.buffer.size();
+    if (!m_delayed_ack_deadline) {
+        m_delayed_ack_deadline = max(current_time_ms() + delayed_ack_timeout, 1u);
+        arm_timer();
     }
 }
 
 void TCPSocket::receive_tcp_packet(const TCPPacket& packet, u16 size)
 {
+    auto options = parse_options(packet);
+    auto now = current_time_ms();
+    size_t payload_size = size - packet.header_size();
+
+    LOCKER(m_send_lock);
+
+    Optional<u32> rtt_sample;
+    if (m_timestamps_enabled && options.has_timestamp) {
+        if (sequence_less_or_equal(packet.sequence_number(), m_ack_number))
+            m_timestamp_recent = options.timestamp_value;
+    }
+
     if (packet.has_ack()) {
         u32 ack_number = packet.ack_number();
 
@@ -261,30 +1105,101 @@ void TCPSocket::receive_tcp_packet(const TCPPacket& packet, u16 size)
         dbg() << "TCPSocket: receive_tcp_packet: " << ack_number;
 #endif
 
-        int removed = 0;
-        LOCKER(m_not_acked_lock);
-        while (!m_not_acked.is_empty()) {
-            auto& packet = m_not_acked.first();
+        u32 previous_send_window = m_send_window;
+        if (sequence_less_or_equal(m_send_unacknowledged, ack_number))
+            m_send_window = packet.has_syn() ? packet.window_size() : packet.window_size() << m_send_window_scale;
 
-#ifdef TCP_SOCKET_DEBUG
-            dbg() << "TCPSocket: iterate: " << packet.ack_number;
-#endif
+        if (m_send_window) {
+            m_persist_deadline = 0;
+            m_persist_backoff = 0;
+        }
 
-            if (packet.ack_number <= ack_number) {
+        if (m_sack_enabled && options.sack_block_count)
+            process_sack_blocks(options.sack_blocks, options.sack_block_count);
+
+        if (sequence_less_than(m_send_unacknowledged, ack_number) && sequence_less_or_equal(ack_number, m_sequence_number)) {
+            size_t acked_bytes = 0;
+            int removed = 0;
+            while (!m_not_acked.is_empty()) {
+                auto& oldest = m_not_acked.first();
+                if (!sequence_less_or_equal(oldest.sequence_number + oldest.sequence_length(), ack_number))
+                    break;
+                // Karn's algorithm: only segments that went out once can
+                // tell us anything about the round trip time.
+                if (oldest.tx_counter == 1)
+                    rtt_sample = now - oldest.tx_time;
+                if (oldest.sacked)
+                    m_bytes_sacked -= oldest.sequence_length();
+                if (oldest.lost)
+                    m_bytes_lost -= oldest.sequence_length();
+                acked_bytes += oldest.payload.size();
+                m_not_acked_size -= oldest.payload.size();
                 m_not_acked.take_first();
                 removed++;
-            } else {
-                break;
             }
-        }
+            m_send_unacknowledged = ack_number;
+            m_duplicate_ack_count = 0;
+            if (sequence_less_than(m_highest_sacked, ack_number))
+                m_highest_sacked = ack_number;
+
+            // Only ACKs that move the window forward may be timed, anything
+            // else might echo a timestamp from long ago (RFC 7323, 4.1).
+            if (m_timestamps_enabled && options.has_timestamp && options.timestamp_echo_reply)
+                rtt_sample = now - options.timestamp_echo_reply;
+
+            if (m_in_recovery) {
+                if (sequence_less_or_equal(m_recovery_point, ack_number)) {
+                    // Everything that was outstanding when the loss was
+                    // detected made it, so the recovery is over.
+                    m_in_recovery = false;
+                    m_congestion_window = m_slow_start_threshold;
+                } else {
+                    // A partial ACK means the next hole was lost as well.
+                    if (!m_sack_enabled) {
+                        m_congestion_window -= min<u32>(acked_bytes, m_congestion_window);
+                        if (acked_bytes >= m_max_segment_size)
+                            m_congestion_window += m_max_segment_size;
+                    }
+                    mark_lost_segments();
+                    if (!m_not_acked.is_empty() && m_not_acked.first().lost)
+                        retransmit(m_not_acked.first());
+                }
+            } else if (acked_bytes) {
+                update_congestion_window(acked_bytes);
+            }
+
+            if (m_not_acked.is_empty())
+                stop_retransmission_timer();
+            else
+                start_retransmission_timer();
 
 #ifdef TCP_SOCKET_DEBUG
-        dbg() << "TCPSocket: receive_tcp_packet acknowledged " << removed << " packets";
+            dbg() << "TCPSocket: receive_tcp_packet acknowledged " << removed << " packets";
 #endif
+        } else if (ack_number == m_send_unacknowledged && !payload_size && !(packet.flags() & (TCPFlags::SYN | TCPFlags::FIN)) && m_send_window == previous_send_window && !m_not_acked.is_empty()) {
+            // A duplicate ACK: a segment after the first outstanding one arrived.
+            ++m_duplicate_ack_count;
+            if (m_in_recovery) {
+                if (m_sack_enabled)
+                    mark_lost_segments();
+                else
+                    m_congestion_window += m_max_segment_size;
+            } else if (m_duplicate_ack_count == duplicate_ack_threshold && sequence_less_or_equal(m_recovery_point, m_send_unacknowledged)) {
+                // m_recovery_point is SND.NXT rather than the last byte sent (RFC 6582's "recover"),
+                // so everything from the last recovery has been acknowledged once we've reached it.
+                enter_fast_recovery();
+            }
+        }
     }
 
+    if (rtt_sample.has_value())
+        update_rtt(rtt_sample.value());
+
     m_packets_in++;
     m_bytes_in += packet.header_size() + size;
+
+    if (packet.has_ack())
+        send_data();
 }
 
 NetworkOrdered<u16> TCPSocket::compute_tcp_checksum(const IPv4Address& source, const IPv4Address& destination, const TCPPacket& packet, u16 payload_size)
@@ -298,7 +1213,7 @@ NetworkOrdered<u16> TCPSocket::compute_tcp_checksum(const IPv4Address& source, c
         NetworkOrdered<u16> payload_size;
     };
 
-    PseudoHeader pseudo_header { source, destination, 0, (u8)IPv4Protocol::TCP, sizeof(TCPPacket) + payload_size };
+    PseudoHeader pseudo_header { source, destination, 0, (u8)IPv4Protocol::TCP, packet.header_size() + payload_size };
 
     u32 checksum = 0;
     auto* w = (const NetworkOrdered<u16>*)&pseudo_header;
@@ -308,12 +1223,11 @@ NetworkOrdered<u16> TCPSocket::compute_tcp_checksum(const IPv4Address& source, c
             checksum = (checksum >> 16) + (checksum & 0xffff);
     }
     w = (const NetworkOrdered<u16>*)&packet;
-    for (size_t i = 0; i < sizeof(packet) / sizeof(u16); ++i) {
+    for (size_t i = 0; i < packet.header_size() / sizeof(u16); ++i) {
         checksum += w[i];
         if (checksum > 0xffff)
             checksum = (checksum >> 16) + (checksum & 0xffff);
     }
-    ASSERT(packet.data_offset() * 4 == sizeof(TCPPacket));
     w = (const NetworkOrdered<u16>*)packet.payload();
     for (size_t i = 0; i < payload_size / sizeof(u16); ++i) {
         checksum += w[i];
@@ -362,7 +1276,7 @@ KResult TCPSocket::protocol_connect(FileDescription& description, ShouldBlock sh
 
     allocate_local_port_if_needed();
 
-    m_sequence_number = get_good_random<u32>();
+    set_sequence_number(get_good_random<u32>());
     m_ack_number = 0;
 
     set_setup_state(SetupState::InProgress);
@@ -31,6 +31,8 @@
 #include <AK/SinglyLinkedList.h>
 #include <AK/WeakPtr.h>
 #include <Kernel/Net/IPv4Socket.h>
+#include <Kernel/Net/TCP.h>
+#include <Kernel/TimerQueue.h>
 
 namespace Kernel {
 
@@ -140,7 +142,12 @@ public:
     void set_error(Error error) { m_error = error; }
 
     void set_ack_number(u32 n) { m_ack_number = n; }
-    void set_sequence_number(u32 n) { m_sequence_number = n; }
+    void set_sequence_number(u32 n)
+    {
+        m_sequence_number = n;
+        m_send_unacknowledged = n;
+        m_recovery_point = n;
+    }
     u32 ack_number() const { return m_ack_number; }
     u32 sequence_number() const { return m_sequence_number; }
     u32 packets_in() const { return m_packets_in; }
@@ -148,9 +155,38 @@ public:
     u32 packets_out() const { return m_packets_out; }
     u32 bytes_out() const { return m_bytes_out; }
 
+    size_t max_segment_size() const { return m_max_segment_size; }
+    u32 congestion_window() const { return m_congestion_window; }
+    u32 slow_start_threshold() const { return m_slow_start_threshold; }
+    u32 send_window() const { return m_send_window; }
+    u32 receive_window() const { return m_last_advertised_window; }
+    u32 smoothed_rtt() const { return m_smoothed_rtt; }
+    u32 rtt_variance() const { return m_rtt_variance; }
+    u32 retransmission_timeout() const { return m_retransmission_timeout; }
+    u32 retransmissions() const { return m_retransmissions; }
+    u32 fast_retransmissions() const { return m_fast_retransmissions; }
+    u32 retransmission_timeouts() const { return m_retransmission_timeouts; }
+    bool is_sack_enabled() const { return m_sack_enabled; }
+    bool has_unacknowledged_data() const { return m_send_unacknowledged != m_sequence_number || m_unsent_size || m_fin_pending; }
+
     void send_tcp_packet(u16 flags, const void* = nullptr, size_t = 0);
-    void send_outgoing_packets();
     void receive_tcp_packet(const TCPPacket&, u16 size);
+    void process_syn_options(const TCPPacket&);
+
+    // Keeps a segment that arrived ahead of ack_number() around until the
+    // gap before it is filled, and reports it to the peer via SACK.
+    void queue_out_of_order_segment(PacketBuffer&, const TCPPacket&, size_t payload_size);
+    // Hands queued segments that now follow ack_number() to the application.
+    // Returns whether there were any, in which case the peer is waiting for
+    // an immediate ACK.
+    bool deliver_out_of_order_segments();
+
+    // Acknowledges data we received, possibly a little later so that the
+    // ACK can cover more data or ride along with data we send back.
+    void delay_ack();
+
+    // Called by NetworkTask when a retransmission timer went off.
+    static void process_expired_timers();
 
     static Lockable<HashMap<IPv4SocketTuple, TCPSocket*>>& sockets_by_tuple();
     static RefPtr<TCPSocket> from_tuple(const IPv4SocketTuple& tuple);
@@ -165,6 +201,10 @@ public:
     void release_for_accept(RefPtr<TCPSocket>);
 
     virtual KResult close() override;
+    virtual bool can_write(const FileDescription&, size_t) const override;
+    virtual KResult setsockopt(int level, int option, Userspace<const void*>, socklen_t) override;
+    virtual KResult getsockopt(FileDescription&, int level, int option, Userspace<void*>, Userspace<socklen_t*>) override;
+    virtual KResultOr<size_t> recvfrom(FileDescription&, void*, size_t, int flags, Userspace<sockaddr*>, Userspace<socklen_t*>) override;
 
 protected:
     void set_direction(Direction direction) { m_direction = direction; }
@@ -175,9 +215,54 @@ private:
 
     static NetworkOrdered<u16> compute_tcp_checksum(const IPv4Address& source, const IPv4Address& destination, const TCPPacket&, u16 payload_size);
 
+    struct OutgoingPacket {
+        u32 sequence_number { 0 };
+        u16 flags { 0 };
+        ByteBuffer payload;
+        int tx_counter { 0 };
+        u32 tx_time { 0 };
+
+        // Loss recovery scoreboard: whether the peer told us it has this
+        // segment, whether we think it was lost, and whether it was resent
+        // since the current recovery started.
+        bool sacked { false };
+        bool lost { false };
+        bool retransmitted { false };
+
+        // SYN and FIN take up a sequence number of their own.
+        u32 sequence_length() const { return payload.size() + ((flags & (TCPFlags::SYN | TCPFlags::FIN)) ? 1 : 0); }
+    };
+
+    struct OutOfOrderSegment {
+        u32 sequence_number { 0 };
+        size_t size { 0 };
+        NonnullRefPtr<PacketBuffer> packet;
+    };
+
+    ByteBuffer build_packet(u16 flags, u32 sequence_number, const void* payload, size_t payload_size);
+    void transmit(OutgoingPacket&);
+    void retransmit(OutgoingPacket&);
+    void send_data();
+    u32 advertised_window() const;
+    u32 bytes_in_flight() const;
+    void update_rtt(u32 sample);
+    void update_congestion_window(size_t acked_bytes);
+    void process_sack_blocks(const u32* blocks, size_t count);
+    size_t build_sack_option(u8* options, size_t space) const;
+    void mark_lost_segments();
+    void enter_fast_recovery();
+    void did_retransmission_timeout();
+    void start_persist_timer();
+    void send_window_probe();
+    void start_retransmission_timer();
+    void stop_retransmission_timer();
+    u32 next_timer_deadline() const;
+    void arm_timer();
+    void check_timers();
+
     virtual void shut_down_for_writing() override;
 
-    virtual KResultOr<size_t> protocol_receive(const KBuffer&, void* buffer, size_t buffer_size, int flags) override;
+    virtual ReadonlyBytes protocol_payload(const PacketBuffer&) const override;
     virtual KResultOr<size_t> protocol_send(const void*, size_t) override;
     virtual KResult protocol_connect(FileDescription&, ShouldBlock) override;
     virtual int protocol_allocate_local_port() override;
@@ -198,15 +283,91 @@ private:
     u32 m_packets_out { 0 };
     u32 m_bytes_out { 0 };
 
-    struct OutgoingPacket {
-        u32 ack_number { 0 };
-        ByteBuffer buffer;
-        int tx_counter { 0 };
-        timeval tx_time { 0, 0 };
-    };
+    // Guards everything below, which is touched both by NetworkTask and
+    // by the threads reading and writing the socket.
+    Lock m_send_lock { "TCPSocket send state" };
 
-    Lock m_not_acked_lock { "TCPSocket unacked packets" };
+    // Segments that have been sent but not acknowledged yet, in order.
     SinglyLinkedList<OutgoingPacket> m_not_acked;
+    size_t m_not_acked_size { 0 };
+
+    // Data written to the socket that the windows didn't let us send yet.
+    // It's only cut into segments when it goes out, so every segment is as
+    // large as the MSS and the windows allow.
+    SinglyLinkedList<ByteBuffer> m_unsent;
+    size_t m_unsent_offset { 0 };
+    size_t m_unsent_size { 0 };
+    bool m_fin_pending { false };
+
+    // Whether segments smaller than the MSS go out right away (TCP_NODELAY),
+    // or are held back until uncorked (TCP_CORK). Otherwise, Nagle's
+    // algorithm applies.
+    bool m_no_delay { false };
+    bool m_corked { false };
+
+    // Segments we received but didn't acknowledge yet.
+    u32 m_segments_since_ack { 0 };
+
+    u32 m_send_unacknowledged { 0 };
+    size_t m_max_segment_size { 536 };
+
+    // What the peer lets us send (its advertised window), and what the
+    // network lets us send (the congestion window, managed NewReno style).
+    u32 m_send_window { 0 };
+    u32 m_congestion_window { 0 };
+    u32 m_slow_start_threshold { 0 };
+    u32 m_bytes_acked_in_congestion_avoidance { 0 };
+
+    // RFC 7323 window scaling and timestamps.
+    bool m_window_scaling_enabled { false };
+    bool m_timestamps_enabled { false };
+    u8 m_send_window_scale { 0 };
+    u8 m_receive_window_scale { 0 };
+    u32 m_timestamp_recent { 0 };
+
+    // Round trip time estimation and retransmission timeout as per RFC 6298,
+    // all in milliseconds. The smoothed RTT is 0 until we have a sample.
+    u32 m_smoothed_rtt { 0 };
+    u32 m_rtt_variance { 0 };
+    u32 m_retransmission_timeout { 1000 };
+
+    // When the retransmission timer, the delayed ACK and the next zero window
+    // probe are due (0 if they aren't pending), and when the TimerQueue timer
+    // that wakes NetworkTask to check on them goes off. The latter is only
+    // re-armed when it's late, not whenever an ACK pushes the retransmission
+    // deadline out. Window probes back off like retransmissions do.
+    u32 m_retransmission_deadline { 0 };
+    u32 m_delayed_ack_deadline { 0 };
+    u32 m_persist_deadline { 0 };
+    u32 m_persist_backoff { 0 };
+    u32 m_timer_expiry { 0 };
+    TimerId m_timer_id { 0 };
+
+    // Fast retransmit and NewReno / SACK based loss recovery.
+    u32 m_duplicate_ack_count { 0 };
+    bool m_in_recovery { false };
+    u32 m_recovery_point { 0 };
+    u32 m_highest_sacked { 0 };
+    u32 m_bytes_sacked { 0 };
+    u32 m_bytes_lost { 0 };
+
+    u32 m_retransmissions { 0 };
+    u32 m_fast_retransmissions { 0 };
+    u32 m_retransmission_timeouts { 0 };
+
+    // Selective acknowledgements (RFC 2018), and what we keep around on the
+    // receiving side to make them worthwhile.
+    bool m_sack_enabled { false };
+    SinglyLinkedList<OutOfOrderSegment> m_out_of_order;
+    size_t m_out_of_order_size { 0 };
+    u32 m_last_out_of_order_sequence { 0 };
+
+    // The receive window grows along with how fast the application drains
+    // the receive buffer, measured once per round trip.
+    u32 m_receive_window_limit { 0 };
+    u32 m_last_advertised_window { 0 };
+    u32 m_bytes_read_in_interval { 0 };
+    u32 m_read_interval_start { 0 };
 };
 
 }
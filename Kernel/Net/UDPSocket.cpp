@@ -79,15 +79,12 @@ NonnullRefPtr<UDPSocket> UDPSocket::create(int protocol)
     return adopt(*new UDPSocket(protocol));
 }
 
-KResultOr<size_t> UDPSocket::protocol_receive(const KBuffer& packet_buffer, void* buffer, size_t buffer_size, int flags)
+ReadonlyBytes UDPSocket::protocol_payload(const PacketBuffer& packet_buffer) const
 {
-    (void)flags;
     auto& ipv4_packet = *(const IPv4Packet*)(packet_buffer.data());
     auto& udp_packet = *static_cast<const UDPPacket*>(ipv4_packet.payload());
     ASSERT(udp_packet.length() >= sizeof(UDPPacket)); // FIXME: This should be rejected earlier.
-    ASSERT(buffer_size >= (udp_packet.length() - sizeof(UDPPacket)));
-    memcpy(buffer, udp_packet.payload(), udp_packet.length() - sizeof(UDPPacket));
-    return udp_packet.length() - sizeof(UDPPacket);
+    return { (const u8*)udp_packet.payload(), udp_packet.length() - sizeof(UDPPacket) };
 }
 
 KResultOr<size_t> UDPSocket::protocol_send(const void* data, size_t data_length)
@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <AK/StringView.h>
+#include <Kernel/Net/VirtIONetworkAdapter.h>
+#include <Kernel/StdLib.h>
+#include <Kernel/Thread.h>
+#include <Kernel/VM/MemoryManager.h>
+
+namespace Kernel {
+
+//#define VIRTIO_NET_DEBUG
+
+#define VIRTIO_NET_F_MAC (1u << 5)
+#define VIRTIO_NET_F_STATUS (1u << 16)
+
+#define VIRTIO_NET_CONFIG_MAC 0
+#define VIRTIO_NET_CONFIG_STATUS 6
+
+#define VIRTIO_NET_S_LINK_UP 1
+
+#define RECEIVEQ 0
+#define TRANSMITQ 1
+
+// Every packet is preceded by this header. We don't negotiate any of the
+// offloads, so all of it stays zero on transmit and is ignored on receive.
+struct [[gnu::packed]] VirtIONetHeader {
+    u8 flags;
+    u8 gso_type;
+    u16 header_length;
+    u16 gso_size;
+    u16 checksum_start;
+    u16 checksum_offset;
+};
+
+// Keep the payload nicely aligned behind the header.
+static constexpr size_t payload_offset = 16;
+
+void VirtIONetworkAdapter::detect()
+{
+    PCI::enumerate([&](const PCI::Address& address, PCI::ID id) {
+        if (address.is_null())
+            return;
+        if (id.vendor_id != VIRTIO_PCI_VENDOR_ID || id.device_id != VIRTIO_PCI_NETWORK_DEVICE_ID)
+            return;
+        (void)adopt(*new VirtIONetworkAdapter(address)).leak_ref();
+    });
+}
+
+VirtIONetworkAdapter::VirtIONetworkAdapter(PCI::Address address)
+    : VirtIODevice(address, "VirtIONetworkAdapter")
+{
+    set_interface_name("virtio");
+    m_initialized = initialize();
+    if (!m_initialized)
+        fail_initialization();
+}
+
+VirtIONetworkAdapter::~VirtIONetworkAdapter()
+{
+}
+
+bool VirtIONetworkAdapter::initialize()
+{
+    if (!negotiate_features(VIRTIO_NET_F_MAC | VIRTIO_NET_F_STATUS | VIRTIO_RING_F_EVENT_IDX))
+        return false;
+    if (!setup_queue(RECEIVEQ) || !setup_queue(TRANSMITQ))
+        return false;
+
+    if (is_feature_accepted(VIRTIO_NET_F_MAC)) {
+        u8 mac[6];
+        for (size_t i = 0; i < 6; ++i)
+            mac[i] = config_read8(VIRTIO_NET_CONFIG_MAC + i);
+        set_mac_address(mac);
+    }
+    if (is_feature_accepted(VIRTIO_NET_F_STATUS))
+        m_link_up = config_read16(VIRTIO_NET_CONFIG_STATUS) & VIRTIO_NET_S_LINK_UP;
+
+    // Each buffer takes two descriptors, one for the header and one for the
+    // packet, so that we don't depend on VIRTIO_F_ANY_LAYOUT.
+    m_rx_buffer_count = min((size_t)128, (size_t)queue(RECEIVEQ).size() / 2);
+    m_tx_buffer_count = min((size_t)32, (size_t)queue(TRANSMITQ).size() / 2);
+    m_rx_buffers_region = MM.allocate_contiguous_kernel_region(PAGE_ROUND_UP(m_rx_buffer_count * buffer_size), "VirtIONetworkAdapter RX", Region::Access::Read | Region::Access::Write);
+    m_tx_buffers_region = MM.allocate_contiguous_kernel_region(PAGE_ROUND_UP(m_tx_buffer_count * buffer_size), "VirtIONetworkAdapter TX", Region::Access::Read | Region::Access::Write);
+    if (!m_rx_buffers_region || !m_tx_buffers_region)
+        return false;
+
+    {
+        auto& rx_queue = queue(RECEIVEQ);
+        ScopedSpinLock lock(rx_queue.lock());
+        for (size_t i = 0; i < m_rx_buffer_count; ++i) {
+            if (!supply_rx_buffer(i))
+                return false;
+        }
+        rx_queue.publish();
+    }
+    for (size_t i = 0; i < m_tx_buffer_count; ++i)
+        m_free_tx_buffers.append(i);
+    // We only want to hear about sent packets when we run out of buffers,
+    // everything else gets reclaimed on the next send_raw().
+    queue(TRANSMITQ).disable_interrupts();
+
+    const auto& mac = mac_address();
+    klog() << "VirtIONetworkAdapter: MAC address: " << String::format("%b", mac[0]) << ":" << String::format("%b", mac[1]) << ":" << String::format("%b", mac[2]) << ":" << String::format("%b", mac[3]) << ":" << String::format("%b", mac[4]) << ":" << String::format("%b", mac[5]);
+
+    finish_initialization();
+    notify_queue(RECEIVEQ);
+    return true;
+}
+
+bool VirtIONetworkAdapter::supply_rx_buffer(size_t index)
+{
+    auto paddr = m_rx_buffers_region->physical_page(index * buffer_size / PAGE_SIZE)->paddr().offset(index * buffer_size % PAGE_SIZE);
+    VirtIOQueue::Buffer buffers[] = {
+        { paddr, sizeof(VirtIONetHeader), true },
+        { paddr.offset(payload_offset), buffer_size - payload_offset, true },
+    };
+    return queue(RECEIVEQ).add_buffers({ buffers, 2 }, (void*)(FlatPtr)index);
+}
+
+bool VirtIONetworkAdapter::link_up()
+{
+    return m_link_up;
+}
+
+void VirtIONetworkAdapter::handle_config_change()
+{
+    if (is_feature_accepted(VIRTIO_NET_F_STATUS))
+        m_link_up = config_read16(VIRTIO_NET_CONFIG_STATUS) & VIRTIO_NET_S_LINK_UP;
+}
+
+void VirtIONetworkAdapter::handle_queue_update()
+{
+    receive();
+
+    auto& tx_queue = queue(TRANSMITQ);
+    ScopedSpinLock lock(tx_queue.lock());
+    tx_queue.disable_interrupts();
+    m_tx_wait_queue.wake_all();
+}
+
+void VirtIONetworkAdapter::receive()
+{
+    auto& rx_queue = queue(RECEIVEQ);
+    for (;;) {
+        void* token;
+        u32 length;
+        size_t index;
+        {
+            ScopedSpinLock lock(rx_queue.lock());
+            rx_queue.disable_interrupts();
+            if (!rx_queue.take_used(token, length)) {
+                // Hand all the buffers we got through back in one go.
+                bool should_notify = rx_queue.publish();
+                bool is_drained = rx_queue.enable_interrupts();
+                if (should_notify)
+                    notify_queue(RECEIVEQ);
+                if (is_drained)
+                    return;
+                continue;
+            }
+            index = (FlatPtr)token;
+        }
+#ifdef VIRTIO_NET_DEBUG
+        klog() << "VirtIONetworkAdapter: Received " << length << " bytes in buffer " << index;
+#endif
+        if (length > sizeof(VirtIONetHeader))
+            did_receive({ rx_buffer(index).offset(payload_offset).as_ptr(), length - sizeof(VirtIONetHeader) });
+
+        ScopedSpinLock lock(rx_queue.lock());
+        bool did_supply = supply_rx_buffer(index);
+        ASSERT(did_supply);
+    }
+}
+
+void VirtIONetworkAdapter::reclaim_tx_buffers()
+{
+    auto& tx_queue = queue(TRANSMITQ);
+    ASSERT(tx_queue.lock().is_locked());
+    void* token;
+    u32 length;
+    while (tx_queue.take_used(token, length))
+        m_free_tx_buffers.append((FlatPtr)token);
+}
+
+void VirtIONetworkAdapter::send_raw(ReadonlyBytes payload)
+{
+    ASSERT(payload.size() <= buffer_size - payload_offset);
+    auto& tx_queue = queue(TRANSMITQ);
+
+    for (;;) {
+        cli();
+        ScopedSpinLock lock(tx_queue.lock());
+        reclaim_tx_buffers();
+        if (!m_free_tx_buffers.is_empty()) {
+            size_t index = m_free_tx_buffers.take_last();
+            auto* buffer = tx_buffer(index).as_ptr();
+            memset(buffer, 0, sizeof(VirtIONetHeader));
+            memcpy(buffer + payload_offset, payload.data(), payload.size());
+
+            auto paddr = m_tx_buffers_region->physical_page(index * buffer_size / PAGE_SIZE)->paddr().offset(index * buffer_size % PAGE_SIZE);
+            VirtIOQueue::Buffer buffers[] = {
+                { paddr, sizeof(VirtIONetHeader), false },
+                { paddr.offset(payload_offset), (u32)payload.size(), false },
+            };
+            bool did_add = tx_queue.add_buffers({ buffers, 2 }, (void*)(FlatPtr)index);
+            ASSERT(did_add);
+            bool should_notify = tx_queue.publish();
+            lock.unlock();
+            sti();
+            if (should_notify)
+                notify_queue(TRANSMITQ);
+            return;
+        }
+        // Out of buffers, so wait for the device to give some back. If it
+        // already did in the meantime, just go around again.
+        if (!tx_queue.enable_interrupts())
+            continue;
+        lock.unlock();
+        Thread::current()->wait_on(m_tx_wait_queue, "VirtIONetworkAdapter");
+    }
+}
+
+}
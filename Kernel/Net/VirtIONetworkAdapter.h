@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <AK/OwnPtr.h>
+#include <Kernel/Net/NetworkAdapter.h>
+#include <Kernel/VirtIO/VirtIO.h>
+#include <Kernel/WaitQueue.h>
+
+namespace Kernel {
+
+class VirtIONetworkAdapter final : public NetworkAdapter
+    , public VirtIODevice {
+public:
+    static void detect();
+
+    explicit VirtIONetworkAdapter(PCI::Address);
+    virtual ~VirtIONetworkAdapter() override;
+
+    virtual void send_raw(ReadonlyBytes) override;
+    virtual bool link_up() override;
+
+    bool is_initialized() const { return m_initialized; }
+
+private:
+    virtual const char* class_name() const override { return "VirtIONetworkAdapter"; }
+
+    // ^VirtIODevice
+    virtual void handle_queue_update() override;
+    virtual void handle_config_change() override;
+
+    bool initialize();
+    void receive();
+    void reclaim_tx_buffers();
+    bool supply_rx_buffer(size_t index);
+
+    VirtualAddress rx_buffer(size_t index) const { return m_rx_buffers_region->vaddr().offset(index * buffer_size); }
+    VirtualAddress tx_buffer(size_t index) const { return m_tx_buffers_region->vaddr().offset(index * buffer_size); }
+
+    static constexpr size_t buffer_size = 2048;
+
+    bool m_initialized { false };
+    bool m_link_up { true };
+
+    OwnPtr<Region> m_rx_buffers_region;
+    OwnPtr<Region> m_tx_buffers_region;
+    size_t m_rx_buffer_count { 0 };
+    size_t m_tx_buffer_count { 0 };
+    Vector<u16> m_free_tx_buffers;
+
+    WaitQueue m_tx_wait_queue;
+};
+
+}
@@ -602,6 +602,29 @@ siginfo_t Process::reap(Process& process)
     return siginfo;
 }
 
+void Process::reap_unparented_processes()
+{
+    InterruptDisabler disabler;
+    // Reaping a process may leave its own dead children without a parent,
+    // so keep going until there's nobody left to reap.
+    bool did_reap;
+    do {
+        did_reap = false;
+        Process::for_each([&](Process& process) {
+            if (!process.is_dead())
+                return IterationDecision::Continue;
+            if (!!process.ppid() && Process::from_pid(process.ppid()))
+                return IterationDecision::Continue;
+            auto name = process.name();
+            auto pid = process.pid();
+            auto exit_status = Process::reap(process);
+            dbg() << "Reaped unparented process " << name << "(" << pid.value() << "), exit status: " << exit_status.si_status;
+            did_reap = true;
+            return IterationDecision::Continue;
+        });
+    } while (did_reap);
+}
+
 bool Process::validate_read_from_kernel(VirtualAddress vaddr, size_t size) const
 {
     if (vaddr.is_null())
@@ -671,6 +694,13 @@ void Process::finalize()
     m_root_directory_relative_to_global_root = nullptr;
 
     disown_all_shared_buffers();
+    {
+        ScopedSpinLock lock(g_scheduler_lock);
+        if (m_alarm_timer_id) {
+            TimerQueue::the().cancel_timer(m_alarm_timer_id);
+            m_alarm_timer_id = 0;
+        }
+    }
     {
         InterruptDisabler disabler;
         // FIXME: PID/TID BUG
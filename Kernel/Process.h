@@ -42,6 +42,7 @@
 #include <Kernel/ProcessGroup.h>
 #include <Kernel/StdLib.h>
 #include <Kernel/Thread.h>
+#include <Kernel/TimerQueue.h>
 #include <Kernel/UnixTypes.h>
 #include <Kernel/VM/RangeAllocator.h>
 #include <LibC/signal_numbers.h>
@@ -195,6 +196,7 @@ public:
 
     int sys$yield();
     int sys$sync();
+    int sys$fsync(int fd);
     int sys$beep();
     int sys$get_process_name(Userspace<char*> buffer, size_t buffer_size);
     int sys$set_process_name(Userspace<const char*> user_name, size_t user_name_length);
@@ -224,6 +226,10 @@ public:
     ssize_t sys$read(int fd, Userspace<u8*>, ssize_t);
     ssize_t sys$write(int fd, const u8*, ssize_t);
     ssize_t sys$writev(int fd, const struct iovec* iov, int iov_count);
+    ssize_t sys$readv(int fd, const struct iovec* iov, int iov_count);
+    ssize_t sys$pread(Userspace<const Syscall::SC_pread_params*>);
+    ssize_t sys$pwrite(Userspace<const Syscall::SC_pwrite_params*>);
+    ssize_t sys$sendfile(Userspace<const Syscall::SC_sendfile_params*>);
     int sys$fstat(int fd, Userspace<stat*>);
     int sys$stat(Userspace<const Syscall::SC_stat_params*>);
     int sys$lseek(int fd, off_t, int whence);
@@ -349,6 +355,7 @@ public:
 
     [[noreturn]] void crash(int signal, u32 eip, bool out_of_memory = false);
     [[nodiscard]] static siginfo_t reap(Process&);
+    static void reap_unparented_processes();
 
     const TTY* tty() const { return m_tty; }
     void set_tty(TTY*);
@@ -499,6 +506,7 @@ public:
         return m_euid == 0;
     }
 
+    Range allocate_range(VirtualAddress, size_t, size_t alignment = PAGE_SIZE);
     Region* allocate_region_with_vmobject(VirtualAddress, size_t, NonnullRefPtr<VMObject>, size_t offset_in_vmobject, const String& name, int prot);
     Region* allocate_region(VirtualAddress, size_t, const String& name, int prot = PROT_READ | PROT_WRITE, bool should_commit = true);
     Region* allocate_region_with_vmobject(const Range&, NonnullRefPtr<VMObject>, size_t offset_in_vmobject, const String& name, int prot);
@@ -579,7 +587,6 @@ private:
     Process(Thread*& first_thread, const String& name, uid_t, gid_t, ProcessID ppid, RingLevel, RefPtr<Custody> cwd = nullptr, RefPtr<Custody> executable = nullptr, TTY* = nullptr, Process* fork_parent = nullptr);
     static ProcessID allocate_pid();
 
-    Range allocate_range(VirtualAddress, size_t, size_t alignment = PAGE_SIZE);
 
     Region& add_region(NonnullOwnPtr<Region>);
 
@@ -692,6 +699,7 @@ private:
     mutable SpinLock<u32> m_lock;
 
     u64 m_alarm_deadline { 0 };
+    TimerId m_alarm_timer_id { 0 };
 
     int m_icon_id { -1 };
 
@@ -703,8 +711,7 @@ private:
     VeilState m_veil_state { VeilState::None };
     Vector<UnveiledPath> m_unveiled_paths;
 
-    WaitQueue& futex_queue(Userspace<const i32*>);
-    HashMap<u32, OwnPtr<WaitQueue>> m_futex_queues;
+    KResultOr<FutexKey> futex_key_for(Userspace<const i32*>);
 
     OwnPtr<PerformanceEventBuffer> m_perf_event_buffer;
 
@@ -63,12 +63,238 @@ void Scheduler::init_thread(Thread& thread)
     g_scheduler_data->m_nonrunnable_threads.append(thread);
 }
 
+// One time slice unit == 1ms
+static constexpr u32 default_time_slice = 10;
+
+// Threads left waiting in a ready queue for this many ticks gain a bit of
+// extra priority, so that low priority threads can't be starved forever.
+static constexpr u64 ready_queue_aging_ticks = default_time_slice;
+
 static u32 time_slice_for(const Thread& thread)
 {
-    // One time slice unit == 1ms
     if (&thread == Processor::current().idle_thread())
         return 1;
-    return 10;
+    return default_time_slice;
+}
+
+static u32 ready_queue_bucket_for(const Thread& thread)
+{
+    // Higher priority threads go into higher buckets, which are served first.
+    auto priority = min(thread.effective_priority(), (u32)THREAD_PRIORITY_MAX);
+    return priority * (ThreadReadyQueue::bucket_count - 1) / THREAD_PRIORITY_MAX;
+}
+
+static u32 highest_ready_bucket(const ThreadReadyQueue& queue)
+{
+    ASSERT(!queue.is_empty());
+    return 31 - count_leading_zeroes_32(queue.m_bucket_mask);
+}
+
+static bool can_run_on(Thread& thread, u32 cpu)
+{
+    if ((thread.affinity() & (1u << cpu)) == 0)
+        return false;
+    // While a process is exec()'ing, only the thread doing so may run.
+    auto exec_tid = thread.process().exec_tid();
+    return !exec_tid || exec_tid == thread.tid();
+}
+
+static Thread* find_ready_thread(ThreadReadyQueue& queue, u32 cpu)
+{
+    for (u32 mask = queue.m_bucket_mask; mask;) {
+        u32 bucket = 31 - count_leading_zeroes_32(mask);
+        for (auto& thread : queue.m_buckets[bucket]) {
+            if (can_run_on(thread, cpu))
+                return &thread;
+        }
+        mask &= ~(1u << bucket);
+    }
+    return nullptr;
+}
+
+static void reschedule_this_processor()
+{
+    Processor::current().invoke_scheduler_async();
+}
+
+static void wake_processor(u32 cpu)
+{
+    ASSERT(cpu != Processor::current().id());
+    // Clear the idle bit right away so that we don't keep sending IPIs to
+    // a processor that is already on its way into the scheduler.
+    g_scheduler_data->m_idle_processors &= ~(1u << cpu);
+    Processor::smp_unicast(cpu, reschedule_this_processor, true);
+}
+
+static u32 pick_processor_for(Thread& thread)
+{
+    auto& data = *g_scheduler_data;
+    u32 allowed = thread.affinity() & data.m_online_processors;
+    if (!allowed) {
+        // None of the processors this thread may run on are scheduling yet.
+        // Park it on the first one, it'll get picked up once that comes online.
+        ASSERT(thread.affinity() != 0);
+        return count_trailing_zeroes_32(thread.affinity());
+    }
+
+    // Prefer the processor the thread last ran on if it's idle, then any
+    // other idle one. Otherwise stay put to keep the caches warm, unless
+    // that processor is noticeably busier than the others.
+    u32 last_cpu = thread.cpu();
+    bool may_use_last_cpu = last_cpu < SchedulerData::max_processors && (allowed & (1u << last_cpu));
+    if (may_use_last_cpu && (data.m_idle_processors & (1u << last_cpu)))
+        return last_cpu;
+    if (u32 idle = allowed & data.m_idle_processors)
+        return count_trailing_zeroes_32(idle);
+
+    u32 best_cpu = may_use_last_cpu ? last_cpu : count_trailing_zeroes_32(allowed);
+    for (u32 mask = allowed; mask; mask &= mask - 1) {
+        u32 cpu = count_trailing_zeroes_32(mask);
+        if (data.m_ready_queues[cpu].m_count + 1 < data.m_ready_queues[best_cpu].m_count)
+            best_cpu = cpu;
+    }
+    return best_cpu;
+}
+
+void Scheduler::queue_runnable_thread(Thread& thread)
+{
+    ASSERT(g_scheduler_lock.own_lock());
+    auto cpu = pick_processor_for(thread);
+    thread.m_ready_queue_cpu = cpu;
+    auto& queue = g_scheduler_data->m_ready_queues[cpu];
+    {
+        ScopedSpinLock queue_lock(queue.m_lock);
+        queue.enqueue(thread, ready_queue_bucket_for(thread));
+    }
+#ifdef SCHEDULER_DEBUG
+    dbg() << "Scheduler[" << Processor::current().id() << "]: Queued " << thread << " on cpu #" << cpu;
+#endif
+    if (cpu != Processor::current().id() && (g_scheduler_data->m_idle_processors & (1u << cpu)))
+        wake_processor(cpu);
+}
+
+void Scheduler::dequeue_runnable_thread(Thread& thread)
+{
+    ASSERT(g_scheduler_lock.own_lock());
+    auto& queue = g_scheduler_data->m_ready_queues[thread.m_ready_queue_cpu];
+    ScopedSpinLock queue_lock(queue.m_lock);
+    queue.dequeue(thread);
+}
+
+Thread* Scheduler::steal_ready_thread(u32 cpu)
+{
+    // We have nothing to do, so take the best thread we're allowed to run
+    // from whichever processor has the most threads waiting.
+    auto& data = *g_scheduler_data;
+    Thread* stolen_thread = nullptr;
+    u32 victim_count = 0;
+    for (u32 victim = 0; victim < SchedulerData::max_processors; victim++) {
+        auto& queue = data.m_ready_queues[victim];
+        if (victim == cpu || queue.m_count <= victim_count)
+            continue;
+        if (auto* thread = find_ready_thread(queue, cpu)) {
+            stolen_thread = thread;
+            victim_count = queue.m_count;
+        }
+    }
+    if (stolen_thread) {
+        data.m_ready_queues[cpu].m_steals++;
+#ifdef SCHEDULER_DEBUG
+        dbg() << "Scheduler[" << cpu << "]: Stole " << *stolen_thread << " from cpu #" << stolen_thread->m_ready_queue_cpu;
+#endif
+    }
+    return stolen_thread;
+}
+
+void Scheduler::age_ready_queues()
+{
+    ASSERT(g_scheduler_lock.own_lock());
+    for (auto& queue : g_scheduler_data->m_ready_queues) {
+        ScopedSpinLock queue_lock(queue.m_lock);
+        if (queue.is_empty())
+            continue;
+        // Walk downwards so that a thread bumped into a higher bucket
+        // doesn't get aged twice in the same pass.
+        for (int bucket = (int)highest_ready_bucket(queue) - 1; bucket >= 0; bucket--) {
+            auto& list = queue.m_buckets[bucket];
+            for (auto it = list.begin(); it != list.end();) {
+                auto& thread = *it;
+                ++it;
+                thread.m_extra_priority++;
+                auto new_bucket = ready_queue_bucket_for(thread);
+                if (new_bucket == (u32)bucket)
+                    continue;
+                queue.dequeue(thread);
+                queue.enqueue(thread, new_bucket);
+            }
+        }
+    }
+}
+
+void Scheduler::balance_ready_queues()
+{
+    ASSERT(g_scheduler_lock.own_lock());
+    auto& data = *g_scheduler_data;
+    u32 current_cpu = Processor::current().id();
+
+    // Only the boot processor gets timer interrupts, so the others need a
+    // nudge when threads are waiting on them and they either went idle or
+    // the thread they are running has used up its time slice.
+    for (u32 mask = data.m_online_processors & ~(1u << current_cpu); mask; mask &= mask - 1) {
+        u32 cpu = count_trailing_zeroes_32(mask);
+        auto& queue = data.m_ready_queues[cpu];
+        if (queue.is_empty())
+            continue;
+        if ((data.m_idle_processors & (1u << cpu)) || g_uptime - queue.m_last_switch_uptime >= default_time_slice)
+            wake_processor(cpu);
+    }
+
+    // Move at most one thread per pass from the busiest to the least busy
+    // processor. Stealing takes care of the rest once a processor runs dry.
+    u32 busiest_cpu = current_cpu;
+    u32 least_busy_cpu = current_cpu;
+    for (u32 mask = data.m_online_processors; mask; mask &= mask - 1) {
+        u32 cpu = count_trailing_zeroes_32(mask);
+        if (data.m_ready_queues[cpu].m_count > data.m_ready_queues[busiest_cpu].m_count)
+            busiest_cpu = cpu;
+        if (data.m_ready_queues[cpu].m_count < data.m_ready_queues[least_busy_cpu].m_count)
+            least_busy_cpu = cpu;
+    }
+    auto& busiest_queue = data.m_ready_queues[busiest_cpu];
+    auto& least_busy_queue = data.m_ready_queues[least_busy_cpu];
+    if (busiest_queue.m_count < least_busy_queue.m_count + 2)
+        return;
+    auto* thread = find_ready_thread(busiest_queue, least_busy_cpu);
+    if (!thread)
+        return;
+    {
+        // Other processors only ever take their own queue's lock without
+        // holding g_scheduler_lock, so the order we take these in doesn't matter.
+        ScopedSpinLock busiest_lock(busiest_queue.m_lock);
+        ScopedSpinLock least_busy_lock(least_busy_queue.m_lock);
+        busiest_queue.dequeue(*thread);
+        thread->m_ready_queue_cpu = least_busy_cpu;
+        least_busy_queue.enqueue(*thread, ready_queue_bucket_for(*thread));
+        least_busy_queue.m_migrations++;
+    }
+#ifdef SCHEDULER_DEBUG
+    dbg() << "Scheduler[" << current_cpu << "]: Migrated " << *thread << " from cpu #" << busiest_cpu << " to cpu #" << least_busy_cpu;
+#endif
+    if (least_busy_cpu != current_cpu && (data.m_idle_processors & (1u << least_busy_cpu)))
+        wake_processor(least_busy_cpu);
+}
+
+SchedulerProcessorStatistics Scheduler::processor_statistics(u32 cpu)
+{
+    ASSERT(cpu < SchedulerData::max_processors);
+    ScopedSpinLock lock(g_scheduler_lock);
+    auto& queue = g_scheduler_data->m_ready_queues[cpu];
+    SchedulerProcessorStatistics statistics;
+    statistics.context_switches = queue.m_context_switches;
+    statistics.steals = queue.m_steals;
+    statistics.migrations = queue.m_migrations;
+    statistics.ready_threads = queue.m_count;
+    return statistics;
 }
 
 timeval Scheduler::time_since_boot()
@@ -333,15 +559,79 @@ void Scheduler::start()
     ASSERT_NOT_REACHED();
 }
 
+void Scheduler::check_blocked_threads()
+{
+    ASSERT(g_scheduler_lock.own_lock());
+    auto now = time_since_boot();
+
+    // Check and unblock threads whose wait conditions have been met.
+    Scheduler::for_each_nonrunnable([&](Thread& thread) {
+        thread.consider_unblock(now.tv_sec, now.tv_usec);
+        return IterationDecision::Continue;
+    });
+}
+
+void Scheduler::dispatch_pending_signals()
+{
+    // This writes to the threads' user stacks, which may fault, so it must
+    // not be done from an IRQ handler.
+    ASSERT(!Processor::current().in_irq());
+    ASSERT(g_scheduler_lock.own_lock());
+    auto& threads = g_scheduler_data->m_signal_pending_threads;
+    for (auto it = threads.begin(); it != threads.end();) {
+        auto& thread = *it;
+        ++it;
+        if (!thread.m_pending_signals || thread.state() == Thread::Dead || thread.state() == Thread::Dying) {
+            threads.remove(thread);
+            continue;
+        }
+        ScopedSpinLock lock(thread.get_lock());
+        if (!thread.has_unmasked_pending_signals())
+            continue;
+        // NOTE: dispatch_one_pending_signal() may unblock the process.
+        bool was_blocked = thread.is_blocked();
+        if (thread.dispatch_one_pending_signal() == ShouldUnblockThread::No)
+            continue;
+        if (was_blocked) {
+#ifdef SCHEDULER_DEBUG
+            dbg() << "Scheduler[" << Processor::current().id() << "]:Unblock " << thread << " due to signal";
+#endif
+            ASSERT(thread.m_blocker != nullptr);
+            thread.m_blocker->set_interrupted_by_signal();
+            thread.unblock();
+        }
+    }
+}
+
+Thread* Scheduler::choose_next_thread(Thread& current_thread, u32 cpu)
+{
+    ASSERT(g_scheduler_lock.own_lock());
+    auto& proc = Processor::current();
+    auto& ready_queue = g_scheduler_data->m_ready_queues[cpu];
+
+    // Keep running the current thread unless something of at least the same
+    // priority is waiting for us, in which case we round-robin. Only when we
+    // would otherwise go idle do we look at other processors' queues.
+    bool current_may_continue = &current_thread != proc.idle_thread()
+        && current_thread.state() == Thread::Running
+        && can_run_on(current_thread, cpu);
+
+    Thread* thread_to_schedule = nullptr;
+    if (!current_may_continue || (!ready_queue.is_empty() && highest_ready_bucket(ready_queue) >= ready_queue_bucket_for(current_thread)))
+        thread_to_schedule = find_ready_thread(ready_queue, cpu);
+    if (!thread_to_schedule && !current_may_continue)
+        thread_to_schedule = steal_ready_thread(cpu);
+
+    if (!thread_to_schedule)
+        thread_to_schedule = current_may_continue ? &current_thread : proc.idle_thread();
+    return thread_to_schedule;
+}
+
 bool Scheduler::pick_next()
 {
     ASSERT_INTERRUPTS_DISABLED();
 
     auto current_thread = Thread::current();
-    auto now = time_since_boot();
-
-    auto now_sec = now.tv_sec;
-    auto now_usec = now.tv_usec;
 
     // Set the m_in_scheduler flag before acquiring the spinlock. This
     // prevents a recursive call into Scheduler::invoke_async upon
@@ -357,8 +647,6 @@ bool Scheduler::pick_next()
             scheduler_data.m_in_scheduler = false;
         });
 
-    ScopedSpinLock lock(g_scheduler_lock);
-
     if (current_thread->should_die() && current_thread->state() == Thread::Running) {
         // Rather than immediately killing threads, yanking the kernel stack
         // away from them (which can lead to e.g. reference leaks), we always
@@ -374,49 +662,29 @@ bool Scheduler::pick_next()
         current_thread->set_state(Thread::Dying);
     }
 
-    // Check and unblock threads whose wait conditions have been met.
-    Scheduler::for_each_nonrunnable([&](Thread& thread) {
-        thread.consider_unblock(now_sec, now_usec);
-        return IterationDecision::Continue;
-    });
-
-    Process::for_each([&](Process& process) {
-        if (process.is_dead()) {
-            if (current_thread->process().pid() != process.pid() && (!process.ppid() || !Process::from_pid(process.ppid()))) {
-                auto name = process.name();
-                auto pid = process.pid();
-                auto exit_status = Process::reap(process);
-                dbg() << "Scheduler[" << Processor::current().id() << "]: Reaped unparented process " << name << "(" << pid.value() << "), exit status: " << exit_status.si_status;
-            }
-            return IterationDecision::Continue;
-        }
-        if (process.m_alarm_deadline && g_uptime > process.m_alarm_deadline) {
-            process.m_alarm_deadline = 0;
-            // FIXME: Should we observe this signal somehow?
-            (void)process.send_signal(SIGALRM, nullptr);
+    auto& proc = Processor::current();
+    u32 cpu = proc.id();
+    auto& ready_queue = g_scheduler_data->m_ready_queues[cpu];
+
+    // Most of the time the current thread simply keeps running, and finding
+    // that out only takes a look at our own ready queue. g_scheduler_lock is
+    // only needed once we're going to switch to another thread, or when
+    // there are signals waiting to be dispatched.
+    bool has_pending_signals = !g_scheduler_data->m_signal_pending_threads.is_empty();
+    if (!has_pending_signals && current_thread != proc.idle_thread() && current_thread->state() == Thread::Running && can_run_on(*current_thread, cpu)) {
+        ScopedSpinLock queue_lock(ready_queue.m_lock);
+        if (ready_queue.is_empty() || highest_ready_bucket(ready_queue) < ready_queue_bucket_for(*current_thread)) {
+            current_thread->m_extra_priority = 0;
+            current_thread->set_ticks_left(time_slice_for(*current_thread));
+            current_thread->did_schedule();
+            ready_queue.m_last_switch_uptime = g_uptime;
+            return false;
         }
-        return IterationDecision::Continue;
-    });
+    }
 
-    // Dispatch any pending signals.
-    Thread::for_each_living([&](Thread& thread) -> IterationDecision {
-        ScopedSpinLock lock(thread.get_lock());
-        if (!thread.has_unmasked_pending_signals())
-            return IterationDecision::Continue;
-        // NOTE: dispatch_one_pending_signal() may unblock the process.
-        bool was_blocked = thread.is_blocked();
-        if (thread.dispatch_one_pending_signal() == ShouldUnblockThread::No)
-            return IterationDecision::Continue;
-        if (was_blocked) {
-#ifdef SCHEDULER_DEBUG
-            dbg() << "Scheduler[" << Processor::current().id() << "]:Unblock " << thread << " due to signal";
-#endif
-            ASSERT(thread.m_blocker != nullptr);
-            thread.m_blocker->set_interrupted_by_signal();
-            thread.unblock();
-        }
-        return IterationDecision::Continue;
-    });
+    ScopedSpinLock lock(g_scheduler_lock);
+
+    dispatch_pending_signals();
 
 #ifdef SCHEDULER_RUNNABLE_DEBUG
     dbg() << "Non-runnables:";
@@ -437,32 +705,8 @@ bool Scheduler::pick_next()
     });
 #endif
 
-    Vector<Thread*, 128> sorted_runnables;
-    for_each_runnable([&sorted_runnables](auto& thread) {
-        if ((thread.affinity() & (1u << Processor::current().id())) != 0)
-            sorted_runnables.append(&thread);
-        return IterationDecision::Continue;
-    });
-    quick_sort(sorted_runnables, [](auto& a, auto& b) { return a->effective_priority() >= b->effective_priority(); });
-
-    Thread* thread_to_schedule = nullptr;
-
-    for (auto* thread : sorted_runnables) {
-        if (thread->process().exec_tid() && thread->process().exec_tid() != thread->tid())
-            continue;
-
-        ASSERT(thread->state() == Thread::Runnable || thread->state() == Thread::Running);
-
-        if (!thread_to_schedule) {
-            thread->m_extra_priority = 0;
-            thread_to_schedule = thread;
-        } else {
-            thread->m_extra_priority++;
-        }
-    }
-
-    if (!thread_to_schedule)
-        thread_to_schedule = Processor::current().idle_thread();
+    auto* thread_to_schedule = choose_next_thread(*current_thread, cpu);
+    thread_to_schedule->m_extra_priority = 0;
 
 #ifdef SCHEDULER_DEBUG
     dbg() << "Scheduler[" << Processor::current().id() << "]: Switch to " << *thread_to_schedule << " @ " << String::format("%04x:%08x", thread_to_schedule->tss().cs, thread_to_schedule->tss().eip);
@@ -531,7 +775,7 @@ bool Scheduler::donate_to(Thread* beneficiary, const char* reason)
 
     (void)reason;
     unsigned ticks_left = Thread::current()->ticks_left();
-    if (!beneficiary || beneficiary->state() != Thread::Runnable || ticks_left <= 1)
+    if (!beneficiary || beneficiary->state() != Thread::Runnable || ticks_left <= 1 || !can_run_on(*beneficiary, proc.id()))
         return Scheduler::yield();
 
     unsigned ticks_to_donate = min(ticks_left - 1, time_slice_for(*beneficiary));
@@ -545,13 +789,25 @@ bool Scheduler::donate_to(Thread* beneficiary, const char* reason)
 
 bool Scheduler::context_switch(Thread* thread)
 {
+    ASSERT(g_scheduler_lock.own_lock());
     thread->set_ticks_left(time_slice_for(*thread));
     thread->did_schedule();
 
+    auto& proc = Processor::current();
+    u32 cpu_bit = 1u << proc.id();
+    auto& ready_queue = g_scheduler_data->m_ready_queues[proc.id()];
+    ready_queue.m_last_switch_uptime = g_uptime;
+    if (thread == proc.idle_thread())
+        g_scheduler_data->m_idle_processors |= cpu_bit & g_scheduler_data->m_online_processors;
+    else
+        g_scheduler_data->m_idle_processors &= ~cpu_bit;
+
     auto from_thread = Thread::current();
     if (from_thread == thread)
         return false;
 
+    ready_queue.m_context_switches++;
+
     if (from_thread) {
         // If the last process hasn't blocked (still marked as running),
         // mark it as runnable for the next round.
@@ -563,7 +819,6 @@ bool Scheduler::context_switch(Thread* thread)
 #endif
     }
 
-    auto& proc = Processor::current();
     if (!thread->is_initialized()) {
         proc.init_context(*thread, false);
         thread->set_initialized(true);
@@ -630,6 +885,12 @@ void Scheduler::prepare_for_idle_loop()
     auto& scheduler_data = Processor::current().get_scheduler_data();
     ASSERT(!scheduler_data.m_in_scheduler);
     scheduler_data.m_in_scheduler = true;
+
+    // From now on this processor picks threads from its ready queue and
+    // may be handed new ones. It starts out running its idle thread.
+    u32 cpu_bit = 1u << Processor::current().id();
+    g_scheduler_data->m_online_processors |= cpu_bit;
+    g_scheduler_data->m_idle_processors |= cpu_bit;
 }
 
 Process* Scheduler::colonel()
@@ -701,7 +962,16 @@ void Scheduler::timer_tick(const RegisterState& regs)
         }
     }
 
-    TimerQueue::the().fire();
+    {
+        // Timers, blocked threads and the ready queues are looked after here,
+        // once per tick, so that picking the next thread doesn't have to.
+        ScopedSpinLock lock(g_scheduler_lock);
+        TimerQueue::the().fire();
+        check_blocked_threads();
+        if (g_uptime % ready_queue_aging_ticks == 0)
+            age_ready_queues();
+        balance_ready_queues();
+    }
 
     if (current_thread->tick())
         return;
@@ -736,10 +1006,16 @@ void Scheduler::idle_loop()
     ASSERT(are_interrupts_enabled());
 
     for (;;) {
-        asm("hlt");
-
-        if (Processor::current().id() == 0)
-            yield();
+        // Whatever just made us go idle may well have been what some blocked
+        // thread was waiting for, so check on them rather than waiting for
+        // the next timer tick to do it.
+        {
+            ScopedSpinLock lock(g_scheduler_lock);
+            check_blocked_threads();
+            dispatch_pending_signals();
+        }
+        if (!yield())
+            asm("hlt");
     }
 }
 
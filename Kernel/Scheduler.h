@@ -49,6 +49,13 @@ extern SchedulerData* g_scheduler_data;
 extern timeval g_timeofday;
 extern RecursiveSpinLock g_scheduler_lock;
 
+struct SchedulerProcessorStatistics {
+    u32 context_switches { 0 };
+    u32 steals { 0 };
+    u32 migrations { 0 };
+    u32 ready_threads { 0 };
+};
+
 class Scheduler {
 public:
     static void initialize();
@@ -78,6 +85,17 @@ public:
     static inline IterationDecision for_each_nonrunnable(Callback);
 
     static void init_thread(Thread& thread);
+    static void queue_runnable_thread(Thread&);
+    static void dequeue_runnable_thread(Thread&);
+    static SchedulerProcessorStatistics processor_statistics(u32 cpu);
+
+private:
+    static void check_blocked_threads();
+    static void dispatch_pending_signals();
+    static Thread* choose_next_thread(Thread& current_thread, u32 cpu);
+    static Thread* steal_ready_thread(u32 cpu);
+    static void age_ready_queues();
+    static void balance_ready_queues();
 };
 
 }
@@ -53,6 +53,16 @@ public:
         return prev_flags;
     }
 
+    ALWAYS_INLINE bool try_lock(u32& prev_flags)
+    {
+        Processor::current().enter_critical(prev_flags);
+        BaseType expected = 0;
+        if (m_lock.compare_exchange_strong(expected, 1, AK::memory_order_acq_rel))
+            return true;
+        Processor::current().leave_critical(prev_flags);
+        return false;
+    }
+
     ALWAYS_INLINE void unlock(u32 prev_flags)
     {
         ASSERT(is_locked());
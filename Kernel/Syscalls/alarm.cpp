@@ -32,15 +32,25 @@ namespace Kernel {
 unsigned Process::sys$alarm(unsigned seconds)
 {
     REQUIRE_PROMISE(stdio);
+    ScopedSpinLock lock(g_scheduler_lock);
     unsigned previous_alarm_remaining = 0;
-    if (m_alarm_deadline && m_alarm_deadline > g_uptime) {
-        previous_alarm_remaining = (m_alarm_deadline - g_uptime) / TimeManagement::the().ticks_per_second();
+    if (m_alarm_timer_id) {
+        TimerQueue::the().cancel_timer(m_alarm_timer_id);
+        m_alarm_timer_id = 0;
+        if (m_alarm_deadline > g_uptime)
+            previous_alarm_remaining = (m_alarm_deadline - g_uptime) / TimeManagement::the().ticks_per_second();
     }
-    if (!seconds) {
-        m_alarm_deadline = 0;
+    if (!seconds)
         return previous_alarm_remaining;
-    }
     m_alarm_deadline = g_uptime + seconds * TimeManagement::the().ticks_per_second();
+    timeval deadline { (time_t)seconds, 0 };
+    // The timer goes off with g_scheduler_lock held, and is cancelled in
+    // finalize() before this process can go away.
+    m_alarm_timer_id = TimerQueue::the().add_timer(deadline, [this] {
+        m_alarm_timer_id = 0;
+        // FIXME: Should we observe this signal somehow?
+        (void)send_signal(SIGALRM, nullptr);
+    });
     return previous_alarm_remaining;
 }
 
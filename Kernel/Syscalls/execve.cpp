@@ -238,8 +238,6 @@ int Process::do_exec(NonnullRefPtr<FileDescription> main_program_description, Ve
     current_thread->m_signal_mask = 0;
     current_thread->m_pending_signals = 0;
 
-    m_futex_queues.clear();
-
     m_region_lookup_cache = {};
 
     disown_all_shared_buffers();
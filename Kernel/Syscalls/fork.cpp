@@ -27,7 +27,9 @@
 #include <Kernel/FileSystem/Custody.h>
 #include <Kernel/FileSystem/FileDescription.h>
 #include <Kernel/Process.h>
+#include <Kernel/VM/MemoryManager.h>
 #include <Kernel/VM/Region.h>
+#include <Kernel/VM/TLBFlushBatch.h>
 
 //#define FORK_DEBUG
 
@@ -78,15 +80,24 @@ pid_t Process::sys$fork(RegisterState& regs)
 #endif
 
     ScopedSpinLock lock(m_lock);
-    for (auto& region : m_regions) {
+    {
+        // Cloning write-protects our own regions one by one. Shoot down the
+        // stale writable translations all at once when we're done, the child
+        // isn't runnable before that anyway. Until then, our other threads
+        // may still write through them, so nobody may fault in (and copy) a
+        // page we've already made copy-on-write.
+        ScopedSpinLock mm_lock(s_mm_lock);
+        TLBFlushBatch tlb_flush_batch(page_directory());
+        for (auto& region : m_regions) {
 #ifdef FORK_DEBUG
-        dbg() << "fork: cloning Region{" << &region << "} '" << region.name() << "' @ " << region.vaddr();
+            dbg() << "fork: cloning Region{" << &region << "} '" << region.name() << "' @ " << region.vaddr();
 #endif
-        auto& child_region = child->add_region(region.clone());
-        child_region.map(child->page_directory());
+            auto& child_region = child->add_region(region.clone());
+            child_region.map(child->page_directory());
 
-        if (&region == m_master_tls_region)
-            child->m_master_tls_region = child_region.make_weak_ptr();
+            if (&region == m_master_tls_region)
+                child->m_master_tls_region = child_region.make_weak_ptr();
+        }
     }
 
     {
@@ -24,8 +24,11 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <AK/HashMap.h>
 #include <AK/Time.h>
+#include <Kernel/FutexQueue.h>
 #include <Kernel/Process.h>
+#include <Kernel/VM/Region.h>
 
 namespace Kernel {
 
@@ -42,12 +45,105 @@ static void compute_relative_timeout_from_absolute(const timespec& absolute_time
     compute_relative_timeout_from_absolute(tv_absolute_time, relative_time);
 }
 
-WaitQueue& Process::futex_queue(Userspace<const i32*> userspace_address)
+// Futex queues live in a global table hashed by FutexKey. Each bucket is
+// protected by a flag that is released by Thread::wait_on() only once the
+// waiting thread has been enqueued, which closes the window between checking
+// the futex value and going to sleep.
+static constexpr size_t futex_bucket_count = 64;
+
+struct FutexBucket {
+    Atomic<bool> lock { false };
+    HashMap<FutexKey, NonnullOwnPtr<FutexQueue>> queues;
+};
+
+static FutexBucket s_futex_buckets[futex_bucket_count];
+
+static FutexBucket& futex_bucket_for(const FutexKey& key)
+{
+    return s_futex_buckets[Traits<FutexKey>::hash(key) % futex_bucket_count];
+}
+
+static void lock_bucket(FutexBucket& bucket)
 {
-    auto& queue = m_futex_queues.ensure(userspace_address.ptr());
-    if (!queue)
-        queue = make<WaitQueue>();
-    return *queue;
+    for (;;) {
+        bool expected = false;
+        if (bucket.lock.compare_exchange_strong(expected, true, AK::memory_order_acq_rel))
+            return;
+        Scheduler::yield();
+    }
+}
+
+static void unlock_bucket(FutexBucket& bucket)
+{
+    bucket.lock.store(false, AK::memory_order_release);
+}
+
+// Locks the buckets for two keys without deadlocking against another thread
+// locking the same pair in the opposite order.
+static void lock_buckets(FutexBucket& bucket1, FutexBucket& bucket2)
+{
+    if (&bucket1 == &bucket2) {
+        lock_bucket(bucket1);
+    } else if (&bucket1 < &bucket2) {
+        lock_bucket(bucket1);
+        lock_bucket(bucket2);
+    } else {
+        lock_bucket(bucket2);
+        lock_bucket(bucket1);
+    }
+}
+
+static void unlock_buckets(FutexBucket& bucket1, FutexBucket& bucket2)
+{
+    unlock_bucket(bucket1);
+    if (&bucket1 != &bucket2)
+        unlock_bucket(bucket2);
+}
+
+static FutexQueue* find_futex_queue(FutexBucket& bucket, const FutexKey& key)
+{
+    auto it = bucket.queues.find(key);
+    if (it == bucket.queues.end())
+        return nullptr;
+    return it->value.ptr();
+}
+
+static FutexQueue& ensure_futex_queue(FutexBucket& bucket, const FutexKey& key)
+{
+    if (auto* queue = find_futex_queue(bucket, key))
+        return *queue;
+    auto queue = make<FutexQueue>(key);
+    auto& queue_ref = *queue;
+    bucket.queues.set(key, move(queue));
+    return queue_ref;
+}
+
+static void release_futex_queue_if_unused(FutexBucket& bucket, FutexQueue& queue)
+{
+    if (queue.user_count() == 0)
+        bucket.queues.remove(queue.key());
+}
+
+KResultOr<FutexKey> Process::futex_key_for(Userspace<const i32*> userspace_address)
+{
+    if (userspace_address.ptr() & (sizeof(i32) - 1))
+        return KResult(-EINVAL);
+    if (!validate_read_typed(userspace_address))
+        return KResult(-EFAULT);
+
+    auto* region = find_region_containing(Range { VirtualAddress(userspace_address.ptr()), sizeof(i32) });
+    if (!region)
+        return KResult(-EFAULT);
+
+    // Futexes in shared memory must be found by every process mapping it,
+    // so key them by the memory itself. Physical addresses aren't stable
+    // enough for that (pages come and go with purging and copy-on-write),
+    // but the VMObject and the offset into it are.
+    if (region->is_shared() || region->vmobject().is_shared_inode()) {
+        FlatPtr offset = region->offset_in_vmobject() + (userspace_address.ptr() - region->vaddr().get());
+        return FutexKey { (FlatPtr)&region->vmobject(), offset };
+    }
+    return FutexKey { (FlatPtr)this, userspace_address.ptr() };
 }
 
 int Process::sys$futex(Userspace<const Syscall::SC_futex_params*> user_params)
@@ -58,15 +154,17 @@ int Process::sys$futex(Userspace<const Syscall::SC_futex_params*> user_params)
     if (!validate_read_and_copy_typed(&params, user_params))
         return -EFAULT;
 
-    if (!validate_read_typed(params.userspace_address))
-        return -EFAULT;
+    auto key_or_error = futex_key_for(params.userspace_address);
+    if (key_or_error.is_error())
+        return key_or_error.error();
+    auto key = key_or_error.value();
 
     switch (params.futex_op) {
-    case FUTEX_WAIT: {
-        i32 user_value;
-        copy_from_user(&user_value, params.userspace_address);
-        if (user_value != params.val)
-            return -EAGAIN;
+    case FUTEX_WAIT:
+    case FUTEX_WAIT_BITSET: {
+        u32 bitset = params.futex_op == FUTEX_WAIT ? FUTEX_BITSET_MATCH_ANY : params.val3;
+        if (bitset == 0)
+            return -EINVAL;
 
         timespec ts_abstimeout { 0, 0 };
         if (params.timeout && !validate_read_and_copy_typed(&ts_abstimeout, params.timeout))
@@ -79,27 +177,101 @@ int Process::sys$futex(Userspace<const Syscall::SC_futex_params*> user_params)
             optional_timeout = &relative_timeout;
         }
 
-        // FIXME: This is supposed to be interruptible by a signal, but right now WaitQueue cannot be interrupted.
-        WaitQueue& wait_queue = futex_queue(params.userspace_address);
-        Thread::BlockResult result = Thread::current()->wait_on(wait_queue, "Futex", optional_timeout);
-        if (result == Thread::BlockResult::InterruptedByTimeout) {
-            return -ETIMEDOUT;
+        auto& bucket = futex_bucket_for(key);
+        lock_bucket(bucket);
+
+        // Check the value while holding the bucket lock, so that a wake can't
+        // slip in between the check and us going to sleep.
+        i32 user_value;
+        copy_from_user(&user_value, params.userspace_address);
+        if (user_value != params.val) {
+            unlock_bucket(bucket);
+            return -EAGAIN;
         }
 
-        break;
+        auto& queue = ensure_futex_queue(bucket, key);
+        queue.add_users(1);
+
+        auto* current_thread = Thread::current();
+        current_thread->set_futex_wake_bitset(bitset);
+
+        // FIXME: This is supposed to be interruptible by a signal, but right now WaitQueue cannot be interrupted.
+        Thread::BlockResult result = current_thread->wait_on(queue, "Futex", optional_timeout, &bucket.lock);
+
+        // We may have been requeued onto a different futex while we were
+        // asleep, in which case that queue now holds our reference. Nobody
+        // can move us once we're out of the queue, so this is stable.
+        auto& final_queue = result == Thread::BlockResult::NotBlocked ? queue : static_cast<FutexQueue&>(*current_thread->wait_queue());
+        auto& final_bucket = futex_bucket_for(final_queue.key());
+        lock_bucket(final_bucket);
+        final_queue.remove_users(1);
+        release_futex_queue_if_unused(final_bucket, final_queue);
+        unlock_bucket(final_bucket);
+
+        if (result == Thread::BlockResult::InterruptedByTimeout)
+            return -ETIMEDOUT;
+        return 0;
     }
     case FUTEX_WAKE:
-        if (params.val == 0)
+    case FUTEX_WAKE_BITSET: {
+        u32 bitset = params.futex_op == FUTEX_WAKE ? FUTEX_BITSET_MATCH_ANY : params.val3;
+        if (bitset == 0)
+            return -EINVAL;
+        if (params.val <= 0)
             return 0;
-        if (params.val == 1) {
-            futex_queue(params.userspace_address).wake_one();
-        } else {
-            futex_queue(params.userspace_address).wake_n(params.val);
-        }
-        break;
+
+        auto& bucket = futex_bucket_for(key);
+        lock_bucket(bucket);
+        u32 woken = 0;
+        if (auto* queue = find_futex_queue(bucket, key))
+            woken = queue->wake_matching(params.val, bitset);
+        unlock_bucket(bucket);
+        return woken;
     }
+    case FUTEX_REQUEUE:
+    case FUTEX_CMP_REQUEUE: {
+        if (params.val < 0 || (i32)params.val2 < 0)
+            return -EINVAL;
 
-    return 0;
+        auto key2_or_error = futex_key_for(params.userspace_address2);
+        if (key2_or_error.is_error())
+            return key2_or_error.error();
+        auto key2 = key2_or_error.value();
+
+        auto& bucket = futex_bucket_for(key);
+        auto& bucket2 = futex_bucket_for(key2);
+        lock_buckets(bucket, bucket2);
+
+        if (params.futex_op == FUTEX_CMP_REQUEUE) {
+            i32 user_value;
+            copy_from_user(&user_value, params.userspace_address);
+            if (user_value != (i32)params.val3) {
+                unlock_buckets(bucket, bucket2);
+                return -EAGAIN;
+            }
+        }
+
+        u32 woken = 0;
+        u32 requeued = 0;
+        if (auto* queue = find_futex_queue(bucket, key)) {
+            woken = queue->wake_matching(params.val, FUTEX_BITSET_MATCH_ANY);
+            if (params.val2 > 0 && !(key == key2)) {
+                // Requeued threads take their reference on the queue with them.
+                auto& queue2 = ensure_futex_queue(bucket2, key2);
+                requeued = queue->requeue_to(queue2, params.val2);
+                queue->remove_users(requeued);
+                queue2.add_users(requeued);
+                release_futex_queue_if_unused(bucket2, queue2);
+                // Everybody may have moved over, in which case nothing keeps this one around.
+                release_futex_queue_if_unused(bucket, *queue);
+            }
+        }
+        unlock_buckets(bucket, bucket2);
+        return woken + requeued;
+    }
+    default:
+        return -ENOSYS;
+    }
 }
 
 }
@@ -26,6 +26,7 @@
 
 #include <Kernel/FileSystem/FileDescription.h>
 #include <Kernel/Process.h>
+#include <Kernel/VM/AnonymousVMObject.h>
 #include <Kernel/VM/PageDirectory.h>
 #include <Kernel/VM/PurgeableVMObject.h>
 #include <Kernel/VM/Region.h>
@@ -118,6 +119,7 @@ void* Process::sys$mmap(Userspace<const Syscall::SC_mmap_params*> user_params)
     bool map_private = flags & MAP_PRIVATE;
     bool map_stack = flags & MAP_STACK;
     bool map_fixed = flags & MAP_FIXED;
+    bool map_large_pages = flags & MAP_LARGE_PAGES;
 
     if (map_shared && map_private)
         return (void*)-EINVAL;
@@ -131,6 +133,12 @@ void* Process::sys$mmap(Userspace<const Syscall::SC_mmap_params*> user_params)
     if (map_stack && (!map_private || !map_anonymous))
         return (void*)-EINVAL;
 
+    if (map_large_pages && (!map_private || !map_anonymous || map_purgeable || map_stack))
+        return (void*)-EINVAL;
+
+    if (map_large_pages)
+        alignment = max(alignment, static_cast<size_t>(LARGE_PAGE_SIZE));
+
     Region* region = nullptr;
 
     auto range = allocate_range(VirtualAddress(addr), size, alignment);
@@ -142,6 +150,11 @@ void* Process::sys$mmap(Userspace<const Syscall::SC_mmap_params*> user_params)
         region = allocate_region_with_vmobject(range, vmobject, 0, !name.is_null() ? name : "mmap (purgeable)", prot);
         if (!region && (!map_fixed && addr != 0))
             region = allocate_region_with_vmobject({}, size, vmobject, 0, !name.is_null() ? name : "mmap (purgeable)", prot);
+    } else if (map_large_pages) {
+        auto vmobject = AnonymousVMObject::create_with_large_pages(range.size());
+        region = allocate_region_with_vmobject(range, vmobject, 0, !name.is_null() ? name : "mmap (large pages)", prot);
+        if (!region && (!map_fixed && addr != 0))
+            region = allocate_region_with_vmobject({}, size, vmobject, 0, !name.is_null() ? name : "mmap (large pages)", prot);
     } else if (map_anonymous) {
         region = allocate_region(range, !name.is_null() ? name : "mmap", prot, false);
         if (!region && (!map_fixed && addr != 0))
@@ -186,6 +199,10 @@ void* Process::sys$mmap(Userspace<const Syscall::SC_mmap_params*> user_params)
         region->set_shared(true);
     if (map_stack)
         region->set_stack(true);
+    if (map_large_pages) {
+        region->set_wants_large_pages(true);
+        region->remap();
+    }
     if (!name.is_null())
         region->set_name(name);
     return region->vaddr().as_ptr();
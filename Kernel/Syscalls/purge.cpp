@@ -28,6 +28,7 @@
 #include <Kernel/Process.h>
 #include <Kernel/VM/InodeVMObject.h>
 #include <Kernel/VM/MemoryManager.h>
+#include <Kernel/VM/PageCache.h>
 #include <Kernel/VM/PurgeableVMObject.h>
 
 namespace Kernel {
@@ -63,6 +64,7 @@ int Process::sys$purge(int mode)
         for (auto& vmobject : vmobjects) {
             purged_page_count += vmobject.release_all_clean_pages();
         }
+        purged_page_count += PageCache::the().evict_unused_pages();
     }
     return purged_page_count;
 }
@@ -24,6 +24,7 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <AK/NumericLimits.h>
 #include <Kernel/FileSystem/FileDescription.h>
 #include <Kernel/Process.h>
 
@@ -64,4 +65,87 @@ ssize_t Process::sys$read(int fd, Userspace<u8*> buffer, ssize_t size)
     return result.value();
 }
 
+ssize_t Process::sys$readv(int fd, const struct iovec* iov, int iov_count)
+{
+    REQUIRE_PROMISE(stdio);
+    if (iov_count < 0)
+        return -EINVAL;
+
+    if (!validate_read_typed(iov, iov_count))
+        return -EFAULT;
+
+    u64 total_length = 0;
+    Vector<iovec, 32> vecs;
+    vecs.resize(iov_count);
+    copy_from_user(vecs.data(), iov, iov_count * sizeof(iovec));
+    for (auto& vec : vecs) {
+        if (!validate_write(vec.iov_base, vec.iov_len))
+            return -EFAULT;
+        total_length += vec.iov_len;
+        if (total_length > NumericLimits<i32>::max())
+            return -EINVAL;
+    }
+
+    auto description = file_description(fd);
+    if (!description)
+        return -EBADF;
+    if (!description->is_readable())
+        return -EBADF;
+    if (description->is_directory())
+        return -EISDIR;
+    if (description->is_blocking()) {
+        if (!description->can_read()) {
+            if (Thread::current()->block<Thread::ReadBlocker>(nullptr, *description).was_interrupted())
+                return -EINTR;
+            if (!description->can_read())
+                return -EAGAIN;
+        }
+    }
+
+    // Only the first read may block, after that we take what we can get
+    // and stop at the first short read.
+    int nread = 0;
+    for (auto& vec : vecs) {
+        if (!vec.iov_len)
+            continue;
+        if (nread && !description->can_read())
+            break;
+        auto result = description->read((u8*)vec.iov_base, vec.iov_len);
+        if (result.is_error()) {
+            if (nread == 0)
+                return result.error();
+            break;
+        }
+        nread += result.value();
+        if (result.value() < vec.iov_len)
+            break;
+    }
+    return nread;
+}
+
+ssize_t Process::sys$pread(Userspace<const Syscall::SC_pread_params*> user_params)
+{
+    REQUIRE_PROMISE(stdio);
+    Syscall::SC_pread_params params;
+    if (!validate_read_and_copy_typed(&params, user_params))
+        return -EFAULT;
+    if ((ssize_t)params.buffer.size < 0)
+        return -EINVAL;
+    if (params.buffer.size == 0)
+        return 0;
+    if (!validate(params.buffer))
+        return -EFAULT;
+    auto description = file_description(params.fd);
+    if (!description)
+        return -EBADF;
+    if (!description->is_readable())
+        return -EBADF;
+    if (description->is_directory())
+        return -EISDIR;
+    auto result = description->pread(params.buffer.data, params.buffer.size, params.offset);
+    if (result.is_error())
+        return result.error();
+    return result.value();
+}
+
 }
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <Kernel/FileSystem/FileDescription.h>
+#include <Kernel/FileSystem/Inode.h>
+#include <Kernel/Process.h>
+#include <Kernel/VM/AnonymousVMObject.h>
+#include <Kernel/VM/MemoryManager.h>
+#include <Kernel/VM/PageCache.h>
+
+namespace Kernel {
+
+static constexpr size_t sendfile_chunk_pages = 16;
+static constexpr size_t sendfile_chunk_size = sendfile_chunk_pages * PAGE_SIZE;
+
+// Maps the page cache pages behind a file into a kernel window, one chunk
+// at a time, so they can be handed to the destination's write() without
+// ever copying them into a buffer first.
+class PageCacheWindow {
+public:
+    static OwnPtr<PageCacheWindow> create()
+    {
+        auto vmobject = AnonymousVMObject::create_with_size(sendfile_chunk_size);
+        auto region = MM.allocate_kernel_region_with_vmobject(*vmobject, sendfile_chunk_size, "sendfile", Region::Access::Read);
+        if (!region)
+            return nullptr;
+        return make<PageCacheWindow>(move(vmobject), region.release_nonnull());
+    }
+
+    PageCacheWindow(NonnullRefPtr<AnonymousVMObject>&& vmobject, NonnullOwnPtr<Region>&& region)
+        : m_vmobject(move(vmobject))
+        , m_region(move(region))
+    {
+    }
+
+    ~PageCacheWindow()
+    {
+        // Drop our references to the cached pages right away, rather than
+        // whenever the VMObject happens to go away.
+        m_region = nullptr;
+        for (auto& page : m_vmobject->physical_pages())
+            page = nullptr;
+    }
+
+    // Maps the pages covering [offset, offset + size) and returns where
+    // offset ended up in the window. size must fit in one window.
+    KResultOr<const u8*> map(Inode& inode, off_t offset, size_t size)
+    {
+        size_t first_page_index = offset / PAGE_SIZE;
+        size_t page_count = PAGE_ROUND_UP(offset % PAGE_SIZE + size) / PAGE_SIZE;
+        ASSERT(page_count <= sendfile_chunk_pages);
+
+        auto& pages = m_vmobject->physical_pages();
+        for (size_t i = 0; i < sendfile_chunk_pages; ++i) {
+            if (i >= page_count) {
+                pages[i] = MM.shared_zero_page();
+                continue;
+            }
+            auto page_or_error = PageCache::the().get_page(inode, first_page_index + i);
+            if (page_or_error.is_error())
+                return page_or_error.error();
+            pages[i] = page_or_error.release_value();
+        }
+        m_region->remap();
+        return m_region->vaddr().offset(offset % PAGE_SIZE).as_ptr();
+    }
+
+private:
+    NonnullRefPtr<AnonymousVMObject> m_vmobject;
+    OwnPtr<Region> m_region;
+};
+
+ssize_t Process::sys$sendfile(Userspace<const Syscall::SC_sendfile_params*> user_params)
+{
+    REQUIRE_PROMISE(stdio);
+    Syscall::SC_sendfile_params params;
+    if (!validate_read_and_copy_typed(&params, user_params))
+        return -EFAULT;
+
+    off_t offset = 0;
+    if (params.offset) {
+        if (!validate_read_and_copy_typed(&offset, params.offset))
+            return -EFAULT;
+        if (!validate_write_typed(params.offset))
+            return -EFAULT;
+    }
+
+    auto in_description = file_description(params.in_fd);
+    auto out_description = file_description(params.out_fd);
+    if (!in_description || !out_description)
+        return -EBADF;
+    if (!in_description->is_readable() || !out_description->is_writable())
+        return -EBADF;
+    if (in_description->is_directory())
+        return -EISDIR;
+    // We always read at an explicit offset, which doesn't make sense for pipes and the like.
+    if (!in_description->file().is_seekable())
+        return -ESPIPE;
+    if (!params.offset)
+        offset = in_description->offset();
+    if (offset < 0)
+        return -EINVAL;
+
+    // Page cached files are written straight from the cache, everything
+    // else is bounced through a kernel buffer. Neither ever touches userspace.
+    auto* inode = in_description->inode();
+    OwnPtr<PageCacheWindow> window;
+    OwnPtr<Region> bounce_buffer;
+    if (inode && !in_description->is_direct() && inode->is_page_cacheable())
+        window = PageCacheWindow::create();
+    if (!window) {
+        bounce_buffer = MM.allocate_kernel_region(sendfile_chunk_size, "sendfile", Region::Access::Read | Region::Access::Write);
+        if (!bounce_buffer)
+            return -ENOMEM;
+    }
+
+    size_t remaining = params.count;
+    ssize_t total_nsent = 0;
+    while (remaining) {
+        // Stop at a page boundary so the next chunk starts out aligned.
+        size_t chunk_size = min(remaining, sendfile_chunk_size - offset % PAGE_SIZE);
+        const u8* data = nullptr;
+
+        if (window) {
+            size_t file_size = inode->size();
+            if ((size_t)offset >= file_size)
+                break;
+            chunk_size = min(chunk_size, file_size - offset);
+            auto data_or_error = window->map(*inode, offset, chunk_size);
+            if (data_or_error.is_error()) {
+                if (total_nsent)
+                    break;
+                return data_or_error.error();
+            }
+            data = data_or_error.value();
+            Thread::current()->did_file_read(chunk_size);
+        } else {
+            auto nread_or_error = in_description->pread(bounce_buffer->vaddr().as_ptr(), chunk_size, offset);
+            if (nread_or_error.is_error()) {
+                if (total_nsent)
+                    break;
+                return nread_or_error.error();
+            }
+            chunk_size = nread_or_error.value();
+            if (!chunk_size)
+                break;
+            data = bounce_buffer->vaddr().as_ptr();
+        }
+
+        ssize_t nsent = do_write(*out_description, data, chunk_size);
+        if (nsent < 0) {
+            if (total_nsent)
+                break;
+            return nsent;
+        }
+        offset += nsent;
+        total_nsent += nsent;
+        remaining -= nsent;
+        if ((size_t)nsent < chunk_size)
+            break;
+    }
+
+    if (params.offset)
+        copy_to_user(params.offset, &offset);
+    else
+        in_description->seek(offset, SEEK_SET);
+    return total_nsent;
+}
+
+}
@@ -24,6 +24,7 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <Kernel/FileSystem/FileDescription.h>
 #include <Kernel/FileSystem/VirtualFileSystem.h>
 #include <Kernel/Process.h>
 
@@ -36,4 +37,16 @@ int Process::sys$sync()
     return 0;
 }
 
+int Process::sys$fsync(int fd)
+{
+    REQUIRE_PROMISE(stdio);
+    auto description = file_description(fd);
+    if (!description)
+        return -EBADF;
+    auto* inode = description->inode();
+    if (!inode)
+        return -EINVAL;
+    return inode->fsync();
+}
+
 }
@@ -65,7 +65,11 @@ KResultOr<siginfo_t> Process::do_waitid(idtype_t idtype, int id, int options)
 
     ASSERT(waitee_process);
     if (waitee_process->is_dead()) {
-        return reap(*waitee_process);
+        auto siginfo = reap(*waitee_process);
+        lock.unlock();
+        // Any dead children it left behind have no parent to wait for them now.
+        Scheduler::notify_finalizer();
+        return siginfo;
     } else {
         // FIXME: PID/TID BUG
         auto* waitee_thread = Thread::from_tid(waitee_pid.value());
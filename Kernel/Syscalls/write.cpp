@@ -129,4 +129,27 @@ ssize_t Process::sys$write(int fd, const u8* data, ssize_t size)
     return do_write(*description, data, size);
 }
 
+ssize_t Process::sys$pwrite(Userspace<const Syscall::SC_pwrite_params*> user_params)
+{
+    REQUIRE_PROMISE(stdio);
+    Syscall::SC_pwrite_params params;
+    if (!validate_read_and_copy_typed(&params, user_params))
+        return -EFAULT;
+    if ((ssize_t)params.data.size < 0)
+        return -EINVAL;
+    if (params.data.size == 0)
+        return 0;
+    if (!validate(params.data))
+        return -EFAULT;
+    auto description = file_description(params.fd);
+    if (!description)
+        return -EBADF;
+    if (!description->is_writable())
+        return -EBADF;
+    auto result = description->pwrite(params.data.data, params.data.size, params.offset);
+    if (result.is_error())
+        return result.error();
+    return result.value();
+}
+
 }
@@ -37,8 +37,10 @@ void FinalizerTask::spawn()
             Thread::current()->wait_on(*g_finalizer_wait_queue, "FinalizerTask");
             
             bool expected = true;
-            if (g_finalizer_has_work.compare_exchange_strong(expected, false, AK::MemoryOrder::memory_order_acq_rel))
+            if (g_finalizer_has_work.compare_exchange_strong(expected, false, AK::MemoryOrder::memory_order_acq_rel)) {
                 Thread::finalize_dying_threads();
+                Process::reap_unparented_processes();
+            }
         }
     });
 }
@@ -27,20 +27,31 @@
 #include <Kernel/FileSystem/VirtualFileSystem.h>
 #include <Kernel/Process.h>
 #include <Kernel/Tasks/SyncTask.h>
-#include <Kernel/Time/TimeManagement.h>
+#include <Kernel/WaitQueue.h>
 
 namespace Kernel {
 
+static WaitQueue* s_sync_wait_queue;
+
 void SyncTask::spawn()
 {
+    s_sync_wait_queue = new WaitQueue;
     Thread* syncd_thread = nullptr;
     Process::create_kernel_process(syncd_thread, "SyncTask", [] {
         dbg() << "SyncTask is running";
         for (;;) {
             VFS::the().sync();
-            Thread::current()->sleep(1 * TimeManagement::the().ticks_per_second());
+            timeval timeout { 1, 0 };
+            Thread::current()->wait_on(*s_sync_wait_queue, "SyncTask", &timeout);
         }
     });
 }
 
+void SyncTask::request_sync()
+{
+    // If we're syncing right now, this makes us go again right after.
+    if (s_sync_wait_queue)
+        s_sync_wait_queue->wake_one();
+}
+
 }
@@ -30,5 +30,7 @@ namespace Kernel {
 class SyncTask {
 public:
     static void spawn();
+    // Syncs again as soon as possible, instead of waiting for the next second.
+    static void request_sync();
 };
 }
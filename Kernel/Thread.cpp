@@ -108,6 +108,12 @@ Thread::~Thread()
 {
     kfree_aligned(m_fpu_state);
 
+    {
+        ScopedSpinLock lock(g_scheduler_lock);
+        if (m_signal_pending_list_node.is_in_list())
+            g_scheduler_data->m_signal_pending_threads.remove(*this);
+    }
+
     auto thread_cnt_before = m_process->m_thread_count.fetch_sub(1, AK::MemoryOrder::memory_order_acq_rel);
     ASSERT(thread_cnt_before != 0);
 }
@@ -331,6 +337,8 @@ void Thread::send_signal(u8 signal, [[maybe_unused]] Process* sender)
     ScopedSpinLock lock(g_scheduler_lock);
     m_pending_signals |= 1 << (signal - 1);
     m_have_any_unmasked_pending_signals.store(m_pending_signals & ~m_signal_mask, AK::memory_order_release);
+    if (!m_signal_pending_list_node.is_in_list())
+        g_scheduler_data->m_signal_pending_threads.append(*this);
 }
 
 // Certain exceptions, such as SIGSEGV and SIGILL, put a
@@ -764,10 +772,15 @@ void Thread::update_state_for_thread(Thread::State previous_state)
         previous_list.remove(*this);
     }
 
-    if (list.contains(*this))
-        return;
+    if (!list.contains(*this))
+        list.append(*this);
 
-    list.append(*this);
+    // Only threads waiting for a processor live in a ready queue, the
+    // running ones are owned by the processor they're running on.
+    if (previous_state == Runnable && m_state != Runnable)
+        Scheduler::dequeue_runnable_thread(*this);
+    else if (previous_state != Runnable && m_state == Runnable)
+        Scheduler::queue_runnable_thread(*this);
 }
 
 String Thread::backtrace()
@@ -901,6 +914,8 @@ Thread::BlockResult Thread::wait_on(WaitQueue& queue, const char* reason, timeva
                 // The WaitQueue was already requested to wake someone when
                 // nobody was waiting. So return right away as we shouldn't
                 // be waiting
+                if (lock)
+                    *lock = false;
 
                 // The API contract guarantees we return with interrupts enabled,
                 // regardless of how we got called
@@ -960,8 +975,11 @@ Thread::BlockResult Thread::wait_on(WaitQueue& queue, const char* reason, timeva
         // scheduler lock, which is held when we insert into the queue
         ScopedSpinLock sched_lock(g_scheduler_lock);
 
-        // If our thread was still in the queue, we timed out
-        if (queue.dequeue(*current_thread))
+        // If our thread was still in the queue, we timed out. Note that
+        // the queue we're in may not be the one we started waiting on,
+        // since futex requeueing can move us to a different queue.
+        auto* current_queue = current_thread->m_wait_queue;
+        if (current_queue && current_queue->dequeue(*current_thread))
             result = BlockResult::InterruptedByTimeout;
 
         // Make sure we cancel the timer if woke normally.
@@ -434,6 +434,15 @@ public:
     void did_syscall() { ++m_syscall_count; }
     unsigned inode_faults() const { return m_inode_faults; }
     void did_inode_fault() { ++m_inode_faults; }
+
+    TLBFlushBatch* tlb_flush_batch() { return m_tlb_flush_batch; }
+    void set_tlb_flush_batch(TLBFlushBatch* batch) { m_tlb_flush_batch = batch; }
+
+    WaitQueue* wait_queue() const { return m_wait_queue; }
+    u32 futex_wake_bitset() const { return m_futex_wake_bitset; }
+    void set_futex_wake_bitset(u32 bitset) { m_futex_wake_bitset = bitset; }
+    Ext2FSJournalHandle* journal_handle() const { return m_journal_handle; }
+    void set_journal_handle(Ext2FSJournalHandle* handle) { m_journal_handle = handle; }
     unsigned zero_faults() const { return m_zero_faults; }
     void did_zero_fault() { ++m_zero_faults; }
     unsigned cow_faults() const { return m_cow_faults; }
@@ -521,11 +530,15 @@ public:
 
 private:
     IntrusiveListNode m_runnable_list_node;
+    IntrusiveListNode m_ready_queue_node;
     IntrusiveListNode m_wait_queue_node;
+    IntrusiveListNode m_signal_pending_list_node;
 
 private:
     friend class SchedulerData;
+    friend struct ThreadReadyQueue;
     friend class WaitQueue;
+    friend class FutexQueue;
     bool unlock_process_if_locked();
     void relock_process(bool did_unlock);
     String backtrace_impl();
@@ -551,6 +564,10 @@ private:
     Blocker* m_blocker { nullptr };
     timespec* m_blocker_timeout { nullptr };
     const char* m_wait_reason { nullptr };
+    WaitQueue* m_wait_queue { nullptr };
+    u32 m_futex_wake_bitset { 0 };
+    // The innermost file system journal handle held by this thread.
+    Ext2FSJournalHandle* m_journal_handle { nullptr };
 
     bool m_is_active { false };
     bool m_is_joinable { true };
@@ -560,6 +577,7 @@ private:
 
     unsigned m_syscall_count { 0 };
     unsigned m_inode_faults { 0 };
+    TLBFlushBatch* m_tlb_flush_batch { nullptr };
     unsigned m_zero_faults { 0 };
     unsigned m_cow_faults { 0 };
 
@@ -578,6 +596,8 @@ private:
     u32 m_priority { THREAD_PRIORITY_NORMAL };
     u32 m_extra_priority { 0 };
     u32 m_priority_boost { 0 };
+    u32 m_ready_queue_cpu { 0 };
+    u32 m_ready_queue_bucket { 0 };
 
     u8 m_stop_signal { 0 };
     State m_stop_state { Invalid };
@@ -632,12 +652,66 @@ inline IterationDecision Thread::for_each_in_state(State state, Callback callbac
 
 const LogStream& operator<<(const LogStream&, const Thread&);
 
+// Runnable threads waiting for a processor. Each bucket holds threads of a
+// similar effective priority, and the mask tracks the non-empty buckets so
+// the highest priority one can be found in constant time.
+// The queue is only ever changed with both g_scheduler_lock and m_lock held,
+// so its processor can look at it while holding just the latter.
+struct ThreadReadyQueue {
+    typedef IntrusiveList<Thread, &Thread::m_ready_queue_node> ThreadList;
+    static constexpr u32 bucket_count = sizeof(u32) * 8;
+
+    SpinLock<u8> m_lock;
+    ThreadList m_buckets[bucket_count];
+    u32 m_bucket_mask { 0 };
+    u32 m_count { 0 };
+
+    u32 m_context_switches { 0 };
+    u32 m_steals { 0 };
+    u32 m_migrations { 0 };
+    u64 m_last_switch_uptime { 0 };
+
+    bool is_empty() const { return m_bucket_mask == 0; }
+
+    void enqueue(Thread& thread, u32 bucket)
+    {
+        ASSERT(m_lock.is_locked());
+        ASSERT(bucket < bucket_count);
+        thread.m_ready_queue_bucket = bucket;
+        m_buckets[bucket].append(thread);
+        m_bucket_mask |= 1u << bucket;
+        m_count++;
+    }
+
+    void dequeue(Thread& thread)
+    {
+        ASSERT(m_lock.is_locked());
+        auto bucket = thread.m_ready_queue_bucket;
+        m_buckets[bucket].remove(thread);
+        if (m_buckets[bucket].is_empty())
+            m_bucket_mask &= ~(1u << bucket);
+        ASSERT(m_count > 0);
+        m_count--;
+    }
+};
+
 struct SchedulerData {
     typedef IntrusiveList<Thread, &Thread::m_runnable_list_node> ThreadList;
+    typedef IntrusiveList<Thread, &Thread::m_signal_pending_list_node> SignalPendingThreadList;
+
+    // Thread affinity is a 32-bit mask, so that's as many processors as we can schedule on.
+    static constexpr u32 max_processors = sizeof(u32) * 8;
 
     ThreadList m_runnable_threads;
     ThreadList m_nonrunnable_threads;
 
+    // Threads that had a signal sent to them which hasn't been dispatched yet.
+    SignalPendingThreadList m_signal_pending_threads;
+
+    ThreadReadyQueue m_ready_queues[max_processors];
+    u32 m_online_processors { 0 };
+    u32 m_idle_processors { 0 };
+
     bool has_thread(Thread& thread) const
     {
         return m_runnable_threads.contains(thread) || m_nonrunnable_threads.contains(thread);
@@ -54,6 +54,7 @@ struct Timer {
     }
 };
 
+// Timers are added, cancelled and fired with g_scheduler_lock held.
 class TimerQueue {
 public:
     TimerQueue();
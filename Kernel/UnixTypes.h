@@ -91,6 +91,7 @@ enum {
 #define MAP_ANON MAP_ANONYMOUS
 #define MAP_STACK 0x40
 #define MAP_PURGEABLE 0x80
+#define MAP_LARGE_PAGES 0x100
 
 #define PROT_READ 0x1
 #define PROT_WRITE 0x2
@@ -114,6 +115,12 @@ enum {
 
 #define FUTEX_WAIT 1
 #define FUTEX_WAKE 2
+#define FUTEX_REQUEUE 3
+#define FUTEX_CMP_REQUEUE 4
+#define FUTEX_WAIT_BITSET 9
+#define FUTEX_WAKE_BITSET 10
+
+#define FUTEX_BITSET_MATCH_ANY 0xffffffff
 
 #define S_IFMT 0170000
 #define S_IFDIR 0040000
@@ -475,6 +482,9 @@ struct pollfd {
 
 #define IP_TTL 2
 
+#define TCP_NODELAY 1
+#define TCP_CORK 3
+
 struct ucred {
     pid_t pid;
     uid_t uid;
@@ -51,6 +51,21 @@ NonnullRefPtr<AnonymousVMObject> AnonymousVMObject::create_with_physical_page(Ph
     return vmobject;
 }
 
+NonnullRefPtr<AnonymousVMObject> AnonymousVMObject::create_with_large_pages(size_t size)
+{
+    auto vmobject = create_with_size(size);
+    // Back every whole 2 MiB chunk with physically contiguous, aligned memory
+    // if we can find some. Whatever is left is faulted in page by page as usual.
+    for (size_t offset = 0; offset + LARGE_PAGE_SIZE <= size; offset += LARGE_PAGE_SIZE) {
+        auto physical_pages = MM.allocate_aligned_contiguous_user_physical_pages(LARGE_PAGE_SIZE, LARGE_PAGE_SIZE);
+        if (physical_pages.is_empty())
+            break;
+        for (size_t i = 0; i < physical_pages.size(); ++i)
+            vmobject->m_physical_pages[offset / PAGE_SIZE + i] = physical_pages[i];
+    }
+    return vmobject;
+}
+
 AnonymousVMObject::AnonymousVMObject(size_t size)
     : VMObject(size)
 {
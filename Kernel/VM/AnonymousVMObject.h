@@ -38,6 +38,7 @@ public:
     static NonnullRefPtr<AnonymousVMObject> create_with_size(size_t);
     static RefPtr<AnonymousVMObject> create_for_physical_range(PhysicalAddress, size_t);
     static NonnullRefPtr<AnonymousVMObject> create_with_physical_page(PhysicalPage&);
+    static NonnullRefPtr<AnonymousVMObject> create_with_large_pages(size_t);
     virtual NonnullRefPtr<VMObject> clone() override;
 
 protected:
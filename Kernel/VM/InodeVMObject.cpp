@@ -96,9 +96,13 @@ void InodeVMObject::inode_contents_changed(Badge<Inode>, off_t offset, ssize_t s
     InterruptDisabler disabler;
     ASSERT(offset >= 0);
 
+    // Pages of page-cacheable inodes are shared with the PageCache, which has
+    // already been updated in place.
     // FIXME: Only invalidate the parts that actually changed.
-    for (auto& physical_page : m_physical_pages)
-        physical_page = nullptr;
+    if (!m_inode->fs().supports_page_cache()) {
+        for (auto& physical_page : m_physical_pages)
+            physical_page = nullptr;
+    }
 
 #if 0
     size_t current_offset = offset;
@@ -26,6 +26,7 @@
 
 #include <AK/Assertions.h>
 #include <AK/Memory.h>
+#include <AK/ScopeGuard.h>
 #include <AK/StringView.h>
 #include <Kernel/Arch/i386/CPU.h>
 #include <Kernel/CMOS.h>
@@ -36,10 +37,12 @@
 #include <Kernel/VM/AnonymousVMObject.h>
 #include <Kernel/VM/ContiguousVMObject.h>
 #include <Kernel/VM/MemoryManager.h>
+#include <Kernel/VM/PageCache.h>
 #include <Kernel/VM/PageDirectory.h>
 #include <Kernel/VM/PhysicalRegion.h>
 #include <Kernel/VM/PurgeableVMObject.h>
 #include <Kernel/VM/SharedInodeVMObject.h>
+#include <Kernel/VM/TLBFlushBatch.h>
 #include <Kernel/StdLib.h>
 
 //#define MM_DEBUG
@@ -60,6 +63,9 @@ namespace Kernel {
 static MemoryManager* s_the;
 RecursiveSpinLock s_mm_lock;
 
+// How many pre-zeroed pages the PageZeroingTask tries to keep around.
+static constexpr unsigned zeroed_page_pool_size = 256;
+
 MemoryManager& MM
 {
     return *s_the;
@@ -193,20 +199,28 @@ void MemoryManager::parse_memory_map()
     ASSERT(m_user_physical_pages > 0);
 }
 
-PageTableEntry* MemoryManager::pte(const PageDirectory& page_directory, VirtualAddress vaddr)
+const PageDirectoryEntry* MemoryManager::pde(const PageDirectory& page_directory, VirtualAddress vaddr)
 {
     ASSERT_INTERRUPTS_DISABLED();
     ASSERT(s_mm_lock.own_lock());
     u32 page_directory_table_index = (vaddr.get() >> 30) & 0x3;
     u32 page_directory_index = (vaddr.get() >> 21) & 0x1ff;
-    u32 page_table_index = (vaddr.get() >> 12) & 0x1ff;
 
     auto* pd = quickmap_pd(const_cast<PageDirectory&>(page_directory), page_directory_table_index);
-    const PageDirectoryEntry& pde = pd[page_directory_index];
-    if (!pde.is_present())
+    return &pd[page_directory_index];
+}
+
+PageTableEntry* MemoryManager::pte(const PageDirectory& page_directory, VirtualAddress vaddr)
+{
+    ASSERT_INTERRUPTS_DISABLED();
+    ASSERT(s_mm_lock.own_lock());
+    u32 page_table_index = (vaddr.get() >> 12) & 0x1ff;
+
+    auto* pde = this->pde(page_directory, vaddr);
+    if (!pde->is_present() || pde->is_huge())
         return nullptr;
 
-    return &quickmap_pt(PhysicalAddress((FlatPtr)pde.page_table_base()))[page_table_index];
+    return &quickmap_pt(PhysicalAddress((FlatPtr)pde->page_table_base()))[page_table_index];
 }
 
 PageTableEntry* MemoryManager::ensure_pte(PageDirectory& page_directory, VirtualAddress vaddr)
@@ -219,6 +233,14 @@ PageTableEntry* MemoryManager::ensure_pte(PageDirectory& page_directory, Virtual
 
     auto* pd = quickmap_pd(page_directory, page_directory_table_index);
     PageDirectoryEntry& pde = pd[page_directory_index];
+    if (pde.is_present() && pde.is_huge()) {
+        // Somebody wants to change a single page inside a large page mapping,
+        // so break it up into a regular page table first.
+        if (!split_large_page(page_directory, vaddr))
+            return nullptr;
+        pd = quickmap_pd(page_directory, page_directory_table_index);
+        ASSERT(&pde == &pd[page_directory_index]);
+    }
     if (!pde.is_present()) {
 #ifdef MM_DEBUG
         dbg() << "MM: PDE " << page_directory_index << " not present (requested for " << vaddr << "), allocating";
@@ -254,6 +276,57 @@ PageTableEntry* MemoryManager::ensure_pte(PageDirectory& page_directory, Virtual
     return &quickmap_pt(PhysicalAddress((FlatPtr)pde.page_table_base()))[page_table_index];
 }
 
+bool MemoryManager::split_large_page(PageDirectory& page_directory, VirtualAddress vaddr)
+{
+    ASSERT_INTERRUPTS_DISABLED();
+    ASSERT(s_mm_lock.own_lock());
+    u32 page_directory_table_index = (vaddr.get() >> 30) & 0x3;
+    u32 page_directory_index = (vaddr.get() >> 21) & 0x1ff;
+
+    auto page_table = allocate_user_physical_page(ShouldZeroFill::No);
+    if (!page_table) {
+        dbg() << "MM: Unable to allocate page table to split large page at " << vaddr;
+        return false;
+    }
+
+    // Allocating may have purged memory and remapped the pd, so look it up only now.
+    auto* pd = quickmap_pd(page_directory, page_directory_table_index);
+    PageDirectoryEntry& pde = pd[page_directory_index];
+    ASSERT(pde.is_present() && pde.is_huge());
+    FlatPtr large_page_base = (FlatPtr)pde.page_table_base();
+
+    auto* page_table_entries = quickmap_pt(page_table->paddr());
+    for (size_t i = 0; i < LARGE_PAGE_SIZE / PAGE_SIZE; ++i) {
+        auto& pte = page_table_entries[i];
+        pte.clear();
+        pte.set_physical_page_base(large_page_base + i * PAGE_SIZE);
+        pte.set_writable(pde.is_writable());
+        pte.set_user_allowed(pde.is_user_allowed());
+        pte.set_write_through(pde.is_write_through());
+        pte.set_cache_disabled(pde.is_cache_disabled());
+        pte.set_global(pde.is_global());
+        pte.set_execute_disabled(pde.is_execute_disabled());
+        pte.set_present(true);
+    }
+
+#ifdef MM_DEBUG
+    dbg() << "MM: Split large page at " << VirtualAddress(vaddr.get() & ~(LARGE_PAGE_SIZE - 1)) << " into page table at " << page_table->paddr();
+#endif
+    pde.clear();
+    pde.set_page_table_base(page_table->paddr().get());
+    pde.set_user_allowed(true);
+    pde.set_present(true);
+    pde.set_writable(true);
+    pde.set_global(&page_directory == m_kernel_page_directory.ptr());
+    auto result = page_directory.m_page_tables.set(vaddr.get() & ~(LARGE_PAGE_SIZE - 1), move(page_table));
+    ASSERT(result == AK::HashSetResult::InsertedNewEntry);
+
+    // The translations didn't change, but the CPU must not see both the large
+    // and the small page for the same address.
+    flush_tlb(&page_directory, VirtualAddress(vaddr.get() & ~(LARGE_PAGE_SIZE - 1)), LARGE_PAGE_SIZE / PAGE_SIZE);
+    return true;
+}
+
 void MemoryManager::release_pte(PageDirectory& page_directory, VirtualAddress vaddr, bool is_last_release)
 {
     ASSERT_INTERRUPTS_DISABLED();
@@ -264,6 +337,12 @@ void MemoryManager::release_pte(PageDirectory& page_directory, VirtualAddress va
 
     auto* pd = quickmap_pd(page_directory, page_directory_table_index);
     PageDirectoryEntry& pde = pd[page_directory_index];
+    if (pde.is_present() && pde.is_huge()) {
+        // Large pages are only used for whole 2 MiB chunks of a region,
+        // so the entire chunk goes away at once.
+        pde.clear();
+        return;
+    }
     if (pde.is_present()) {
         auto* page_table = quickmap_pt(PhysicalAddress((FlatPtr)pde.page_table_base()));
         auto& pte = page_table[page_table_index];
@@ -414,7 +493,9 @@ OwnPtr<Region> MemoryManager::allocate_kernel_region(PhysicalAddress paddr, size
 {
     ASSERT(!(size % PAGE_SIZE));
     ScopedSpinLock lock(s_mm_lock);
-    auto range = kernel_page_directory().range_allocator().allocate_anywhere(size);
+    // Give large physical ranges (e.g. framebuffers) a chance to be mapped with large pages.
+    size_t alignment = size >= LARGE_PAGE_SIZE && !(paddr.get() % LARGE_PAGE_SIZE) ? LARGE_PAGE_SIZE : PAGE_SIZE;
+    auto range = kernel_page_directory().range_allocator().allocate_anywhere(size, alignment);
     if (!range.is_valid())
         return nullptr;
     auto vmobject = AnonymousVMObject::create_for_physical_range(paddr, size);
@@ -449,8 +530,10 @@ OwnPtr<Region> MemoryManager::allocate_kernel_region_with_vmobject(const Range&
         region = Region::create_user_accessible(range, vmobject, 0, name, access, cacheable);
     else
         region = Region::create_kernel_only(range, vmobject, 0, name, access, cacheable);
-    if (region)
+    if (region) {
+        region->set_wants_large_pages(true);
         region->map(kernel_page_directory());
+    }
     return region;
 }
 
@@ -498,24 +581,59 @@ RefPtr<PhysicalPage> MemoryManager::find_free_user_physical_page()
 RefPtr<PhysicalPage> MemoryManager::allocate_user_physical_page(ShouldZeroFill should_zero_fill, bool* did_purge)
 {
     ScopedSpinLock lock(s_mm_lock);
-    auto page = find_free_user_physical_page();
+    RefPtr<PhysicalPage> page;
+    bool page_is_zeroed = false;
     bool purged_pages = false;
 
+    if (should_zero_fill == ShouldZeroFill::Yes && !m_zeroed_user_physical_pages.is_empty()) {
+        page = m_zeroed_user_physical_pages.take_last();
+        page_is_zeroed = true;
+    } else {
+        page = find_free_user_physical_page();
+    }
+
+    if (!page && !m_zeroed_user_physical_pages.is_empty()) {
+        // The free lists are empty, but there are still pages in the zeroed pool.
+        page = m_zeroed_user_physical_pages.take_last();
+        page_is_zeroed = true;
+    }
+
     if (!page) {
-        // We didn't have a single free physical page. Let's try to free something up!
-        // First, we look for a purgeable VMObject in the volatile state.
-        for_each_vmobject_of_type<PurgeableVMObject>([&](auto& vmobject) {
-            int purged_page_count = vmobject.purge_with_interrupts_disabled({});
-            if (purged_page_count) {
-                klog() << "MM: Purge saved the day! Purged " << purged_page_count << " pages from PurgeableVMObject{" << &vmobject << "}";
-                page = find_free_user_physical_page();
-                purged_pages = true;
-                ASSERT(page);
-                return IterationDecision::Break;
-            }
-            return IterationDecision::Continue;
+        // Purging frees pages right away, so the translations it takes down
+        // can't wait for a TLBFlushBatch we may be in the middle of.
+        auto* current_thread = Thread::current();
+        auto* tlb_flush_batch = current_thread ? current_thread->tlb_flush_batch() : nullptr;
+        if (tlb_flush_batch)
+            current_thread->set_tlb_flush_batch(nullptr);
+        ScopeGuard restore_tlb_flush_batch([&] {
+            if (tlb_flush_batch)
+                current_thread->set_tlb_flush_batch(tlb_flush_batch);
         });
 
+        // We didn't have a single free physical page. Let's try to free something up!
+        // Cached file contents nobody maps are the cheapest to give up, since
+        // they can simply be read back in.
+        if (size_t evicted_page_count = PageCache::the().try_evict_unused_pages()) {
+            klog() << "MM: Evicted " << evicted_page_count << " unused pages from the page cache";
+            page = find_free_user_physical_page();
+            ASSERT(page);
+        }
+
+        // Next, we look for a purgeable VMObject in the volatile state.
+        if (!page) {
+            for_each_vmobject_of_type<PurgeableVMObject>([&](auto& vmobject) {
+                int purged_page_count = vmobject.purge_with_interrupts_disabled({});
+                if (purged_page_count) {
+                    klog() << "MM: Purge saved the day! Purged " << purged_page_count << " pages from PurgeableVMObject{" << &vmobject << "}";
+                    page = find_free_user_physical_page();
+                    purged_pages = true;
+                    ASSERT(page);
+                    return IterationDecision::Break;
+                }
+                return IterationDecision::Continue;
+            });
+        }
+
         if (!page) {
             klog() << "MM: no user physical pages available";
             return {};
@@ -527,9 +645,14 @@ RefPtr<PhysicalPage> MemoryManager::allocate_user_physical_page(ShouldZeroFill s
 #endif
 
     if (should_zero_fill == ShouldZeroFill::Yes) {
-        auto* ptr = quickmap_page(*page);
-        memset(ptr, 0, PAGE_SIZE);
-        unquickmap_page();
+        if (page_is_zeroed) {
+            ++m_zeroed_page_pool_hits;
+        } else {
+            ++m_zeroed_page_pool_misses;
+            auto* ptr = quickmap_page(*page);
+            memset(ptr, 0, PAGE_SIZE);
+            unquickmap_page();
+        }
     }
 
     if (did_purge)
@@ -539,6 +662,53 @@ RefPtr<PhysicalPage> MemoryManager::allocate_user_physical_page(ShouldZeroFill s
     return page;
 }
 
+void MemoryManager::refill_zeroed_page_pool()
+{
+    for (;;) {
+        // Zero one page at a time so that the lock is never held for long.
+        ScopedSpinLock lock(s_mm_lock);
+        if (m_zeroed_user_physical_pages.size() >= zeroed_page_pool_size)
+            return;
+        // Leave memory that's getting scarce alone, zeroing it ahead of time isn't worth much then.
+        unsigned free_pages = m_user_physical_pages - m_user_physical_pages_used - m_zeroed_user_physical_pages.size();
+        if (free_pages < zeroed_page_pool_size * 2)
+            return;
+        auto page = find_free_user_physical_page();
+        if (!page)
+            return;
+        auto* ptr = quickmap_page(*page);
+        memset(ptr, 0, PAGE_SIZE);
+        unquickmap_page();
+        m_zeroed_user_physical_pages.append(page.release_nonnull());
+    }
+}
+
+NonnullRefPtrVector<PhysicalPage> MemoryManager::allocate_aligned_contiguous_user_physical_pages(size_t size, size_t alignment)
+{
+    ASSERT(!(size % PAGE_SIZE));
+    ScopedSpinLock lock(s_mm_lock);
+    size_t count = size / PAGE_SIZE;
+    NonnullRefPtrVector<PhysicalPage> physical_pages;
+
+    for (auto& region : m_user_physical_regions) {
+        physical_pages = region.take_aligned_contiguous_free_pages(count, alignment, false);
+        if (!physical_pages.is_empty())
+            break;
+    }
+
+    if (physical_pages.is_empty())
+        return {};
+
+    for (auto& page : physical_pages) {
+        auto* ptr = quickmap_page(page);
+        memset(ptr, 0, PAGE_SIZE);
+        unquickmap_page();
+    }
+
+    m_user_physical_pages_used += count;
+    return physical_pages;
+}
+
 void MemoryManager::deallocate_supervisor_physical_page(const PhysicalPage& page)
 {
     ScopedSpinLock lock(s_mm_lock);
@@ -623,6 +793,7 @@ void MemoryManager::enter_process_paging_scope(Process& process)
     ScopedSpinLock lock(s_mm_lock);
 
     current_thread->tss().cr3 = process.page_directory().cr3();
+    Processor::current().set_active_cr3(process.page_directory().cr3());
     write_cr3(process.page_directory().cr3());
 }
 
@@ -634,12 +805,25 @@ void MemoryManager::flush_tlb_local(VirtualAddress vaddr, size_t page_count)
     Processor::flush_tlb_local(vaddr, page_count);
 }
 
-void MemoryManager::flush_tlb(VirtualAddress vaddr, size_t page_count)
+void MemoryManager::flush_tlb(const PageDirectory* page_directory, VirtualAddress vaddr, size_t page_count)
 {
 #ifdef MM_DEBUG
     dbg() << "MM: Flush " << page_count << " pages at " << vaddr;
 #endif
-    Processor::flush_tlb(vaddr, page_count);
+    // Kernel memory is mapped into every address space, anything else only
+    // needs flushing where its own page directory is loaded.
+    if (!page_directory || page_directory == MM.m_kernel_page_directory.ptr() || !is_user_address(vaddr)) {
+        Processor::flush_tlb(0, vaddr, page_count);
+        return;
+    }
+    if (auto* current_thread = Thread::current()) {
+        auto* batch = current_thread->tlb_flush_batch();
+        if (batch && &batch->page_directory() == page_directory) {
+            batch->add(vaddr, page_count);
+            return;
+        }
+    }
+    Processor::flush_tlb(page_directory->cr3(), vaddr, page_count);
 }
 
 extern "C" PageTableEntry boot_pd3_pt1023[1024];
@@ -778,12 +962,30 @@ bool MemoryManager::can_read_without_faulting(const Process& process, VirtualAdd
     // FIXME: Use the size argument!
     UNUSED_PARAM(size);
     ScopedSpinLock lock(s_mm_lock);
+    auto* pde = const_cast<MemoryManager*>(this)->pde(process.page_directory(), vaddr);
+    if (pde->is_present() && pde->is_huge())
+        return true;
     auto* pte = const_cast<MemoryManager*>(this)->pte(process.page_directory(), vaddr);
     if (!pte)
         return false;
     return pte->is_present();
 }
 
+PhysicalAddress MemoryManager::physical_address_for_kernel_vaddr(VirtualAddress vaddr)
+{
+    ASSERT(!is_user_address(vaddr));
+    ScopedSpinLock lock(s_mm_lock);
+    auto* pde = this->pde(kernel_page_directory(), vaddr);
+    if (!pde->is_present())
+        return {};
+    if (pde->is_huge())
+        return PhysicalAddress((FlatPtr)pde->page_table_base() + (vaddr.get() & (LARGE_PAGE_SIZE - 1)));
+    auto* pte = this->pte(kernel_page_directory(), vaddr);
+    if (!pte || !pte->is_present())
+        return {};
+    return PhysicalAddress((FlatPtr)pte->physical_page_base() + (vaddr.get() & ~PAGE_MASK));
+}
+
 bool MemoryManager::validate_user_read(const Process& process, VirtualAddress vaddr, size_t size) const
 {
     if (!is_user_address(vaddr))
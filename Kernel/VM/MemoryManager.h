@@ -76,6 +76,7 @@ extern RecursiveSpinLock s_mm_lock;
 
 class MemoryManager {
     AK_MAKE_ETERNAL
+    friend class PageCache;
     friend class PageDirectory;
     friend class PhysicalPage;
     friend class PhysicalRegion;
@@ -107,14 +108,20 @@ public:
 
     bool can_read_without_faulting(const Process&, VirtualAddress, size_t) const;
 
+    // Looks up the physical address currently backing a kernel virtual address.
+    // Returns a null address if nothing is mapped there.
+    PhysicalAddress physical_address_for_kernel_vaddr(VirtualAddress);
+
     enum class ShouldZeroFill {
         No,
         Yes
     };
 
     RefPtr<PhysicalPage> allocate_user_physical_page(ShouldZeroFill = ShouldZeroFill::Yes, bool* did_purge = nullptr);
+    void refill_zeroed_page_pool();
     RefPtr<PhysicalPage> allocate_supervisor_physical_page();
     NonnullRefPtrVector<PhysicalPage> allocate_contiguous_supervisor_physical_pages(size_t size);
+    NonnullRefPtrVector<PhysicalPage> allocate_aligned_contiguous_user_physical_pages(size_t size, size_t alignment);
     void deallocate_user_physical_page(const PhysicalPage&);
     void deallocate_supervisor_physical_page(const PhysicalPage&);
 
@@ -130,6 +137,7 @@ public:
     unsigned user_physical_pages_used() const { return m_user_physical_pages_used; }
     unsigned super_physical_pages() const { return m_super_physical_pages; }
     unsigned super_physical_pages_used() const { return m_super_physical_pages_used; }
+    unsigned zeroed_user_physical_pages() const { return m_zeroed_user_physical_pages.size(); }
 
     template<typename Callback>
     static void for_each_vmobject(Callback callback)
@@ -180,7 +188,7 @@ private:
     void protect_kernel_image();
     void parse_memory_map();
     static void flush_tlb_local(VirtualAddress, size_t page_count = 1);
-    static void flush_tlb(VirtualAddress, size_t page_count = 1);
+    static void flush_tlb(const PageDirectory*, VirtualAddress, size_t page_count = 1);
 
     static Region* user_region_from_vaddr(Process&, VirtualAddress);
     static Region* kernel_region_from_vaddr(VirtualAddress);
@@ -194,8 +202,10 @@ private:
     PageDirectoryEntry* quickmap_pd(PageDirectory&, size_t pdpt_index);
     PageTableEntry* quickmap_pt(PhysicalAddress);
 
+    const PageDirectoryEntry* pde(const PageDirectory&, VirtualAddress);
     PageTableEntry* pte(const PageDirectory&, VirtualAddress);
     PageTableEntry* ensure_pte(PageDirectory&, VirtualAddress);
+    bool split_large_page(PageDirectory&, VirtualAddress);
     void release_pte(PageDirectory&, VirtualAddress, bool);
 
     RefPtr<PageDirectory> m_kernel_page_directory;
@@ -208,6 +218,13 @@ private:
     unsigned m_super_physical_pages { 0 };
     unsigned m_super_physical_pages_used { 0 };
 
+    // Free user pages that have already been zeroed by the PageZeroingTask.
+    // They're not counted as used, and anyone can have them once the free
+    // lists run dry.
+    NonnullRefPtrVector<PhysicalPage> m_zeroed_user_physical_pages;
+    unsigned m_zeroed_page_pool_hits { 0 };
+    unsigned m_zeroed_page_pool_misses { 0 };
+
     NonnullRefPtrVector<PhysicalRegion> m_user_physical_regions;
     NonnullRefPtrVector<PhysicalRegion> m_super_physical_regions;
 
@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <AK/ByteBuffer.h>
+#include <AK/Singleton.h>
+#include <Kernel/FileSystem/Inode.h>
+#include <Kernel/VM/MemoryManager.h>
+#include <Kernel/VM/PageCache.h>
+
+//#define PAGE_CACHE_DEBUG
+
+namespace Kernel {
+
+static AK::Singleton<PageCache> s_the;
+
+// Once less than 1/16th of user memory is free, unused pages are evicted
+// in batches before paging in anything new.
+static constexpr size_t low_memory_divisor = 16;
+static constexpr size_t eviction_batch_size = 32;
+
+// Sequential access starts out reading 4 pages at a time and doubles the
+// window on every miss up to 128 KiB. Faults that don't look sequential
+// read the aligned 32 KiB cluster around the faulting page instead.
+static constexpr size_t initial_readahead_pages = 4;
+static constexpr size_t max_readahead_pages = 32;
+static constexpr size_t fault_cluster_pages = 8;
+
+PageCache& PageCache::the()
+{
+    return *s_the;
+}
+
+PageCache::PageCache()
+{
+}
+
+PageCache::InodePages& PageCache::ensure_inode_pages(const Inode& inode)
+{
+    ASSERT(m_lock.is_locked());
+    auto it = m_inodes.find(&inode);
+    if (it != m_inodes.end())
+        return *it->value;
+    auto inode_pages = make<InodePages>();
+    auto& inode_pages_ref = *inode_pages;
+    m_inodes.set(&inode, move(inode_pages));
+    return inode_pages_ref;
+}
+
+PageCache::CachedPage* PageCache::find_page(const Inode& inode, size_t page_index)
+{
+    ASSERT(m_lock.is_locked());
+    auto it = m_inodes.find(&inode);
+    if (it == m_inodes.end())
+        return nullptr;
+    auto page_it = it->value->pages.find(page_index);
+    if (page_it == it->value->pages.end())
+        return nullptr;
+    return page_it->value.ptr();
+}
+
+void PageCache::remove_page(InodePages& inode_pages, CachedPage& cached_page, NonnullRefPtrVector<PhysicalPage>& pages_to_release)
+{
+    ASSERT(m_lock.is_locked());
+    // The physical pages are released by the caller once the lock is dropped,
+    // as giving them back to the MemoryManager takes its lock.
+    pages_to_release.append(cached_page.physical_page);
+    m_lru.remove(cached_page);
+    --m_cached_pages;
+    inode_pages.pages.remove(cached_page.page_index);
+}
+
+KResultOr<NonnullRefPtr<PhysicalPage>> PageCache::get_page(Inode& inode, size_t page_index, AccessType access_type, bool* was_cached)
+{
+    if (was_cached)
+        *was_cached = true;
+
+    for (;;) {
+        u32 generation;
+        size_t first_page_index = page_index;
+        size_t page_count = 1;
+        {
+            ScopedSpinLock lock(m_lock);
+            auto& inode_pages = ensure_inode_pages(inode);
+            bool is_sequential = page_index == 0 || page_index == inode_pages.next_page_index || page_index == inode_pages.readahead_end;
+            inode_pages.next_page_index = page_index + 1;
+
+            if (auto* cached_page = find_page(inode, page_index)) {
+                m_lru.append(*cached_page);
+                ++m_hits;
+                NonnullRefPtr<PhysicalPage> physical_page = cached_page->physical_page;
+                return physical_page;
+            }
+            ++m_misses;
+            if (was_cached)
+                *was_cached = false;
+
+            if (is_sequential) {
+                inode_pages.readahead_pages = clamp(inode_pages.readahead_pages * 2, initial_readahead_pages, max_readahead_pages);
+                page_count = inode_pages.readahead_pages;
+                inode_pages.readahead_end = page_index + page_count;
+            } else {
+                inode_pages.readahead_pages = 0;
+                if (access_type == AccessType::Fault) {
+                    first_page_index = page_index - page_index % fault_cluster_pages;
+                    page_count = fault_cluster_pages;
+                }
+            }
+
+            // Don't read past the end of the file, or anything we already have.
+            size_t inode_page_count = PAGE_ROUND_UP(inode.size()) / PAGE_SIZE;
+            if (page_index < inode_page_count) {
+                page_count = min(page_count, inode_page_count - first_page_index);
+            } else {
+                first_page_index = page_index;
+                page_count = 1;
+            }
+            while (first_page_index < page_index && find_page(inode, first_page_index)) {
+                ++first_page_index;
+                --page_count;
+            }
+            while (first_page_index + page_count - 1 > page_index && find_page(inode, first_page_index + page_count - 1))
+                --page_count;
+
+            generation = inode_pages.generation;
+        }
+
+        make_room_if_needed();
+
+        RefPtr<PhysicalPage> physical_page;
+        auto result = page_in(inode, page_index, first_page_index, page_count, generation, physical_page);
+        if (result.is_error())
+            return result;
+        if (physical_page)
+            return physical_page.release_nonnull();
+#ifdef PAGE_CACHE_DEBUG
+        dbg() << "PageCache: Inode " << inode.identifier() << " changed while paging in " << page_index << ", retrying";
+#endif
+    }
+}
+
+KResult PageCache::page_in(Inode& inode, size_t page_index, size_t first_page_index, size_t page_count, u32 generation, RefPtr<PhysicalPage>& requested_page)
+{
+    ASSERT(page_index >= first_page_index && page_index < first_page_index + page_count);
+
+    auto buffer = ByteBuffer::create_uninitialized(page_count * PAGE_SIZE);
+    ssize_t nread = 0;
+    if (first_page_index * PAGE_SIZE < inode.size()) {
+        nread = inode.read_bytes(first_page_index * PAGE_SIZE, buffer.size(), buffer.data(), nullptr);
+        if (nread < 0)
+            return KResult(nread);
+    }
+    // If we read less than we asked for, zero out the rest to avoid leaking uninitialized data.
+    memset(buffer.data() + nread, 0, buffer.size() - nread);
+
+    NonnullRefPtrVector<PhysicalPage> physical_pages;
+    for (size_t i = 0; i < page_count; ++i) {
+        auto physical_page = MM.allocate_user_physical_page(MemoryManager::ShouldZeroFill::No);
+        if (physical_page.is_null()) {
+            // Pages after the requested one are only read-ahead, so it's fine to drop them.
+            if (first_page_index + i > page_index)
+                break;
+            klog() << "PageCache: Unable to allocate a physical page";
+            return KResult(-ENOMEM);
+        }
+        u8* dest_ptr = MM.quickmap_page(*physical_page);
+        memcpy(dest_ptr, buffer.data() + i * PAGE_SIZE, PAGE_SIZE);
+        MM.unquickmap_page();
+        physical_pages.append(physical_page.release_nonnull());
+    }
+
+    ScopedSpinLock lock(m_lock);
+    auto& inode_pages = ensure_inode_pages(inode);
+    if (inode_pages.generation != generation)
+        return KSuccess;
+    for (size_t i = 0; i < physical_pages.size(); ++i) {
+        size_t index = first_page_index + i;
+        if (auto* cached_page = find_page(inode, index)) {
+            // Somebody else paged this one in while we were reading.
+            if (index == page_index)
+                requested_page = cached_page->physical_page;
+            continue;
+        }
+        auto physical_page = physical_pages.ptr_at(i);
+        auto cached_page = make<CachedPage>(inode, index, move(physical_page));
+        if (index == page_index)
+            requested_page = cached_page->physical_page;
+        else
+            ++m_readahead_pages;
+        m_lru.append(*cached_page);
+        inode_pages.pages.set(index, move(cached_page));
+        ++m_cached_pages;
+    }
+    return KSuccess;
+}
+
+RefPtr<PhysicalPage> PageCache::find_cached_page(const Inode& inode, size_t page_index)
+{
+    ScopedSpinLock lock(m_lock);
+    auto* cached_page = find_page(inode, page_index);
+    if (!cached_page)
+        return nullptr;
+    m_lru.append(*cached_page);
+    return cached_page->physical_page;
+}
+
+ssize_t PageCache::read(Inode& inode, off_t offset, ssize_t count, u8* buffer)
+{
+    ASSERT(offset >= 0);
+    ASSERT(count >= 0);
+    size_t size = inode.size();
+    if (static_cast<size_t>(offset) >= size)
+        return 0;
+
+    size_t remaining = min(static_cast<size_t>(count), size - offset);
+    ssize_t nread = 0;
+    while (remaining) {
+        size_t page_index = offset / PAGE_SIZE;
+        size_t offset_in_page = offset % PAGE_SIZE;
+        size_t bytes_to_copy = min(remaining, static_cast<size_t>(PAGE_SIZE) - offset_in_page);
+
+        auto page_or_error = get_page(inode, page_index);
+        if (page_or_error.is_error())
+            return nread ? nread : page_or_error.error();
+
+        // The destination may be a user buffer that could fault, so bounce
+        // through the stack instead of copying out of the quickmapped page.
+        u8 page_buffer[PAGE_SIZE];
+        u8* src_ptr = MM.quickmap_page(*page_or_error.value());
+        memcpy(page_buffer, src_ptr + offset_in_page, bytes_to_copy);
+        MM.unquickmap_page();
+        memcpy(buffer + nread, page_buffer, bytes_to_copy);
+
+        offset += bytes_to_copy;
+        nread += bytes_to_copy;
+        remaining -= bytes_to_copy;
+    }
+    return nread;
+}
+
+void PageCache::inode_contents_changed(Inode& inode, off_t offset, ssize_t size, const u8* data)
+{
+    ASSERT(offset >= 0);
+    {
+        ScopedSpinLock lock(m_lock);
+        auto it = m_inodes.find(&inode);
+        if (it == m_inodes.end())
+            return;
+        ++it->value->generation;
+    }
+
+    while (size > 0) {
+        size_t page_index = offset / PAGE_SIZE;
+        size_t offset_in_page = offset % PAGE_SIZE;
+        size_t bytes_to_copy = min(static_cast<size_t>(size), static_cast<size_t>(PAGE_SIZE) - offset_in_page);
+
+        // Same as in read(), the data may live in userspace.
+        u8 page_buffer[PAGE_SIZE];
+        if (data)
+            memcpy(page_buffer, data, bytes_to_copy);
+
+        NonnullRefPtrVector<PhysicalPage> pages_to_release;
+        {
+            ScopedSpinLock lock(m_lock);
+            auto it = m_inodes.find(&inode);
+            if (it == m_inodes.end())
+                return;
+            if (auto* cached_page = find_page(inode, page_index)) {
+                if (data) {
+                    u8* dest_ptr = MM.quickmap_page(*cached_page->physical_page);
+                    memcpy(dest_ptr + offset_in_page, page_buffer, bytes_to_copy);
+                    MM.unquickmap_page();
+                } else {
+                    remove_page(*it->value, *cached_page, pages_to_release);
+                }
+            }
+        }
+
+        offset += bytes_to_copy;
+        size -= bytes_to_copy;
+        if (data)
+            data += bytes_to_copy;
+    }
+}
+
+void PageCache::inode_size_changed(Inode& inode, size_t old_size, size_t new_size)
+{
+    NonnullRefPtrVector<PhysicalPage> pages_to_release;
+    ScopedSpinLock lock(m_lock);
+    auto it = m_inodes.find(&inode);
+    if (it == m_inodes.end())
+        return;
+    auto& inode_pages = *it->value;
+    ++inode_pages.generation;
+    if (new_size >= old_size)
+        return;
+
+    size_t new_page_count = PAGE_ROUND_UP(new_size) / PAGE_SIZE;
+    Vector<CachedPage*> pages_past_end;
+    for (auto& page_it : inode_pages.pages) {
+        if (page_it.key >= new_page_count)
+            pages_past_end.append(page_it.value.ptr());
+    }
+    for (auto* cached_page : pages_past_end)
+        remove_page(inode_pages, *cached_page, pages_to_release);
+
+    // Whatever used to be past the new end of the last page must read back as zeroes.
+    if (new_size % PAGE_SIZE) {
+        if (auto* cached_page = find_page(inode, new_size / PAGE_SIZE)) {
+            u8* ptr = MM.quickmap_page(*cached_page->physical_page);
+            memset(ptr + new_size % PAGE_SIZE, 0, PAGE_SIZE - new_size % PAGE_SIZE);
+            MM.unquickmap_page();
+        }
+    }
+}
+
+void PageCache::evict_inode(const Inode& inode)
+{
+    NonnullRefPtrVector<PhysicalPage> pages_to_release;
+    ScopedSpinLock lock(m_lock);
+    auto it = m_inodes.find(&inode);
+    if (it == m_inodes.end())
+        return;
+    auto inode_pages = move(it->value);
+    m_inodes.remove(it);
+    for (auto& page_it : inode_pages->pages) {
+        pages_to_release.append(page_it.value->physical_page);
+        m_lru.remove(*page_it.value);
+        --m_cached_pages;
+    }
+}
+
+size_t PageCache::evict_unused_pages(size_t max_count)
+{
+    NonnullRefPtrVector<PhysicalPage> pages_to_release;
+    ScopedSpinLock lock(m_lock);
+    return evict_unused_pages_locked(max_count, pages_to_release);
+}
+
+size_t PageCache::try_evict_unused_pages()
+{
+    NonnullRefPtrVector<PhysicalPage> pages_to_release;
+    u32 prev_flags;
+    if (!m_lock.try_lock(prev_flags))
+        return 0;
+    auto evicted_count = evict_unused_pages_locked(eviction_batch_size, pages_to_release);
+    m_lock.unlock(prev_flags);
+    return evicted_count;
+}
+
+size_t PageCache::evict_unused_pages_locked(size_t max_count, NonnullRefPtrVector<PhysicalPage>& pages_to_release)
+{
+    ASSERT(m_lock.is_locked());
+    for (auto it = m_lru.begin(); it != m_lru.end() && pages_to_release.size() < max_count;) {
+        auto& cached_page = *it;
+        ++it;
+        // Pages that are still mapped somewhere stay, since evicting them
+        // would not free anything.
+        if (cached_page.physical_page->ref_count() != 1)
+            continue;
+        auto inode_it = m_inodes.find(&cached_page.inode);
+        ASSERT(inode_it != m_inodes.end());
+        remove_page(*inode_it->value, cached_page, pages_to_release);
+    }
+    m_evictions += pages_to_release.size();
+#ifdef PAGE_CACHE_DEBUG
+    dbg() << "PageCache: Evicted " << pages_to_release.size() << " pages";
+#endif
+    return pages_to_release.size();
+}
+
+void PageCache::make_room_if_needed()
+{
+    size_t free_pages = MM.user_physical_pages() - MM.user_physical_pages_used();
+    if (free_pages > MM.user_physical_pages() / low_memory_divisor)
+        return;
+    evict_unused_pages(eviction_batch_size);
+}
+
+PageCache::Statistics PageCache::statistics() const
+{
+    ScopedSpinLock lock(m_lock);
+    Statistics statistics;
+    statistics.cached_pages = m_cached_pages;
+    statistics.hits = m_hits;
+    statistics.misses = m_misses;
+    statistics.evictions = m_evictions;
+    statistics.readahead_pages = m_readahead_pages;
+    return statistics;
+}
+
+}
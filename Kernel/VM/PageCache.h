@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <AK/HashMap.h>
+#include <AK/IntrusiveList.h>
+#include <AK/NumericLimits.h>
+#include <AK/NonnullOwnPtr.h>
+#include <AK/NonnullRefPtrVector.h>
+#include <Kernel/Forward.h>
+#include <Kernel/KResult.h>
+#include <Kernel/SpinLock.h>
+#include <Kernel/VM/PhysicalPage.h>
+
+namespace Kernel {
+
+// The page cache holds the contents of regular files, one physical page per
+// (inode, page index). read() copies out of it, and InodeVMObjects map the
+// very same pages, so a file that's both read and mapped is only in memory once.
+// Pages referenced by nothing but the cache are evicted in LRU order when
+// memory runs low.
+//
+// Misses read more than the one page asked for: sequential access grows a
+// per-inode read-ahead window, and page faults read a small aligned cluster
+// around the faulting page.
+class PageCache {
+    AK_MAKE_NONCOPYABLE(PageCache);
+    AK_MAKE_NONMOVABLE(PageCache);
+
+public:
+    static PageCache& the();
+
+    PageCache();
+
+    struct Statistics {
+        size_t cached_pages { 0 };
+        size_t hits { 0 };
+        size_t misses { 0 };
+        size_t evictions { 0 };
+        size_t readahead_pages { 0 };
+    };
+
+    enum class AccessType {
+        Read,
+        Fault,
+    };
+
+    KResultOr<NonnullRefPtr<PhysicalPage>> get_page(Inode&, size_t page_index, AccessType = AccessType::Read, bool* was_cached = nullptr);
+    RefPtr<PhysicalPage> find_cached_page(const Inode&, size_t page_index);
+    ssize_t read(Inode&, off_t offset, ssize_t count, u8* buffer);
+
+    void inode_contents_changed(Inode&, off_t offset, ssize_t size, const u8* data);
+    void inode_size_changed(Inode&, size_t old_size, size_t new_size);
+    void evict_inode(const Inode&);
+
+    size_t evict_unused_pages(size_t max_count = NumericLimits<size_t>::max());
+
+    // For the MemoryManager when it ran out of pages. This is called with the
+    // MM lock held, which we otherwise take while holding our own lock, so it
+    // gives up instead of waiting if someone else is using the cache.
+    size_t try_evict_unused_pages();
+
+    Statistics statistics() const;
+
+private:
+    struct CachedPage {
+        CachedPage(const Inode& inode, size_t page_index, NonnullRefPtr<PhysicalPage>&& physical_page)
+            : inode(inode)
+            , page_index(page_index)
+            , physical_page(move(physical_page))
+        {
+        }
+
+        const Inode& inode;
+        size_t page_index { 0 };
+        NonnullRefPtr<PhysicalPage> physical_page;
+        IntrusiveListNode lru_node;
+    };
+
+    struct InodePages {
+        HashMap<size_t, NonnullOwnPtr<CachedPage>> pages;
+        // Bumped whenever the contents change, so a racing page-in can tell
+        // that what it read from disk is already stale.
+        u32 generation { 0 };
+
+        // Read-ahead state: the page we expect next if access is sequential,
+        // the end of the last read-ahead window, and that window's size.
+        size_t next_page_index { 0 };
+        size_t readahead_end { 0 };
+        size_t readahead_pages { 0 };
+    };
+
+    InodePages& ensure_inode_pages(const Inode&);
+    CachedPage* find_page(const Inode&, size_t page_index);
+    size_t evict_unused_pages_locked(size_t max_count, NonnullRefPtrVector<PhysicalPage>& pages_to_release);
+    void make_room_if_needed();
+    KResult page_in(Inode&, size_t page_index, size_t first_page_index, size_t page_count, u32 generation, RefPtr<PhysicalPage>& requested_page);
+    void remove_page(InodePages&, CachedPage&, NonnullRefPtrVector<PhysicalPage>& pages_to_release);
+
+    mutable SpinLock<u8> m_lock;
+    HashMap<const Inode*, NonnullOwnPtr<InodePages>> m_inodes;
+    IntrusiveList<CachedPage, &CachedPage::lru_node> m_lru;
+    size_t m_cached_pages { 0 };
+    size_t m_hits { 0 };
+    size_t m_misses { 0 };
+    size_t m_evictions { 0 };
+    size_t m_readahead_pages { 0 };
+};
+
+}
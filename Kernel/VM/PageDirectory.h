@@ -38,6 +38,7 @@ class Process;
 
 class PageDirectory : public RefCounted<PageDirectory> {
     friend class MemoryManager;
+    friend class Region;
 
 public:
     static NonnullRefPtr<PageDirectory> create_for_userspace(Process& process, const RangeAllocator* parent_range_allocator = nullptr)
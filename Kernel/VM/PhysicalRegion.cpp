@@ -79,6 +79,41 @@ NonnullRefPtrVector<PhysicalPage> PhysicalRegion::take_contiguous_free_pages(siz
     return physical_pages;
 }
 
+NonnullRefPtrVector<PhysicalPage> PhysicalRegion::take_aligned_contiguous_free_pages(size_t count, size_t alignment, bool supervisor)
+{
+    ASSERT(count != 0);
+    ASSERT(alignment && !(alignment % PAGE_SIZE));
+
+    NonnullRefPtrVector<PhysicalPage> physical_pages;
+    if (free() < count)
+        return physical_pages;
+
+    // Unlike take_contiguous_free_pages(), this may fail, so callers must be
+    // prepared to get nothing back.
+    FlatPtr first_aligned_address = (m_lower.get() + alignment - 1) & ~(alignment - 1);
+    size_t pages_per_step = alignment / PAGE_SIZE;
+    for (size_t first_index = (first_aligned_address - m_lower.get()) / PAGE_SIZE; first_index + count <= m_pages; first_index += pages_per_step) {
+        bool range_is_free = true;
+        for (size_t i = 0; i < count; ++i) {
+            if (m_bitmap.get(first_index + i)) {
+                range_is_free = false;
+                break;
+            }
+        }
+        if (!range_is_free)
+            continue;
+
+        physical_pages.ensure_capacity(count);
+        for (size_t i = 0; i < count; ++i) {
+            m_bitmap.set(first_index + i, true);
+            physical_pages.append(PhysicalPage::create(m_lower.offset(PAGE_SIZE * (first_index + i)), supervisor));
+        }
+        m_used += count;
+        break;
+    }
+    return physical_pages;
+}
+
 unsigned PhysicalRegion::find_contiguous_free_pages(size_t count)
 {
     ASSERT(count != 0);
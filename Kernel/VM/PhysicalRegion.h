@@ -53,6 +53,7 @@ public:
 
     RefPtr<PhysicalPage> take_free_page(bool supervisor);
     NonnullRefPtrVector<PhysicalPage> take_contiguous_free_pages(size_t count, bool supervisor);
+    NonnullRefPtrVector<PhysicalPage> take_aligned_contiguous_free_pages(size_t count, size_t alignment, bool supervisor);
     void return_page_at(PhysicalAddress addr);
     void return_page(const PhysicalPage& page) { return_page_at(page.paddr()); }
 
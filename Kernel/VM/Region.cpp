@@ -31,6 +31,7 @@
 #include <Kernel/Thread.h>
 #include <Kernel/VM/AnonymousVMObject.h>
 #include <Kernel/VM/MemoryManager.h>
+#include <Kernel/VM/PageCache.h>
 #include <Kernel/VM/PageDirectory.h>
 #include <Kernel/VM/Region.h>
 #include <Kernel/VM/SharedInodeVMObject.h>
@@ -40,6 +41,10 @@
 
 namespace Kernel {
 
+// Inode faults map up to this many neighbouring pages, from the aligned 64 KiB
+// block around the faulting page, if they're already in the page cache.
+static constexpr size_t fault_around_pages = 16;
+
 Region::Region(const Range& range, NonnullRefPtr<VMObject> vmobject, size_t offset_in_vmobject, const String& name, u8 access, bool cacheable, bool kernel)
     : m_range(range)
     , m_offset_in_vmobject(offset_in_vmobject)
@@ -92,6 +97,7 @@ NonnullOwnPtr<Region> Region::clone()
         auto region = Region::create_user_accessible(m_range, m_vmobject, m_offset_in_vmobject, m_name, m_access);
         region->set_mmap(m_mmap);
         region->set_shared(m_shared);
+        region->set_wants_large_pages(m_large_pages);
         return region;
     }
 
@@ -113,6 +119,7 @@ NonnullOwnPtr<Region> Region::clone()
         clone_region->set_stack(true);
     }
     clone_region->set_mmap(m_mmap);
+    clone_region->set_wants_large_pages(m_large_pages);
     return clone_region;
 }
 
@@ -126,11 +133,11 @@ bool Region::commit()
         if (!commit(i)) {
             // Flush what we did commit
             if (i > 0)
-                MM.flush_tlb(vaddr(), i + 1);
+                MM.flush_tlb(m_page_directory.ptr(), vaddr(), i + 1);
             return false;
         }
     }
-    MM.flush_tlb(vaddr(), page_count());
+    MM.flush_tlb(m_page_directory.ptr(), vaddr(), page_count());
     return true;
 }
 
@@ -258,6 +265,57 @@ bool Region::map_individual_page_impl(size_t page_index)
     return true;
 }
 
+bool Region::can_map_large_page(size_t page_index) const
+{
+    constexpr size_t pages_per_large_page = LARGE_PAGE_SIZE / PAGE_SIZE;
+    if (!m_large_pages || (!is_readable() && !is_writable()))
+        return false;
+    if (vaddr_from_page_index(page_index).get() % LARGE_PAGE_SIZE)
+        return false;
+    if (page_index + pages_per_large_page > page_count())
+        return false;
+    auto* first_page = physical_page(page_index);
+    if (!first_page || first_page->paddr().get() % LARGE_PAGE_SIZE)
+        return false;
+    for (size_t i = 0; i < pages_per_large_page; ++i) {
+        auto* page = physical_page(page_index + i);
+        if (!page || page->paddr() != first_page->paddr().offset(i * PAGE_SIZE))
+            return false;
+        if (should_cow(page_index + i))
+            return false;
+    }
+    return true;
+}
+
+bool Region::map_large_page_impl(size_t page_index)
+{
+    ASSERT(s_mm_lock.own_lock());
+    auto page_vaddr = vaddr_from_page_index(page_index);
+    u32 page_directory_table_index = (page_vaddr.get() >> 30) & 0x3;
+    u32 page_directory_index = (page_vaddr.get() >> 21) & 0x1ff;
+
+    auto* pd = MM.quickmap_pd(*m_page_directory, page_directory_table_index);
+    auto& pde = pd[page_directory_index];
+    if (pde.is_present() && !pde.is_huge()) {
+        // Every page in this chunk belongs to us, so the page table that
+        // used to map it can go.
+        m_page_directory->m_page_tables.remove(page_vaddr.get());
+    }
+    pde.clear();
+    pde.set_page_table_base(physical_page(page_index)->paddr().get());
+    pde.set_huge(true);
+    pde.set_cache_disabled(!m_cacheable);
+    pde.set_writable(is_writable());
+    if (Processor::current().has_feature(CPUFeature::NX))
+        pde.set_execute_disabled(!is_executable());
+    pde.set_user_allowed(is_user_accessible());
+    pde.set_present(true);
+#ifdef MM_DEBUG
+    dbg() << "MM: >> region map (PD=" << m_page_directory->cr3() << ") " << name() << " " << page_vaddr << " => " << physical_page(page_index)->paddr() << " (large page)";
+#endif
+    return true;
+}
+
 bool Region::remap_page(size_t page_index, bool with_flush)
 {
     ASSERT(m_page_directory);
@@ -265,7 +323,7 @@ bool Region::remap_page(size_t page_index, bool with_flush)
     ASSERT(physical_page(page_index));
     bool success = map_individual_page_impl(page_index);
     if (with_flush)
-        MM.flush_tlb(vaddr_from_page_index(page_index));
+        MM.flush_tlb(m_page_directory.ptr(), vaddr_from_page_index(page_index));
     return success;
 }
 
@@ -282,7 +340,7 @@ void Region::unmap(ShouldDeallocateVirtualMemoryRange deallocate_range)
         dbg() << "MM: >> Unmapped " << vaddr << " => P" << String::format("%p", page ? page->paddr().get() : 0) << " <<";
 #endif
     }
-    MM.flush_tlb(vaddr(), page_count());
+    MM.flush_tlb(m_page_directory.ptr(), vaddr(), page_count());
     if (deallocate_range == ShouldDeallocateVirtualMemoryRange::Yes) {
         if (m_page_directory->range_allocator().contains(range()))
             m_page_directory->range_allocator().deallocate(range());
@@ -308,12 +366,17 @@ bool Region::map(PageDirectory& page_directory)
 #endif
     size_t page_index = 0;
     while (page_index < page_count()) {
+        if (can_map_large_page(page_index)) {
+            map_large_page_impl(page_index);
+            page_index += LARGE_PAGE_SIZE / PAGE_SIZE;
+            continue;
+        }
         if (!map_individual_page_impl(page_index))
             break;
         ++page_index;
     }
     if (page_index > 0) {
-        MM.flush_tlb(vaddr(), page_index);
+        MM.flush_tlb(m_page_directory.ptr(), vaddr(), page_index);
         return page_index == page_count();
     }
     return false;
@@ -454,6 +517,38 @@ PageFaultResponse Region::handle_cow_fault(size_t page_index_in_region)
     return PageFaultResponse::Continue;
 }
 
+void Region::fault_around(Inode& inode, size_t page_index_in_region)
+{
+    ASSERT_INTERRUPTS_DISABLED();
+    ASSERT(vmobject().m_paging_lock.is_locked());
+
+    // Map whatever neighbouring pages are already in the page cache, so that
+    // walking through a mapped file doesn't take a fault for every single page.
+    // This never does I/O; getting the neighbours into the cache is up to read-ahead.
+    auto& inode_vmobject = static_cast<InodeVMObject&>(vmobject());
+    size_t vmobject_page_index = first_page_index() + page_index_in_region;
+    size_t first = max(vmobject_page_index - vmobject_page_index % fault_around_pages, first_page_index());
+    size_t end = min(min(first + fault_around_pages, first_page_index() + page_count()), inode_vmobject.page_count());
+    for (size_t index = first; index < end; ++index) {
+        if (index == vmobject_page_index)
+            continue;
+        auto& vmobject_physical_page_entry = inode_vmobject.physical_pages()[index];
+        if (!vmobject_physical_page_entry.is_null())
+            continue;
+        auto physical_page = PageCache::the().find_cached_page(inode, index);
+        if (!physical_page)
+            continue;
+        vmobject_physical_page_entry = move(physical_page);
+        size_t neighbour_index_in_region = index - first_page_index();
+        if (!m_shared)
+            set_should_cow(neighbour_index_in_region, true);
+        // These pages weren't mapped before, so there's nothing to flush.
+        if (!remap_page(neighbour_index_in_region, false))
+            break;
+        ++m_fault_around_count;
+    }
+}
+
 PageFaultResponse Region::handle_inode_fault(size_t page_index_in_region)
 {
     ASSERT_INTERRUPTS_DISABLED();
@@ -487,8 +582,31 @@ PageFaultResponse Region::handle_inode_fault(size_t page_index_in_region)
     dbg() << "MM: page_in_from_inode ready to read from inode";
 #endif
     sti();
-    u8 page_buffer[PAGE_SIZE];
     auto& inode = inode_vmobject.inode();
+    if (inode.fs().supports_page_cache()) {
+        // Map the very page the PageCache holds. Private mappings get their own
+        // copy on the first write.
+        bool was_cached = false;
+        auto page_or_error = PageCache::the().get_page(inode, first_page_index() + page_index_in_region, PageCache::AccessType::Fault, &was_cached);
+        cli();
+        ++m_inode_fault_count;
+        if (!was_cached)
+            ++m_inode_fault_miss_count;
+        if (page_or_error.is_error()) {
+            int error = page_or_error.error();
+            klog() << "MM: handle_inode_fault had error (" << error << ") while paging in from the page cache!";
+            return error == -ENOMEM ? PageFaultResponse::OutOfMemory : PageFaultResponse::ShouldCrash;
+        }
+        vmobject_physical_page_entry = page_or_error.release_value();
+        if (!m_shared)
+            set_should_cow(page_index_in_region, true);
+        if (!remap_page(page_index_in_region))
+            return PageFaultResponse::OutOfMemory;
+        fault_around(inode, page_index_in_region);
+        return PageFaultResponse::Continue;
+    }
+
+    u8 page_buffer[PAGE_SIZE];
     auto nread = inode.read_bytes((first_page_index() + page_index_in_region) * PAGE_SIZE, PAGE_SIZE, page_buffer, nullptr);
     if (nread < 0) {
         klog() << "MM: handle_inode_fault had error (" << nread << ") while reading!";
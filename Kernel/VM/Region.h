@@ -99,6 +99,11 @@ public:
     bool is_kernel() const { return m_kernel || vaddr().get() >= 0xc0000000; }
     void set_kernel(bool kernel) { m_kernel = kernel; }
 
+    // Physically contiguous, suitably aligned 2 MiB chunks of regions that
+    // want large pages are mapped with a single PDE instead of a page table.
+    bool wants_large_pages() const { return m_large_pages; }
+    void set_wants_large_pages(bool large_pages) { m_large_pages = large_pages; }
+
     PageFaultResponse handle_fault(const PageFault&);
 
     NonnullOwnPtr<Region> clone();
@@ -166,6 +171,10 @@ public:
 
     u32 cow_pages() const;
 
+    u32 inode_fault_count() const { return m_inode_fault_count; }
+    u32 inode_fault_miss_count() const { return m_inode_fault_miss_count; }
+    u32 fault_around_count() const { return m_fault_around_count; }
+
     void set_readable(bool b) { set_access_bit(Access::Read, b); }
     void set_writable(bool b) { set_access_bit(Access::Write, b); }
     void set_executable(bool b) { set_access_bit(Access::Execute, b); }
@@ -207,7 +216,11 @@ private:
     PageFaultResponse handle_inode_fault(size_t page_index);
     PageFaultResponse handle_zero_fault(size_t page_index);
 
+    void fault_around(Inode&, size_t page_index);
+
     bool map_individual_page_impl(size_t page_index);
+    bool can_map_large_page(size_t page_index) const;
+    bool map_large_page_impl(size_t page_index);
 
     RefPtr<PageDirectory> m_page_directory;
     Range m_range;
@@ -222,7 +235,11 @@ private:
     bool m_stack : 1 { false };
     bool m_mmap : 1 { false };
     bool m_kernel : 1 { false };
+    bool m_large_pages : 1 { false };
     mutable OwnPtr<Bitmap> m_cow_map;
+    u32 m_inode_fault_count { 0 };
+    u32 m_inode_fault_miss_count { 0 };
+    u32 m_fault_around_count { 0 };
 };
 
 inline unsigned prot_to_region_access_flags(int prot)
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <Kernel/Thread.h>
+#include <Kernel/VM/PageDirectory.h>
+#include <Kernel/VM/TLBFlushBatch.h>
+
+namespace Kernel {
+
+TLBFlushBatch::TLBFlushBatch(PageDirectory& page_directory)
+    : m_page_directory(page_directory)
+{
+    auto* current_thread = Thread::current();
+    ASSERT(current_thread);
+    m_previous_batch = current_thread->tlb_flush_batch();
+    current_thread->set_tlb_flush_batch(this);
+}
+
+TLBFlushBatch::~TLBFlushBatch()
+{
+    flush();
+    auto* current_thread = Thread::current();
+    ASSERT(current_thread->tlb_flush_batch() == this);
+    current_thread->set_tlb_flush_batch(m_previous_batch);
+}
+
+void TLBFlushBatch::add(VirtualAddress vaddr, size_t page_count)
+{
+    if (!page_count)
+        return;
+    auto* ptr = vaddr.as_ptr();
+    // Regions are usually walked in order, so try extending the last range first.
+    if (m_range_count) {
+        auto& last_range = m_ranges[m_range_count - 1];
+        if (last_range.ptr + last_range.page_count * PAGE_SIZE == ptr) {
+            last_range.page_count += page_count;
+            return;
+        }
+    }
+    if (m_range_count == max_ranges)
+        flush();
+    m_ranges[m_range_count++] = { ptr, page_count };
+}
+
+void TLBFlushBatch::flush()
+{
+    if (!m_range_count)
+        return;
+    Processor::count_batched_tlb_flush_ranges(m_range_count);
+    Processor::flush_tlb(m_page_directory.cr3(), m_ranges, m_range_count);
+    m_range_count = 0;
+}
+
+}
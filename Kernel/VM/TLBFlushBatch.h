@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <AK/Noncopyable.h>
+#include <AK/Types.h>
+#include <Kernel/Arch/i386/CPU.h>
+#include <Kernel/Forward.h>
+
+namespace Kernel {
+
+// While a TLBFlushBatch is alive, TLB flushes the current thread makes in its
+// page directory are collected instead of being sent out one by one. When the
+// batch is destroyed (or fills up), each processor that has the address space
+// loaded gets a single shootdown covering all of them.
+//
+// Only use this where stale translations are harmless until the end of the
+// batch, e.g. when write-protecting memory for fork() while holding the MM
+// lock, so no page fault can act on the new protection before everybody
+// sees it. Never around unmapping memory that is freed before the batch
+// ends. (Purging on allocation failure bypasses the batch for this reason.)
+class TLBFlushBatch {
+    AK_MAKE_NONCOPYABLE(TLBFlushBatch);
+    AK_MAKE_NONMOVABLE(TLBFlushBatch);
+
+public:
+    explicit TLBFlushBatch(PageDirectory&);
+    ~TLBFlushBatch();
+
+    const PageDirectory& page_directory() const { return m_page_directory; }
+
+    void add(VirtualAddress, size_t page_count);
+    void flush();
+
+private:
+    static constexpr size_t max_ranges = 16;
+
+    PageDirectory& m_page_directory;
+    TLBFlushBatch* m_previous_batch { nullptr };
+    TLBFlushRange m_ranges[max_ranges];
+    size_t m_range_count { 0 };
+};
+
+}
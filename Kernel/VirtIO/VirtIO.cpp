@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <Kernel/VirtIO/VirtIO.h>
+
+namespace Kernel {
+
+//#define VIRTIO_DEBUG
+
+#define VIRTIO_PCI_DEVICE_FEATURES 0x00
+#define VIRTIO_PCI_GUEST_FEATURES 0x04
+#define VIRTIO_PCI_QUEUE_ADDRESS 0x08
+#define VIRTIO_PCI_QUEUE_SIZE 0x0c
+#define VIRTIO_PCI_QUEUE_SELECT 0x0e
+#define VIRTIO_PCI_QUEUE_NOTIFY 0x10
+#define VIRTIO_PCI_DEVICE_STATUS 0x12
+#define VIRTIO_PCI_ISR_STATUS 0x13
+#define VIRTIO_PCI_DEVICE_CONFIG 0x14
+
+#define VIRTIO_STATUS_ACKNOWLEDGE 1
+#define VIRTIO_STATUS_DRIVER 2
+#define VIRTIO_STATUS_DRIVER_OK 4
+#define VIRTIO_STATUS_FAILED 128
+
+#define VIRTIO_ISR_QUEUE_INTERRUPT 1
+#define VIRTIO_ISR_CONFIG_INTERRUPT 2
+
+VirtIODevice::VirtIODevice(PCI::Address address, const char* class_name)
+    : PCI::Device(address, PCI::get_interrupt_line(address))
+    , m_class_name(class_name)
+    , m_io_base(PCI::get_BAR0(address) & ~1)
+{
+    klog() << m_class_name << ": Found @ " << pci_address() << ", I/O base " << m_io_base << ", IRQ " << PCI::get_interrupt_line(address);
+    PCI::enable_bus_mastering(pci_address());
+    PCI::enable_interrupt_line(pci_address());
+}
+
+VirtIODevice::~VirtIODevice()
+{
+}
+
+void VirtIODevice::set_status_bits(u8 bits)
+{
+    auto status_port = m_io_base.offset(VIRTIO_PCI_DEVICE_STATUS);
+    status_port.out<u8>(status_port.in<u8>() | bits);
+}
+
+bool VirtIODevice::negotiate_features(u32 supported_features)
+{
+    m_io_base.offset(VIRTIO_PCI_DEVICE_STATUS).out<u8>(0);
+    set_status_bits(VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+    u32 device_features = m_io_base.offset(VIRTIO_PCI_DEVICE_FEATURES).in<u32>();
+    m_accepted_features = device_features & supported_features;
+    m_io_base.offset(VIRTIO_PCI_GUEST_FEATURES).out<u32>(m_accepted_features);
+#ifdef VIRTIO_DEBUG
+    klog() << m_class_name << ": Device features " << String::format("%08x", device_features) << ", accepted " << String::format("%08x", m_accepted_features);
+#endif
+    return !(m_io_base.offset(VIRTIO_PCI_DEVICE_STATUS).in<u8>() & VIRTIO_STATUS_FAILED);
+}
+
+bool VirtIODevice::setup_queue(u16 queue_index)
+{
+    ASSERT(queue_index == m_queues.size());
+    m_io_base.offset(VIRTIO_PCI_QUEUE_SELECT).out<u16>(queue_index);
+    u16 queue_size = m_io_base.offset(VIRTIO_PCI_QUEUE_SIZE).in<u16>();
+    if (!queue_size) {
+        klog() << m_class_name << ": Queue " << queue_index << " doesn't exist";
+        return false;
+    }
+
+    auto queue = make<VirtIOQueue>(queue_size, is_feature_accepted(VIRTIO_RING_F_EVENT_IDX));
+    if (queue->is_null())
+        return false;
+    m_io_base.offset(VIRTIO_PCI_QUEUE_ADDRESS).out<u32>(queue->physical_address().get() >> 12);
+    m_queues.append(move(queue));
+#ifdef VIRTIO_DEBUG
+    klog() << m_class_name << ": Queue " << queue_index << " has " << queue_size << " descriptors";
+#endif
+    return true;
+}
+
+void VirtIODevice::notify_queue(u16 queue_index)
+{
+    m_io_base.offset(VIRTIO_PCI_QUEUE_NOTIFY).out<u16>(queue_index);
+}
+
+void VirtIODevice::finish_initialization()
+{
+    set_status_bits(VIRTIO_STATUS_DRIVER_OK);
+    enable_irq();
+}
+
+void VirtIODevice::fail_initialization()
+{
+    set_status_bits(VIRTIO_STATUS_FAILED);
+}
+
+u8 VirtIODevice::config_read8(u16 offset)
+{
+    return m_io_base.offset(VIRTIO_PCI_DEVICE_CONFIG + offset).in<u8>();
+}
+
+u16 VirtIODevice::config_read16(u16 offset)
+{
+    return m_io_base.offset(VIRTIO_PCI_DEVICE_CONFIG + offset).in<u16>();
+}
+
+u32 VirtIODevice::config_read32(u16 offset)
+{
+    return m_io_base.offset(VIRTIO_PCI_DEVICE_CONFIG + offset).in<u32>();
+}
+
+void VirtIODevice::handle_irq(const RegisterState&)
+{
+    // Reading the ISR status acknowledges the interrupt.
+    u8 isr_status = m_io_base.offset(VIRTIO_PCI_ISR_STATUS).in<u8>();
+    if (isr_status & VIRTIO_ISR_CONFIG_INTERRUPT)
+        handle_config_change();
+    if (isr_status & VIRTIO_ISR_QUEUE_INTERRUPT)
+        handle_queue_update();
+}
+
+}
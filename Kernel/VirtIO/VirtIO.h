@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+//
+// Virtio PCI transport
+//
+// We talk to the legacy (virtio 0.9.5) register interface in I/O space,
+// which every transitional device QEMU emulates still offers, so there's
+// no need to map capability structures on i686.
+//
+// More information about virtio can be found here:
+//      https://docs.oasis-open.org/virtio/virtio/v1.1/virtio-v1.1.html
+//
+
+#pragma once
+
+#include <AK/NonnullOwnPtrVector.h>
+#include <Kernel/IO.h>
+#include <Kernel/PCI/Access.h>
+#include <Kernel/PCI/Device.h>
+#include <Kernel/VirtIO/VirtIOQueue.h>
+
+namespace Kernel {
+
+#define VIRTIO_PCI_VENDOR_ID 0x1af4
+#define VIRTIO_PCI_NETWORK_DEVICE_ID 0x1000
+#define VIRTIO_PCI_BLOCK_DEVICE_ID 0x1001
+
+#define VIRTIO_F_NOTIFY_ON_EMPTY (1u << 24)
+#define VIRTIO_F_ANY_LAYOUT (1u << 27)
+#define VIRTIO_RING_F_INDIRECT_DESC (1u << 28)
+#define VIRTIO_RING_F_EVENT_IDX (1u << 29)
+
+class VirtIODevice : public PCI::Device {
+public:
+    virtual ~VirtIODevice() override;
+
+    virtual const char* purpose() const override { return m_class_name; }
+
+protected:
+    VirtIODevice(PCI::Address, const char* class_name);
+
+    // Resets the device and offers it the features we support out of what
+    // it has. Returns false if the device didn't accept them.
+    bool negotiate_features(u32 supported_features);
+    bool is_feature_accepted(u32 feature) const { return m_accepted_features & feature; }
+
+    bool setup_queue(u16 queue_index);
+    VirtIOQueue& queue(u16 queue_index) { return m_queues[queue_index]; }
+    void notify_queue(u16 queue_index);
+
+    // Tells the device we're ready to go, or that we've given up on it.
+    void finish_initialization();
+    void fail_initialization();
+
+    u8 config_read8(u16 offset);
+    u16 config_read16(u16 offset);
+    u32 config_read32(u16 offset);
+
+    virtual void handle_queue_update() = 0;
+    virtual void handle_config_change() { }
+
+private:
+    //^ IRQHandler
+    virtual void handle_irq(const RegisterState&) override final;
+
+    void set_status_bits(u8);
+
+    const char* m_class_name { nullptr };
+    IOAddress m_io_base;
+    u32 m_accepted_features { 0 };
+    NonnullOwnPtrVector<VirtIOQueue> m_queues;
+};
+
+}
@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <AK/Atomic.h>
+#include <AK/StringView.h>
+#include <Kernel/StdLib.h>
+#include <Kernel/VM/MemoryManager.h>
+#include <Kernel/VirtIO/VirtIOQueue.h>
+
+namespace Kernel {
+
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2
+
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+#define VIRTQ_USED_F_NO_NOTIFY 1
+
+VirtIOQueue::VirtIOQueue(u16 queue_size, bool use_event_index)
+    : m_queue_size(queue_size)
+    , m_use_event_index(use_event_index)
+{
+    size_t size_of_descriptors = sizeof(Descriptor) * queue_size;
+    size_t size_of_driver_ring = sizeof(DriverRing) + sizeof(u16) * (queue_size + 1);
+    size_t device_ring_offset = PAGE_ROUND_UP(size_of_descriptors + size_of_driver_ring);
+    size_t size_of_device_ring = sizeof(DeviceRing) + sizeof(DeviceRingItem) * queue_size + sizeof(u16);
+    m_region = MM.allocate_contiguous_kernel_region(PAGE_ROUND_UP(device_ring_offset + size_of_device_ring), "VirtIO Queue", Region::Access::Read | Region::Access::Write);
+    if (!m_region)
+        return;
+
+    auto* base = m_region->vaddr().as_ptr();
+    memset(base, 0, m_region->size());
+    m_descriptors = reinterpret_cast<Descriptor*>(base);
+    m_driver_ring = reinterpret_cast<DriverRing*>(base + size_of_descriptors);
+    m_device_ring = reinterpret_cast<DeviceRing*>(base + device_ring_offset);
+
+    for (u16 i = 0; i + 1 < queue_size; ++i)
+        m_descriptors[i].next = i + 1;
+    m_free_head = 0;
+    m_free_descriptor_count = queue_size;
+    m_tokens.resize(queue_size);
+}
+
+VirtIOQueue::~VirtIOQueue()
+{
+}
+
+bool VirtIOQueue::add_buffers(Span<const Buffer> buffers, void* token)
+{
+    ASSERT(m_lock.is_locked());
+    ASSERT(!buffers.is_empty());
+    if (buffers.size() > m_free_descriptor_count)
+        return false;
+
+    // Free descriptors are linked through their next fields, so taking them
+    // off the front of the free list already chains them together.
+    u16 head = m_free_head;
+    u16 last = head;
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        last = m_free_head;
+        auto& descriptor = m_descriptors[last];
+        descriptor.address = buffers[i].paddr.get();
+        descriptor.length = buffers[i].length;
+        descriptor.flags = buffers[i].device_writable ? VIRTQ_DESC_F_WRITE : 0;
+        if (i + 1 < buffers.size())
+            descriptor.flags |= VIRTQ_DESC_F_NEXT;
+        m_free_head = descriptor.next;
+    }
+    m_free_descriptor_count -= buffers.size();
+
+    m_tokens[head] = token;
+    m_driver_ring->rings[m_driver_index % m_queue_size] = head;
+    ++m_driver_index;
+    return true;
+}
+
+bool VirtIOQueue::publish()
+{
+    ASSERT(m_lock.is_locked());
+    u16 old_index = m_published_index;
+    u16 new_index = m_driver_index;
+    if (old_index == new_index)
+        return false;
+
+    // The device must see the ring entries before the new index, and we must
+    // see its view of what it wants notifications for after it.
+    AK::atomic_thread_fence(AK::memory_order_seq_cst);
+    m_driver_ring->index = new_index;
+    m_published_index = new_index;
+    AK::atomic_thread_fence(AK::memory_order_seq_cst);
+
+    if (m_use_event_index) {
+        u16 event = avail_event();
+        return (u16)(new_index - event - 1) < (u16)(new_index - old_index);
+    }
+    return !(m_device_ring->flags & VIRTQ_USED_F_NO_NOTIFY);
+}
+
+bool VirtIOQueue::take_used(void*& token, u32& length)
+{
+    ASSERT(m_lock.is_locked());
+    if (m_used_index == m_device_ring->index)
+        return false;
+    AK::atomic_thread_fence(AK::memory_order_acquire);
+
+    auto& item = m_device_ring->rings[m_used_index % m_queue_size];
+    u16 head = item.index;
+    length = item.length;
+    token = m_tokens[head];
+    m_tokens[head] = nullptr;
+    ++m_used_index;
+
+    // Put the whole chain back on the free list.
+    u16 last = head;
+    u16 count = 1;
+    while (m_descriptors[last].flags & VIRTQ_DESC_F_NEXT) {
+        last = m_descriptors[last].next;
+        ++count;
+    }
+    m_descriptors[last].next = m_free_head;
+    m_free_head = head;
+    m_free_descriptor_count += count;
+    return true;
+}
+
+void VirtIOQueue::disable_interrupts()
+{
+    ASSERT(m_lock.is_locked());
+    if (m_use_event_index) {
+        // An event index we've already passed won't come up again until the
+        // ring index wraps around.
+        used_event() = m_used_index - 1;
+    } else {
+        m_driver_ring->flags = m_driver_ring->flags | VIRTQ_AVAIL_F_NO_INTERRUPT;
+    }
+}
+
+bool VirtIOQueue::enable_interrupts()
+{
+    ASSERT(m_lock.is_locked());
+    if (m_use_event_index)
+        used_event() = m_used_index;
+    else
+        m_driver_ring->flags = m_driver_ring->flags & ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+    AK::atomic_thread_fence(AK::memory_order_seq_cst);
+    return m_used_index == m_device_ring->index;
+}
+
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <AK/OwnPtr.h>
+#include <AK/Span.h>
+#include <AK/Vector.h>
+#include <Kernel/PhysicalAddress.h>
+#include <Kernel/SpinLock.h>
+#include <Kernel/VM/PhysicalPage.h>
+#include <Kernel/VM/Region.h>
+
+namespace Kernel {
+
+// A split virtqueue laid out the way legacy virtio devices expect it: the
+// descriptor table and the driver ("available") ring, followed by the device
+// ("used") ring on the next page boundary.
+class VirtIOQueue {
+public:
+    struct Buffer {
+        PhysicalAddress paddr;
+        u32 length { 0 };
+        bool device_writable { false };
+    };
+
+    VirtIOQueue(u16 queue_size, bool use_event_index);
+    ~VirtIOQueue();
+
+    bool is_null() const { return !m_region; }
+    u16 size() const { return m_queue_size; }
+    PhysicalAddress physical_address() const { return m_region->physical_page(0)->paddr(); }
+    size_t free_descriptor_count() const { return m_free_descriptor_count; }
+
+    // Chains the buffers together and queues them up for the device, which
+    // won't see them until the next publish(). Fails if the queue is full.
+    bool add_buffers(Span<const Buffer>, void* token);
+
+    // Makes everything added since the last call visible to the device at
+    // once, and tells whether the device needs to be notified about it.
+    bool publish();
+
+    // Takes the next chain the device is done with, if any.
+    bool take_used(void*& token, u32& length);
+
+    // Suppresses interrupts for used chains. enable_interrupts() returns
+    // false if chains were used in the meantime, so the caller has to drain
+    // the queue again to avoid missing them.
+    void disable_interrupts();
+    bool enable_interrupts();
+
+    SpinLock<u8>& lock() { return m_lock; }
+
+private:
+    struct [[gnu::packed]] Descriptor {
+        u64 address;
+        u32 length;
+        u16 flags;
+        u16 next;
+    };
+
+    struct [[gnu::packed]] DriverRing {
+        u16 flags;
+        u16 index;
+        u16 rings[];
+    };
+
+    struct [[gnu::packed]] DeviceRingItem {
+        u32 index;
+        u32 length;
+    };
+
+    struct [[gnu::packed]] DeviceRing {
+        u16 flags;
+        u16 index;
+        DeviceRingItem rings[];
+    };
+
+    // With VIRTIO_RING_F_EVENT_IDX, each side tells the other at which ring
+    // index it wants to hear about progress in a field right behind its ring.
+    volatile u16& used_event() { return *reinterpret_cast<volatile u16*>(&m_driver_ring->rings[m_queue_size]); }
+    volatile u16& avail_event() { return *reinterpret_cast<volatile u16*>(&m_device_ring->rings[m_queue_size]); }
+
+    u16 m_queue_size { 0 };
+    bool m_use_event_index { false };
+    OwnPtr<Region> m_region;
+    Descriptor* m_descriptors { nullptr };
+    volatile DriverRing* m_driver_ring { nullptr };
+    volatile DeviceRing* m_device_ring { nullptr };
+    Vector<void*> m_tokens;
+
+    u16 m_free_head { 0 };
+    u16 m_free_descriptor_count { 0 };
+    u16 m_driver_index { 0 };
+    u16 m_published_index { 0 };
+    u16 m_used_index { 0 };
+
+    SpinLock<u8> m_lock;
+};
+
+}
@@ -53,6 +53,7 @@ bool WaitQueue::enqueue(Thread& thread)
         return false;
     }
     m_threads.append(thread);
+    thread.m_wait_queue = this;
     return true;
 }
 
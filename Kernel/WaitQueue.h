@@ -46,7 +46,7 @@ public:
     void wake_all();
     void clear();
 
-private:
+protected:
     typedef IntrusiveList<Thread, &Thread::m_wait_queue_node> ThreadList;
     ThreadList m_threads;
     SpinLock<u32> m_lock;
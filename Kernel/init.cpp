@@ -31,6 +31,8 @@
 #include <Kernel/Arch/i386/CPU.h>
 #include <Kernel/CMOS.h>
 #include <Kernel/CommandLine.h>
+#include <Kernel/Devices/AHCIController.h>
+#include <Kernel/Devices/AHCIDiskDevice.h>
 #include <Kernel/Devices/BXVGADevice.h>
 #include <Kernel/Devices/DiskPartition.h>
 #include <Kernel/Devices/EBRPartitionTable.h>
@@ -48,6 +50,7 @@
 #include <Kernel/Devices/SerialDevice.h>
 #include <Kernel/Devices/UHCIController.h>
 #include <Kernel/Devices/VMWareBackdoor.h>
+#include <Kernel/Devices/VirtIOBlockDevice.h>
 #include <Kernel/Devices/ZeroDevice.h>
 #include <Kernel/FileSystem/Ext2FileSystem.h>
 #include <Kernel/FileSystem/VirtualFileSystem.h>
@@ -62,6 +65,7 @@
 #include <Kernel/Net/LoopbackAdapter.h>
 #include <Kernel/Net/NetworkTask.h>
 #include <Kernel/Net/RTL8139NetworkAdapter.h>
+#include <Kernel/Net/VirtIONetworkAdapter.h>
 #include <Kernel/PCI/Access.h>
 #include <Kernel/PCI/Initializer.h>
 #include <Kernel/Process.h>
@@ -71,6 +75,7 @@
 #include <Kernel/TTY/PTYMultiplexer.h>
 #include <Kernel/TTY/VirtualConsole.h>
 #include <Kernel/Tasks/FinalizerTask.h>
+#include <Kernel/Tasks/PageZeroingTask.h>
 #include <Kernel/Tasks/SyncTask.h>
 #include <Kernel/Time/TimeManagement.h>
 #include <Kernel/VM/MemoryManager.h>
@@ -218,6 +223,7 @@ void init_stage2()
 
     SyncTask::spawn();
     FinalizerTask::spawn();
+    PageZeroingTask::spawn();
 
     PCI::initialize();
 
@@ -251,6 +257,7 @@ void init_stage2()
 
     E1000NetworkAdapter::detect();
     RTL8139NetworkAdapter::detect();
+    VirtIONetworkAdapter::detect();
 
     LoopbackAdapter::the();
 
@@ -266,15 +273,33 @@ void init_stage2()
 
     auto root = kernel_command_line().lookup("root").value_or("/dev/hda");
 
-    if (!root.starts_with("/dev/hda")) {
-        klog() << "init_stage2: root filesystem must be on the first IDE hard drive (/dev/hda)";
-        Processor::halt();
+    auto ahci = AHCIController::create();
+    auto virtio_disks = VirtIOBlockDevice::detect();
+
+    // Probing the legacy IDE ports hangs on machines that don't have them,
+    // so we only do it when we're asked to boot from there.
+    OwnPtr<PATAChannel> pata0;
+    RefPtr<BlockDevice> root_disk;
+    if (root.starts_with("/dev/hda")) {
+        pata0 = PATAChannel::create(PATAChannel::ChannelType::Primary, force_pio);
+        root_disk = pata0->master_device();
+        root = root.substring(strlen("/dev/hda"), root.length() - strlen("/dev/hda"));
+    } else if (root.starts_with("/dev/sda")) {
+        if (ahci && !ahci->disks().is_empty())
+            root_disk = ahci->disks().first();
+        root = root.substring(strlen("/dev/sda"), root.length() - strlen("/dev/sda"));
+    } else if (root.starts_with("/dev/vda")) {
+        if (!virtio_disks.is_empty())
+            root_disk = virtio_disks.first();
+        root = root.substring(strlen("/dev/vda"), root.length() - strlen("/dev/vda"));
     }
 
-    auto pata0 = PATAChannel::create(PATAChannel::ChannelType::Primary, force_pio);
-    NonnullRefPtr<BlockDevice> root_dev = *pata0->master_device();
+    if (!root_disk) {
+        klog() << "init_stage2: root filesystem must be on the first IDE (/dev/hda), SATA (/dev/sda) or virtio (/dev/vda) hard drive";
+        Processor::halt();
+    }
 
-    root = root.substring(strlen("/dev/hda"), root.length() - strlen("/dev/hda"));
+    NonnullRefPtr<BlockDevice> root_dev = *root_disk;
 
     if (root.length()) {
         auto partition_number = root.to_uint();
@@ -24,6 +24,7 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <AK/Atomic.h>
 #include <AK/InlineLinkedList.h>
 #include <AK/LogStream.h>
 #include <AK/ScopedValueRollback.h>
@@ -37,8 +38,7 @@
 #include <string.h>
 #include <sys/internals.h>
 #include <sys/mman.h>
-
-// FIXME: Thread safety.
+#include <unistd.h>
 
 //#define MALLOC_DEBUG
 #define RECYCLE_BIG_ALLOCATIONS
@@ -70,11 +70,17 @@ static bool s_log_malloc = false;
 static bool s_scrub_malloc = true;
 static bool s_scrub_free = true;
 static bool s_profiling = false;
-static unsigned short size_classes[] = { 8, 16, 32, 64, 128, 252, 508, 1016, 2036, 4090, 8188, 16376, 32756, 0 };
+static constexpr unsigned short size_classes[] = { 8, 16, 32, 64, 128, 252, 508, 1016, 2036, 4090, 8188, 16376, 32756, 0 };
 static constexpr size_t num_size_classes = sizeof(size_classes) / sizeof(unsigned short);
+static constexpr size_t largest_chunked_size = size_classes[num_size_classes - 2];
+
+// Maps (size / size_class_granularity) to a size class, see size_class_for_size().
+static constexpr size_t size_class_granularity = 8;
+static u8 g_size_class_lookup[largest_chunked_size / size_class_granularity + 2];
 
 struct MallocStats {
     size_t number_of_malloc_calls;
+    size_t number_of_thread_cache_mallocs;
 
     size_t number_of_big_allocator_hits;
     size_t number_of_big_allocator_purge_hits;
@@ -86,6 +92,8 @@ struct MallocStats {
     size_t number_of_blocks_full;
 
     size_t number_of_free_calls;
+    size_t number_of_thread_cache_frees;
+    size_t number_of_remote_frees;
 
     size_t number_of_big_allocator_keeps;
     size_t number_of_big_allocator_frees;
@@ -140,8 +148,51 @@ struct ChunkedBlock
     ChunkedBlock* m_next { nullptr };
     FreelistEntry* m_freelist { nullptr };
     unsigned short m_free_chunks { 0 };
+    // The thread whose cache this block is in, or 0 if the block is
+    // owned by its Allocator and may only be touched under malloc_lock().
+    Atomic<pid_t> m_owner_tid { 0 };
+    // Chunks freed by threads other than the owner.
+    Atomic<FreelistEntry*> m_remote_freelist { nullptr };
     [[gnu::aligned(8)]] unsigned char m_slot[0];
 
+    // While a block isn't in any thread's cache, its remote freelist holds
+    // this marker so that other threads free into it under malloc_lock().
+    static FreelistEntry* abandoned_marker() { return reinterpret_cast<FreelistEntry*>(1); }
+
+    bool try_push_remote_free(FreelistEntry* entry)
+    {
+        auto* head = m_remote_freelist.load(AK::memory_order_relaxed);
+        do {
+            if (head == abandoned_marker())
+                return false;
+            entry->next = head;
+        } while (!m_remote_freelist.compare_exchange_strong(head, entry, AK::memory_order_acq_rel));
+        return true;
+    }
+
+    // Only called by the owner, moves remotely freed chunks onto our freelist.
+    size_t take_remote_frees()
+    {
+        size_t count = 0;
+        auto* entry = m_remote_freelist.exchange(nullptr, AK::memory_order_acq_rel);
+        while (entry) {
+            auto* next = entry->next;
+            entry->next = m_freelist;
+            m_freelist = entry;
+            ++m_free_chunks;
+            ++count;
+            entry = next;
+        }
+        return count;
+    }
+
+    // Fails if some other thread freed into the block in the meantime.
+    bool try_abandon()
+    {
+        FreelistEntry* expected = nullptr;
+        return m_remote_freelist.compare_exchange_strong(expected, abandoned_marker(), AK::memory_order_acq_rel);
+    }
+
     void* chunk(size_t index)
     {
         return &m_slot[index * m_size];
@@ -160,6 +211,9 @@ struct Allocator {
     ChunkedBlock* empty_blocks[number_of_chunked_blocks_to_keep_around_per_size_class] { nullptr };
     InlineLinkedList<ChunkedBlock> usable_blocks;
     InlineLinkedList<ChunkedBlock> full_blocks;
+    // Blocks that are in some thread's cache, so that they can be found
+    // again after fork(), when all but one of those threads are gone.
+    InlineLinkedList<ChunkedBlock> thread_blocks;
 };
 
 struct BigAllocator {
@@ -185,18 +239,35 @@ static inline BigAllocator (&big_allocators())[1]
     return reinterpret_cast<BigAllocator(&)[1]>(g_big_allocators_storage);
 }
 
+static size_t size_class_for_size(size_t size)
+{
+    // Size classes are at least size_class_granularity apart, so at most one
+    // class boundary falls inside each granule and one step corrects for it.
+    size_t size_class = g_size_class_lookup[(size + size_class_granularity - 1) / size_class_granularity];
+    if (size > size_classes[size_class])
+        ++size_class;
+    return size_class;
+}
+
 static Allocator* allocator_for_size(size_t size, size_t& good_size)
 {
-    for (size_t i = 0; size_classes[i]; ++i) {
-        if (size <= size_classes[i]) {
-            good_size = size_classes[i];
-            return &allocators()[i];
-        }
+    if (size > largest_chunked_size) {
+        good_size = PAGE_ROUND_UP(size);
+        return nullptr;
     }
-    good_size = PAGE_ROUND_UP(size);
-    return nullptr;
+    auto size_class = size_class_for_size(size);
+    good_size = size_classes[size_class];
+    return &allocators()[size_class];
 }
 
+// Every thread allocates from a ChunkedBlock of its own for each size class,
+// without taking malloc_lock(). Frees from other threads go onto the block's
+// remote freelist, which the owner drains once its own freelist runs dry.
+static __thread ChunkedBlock* s_thread_blocks[num_size_classes];
+static __thread size_t s_thread_malloc_calls;
+static __thread size_t s_thread_free_calls;
+static __thread size_t s_thread_remote_frees;
+
 #ifdef RECYCLE_BIG_ALLOCATIONS
 static BigAllocator* big_allocator_for_size(size_t size)
 {
@@ -221,65 +292,69 @@ static void os_free(void* ptr, size_t size)
     assert(rc == 0);
 }
 
-static void* malloc_impl(size_t size)
+// Called with malloc_lock() held, for an empty block that isn't in any thread's cache.
+static void release_empty_block(Allocator& allocator, ChunkedBlock* block)
 {
-    LOCKER(malloc_lock());
-
-    if (s_log_malloc)
-        dbgprintf("LibC: malloc(%zu)\n", size);
-
-    if (!size)
-        return nullptr;
-
-    g_malloc_stats.number_of_malloc_calls++;
-
-    size_t good_size;
-    auto* allocator = allocator_for_size(size, good_size);
-
-    if (!allocator) {
-        size_t real_size = round_up_to_power_of_two(sizeof(BigAllocationBlock) + size, block_size);
-#ifdef RECYCLE_BIG_ALLOCATIONS
-        if (auto* allocator = big_allocator_for_size(real_size)) {
-            if (!allocator->blocks.is_empty()) {
-                g_malloc_stats.number_of_big_allocator_hits++;
-                auto* block = allocator->blocks.take_last();
-                int rc = madvise(block, real_size, MADV_SET_NONVOLATILE);
-                bool this_block_was_purged = rc == 1;
-                if (rc < 0) {
-                    perror("madvise");
-                    ASSERT_NOT_REACHED();
-                }
-                if (mprotect(block, real_size, PROT_READ | PROT_WRITE) < 0) {
-                    perror("mprotect");
-                    ASSERT_NOT_REACHED();
-                }
-                if (this_block_was_purged) {
-                    g_malloc_stats.number_of_big_allocator_purge_hits++;
-                    new (block) BigAllocationBlock(real_size);
-                }
-
-                ue_notify_malloc(&block->m_slot[0], size);
-                return &block->m_slot[0];
-            }
-        }
+    if (allocator.block_count < number_of_chunked_blocks_to_keep_around_per_size_class) {
+#ifdef MALLOC_DEBUG
+        dbgprintf("Keeping block %p around for size class %zu\n", block, allocator.size);
 #endif
-        g_malloc_stats.number_of_big_allocs++;
-        auto* block = (BigAllocationBlock*)os_alloc(real_size, "malloc: BigAllocationBlock");
-        new (block) BigAllocationBlock(real_size);
-        ue_notify_malloc(&block->m_slot[0], size);
-        return &block->m_slot[0];
+        g_malloc_stats.number_of_keeps++;
+        allocator.usable_blocks.remove(block);
+        allocator.empty_blocks[allocator.empty_block_count++] = block;
+        mprotect(block, block_size, PROT_NONE);
+        madvise(block, block_size, MADV_SET_VOLATILE);
+        return;
     }
+#ifdef MALLOC_DEBUG
+    dbgprintf("Releasing block %p for size class %zu\n", block, allocator.size);
+#endif
+    g_malloc_stats.number_of_frees++;
+    allocator.usable_blocks.remove(block);
+    --allocator.block_count;
+    os_free(block, block_size);
+}
 
-    ChunkedBlock* block = nullptr;
+// Called with malloc_lock() held. The block must already be abandoned.
+static void return_block_to_allocator(Allocator& allocator, ChunkedBlock* block)
+{
+    allocator.thread_blocks.remove(block);
+    block->m_owner_tid.store(0, AK::memory_order_relaxed);
+    if (block->is_full()) {
+        g_malloc_stats.number_of_blocks_full++;
+#ifdef MALLOC_DEBUG
+        dbgprintf("Block %p is now full in size class %zu\n", block, allocator.size);
+#endif
+        allocator.full_blocks.append(block);
+        return;
+    }
+    allocator.usable_blocks.append(block);
+    if (!block->used_chunks())
+        release_empty_block(allocator, block);
+}
 
-    for (block = allocator->usable_blocks.head(); block; block = block->next()) {
-        if (block->free_chunks())
-            break;
+static ChunkedBlock* refill_thread_block(size_t size_class, ChunkedBlock* exhausted_block)
+{
+    if (exhausted_block && !exhausted_block->try_abandon()) {
+        // Other threads freed into the block after we last looked.
+        exhausted_block->take_remote_frees();
+        return exhausted_block;
     }
 
-    if (!block && allocator->empty_block_count) {
+    LOCKER(malloc_lock());
+    auto& allocator = allocators()[size_class];
+    size_t good_size = allocator.size;
+
+    if (exhausted_block)
+        return_block_to_allocator(allocator, exhausted_block);
+
+    ChunkedBlock* block = allocator.usable_blocks.head();
+    if (block)
+        allocator.usable_blocks.remove(block);
+
+    if (!block && allocator.empty_block_count) {
         g_malloc_stats.number_of_empty_block_hits++;
-        block = allocator->empty_blocks[--allocator->empty_block_count];
+        block = allocator.empty_blocks[--allocator.empty_block_count];
         int rc = madvise(block, block_size, MADV_SET_NONVOLATILE);
         bool this_block_was_purged = rc == 1;
         if (rc < 0) {
@@ -295,7 +370,6 @@ static void* malloc_impl(size_t size)
             g_malloc_stats.number_of_empty_block_purge_hits++;
             new (block) ChunkedBlock(good_size);
         }
-        allocator->usable_blocks.append(block);
     }
 
     if (!block) {
@@ -304,21 +378,76 @@ static void* malloc_impl(size_t size)
         snprintf(buffer, sizeof(buffer), "malloc: ChunkedBlock(%zu)", good_size);
         block = (ChunkedBlock*)os_alloc(block_size, buffer);
         new (block) ChunkedBlock(good_size);
-        allocator->usable_blocks.append(block);
-        ++allocator->block_count;
+        ++allocator.block_count;
+    }
+
+    block->m_remote_freelist.store(nullptr, AK::memory_order_release);
+    block->m_owner_tid.store(gettid(), AK::memory_order_relaxed);
+    allocator.thread_blocks.append(block);
+    return block;
+}
+
+static void* big_malloc_impl(size_t size)
+{
+    LOCKER(malloc_lock());
+    g_malloc_stats.number_of_malloc_calls++;
+
+    size_t real_size = round_up_to_power_of_two(sizeof(BigAllocationBlock) + size, block_size);
+#ifdef RECYCLE_BIG_ALLOCATIONS
+    if (auto* allocator = big_allocator_for_size(real_size)) {
+        if (!allocator->blocks.is_empty()) {
+            g_malloc_stats.number_of_big_allocator_hits++;
+            auto* block = allocator->blocks.take_last();
+            int rc = madvise(block, real_size, MADV_SET_NONVOLATILE);
+            bool this_block_was_purged = rc == 1;
+            if (rc < 0) {
+                perror("madvise");
+                ASSERT_NOT_REACHED();
+            }
+            if (mprotect(block, real_size, PROT_READ | PROT_WRITE) < 0) {
+                perror("mprotect");
+                ASSERT_NOT_REACHED();
+            }
+            if (this_block_was_purged) {
+                g_malloc_stats.number_of_big_allocator_purge_hits++;
+                new (block) BigAllocationBlock(real_size);
+            }
+
+            ue_notify_malloc(&block->m_slot[0], size);
+            return &block->m_slot[0];
+        }
+    }
+#endif
+    g_malloc_stats.number_of_big_allocs++;
+    auto* block = (BigAllocationBlock*)os_alloc(real_size, "malloc: BigAllocationBlock");
+    new (block) BigAllocationBlock(real_size);
+    ue_notify_malloc(&block->m_slot[0], size);
+    return &block->m_slot[0];
+}
+
+static void* malloc_impl(size_t size)
+{
+    if (s_log_malloc)
+        dbgprintf("LibC: malloc(%zu)\n", size);
+
+    if (!size)
+        return nullptr;
+
+    if (size > largest_chunked_size)
+        return big_malloc_impl(size);
+
+    ++s_thread_malloc_calls;
+
+    size_t size_class = size_class_for_size(size);
+    auto* block = s_thread_blocks[size_class];
+    if (!block || block->is_full()) {
+        if (!block || !block->take_remote_frees())
+            block = s_thread_blocks[size_class] = refill_thread_block(size_class, block);
     }
 
     --block->m_free_chunks;
     void* ptr = block->m_freelist;
     block->m_freelist = block->m_freelist->next;
-    if (block->is_full()) {
-        g_malloc_stats.number_of_blocks_full++;
-#ifdef MALLOC_DEBUG
-        dbgprintf("Block %p is now full in size class %zu\n", block, good_size);
-#endif
-        allocator->usable_blocks.remove(block);
-        allocator->full_blocks.append(block);
-    }
 #ifdef MALLOC_DEBUG
     dbgprintf("LibC: allocated %p (chunk in block %p, size %zu)\n", ptr, block, block->bytes_per_chunk());
 #endif
@@ -330,6 +459,30 @@ static void* malloc_impl(size_t size)
     return ptr;
 }
 
+// Called with malloc_lock() held, for a block that isn't in any thread's cache.
+static void free_to_abandoned_block(ChunkedBlock* block, FreelistEntry* entry)
+{
+    size_t good_size;
+    auto* allocator = allocator_for_size(block->m_size, good_size);
+
+    entry->next = block->m_freelist;
+    block->m_freelist = entry;
+
+    if (block->is_full()) {
+#ifdef MALLOC_DEBUG
+        dbgprintf("Block %p no longer full in size class %zu\n", block, good_size);
+#endif
+        g_malloc_stats.number_of_freed_full_blocks++;
+        allocator->full_blocks.remove(block);
+        allocator->usable_blocks.prepend(block);
+    }
+
+    ++block->m_free_chunks;
+
+    if (!block->used_chunks())
+        release_empty_block(*allocator, block);
+}
+
 static void free_impl(void* ptr)
 {
     ScopedValueRollback rollback(errno);
@@ -337,14 +490,13 @@ static void free_impl(void* ptr)
     if (!ptr)
         return;
 
-    g_malloc_stats.number_of_free_calls++;
-
-    LOCKER(malloc_lock());
-
     void* block_base = (void*)((FlatPtr)ptr & block_mask);
     size_t magic = *(size_t*)block_base;
 
     if (magic == MAGIC_BIGALLOC_HEADER) {
+        LOCKER(malloc_lock());
+        g_malloc_stats.number_of_free_calls++;
+
         auto* block = (BigAllocationBlock*)block_base;
 #ifdef RECYCLE_BIG_ALLOCATIONS
         if (auto* allocator = big_allocator_for_size(block->m_size)) {
@@ -373,53 +525,46 @@ static void free_impl(void* ptr)
     auto* block = (ChunkedBlock*)block_base;
 
 #ifdef MALLOC_DEBUG
-    dbgprintf("LibC: freeing %p in allocator %p (size=%u, used=%u)\n", ptr, block, block->bytes_per_chunk(), block->used_chunks());
+    dbgprintf("LibC: freeing %p in allocator %p (size=%zu, used=%zu)\n", ptr, block, block->bytes_per_chunk(), block->used_chunks());
 #endif
 
     if (s_scrub_free)
         memset(ptr, FREE_SCRUB_BYTE, block->bytes_per_chunk());
 
-    auto* entry = (FreelistEntry*)ptr;
-    entry->next = block->m_freelist;
-    block->m_freelist = entry;
+    ++s_thread_free_calls;
 
-    if (block->is_full()) {
-        size_t good_size;
-        auto* allocator = allocator_for_size(block->m_size, good_size);
-#ifdef MALLOC_DEBUG
-        dbgprintf("Block %p no longer full in size class %u\n", block, good_size);
-#endif
-        g_malloc_stats.number_of_freed_full_blocks++;
-        allocator->full_blocks.remove(block);
-        allocator->usable_blocks.prepend(block);
+    auto* entry = (FreelistEntry*)ptr;
+    if (block->m_owner_tid.load(AK::memory_order_relaxed) == gettid()) {
+        entry->next = block->m_freelist;
+        block->m_freelist = entry;
+        ++block->m_free_chunks;
+        return;
     }
 
-    ++block->m_free_chunks;
-
-    if (!block->used_chunks()) {
-        size_t good_size;
-        auto* allocator = allocator_for_size(block->m_size, good_size);
-        if (allocator->block_count < number_of_chunked_blocks_to_keep_around_per_size_class) {
-#ifdef MALLOC_DEBUG
-            dbgprintf("Keeping block %p around for size class %u\n", block, good_size);
-#endif
-            g_malloc_stats.number_of_keeps++;
-            allocator->usable_blocks.remove(block);
-            allocator->empty_blocks[allocator->empty_block_count++] = block;
-            mprotect(block, block_size, PROT_NONE);
-            madvise(block, block_size, MADV_SET_VOLATILE);
+    for (;;) {
+        if (block->try_push_remote_free(entry)) {
+            ++s_thread_remote_frees;
+            return;
+        }
+        LOCKER(malloc_lock());
+        // The block may have been picked up by another thread before we got the lock.
+        if (!block->m_owner_tid.load(AK::memory_order_relaxed)) {
+            free_to_abandoned_block(block, entry);
             return;
         }
-#ifdef MALLOC_DEBUG
-        dbgprintf("Releasing block %p for size class %u\n", block, good_size);
-#endif
-        g_malloc_stats.number_of_frees++;
-        allocator->usable_blocks.remove(block);
-        --allocator->block_count;
-        os_free(block, block_size);
     }
 }
 
+static void fold_thread_malloc_stats()
+{
+    g_malloc_stats.number_of_thread_cache_mallocs += s_thread_malloc_calls;
+    g_malloc_stats.number_of_thread_cache_frees += s_thread_free_calls;
+    g_malloc_stats.number_of_remote_frees += s_thread_remote_frees;
+    s_thread_malloc_calls = 0;
+    s_thread_free_calls = 0;
+    s_thread_remote_frees = 0;
+}
+
 [[gnu::flatten]] void* malloc(size_t size)
 {
     void* ptr = malloc_impl(size);
@@ -449,7 +594,6 @@ size_t malloc_size(void* ptr)
 {
     if (!ptr)
         return 0;
-    LOCKER(malloc_lock());
     void* page_base = (void*)((FlatPtr)ptr & block_mask);
     auto* header = (const CommonHeader*)page_base;
     auto size = header->m_size;
@@ -465,7 +609,6 @@ void* realloc(void* ptr, size_t size)
     if (!size)
         return nullptr;
 
-    LOCKER(malloc_lock());
     auto existing_allocation_size = malloc_size(ptr);
     if (size <= existing_allocation_size)
         return ptr;
@@ -494,12 +637,78 @@ void __malloc_init()
         allocators()[i].size = size_classes[i];
     }
 
+    for (size_t granule = 0, size_class = 0; granule < sizeof(g_size_class_lookup); ++granule) {
+        size_t smallest_size_in_granule = granule ? (granule - 1) * size_class_granularity + 1 : 0;
+        while (size_classes[size_class] < smallest_size_in_granule)
+            ++size_class;
+        g_size_class_lookup[granule] = size_class;
+    }
+
     new (&big_allocators()[0])(BigAllocator);
 }
 
+void __malloc_thread_exit()
+{
+    for (size_t size_class = 0; size_class < num_size_classes; ++size_class) {
+        auto* block = s_thread_blocks[size_class];
+        if (!block)
+            continue;
+        s_thread_blocks[size_class] = nullptr;
+        while (!block->try_abandon())
+            block->take_remote_frees();
+        LOCKER(malloc_lock());
+        return_block_to_allocator(allocators()[size_class], block);
+    }
+
+    LOCKER(malloc_lock());
+    fold_thread_malloc_stats();
+}
+
+// fork() holds malloc_lock() across the syscall, so the child doesn't
+// inherit it in the middle of some other thread's update.
+void __malloc_prepare_fork()
+{
+    malloc_lock().lock();
+}
+
+void __malloc_parent_after_fork()
+{
+    malloc_lock().unlock();
+}
+
+// Blocks are owned by thread ID, but only the forking thread makes it into
+// the child, and with a new ID at that. Its blocks are given the new ID, and
+// the blocks cached by the other threads go back to the allocators.
+void __malloc_child_after_fork()
+{
+    new (&malloc_lock()) LibThread::Lock();
+    pid_t tid = gettid();
+    for (size_t size_class = 0; size_class < num_size_classes; ++size_class) {
+        auto& allocator = allocators()[size_class];
+        for (auto* block = allocator.thread_blocks.head(); block;) {
+            auto* next = block->next();
+            if (block == s_thread_blocks[size_class]) {
+                block->m_owner_tid.store(tid, AK::memory_order_relaxed);
+            } else {
+                // Nobody else is around to free into the block anymore.
+                block->take_remote_frees();
+                bool abandoned = block->try_abandon();
+                ASSERT(abandoned);
+                return_block_to_allocator(allocator, block);
+            }
+            block = next;
+        }
+    }
+}
+
 void serenity_dump_malloc_stats()
 {
-    dbg() << "# malloc() calls: " << g_malloc_stats.number_of_malloc_calls;
+    {
+        LOCKER(malloc_lock());
+        fold_thread_malloc_stats();
+    }
+    dbg() << "# malloc() calls: " << g_malloc_stats.number_of_malloc_calls + g_malloc_stats.number_of_thread_cache_mallocs;
+    dbg() << "thread cache mallocs: " << g_malloc_stats.number_of_thread_cache_mallocs;
     dbg();
     dbg() << "big alloc hits: " << g_malloc_stats.number_of_big_allocator_hits;
     dbg() << "big alloc hits that were purged: " << g_malloc_stats.number_of_big_allocator_purge_hits;
@@ -510,7 +719,9 @@ void serenity_dump_malloc_stats()
     dbg() << "block allocs: " << g_malloc_stats.number_of_block_allocs;
     dbg() << "filled blocks: " << g_malloc_stats.number_of_blocks_full;
     dbg();
-    dbg() << "# free() calls: " << g_malloc_stats.number_of_free_calls;
+    dbg() << "# free() calls: " << g_malloc_stats.number_of_free_calls + g_malloc_stats.number_of_thread_cache_frees;
+    dbg() << "thread cache frees: " << g_malloc_stats.number_of_thread_cache_frees;
+    dbg() << "remote frees: " << g_malloc_stats.number_of_remote_frees;
     dbg();
     dbg() << "big alloc keeps: " << g_malloc_stats.number_of_big_allocator_keeps;
     dbg() << "big alloc frees: " << g_malloc_stats.number_of_big_allocator_frees;
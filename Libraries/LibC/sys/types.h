@@ -94,6 +94,8 @@ typedef struct __pthread_cond_t {
     int32_t value;
     uint32_t previous;
     int clockid; // clockid_t
+    struct __pthread_mutex_t* mutex;
+    uint32_t waiters;
 } pthread_cond_t;
 
 typedef void* pthread_rwlock_t;
@@ -39,6 +39,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/internals.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/types.h>
@@ -70,10 +71,14 @@ int fchown(int fd, uid_t uid, gid_t gid)
 
 pid_t fork()
 {
+    __malloc_prepare_fork();
     int rc = syscall(SC_fork);
     if (rc == 0) {
         s_cached_tid = 0;
         s_cached_pid = 0;
+        __malloc_child_after_fork();
+    } else {
+        __malloc_parent_after_fork();
     }
     __RETURN_WITH_ERRNO(rc, rc, -1);
 }
@@ -611,9 +616,8 @@ void sysbeep()
 
 int fsync(int fd)
 {
-    UNUSED_PARAM(fd);
-    dbgprintf("FIXME: Implement fsync()\n");
-    return 0;
+    int rc = syscall(SC_fsync, fd);
+    __RETURN_WITH_ERRNO(rc, rc, -1);
 }
 
 int halt()
@@ -705,12 +709,16 @@ int unveil(const char* path, const char* permissions)
 
 ssize_t pread(int fd, void* buf, size_t count, off_t offset)
 {
-    // FIXME: This is not thread safe and should be implemented in the kernel instead.
-    off_t old_offset = lseek(fd, 0, SEEK_CUR);
-    lseek(fd, offset, SEEK_SET);
-    ssize_t nread = read(fd, buf, count);
-    lseek(fd, old_offset, SEEK_SET);
-    return nread;
+    Syscall::SC_pread_params params { fd, { (u8*)buf, count }, offset };
+    int rc = syscall(SC_pread, &params);
+    __RETURN_WITH_ERRNO(rc, rc, -1);
+}
+
+ssize_t pwrite(int fd, const void* buf, size_t count, off_t offset)
+{
+    Syscall::SC_pwrite_params params { fd, { (const u8*)buf, count }, offset };
+    int rc = syscall(SC_pwrite, &params);
+    __RETURN_WITH_ERRNO(rc, rc, -1);
 }
 
 char* getpass(const char* prompt)
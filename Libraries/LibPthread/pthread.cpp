@@ -28,12 +28,14 @@
 #include <AK/Atomic.h>
 #include <AK/StdLibExtras.h>
 #include <Kernel/API/Syscall.h>
+#include <errno.h>
 #include <limits.h>
 #include <pthread.h>
 #include <serenity.h>
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/internals.h>
 #include <sys/mman.h>
 #include <time.h>
 #include <unistd.h>
@@ -134,6 +136,7 @@ int pthread_create(pthread_t* thread, pthread_attr_t* attributes, void* (*start_
 
 void pthread_exit(void* value_ptr)
 {
+    __malloc_thread_exit();
     exit_thread(value_ptr);
 }
 
@@ -168,31 +171,44 @@ int pthread_mutex_destroy(pthread_mutex_t*)
     return 0;
 }
 
+// A mutex is unlocked (0), locked (1), or locked with threads possibly
+// sleeping on it (2). Only the last state requires a futex wake on unlock.
+static constexpr u32 mutex_unlocked = 0;
+static constexpr u32 mutex_locked_no_waiters = 1;
+static constexpr u32 mutex_locked_with_waiters = 2;
+
+static void mutex_lock_contended(pthread_mutex_t* mutex)
+{
+    auto& atomic = reinterpret_cast<Atomic<u32>&>(mutex->lock);
+    while (atomic.exchange(mutex_locked_with_waiters, AK::memory_order_acquire) != mutex_unlocked)
+        futex_wait(reinterpret_cast<i32*>(&mutex->lock), mutex_locked_with_waiters, nullptr);
+    mutex->owner = pthread_self();
+    mutex->level = 0;
+}
+
 int pthread_mutex_lock(pthread_mutex_t* mutex)
 {
     auto& atomic = reinterpret_cast<Atomic<u32>&>(mutex->lock);
     pthread_t this_thread = pthread_self();
-    for (;;) {
-        u32 expected = false;
-        if (!atomic.compare_exchange_strong(expected, true, AK::memory_order_acq_rel)) {
-            if (mutex->type == PTHREAD_MUTEX_RECURSIVE && mutex->owner == this_thread) {
-                mutex->level++;
-                return 0;
-            }
-            sched_yield();
-            continue;
-        }
+    u32 expected = mutex_unlocked;
+    if (atomic.compare_exchange_strong(expected, mutex_locked_no_waiters, AK::memory_order_acq_rel)) {
         mutex->owner = this_thread;
         mutex->level = 0;
         return 0;
     }
+    if (mutex->type == PTHREAD_MUTEX_RECURSIVE && mutex->owner == this_thread) {
+        mutex->level++;
+        return 0;
+    }
+    mutex_lock_contended(mutex);
+    return 0;
 }
 
 int pthread_mutex_trylock(pthread_mutex_t* mutex)
 {
     auto& atomic = reinterpret_cast<Atomic<u32>&>(mutex->lock);
-    u32 expected = false;
-    if (!atomic.compare_exchange_strong(expected, true, AK::memory_order_acq_rel)) {
+    u32 expected = mutex_unlocked;
+    if (!atomic.compare_exchange_strong(expected, mutex_locked_no_waiters, AK::memory_order_acq_rel)) {
         if (mutex->type == PTHREAD_MUTEX_RECURSIVE && mutex->owner == pthread_self()) {
             mutex->level++;
             return 0;
@@ -211,7 +227,9 @@ int pthread_mutex_unlock(pthread_mutex_t* mutex)
         return 0;
     }
     mutex->owner = 0;
-    mutex->lock = 0;
+    auto& atomic = reinterpret_cast<Atomic<u32>&>(mutex->lock);
+    if (atomic.exchange(mutex_unlocked, AK::memory_order_release) == mutex_locked_with_waiters)
+        futex_wake(reinterpret_cast<i32*>(&mutex->lock), 1);
     return 0;
 }
 
@@ -478,6 +496,8 @@ int pthread_cond_init(pthread_cond_t* cond, const pthread_condattr_t* attr)
     cond->value = 0;
     cond->previous = 0;
     cond->clockid = attr ? attr->clockid : CLOCK_MONOTONIC;
+    cond->mutex = nullptr;
+    cond->waiters = 0;
     return 0;
 }
 
@@ -490,10 +510,24 @@ static int cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct
 {
     i32 value = cond->value;
     cond->previous = value;
+    cond->mutex = mutex;
+    ++cond->waiters;
     pthread_mutex_unlock(mutex);
-    int rc = futex(&cond->value, FUTEX_WAIT, value, abstime);
-    pthread_mutex_lock(mutex);
-    return rc;
+    int rc = futex_wait(&cond->value, value, abstime);
+    int saved_errno = errno;
+    // pthread_cond_broadcast() may have requeued us onto the mutex behind
+    // other waiters, so take it the way a sleeping waiter would, making
+    // sure whoever unlocks it next wakes up the rest.
+    mutex_lock_contended(mutex);
+    // Once the last waiter is gone, stop requeueing onto this mutex; the
+    // caller is free to destroy it or wait with a different one next time.
+    if (--cond->waiters == 0)
+        cond->mutex = nullptr;
+    if (rc < 0 && saved_errno == ETIMEDOUT) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
 }
 
 int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex)
@@ -529,8 +563,8 @@ int pthread_cond_signal(pthread_cond_t* cond)
 {
     u32 value = cond->previous + 1;
     cond->value = value;
-    int rc = futex(&cond->value, FUTEX_WAKE, 1, nullptr);
-    ASSERT(rc == 0);
+    int rc = futex_wake(&cond->value, 1);
+    ASSERT(rc >= 0);
     return 0;
 }
 
@@ -538,8 +572,19 @@ int pthread_cond_broadcast(pthread_cond_t* cond)
 {
     u32 value = cond->previous + 1;
     cond->value = value;
-    int rc = futex(&cond->value, FUTEX_WAKE, INT32_MAX, nullptr);
-    ASSERT(rc == 0);
+    auto* mutex = cond->mutex;
+    if (mutex) {
+        // Wake one waiter and move the rest over to the mutex, so they're
+        // woken one at a time as it's unlocked instead of all at once.
+        auto* requeue_count = reinterpret_cast<const struct timespec*>(static_cast<FlatPtr>(INT32_MAX));
+        int rc = futex(&cond->value, FUTEX_CMP_REQUEUE, 1, requeue_count, reinterpret_cast<i32*>(&mutex->lock), value);
+        if (rc >= 0)
+            return 0;
+        // The condition changed under us, fall back to waking everyone.
+        ASSERT(errno == EAGAIN);
+    }
+    int rc = futex_wake(&cond->value, INT32_MAX);
+    ASSERT(rc >= 0);
     return 0;
 }
 
@@ -118,6 +118,20 @@ mknod mnt/dev/hdd b 4 1
 for hd in a b c d; do
     chmod 600 mnt/dev/hd$hd
 done
+mknod mnt/dev/sda b 8 0
+mknod mnt/dev/sdb b 8 16
+mknod mnt/dev/sdc b 8 32
+mknod mnt/dev/sdd b 8 48
+for sd in a b c d; do
+    chmod 600 mnt/dev/sd$sd
+done
+mknod mnt/dev/vda b 254 0
+mknod mnt/dev/vdb b 254 16
+mknod mnt/dev/vdc b 254 32
+mknod mnt/dev/vdd b 254 48
+for vd in a b c d; do
+    chmod 600 mnt/dev/vd$vd
+done
 
 ln -s /proc/self/fd/0 mnt/dev/stdin
 ln -s /proc/self/fd/1 mnt/dev/stdout
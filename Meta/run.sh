@@ -62,6 +62,36 @@ $SERENITY_EXTRA_QEMU_ARGS
 -soundhw sb16
 "
 
+[ -z "$SERENITY_COMMON_QEMU_AHCI_ARGS" ] && SERENITY_COMMON_QEMU_AHCI_ARGS="
+$SERENITY_EXTRA_QEMU_ARGS
+-s -m $SERENITY_RAM_SIZE
+-cpu $SERENITY_QEMU_CPU
+-machine q35
+-d guest_errors
+-smp 2
+-device VGA,vgamem_mb=64
+-drive file=${SERENITY_DISK_IMAGE},format=raw,id=disk,if=none
+-device ide-hd,bus=ide.0,drive=disk
+-usb
+-debugcon stdio
+-soundhw pcspk
+-soundhw sb16
+"
+
+[ -z "$SERENITY_COMMON_QEMU_VIRTIO_ARGS" ] && SERENITY_COMMON_QEMU_VIRTIO_ARGS="
+$SERENITY_EXTRA_QEMU_ARGS
+-s -m $SERENITY_RAM_SIZE
+-cpu $SERENITY_QEMU_CPU
+-d guest_errors
+-smp 2
+-device VGA,vgamem_mb=64
+-drive file=${SERENITY_DISK_IMAGE},format=raw,if=virtio
+-usb
+-debugcon stdio
+-soundhw pcspk
+-soundhw sb16
+"
+
 export SDL_VIDEO_X11_DGAMOUSE=0
 
 : "${SERENITY_BUILD:=.}"
@@ -100,6 +130,25 @@ elif [ "$1" = "qgrub" ]; then
         $SERENITY_PACKET_LOGGING_ARG \
         -netdev user,id=breh,hostfwd=tcp:127.0.0.1:8888-10.0.2.15:8888,hostfwd=tcp:127.0.0.1:8823-10.0.2.15:23 \
         -device e1000,netdev=breh
+elif [ "$1" = "qahci" ]; then
+    # Meta/run.sh qahci: qemu (q35 chipset) with the disk on the AHCI controller
+    "$SERENITY_QEMU_BIN" \
+        $SERENITY_COMMON_QEMU_AHCI_ARGS \
+        $SERENITY_KVM_ARG \
+        -netdev user,id=breh,hostfwd=tcp:127.0.0.1:8888-10.0.2.15:8888,hostfwd=tcp:127.0.0.1:8823-10.0.2.15:23 \
+        -device e1000,netdev=breh \
+        -kernel Kernel/Kernel \
+        -append "${SERENITY_KERNEL_CMDLINE} root=/dev/sda"
+elif [ "$1" = "qvirtio" ]; then
+    # Meta/run.sh qvirtio: qemu with the disk and the network adapter on virtio
+    "$SERENITY_QEMU_BIN" \
+        $SERENITY_COMMON_QEMU_VIRTIO_ARGS \
+        $SERENITY_KVM_ARG \
+        $SERENITY_PACKET_LOGGING_ARG \
+        -netdev user,id=breh,hostfwd=tcp:127.0.0.1:8888-10.0.2.15:8888,hostfwd=tcp:127.0.0.1:8823-10.0.2.15:23 \
+        -device virtio-net-pci,netdev=breh \
+        -kernel Kernel/Kernel \
+        -append "${SERENITY_KERNEL_CMDLINE} root=/dev/vda"
 elif [ "$1" = "q35_cmd" ]; then
     # Meta/run.sh q35_cmd: qemu (q35 chipset) with SerenityOS with custom commandline
     shift
@@ -35,7 +35,11 @@
 #include <LibCore/File.h>
 #include <LibCore/MimeData.h>
 #include <LibHTTP/HttpRequest.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
@@ -54,6 +58,15 @@ void Client::die()
     remove_from_parent();
 }
 
+void Client::set_corked(bool corked)
+{
+    // While corked, the kernel holds back partial segments, so the headers
+    // and the start of the body share packets instead of each getting their own.
+    int value = corked;
+    if (setsockopt(m_socket->fd(), IPPROTO_TCP, TCP_CORK, &value, sizeof(value)) < 0)
+        perror("setsockopt(TCP_CORK)");
+}
+
 void Client::start()
 {
     m_socket->on_ready_to_read = [this] {
@@ -125,7 +138,46 @@ void Client::handle_request(ByteBuffer raw_request)
         return;
     }
 
-    send_response(file->read_all(), request, Core::guess_mime_type_based_on_filename(request.url()));
+    send_file(*file, request, Core::guess_mime_type_based_on_filename(request.url()));
+}
+
+void Client::send_file(Core::File& file, const HTTP::HttpRequest& request, const String& content_type)
+{
+    struct stat st;
+    if (fstat(file.fd(), &st) < 0) {
+        perror("fstat");
+        send_error_response(500, "Internal server error!", request);
+        return;
+    }
+
+    StringBuilder builder;
+    builder.append("HTTP/1.0 200 OK\r\n");
+    builder.append("Server: WebServer (SerenityOS)\r\n");
+    builder.append("Content-Type: ");
+    builder.append(content_type);
+    builder.append("\r\n");
+    builder.appendf("Content-Length: %u\r\n", (unsigned)st.st_size);
+    builder.append("\r\n");
+
+    set_corked(true);
+    m_socket->write(builder.to_string());
+
+    // Let the kernel move the file straight into the socket instead of
+    // reading it into a buffer here and writing it back out.
+    size_t remaining = st.st_size;
+    while (remaining) {
+        ssize_t nsent = sendfile(m_socket->fd(), file.fd(), nullptr, remaining);
+        if (nsent < 0) {
+            perror("sendfile");
+            break;
+        }
+        if (nsent == 0)
+            break;
+        remaining -= nsent;
+    }
+    set_corked(false);
+
+    log_response(200, request);
 }
 
 void Client::send_response(StringView response, const HTTP::HttpRequest& request, const String& content_type)
@@ -138,8 +190,10 @@ void Client::send_response(StringView response, const HTTP::HttpRequest& request
     builder.append("\r\n");
     builder.append("\r\n");
 
+    set_corked(true);
     m_socket->write(builder.to_string());
     m_socket->write(response);
+    set_corked(false);
 
     log_response(200, request);
 }
@@ -26,6 +26,7 @@
 
 #pragma once
 
+#include <LibCore/Forward.h>
 #include <LibCore/Object.h>
 #include <LibCore/TCPSocket.h>
 #include <LibHTTP/Forward.h>
@@ -43,9 +44,11 @@ private:
 
     void handle_request(ByteBuffer);
     void send_response(StringView, const HTTP::HttpRequest&, const String& content_type);
+    void send_file(Core::File&, const HTTP::HttpRequest&, const String& content_type);
     void send_redirect(StringView redirect, const HTTP::HttpRequest& request);
     void send_error_response(unsigned code, const StringView& message, const HTTP::HttpRequest&);
     void die();
+    void set_corked(bool);
     void log_response(unsigned code, const HTTP::HttpRequest&);
     void handle_directory_listing(const String& requested_path, const String& real_path, const HTTP::HttpRequest&);
 
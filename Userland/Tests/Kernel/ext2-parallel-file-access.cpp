@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <AK/Atomic.h>
+#include <AK/JsonArray.h>
+#include <AK/JsonValue.h>
+#include <AK/String.h>
+#include <AK/Vector.h>
+#include <LibCore/ElapsedTimer.h>
+#include <LibCore/File.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Every thread gets a file of its own, into which it keeps writing chunks
+// and reading them back. Since the threads never touch each other's files,
+// their throughput should add up as long as there are processors to run
+// them on, instead of everybody queueing up behind a file system-wide lock.
+// The contents are checked on every read, so this doubles as a stress test.
+
+struct Worker {
+    int index { 0 };
+    String path;
+    pthread_t thread;
+    u64 bytes { 0 };
+    bool failed { false };
+};
+
+static size_t s_file_size = 4 * MiB;
+static size_t s_chunk_size = 64 * KiB;
+static Atomic<bool> s_stop { false };
+
+static u8 pattern_byte(int worker_index, size_t offset, u32 generation)
+{
+    return (u8)(worker_index * 31 + offset / 512 + generation * 7);
+}
+
+static void* work(void* arg)
+{
+    auto& worker = *reinterpret_cast<Worker*>(arg);
+    int fd = open(worker.path.characters(), O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd < 0) {
+        perror("open");
+        worker.failed = true;
+        return nullptr;
+    }
+
+    auto* write_buffer = (u8*)malloc(s_chunk_size);
+    auto* read_buffer = (u8*)malloc(s_chunk_size);
+    size_t chunk_count = s_file_size / s_chunk_size;
+
+    for (u32 generation = 0; !s_stop.load(AK::MemoryOrder::memory_order_relaxed); ++generation) {
+        size_t offset = (generation % chunk_count) * s_chunk_size;
+        for (size_t i = 0; i < s_chunk_size; ++i)
+            write_buffer[i] = pattern_byte(worker.index, offset + i, generation);
+
+        if (lseek(fd, offset, SEEK_SET) < 0 || write(fd, write_buffer, s_chunk_size) != (ssize_t)s_chunk_size) {
+            perror("write");
+            worker.failed = true;
+            break;
+        }
+        if (lseek(fd, offset, SEEK_SET) < 0 || read(fd, read_buffer, s_chunk_size) != (ssize_t)s_chunk_size) {
+            perror("read");
+            worker.failed = true;
+            break;
+        }
+        if (memcmp(write_buffer, read_buffer, s_chunk_size) != 0) {
+            fprintf(stderr, "Worker %d: read back something else than it wrote at offset %zu\n", worker.index, offset);
+            worker.failed = true;
+            break;
+        }
+        worker.bytes += 2 * s_chunk_size;
+    }
+
+    free(write_buffer);
+    free(read_buffer);
+    close(fd);
+    unlink(worker.path.characters());
+    return nullptr;
+}
+
+static int processor_count()
+{
+    auto file = Core::File::construct("/proc/cpuinfo");
+    if (!file->open(Core::IODevice::ReadOnly))
+        return 1;
+    auto json = JsonValue::from_string(file->read_all());
+    if (!json.has_value() || !json.value().is_array())
+        return 1;
+    return max(1, json.value().as_array().size());
+}
+
+// Returns the combined throughput in KiB/s, or -1 if anything went wrong.
+static i64 run(const String& directory, int thread_count, int seconds)
+{
+    Vector<Worker*> workers;
+    for (int i = 0; i < thread_count; ++i) {
+        auto* worker = new Worker;
+        worker->index = i;
+        worker->path = String::format("%s/ext2-parallel-file-access.%d.%d", directory.characters(), getpid(), i);
+        workers.append(worker);
+    }
+
+    s_stop.store(false);
+    Core::ElapsedTimer timer;
+    timer.start();
+    for (auto* worker : workers) {
+        if (pthread_create(&worker->thread, nullptr, work, worker) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    sleep(seconds);
+    s_stop.store(true);
+
+    u64 bytes = 0;
+    bool failed = false;
+    for (auto* worker : workers) {
+        pthread_join(worker->thread, nullptr);
+        bytes += worker->bytes;
+        failed |= worker->failed;
+        delete worker;
+    }
+    auto elapsed_ms = max(1, timer.elapsed());
+    if (failed)
+        return -1;
+    return bytes * 1000 / elapsed_ms / KiB;
+}
+
+static void exit_with_usage(int rc)
+{
+    fprintf(stderr, "Usage: ext2-parallel-file-access [-h] [-d directory] [-p max threads] [-t seconds] [-f file size] [-c chunk size]\n");
+    exit(rc);
+}
+
+int main(int argc, char** argv)
+{
+    String directory = ".";
+    int max_thread_count = 0;
+    int seconds = 3;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "hd:p:t:f:c:")) != -1) {
+        switch (opt) {
+        case 'h':
+            exit_with_usage(0);
+            break;
+        case 'd':
+            directory = optarg;
+            break;
+        case 'p':
+            max_thread_count = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'f':
+            s_file_size = atoi(optarg);
+            break;
+        case 'c':
+            s_chunk_size = atoi(optarg);
+            break;
+        default:
+            exit_with_usage(1);
+        }
+    }
+
+    if (!max_thread_count)
+        max_thread_count = processor_count() * 2;
+    if (max_thread_count <= 0 || seconds <= 0 || !s_chunk_size || s_file_size < s_chunk_size)
+        exit_with_usage(1);
+
+    printf("%d processors, %zu KiB files, %zu KiB chunks, %d seconds per run\n", processor_count(), s_file_size / KiB, s_chunk_size / KiB, seconds);
+
+    i64 single_thread_throughput = 0;
+    for (int thread_count = 1; thread_count <= max_thread_count; thread_count *= 2) {
+        auto throughput = run(directory, thread_count, seconds);
+        if (throughput < 0) {
+            printf("%d threads: FAILED\n", thread_count);
+            return 1;
+        }
+        if (thread_count == 1)
+            single_thread_throughput = max((i64)1, throughput);
+        printf("%d threads: %lld KiB/s (%lld.%02lldx)\n", thread_count, throughput, throughput / single_thread_throughput, throughput * 100 / single_thread_throughput % 100);
+    }
+    return 0;
+}
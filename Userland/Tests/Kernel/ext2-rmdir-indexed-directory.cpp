@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <AK/String.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Fills a directory until it gets converted into a hashed (indexed) one,
+// empties it again and then removes it. "." and ".." are not part of the
+// hashed leaves, so both looking them up and rmdir() have to cope with that.
+// Run it from a directory on an ext2 file system with dir_index enabled.
+
+static const int entry_count = 500;
+
+#define EXPECT(condition)                                                  \
+    do {                                                                   \
+        if (!(condition)) {                                                \
+            fprintf(stderr, "FAIL: %s (line %d)\n", #condition, __LINE__); \
+            return false;                                                  \
+        }                                                                  \
+    } while (0)
+
+static String entry_path(const String& directory, int index)
+{
+    return String::format("%s/a-rather-long-file-name-to-fill-blocks-quickly.%d", directory.characters(), index);
+}
+
+static bool test_rmdir_indexed_directory(const String& parent_directory, const String& directory)
+{
+    EXPECT(mkdir(directory.characters(), 0755) == 0);
+
+    for (int i = 0; i < entry_count; ++i) {
+        int fd = open(entry_path(directory, i).characters(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+        EXPECT(fd >= 0);
+        close(fd);
+    }
+
+    struct stat parent;
+    struct stat dot_dot;
+    struct stat dot;
+    struct stat self;
+    EXPECT(stat(String::format("%s/..", directory.characters()).characters(), &dot_dot) == 0);
+    EXPECT(stat(parent_directory.characters(), &parent) == 0);
+    EXPECT(dot_dot.st_ino == parent.st_ino);
+    EXPECT(stat(String::format("%s/.", directory.characters()).characters(), &dot) == 0);
+    EXPECT(stat(directory.characters(), &self) == 0);
+    EXPECT(dot.st_ino == self.st_ino);
+
+    for (int i = 0; i < entry_count; ++i)
+        EXPECT(unlink(entry_path(directory, i).characters()) == 0);
+
+    EXPECT(rmdir(directory.characters()) == 0);
+    EXPECT(access(directory.characters(), F_OK) < 0);
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    String directory = argc > 1 ? argv[1] : ".";
+    auto path = String::format("%s/ext2-rmdir-indexed-directory.%d", directory.characters(), getpid());
+    if (!test_rmdir_indexed_directory(directory, path))
+        return 1;
+    printf("PASS\n");
+    return 0;
+}
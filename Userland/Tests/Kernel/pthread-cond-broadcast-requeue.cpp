@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <serenity.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Many threads wait on one condition variable and get woken by a single
+// broadcast. The broadcast requeues all but one of them onto the mutex,
+// so this checks that every waiter still makes it out. Then the same goes
+// for a requeue that moves every waiter and wakes none of them.
+
+static constexpr int thread_count = 16;
+static constexpr int round_count = 100;
+
+static pthread_mutex_t s_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_cond = PTHREAD_COND_INITIALIZER;
+static int s_generation = 0;
+static int s_waiting = 0;
+static int s_woken = 0;
+
+static int32_t s_futex = 0;
+static int32_t s_futex2 = 0;
+
+static void* waiter(void*)
+{
+    for (int round = 0; round < round_count; ++round) {
+        pthread_mutex_lock(&s_mutex);
+        int generation = s_generation;
+        ++s_waiting;
+        while (generation == s_generation)
+            pthread_cond_wait(&s_cond, &s_mutex);
+        ++s_woken;
+        pthread_mutex_unlock(&s_mutex);
+    }
+    return nullptr;
+}
+
+static void* futex_waiter(void*)
+{
+    int rc = futex_wait(&s_futex, 0, nullptr);
+    assert(rc == 0);
+    return nullptr;
+}
+
+static void test_broadcast()
+{
+    pthread_t threads[thread_count];
+    for (int i = 0; i < thread_count; ++i)
+        pthread_create(&threads[i], nullptr, waiter, nullptr);
+
+    for (int round = 0; round < round_count; ++round) {
+        for (;;) {
+            pthread_mutex_lock(&s_mutex);
+            if (s_waiting == thread_count)
+                break;
+            pthread_mutex_unlock(&s_mutex);
+            usleep(1000);
+        }
+        s_waiting = 0;
+        ++s_generation;
+        pthread_cond_broadcast(&s_cond);
+        pthread_mutex_unlock(&s_mutex);
+    }
+
+    for (int i = 0; i < thread_count; ++i)
+        pthread_join(threads[i], nullptr);
+
+    assert(s_woken == thread_count * round_count);
+    printf("PASS: %d broadcasts woke %d waiters\n", round_count, s_woken);
+}
+
+static void test_requeue_everyone()
+{
+    auto* requeue_count = reinterpret_cast<const struct timespec*>(static_cast<uintptr_t>(INT32_MAX));
+    int requeued = 0;
+    for (int round = 0; round < round_count; ++round) {
+        pthread_t threads[thread_count];
+        for (int i = 0; i < thread_count; ++i)
+            pthread_create(&threads[i], nullptr, futex_waiter, nullptr);
+
+        // Wake nobody, and move everybody over once they're all asleep.
+        for (int moved = 0; moved < thread_count;) {
+            int rc = futex(&s_futex, FUTEX_REQUEUE, 0, requeue_count, &s_futex2, 0);
+            assert(rc >= 0);
+            moved += rc;
+            if (moved < thread_count)
+                usleep(1000);
+        }
+        requeued += thread_count;
+
+        int rc = futex_wake(&s_futex2, INT32_MAX);
+        assert(rc == thread_count);
+        for (int i = 0; i < thread_count; ++i)
+            pthread_join(threads[i], nullptr);
+    }
+    printf("PASS: %d requeues moved %d waiters\n", round_count, requeued);
+}
+
+int main()
+{
+    test_broadcast();
+    test_requeue_everyone();
+    return EXIT_SUCCESS;
+}
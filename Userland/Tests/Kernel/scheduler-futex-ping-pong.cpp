@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <AK/Atomic.h>
+#include <AK/HashMap.h>
+#include <AK/JsonArray.h>
+#include <AK/JsonObject.h>
+#include <AK/JsonValue.h>
+#include <AK/Vector.h>
+#include <LibCore/ElapsedTimer.h>
+#include <LibCore/File.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <serenity.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Pairs of threads bounce a token back and forth through a futex, which
+// makes every round trip cost two wakeups and two context switches.
+// We report how many context switches each processor did per second.
+
+struct PingPong {
+    i32 turn { 0 };
+    u64 round_trips { 0 };
+    pthread_t threads[2];
+};
+
+static Atomic<bool> s_stop { false };
+
+static void pass_token(PingPong& ping_pong, i32 mine, i32 theirs)
+{
+    while (ping_pong.turn != mine) {
+        if (s_stop.load(AK::MemoryOrder::memory_order_relaxed))
+            return;
+        futex_wait(&ping_pong.turn, theirs, nullptr);
+    }
+    ping_pong.turn = theirs;
+    futex_wake(&ping_pong.turn, 1);
+}
+
+static void* ping(void* arg)
+{
+    auto& ping_pong = *reinterpret_cast<PingPong*>(arg);
+    while (!s_stop.load(AK::MemoryOrder::memory_order_relaxed)) {
+        pass_token(ping_pong, 0, 1);
+        ping_pong.round_trips++;
+    }
+    return nullptr;
+}
+
+static void* pong(void* arg)
+{
+    auto& ping_pong = *reinterpret_cast<PingPong*>(arg);
+    while (!s_stop.load(AK::MemoryOrder::memory_order_relaxed))
+        pass_token(ping_pong, 1, 0);
+    return nullptr;
+}
+
+static HashMap<u32, u32> context_switches_per_processor()
+{
+    HashMap<u32, u32> context_switches;
+    auto file = Core::File::construct("/proc/cpuinfo");
+    if (!file->open(Core::IODevice::ReadOnly)) {
+        fprintf(stderr, "Failed to open /proc/cpuinfo: %s\n", file->error_string());
+        exit(1);
+    }
+    auto json = JsonValue::from_string(file->read_all());
+    ASSERT(json.has_value());
+    json.value().as_array().for_each([&](auto& value) {
+        auto& processor = value.as_object();
+        context_switches.set(processor.get("processor").to_u32(), processor.get("context_switches").to_u32());
+    });
+    return context_switches;
+}
+
+static void exit_with_usage(int rc)
+{
+    fprintf(stderr, "Usage: scheduler-futex-ping-pong [-h] [-p pairs] [-t seconds]\n");
+    exit(rc);
+}
+
+int main(int argc, char** argv)
+{
+    int pair_count = 4;
+    int seconds = 5;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "hp:t:")) != -1) {
+        switch (opt) {
+        case 'h':
+            exit_with_usage(0);
+            break;
+        case 'p':
+            pair_count = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        default:
+            exit_with_usage(1);
+        }
+    }
+
+    if (pair_count <= 0 || seconds <= 0)
+        exit_with_usage(1);
+
+    Vector<PingPong*> pairs;
+    for (int i = 0; i < pair_count; ++i)
+        pairs.append(new PingPong);
+
+    auto switches_before = context_switches_per_processor();
+    Core::ElapsedTimer timer;
+    timer.start();
+
+    for (auto* ping_pong : pairs) {
+        if (pthread_create(&ping_pong->threads[0], nullptr, ping, ping_pong) != 0
+            || pthread_create(&ping_pong->threads[1], nullptr, pong, ping_pong) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    sleep(seconds);
+    s_stop.store(true);
+
+    for (auto* ping_pong : pairs) {
+        // Wake up anyone still waiting for a token that will never come.
+        ping_pong->turn = 2;
+        futex_wake(&ping_pong->turn, 2);
+        pthread_join(ping_pong->threads[0], nullptr);
+        pthread_join(ping_pong->threads[1], nullptr);
+    }
+
+    auto elapsed_ms = timer.elapsed();
+    auto switches_after = context_switches_per_processor();
+
+    u64 round_trips = 0;
+    for (auto* ping_pong : pairs)
+        round_trips += ping_pong->round_trips;
+
+    printf("%d thread pairs, %d ms, %llu round trips (%llu/s)\n", pair_count, elapsed_ms, round_trips, round_trips * 1000 / elapsed_ms);
+
+    u64 total_switches = 0;
+    for (auto& it : switches_after) {
+        u32 switches = it.value - switches_before.get(it.key).value_or(0);
+        total_switches += switches;
+        printf("cpu #%u: %u context switches (%llu/s)\n", it.key, switches, (u64)switches * 1000 / elapsed_ms);
+    }
+    printf("total: %llu context switches (%llu/s)\n", total_switches, total_switches * 1000 / elapsed_ms);
+
+    for (auto* ping_pong : pairs)
+        delete ping_pong;
+    return 0;
+}
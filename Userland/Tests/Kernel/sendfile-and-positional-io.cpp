@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <AK/String.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Checks that pread()/pwrite() leave the file offset alone, that readv()
+// scatters in order, and that sendfile() copies exactly the requested range.
+// Run it from a directory on a disk file system (not /tmp) to get the page
+// cache path in sendfile().
+
+static const size_t file_size = 100 * KiB + 123;
+
+static u8 pattern_byte(size_t offset)
+{
+    return (u8)(offset * 7 + offset / 4096);
+}
+
+#define EXPECT(condition)                                                  \
+    do {                                                                   \
+        if (!(condition)) {                                                \
+            fprintf(stderr, "FAIL: %s (line %d)\n", #condition, __LINE__); \
+            return false;                                                  \
+        }                                                                  \
+    } while (0)
+
+static bool test_pread_pwrite(int fd)
+{
+    auto* buffer = (u8*)malloc(file_size);
+    for (size_t i = 0; i < file_size; ++i)
+        buffer[i] = pattern_byte(i);
+
+    EXPECT(lseek(fd, 17, SEEK_SET) == 17);
+    EXPECT(pwrite(fd, buffer, file_size, 0) == (ssize_t)file_size);
+    EXPECT(lseek(fd, 0, SEEK_CUR) == 17);
+
+    memset(buffer, 0, file_size);
+    EXPECT(pread(fd, buffer, file_size, 0) == (ssize_t)file_size);
+    EXPECT(lseek(fd, 0, SEEK_CUR) == 17);
+    for (size_t i = 0; i < file_size; ++i)
+        EXPECT(buffer[i] == pattern_byte(i));
+
+    EXPECT(pread(fd, buffer, 16, file_size) == 0);
+    EXPECT(pread(fd, buffer, 16, -1) < 0);
+    free(buffer);
+    return true;
+}
+
+static bool test_readv(int fd)
+{
+    u8 first[3];
+    u8 second[4096];
+    u8 third[5];
+    iovec vecs[] = {
+        { first, sizeof(first) },
+        { second, sizeof(second) },
+        { third, sizeof(third) },
+    };
+    off_t offset = file_size - sizeof(first) - sizeof(second) - 2;
+    EXPECT(lseek(fd, offset, SEEK_SET) == offset);
+    EXPECT(readv(fd, vecs, 3) == (ssize_t)(sizeof(first) + sizeof(second) + 2));
+    EXPECT(lseek(fd, 0, SEEK_CUR) == (off_t)file_size);
+    for (size_t i = 0; i < sizeof(first); ++i)
+        EXPECT(first[i] == pattern_byte(offset + i));
+    for (size_t i = 0; i < sizeof(second); ++i)
+        EXPECT(second[i] == pattern_byte(offset + sizeof(first) + i));
+    for (size_t i = 0; i < 2; ++i)
+        EXPECT(third[i] == pattern_byte(offset + sizeof(first) + sizeof(second) + i));
+    return true;
+}
+
+static bool test_sendfile(int fd, const String& out_path)
+{
+    int out_fd = open(out_path.characters(), O_CREAT | O_TRUNC | O_RDWR, 0644);
+    EXPECT(out_fd >= 0);
+
+    // With an explicit offset, the in offset stays put and *offset advances.
+    off_t offset = 1000;
+    size_t count = 70 * KiB;
+    EXPECT(lseek(fd, 5, SEEK_SET) == 5);
+    EXPECT(sendfile(out_fd, fd, &offset, count) == (ssize_t)count);
+    EXPECT(offset == (off_t)(1000 + count));
+    EXPECT(lseek(fd, 0, SEEK_CUR) == 5);
+
+    // Without one, the in offset is used and advanced, and we stop at EOF.
+    EXPECT(lseek(fd, 1000 + count, SEEK_SET) == (off_t)(1000 + count));
+    EXPECT(sendfile(out_fd, fd, nullptr, file_size) == (ssize_t)(file_size - 1000 - count));
+    EXPECT(lseek(fd, 0, SEEK_CUR) == (off_t)file_size);
+
+    size_t out_size = file_size - 1000;
+    auto* buffer = (u8*)malloc(out_size);
+    EXPECT(pread(out_fd, buffer, out_size + 1, 0) == (ssize_t)out_size);
+    for (size_t i = 0; i < out_size; ++i)
+        EXPECT(buffer[i] == pattern_byte(1000 + i));
+    free(buffer);
+
+    close(out_fd);
+    unlink(out_path.characters());
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    String directory = argc > 1 ? argv[1] : ".";
+    auto path = String::format("%s/sendfile-and-positional-io.%d", directory.characters(), getpid());
+    int fd = open(path.characters(), O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+
+    bool success = test_pread_pwrite(fd) && test_readv(fd) && test_sendfile(fd, String::format("%s.out", path.characters()));
+    close(fd);
+    unlink(path.characters());
+    if (!success)
+        return 1;
+    printf("PASS\n");
+    return 0;
+}
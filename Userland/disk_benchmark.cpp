@@ -25,10 +25,13 @@
  */
 
 #include <AK/ByteBuffer.h>
+#include <AK/JsonArray.h>
+#include <AK/JsonObject.h>
 #include <AK/String.h>
 #include <AK/Types.h>
 #include <AK/Vector.h>
 #include <LibCore/ElapsedTimer.h>
+#include <LibCore/File.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <stdio.h>
@@ -37,14 +40,14 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
-struct Result {
+struct BenchmarkResult {
     u64 write_bps;
     u64 read_bps;
 };
 
-static Result average_result(const Vector<Result>& results)
+static BenchmarkResult average_result(const Vector<BenchmarkResult>& results)
 {
-    Result average;
+    BenchmarkResult average;
 
     for (auto& res : results) {
         average.write_bps += res.write_bps;
@@ -57,13 +60,74 @@ static Result average_result(const Vector<Result>& results)
     return average;
 }
 
+struct QueueStatistics {
+    u64 submitted_requests { 0 };
+    u64 merged_requests { 0 };
+    u64 transfers { 0 };
+    u64 blocks { 0 };
+};
+
+// Sums up the request queue counters of all block devices, so we can tell how
+// well the kernel managed to batch up the I/O a benchmark run generated.
+static QueueStatistics block_queue_statistics()
+{
+    QueueStatistics statistics;
+    auto file = Core::File::construct("/proc/devices");
+    if (!file->open(Core::IODevice::ReadOnly))
+        return statistics;
+    auto json = JsonValue::from_string(file->read_all());
+    if (!json.has_value() || !json.value().is_array())
+        return statistics;
+    json.value().as_array().for_each([&](auto& value) {
+        auto& device = value.as_object();
+        if (device.get("type").to_string() != "block")
+            return;
+        statistics.submitted_requests += device.get("submitted_requests").template to_number<u64>();
+        statistics.merged_requests += device.get("merged_requests").template to_number<u64>();
+        statistics.transfers += device.get("transfers").template to_number<u64>();
+        statistics.blocks += device.get("blocks_read").template to_number<u64>() + device.get("blocks_written").template to_number<u64>();
+    });
+    return statistics;
+}
+
+struct AllocationStatistics {
+    u64 allocated_blocks { 0 };
+    u64 allocated_extents { 0 };
+    u64 free_extents { 0 };
+    u64 largest_free_extent { 0 };
+};
+
+// Sums up the block allocation counters of all the filesystems that have them,
+// which tell us how fragmented the files written by a benchmark run ended up.
+static AllocationStatistics allocation_statistics()
+{
+    AllocationStatistics statistics;
+    auto file = Core::File::construct("/proc/df");
+    if (!file->open(Core::IODevice::ReadOnly))
+        return statistics;
+    auto json = JsonValue::from_string(file->read_all());
+    if (!json.has_value() || !json.value().is_array())
+        return statistics;
+    json.value().as_array().for_each([&](auto& value) {
+        auto& fs = value.as_object();
+        if (!fs.has("allocated_block_count"))
+            return;
+        statistics.allocated_blocks += fs.get("allocated_block_count").template to_number<u64>();
+        statistics.allocated_extents += fs.get("allocated_extent_count").template to_number<u64>();
+        statistics.free_extents += fs.get("free_extent_count").template to_number<u64>();
+        statistics.largest_free_extent = max(statistics.largest_free_extent, fs.get("largest_free_extent").template to_number<u64>());
+    });
+    return statistics;
+}
+
 static void exit_with_usage(int rc)
 {
-    fprintf(stderr, "Usage: disk_benchmark [-h] [-d directory] [-t time_per_benchmark] [-f file_size1,file_size2,...] [-b block_size1,block_size2,...]\n");
+    fprintf(stderr, "Usage: disk_benchmark [-h] [-a] [-s] [-d directory] [-t time_per_benchmark] [-f file_size1,file_size2,...] [-b block_size1,block_size2,...]\n");
     exit(rc);
 }
 
-static Result benchmark(const String& filename, int file_size, int block_size, ByteBuffer& buffer, bool allow_cache);
+static BenchmarkResult benchmark(const String& filename, int file_size, int block_size, ByteBuffer& buffer, bool allow_cache, bool sync_writes);
+static BenchmarkResult append_benchmark(const String& directory, int file_size, int block_size, ByteBuffer& buffer, bool sync_writes);
 
 int main(int argc, char** argv)
 {
@@ -72,16 +136,24 @@ int main(int argc, char** argv)
     Vector<int> file_sizes;
     Vector<int> block_sizes;
     bool allow_cache = false;
+    bool append = false;
+    bool sync_writes = false;
 
     int opt;
-    while ((opt = getopt(argc, argv, "chd:t:f:b:")) != -1) {
+    while ((opt = getopt(argc, argv, "achsd:t:f:b:")) != -1) {
         switch (opt) {
         case 'h':
             exit_with_usage(0);
             break;
+        case 'a':
+            append = true;
+            break;
         case 'c':
             allow_cache = true;
             break;
+        case 's':
+            sync_writes = true;
+            break;
         case 'd':
             directory = strdup(optarg);
             break;
@@ -117,20 +189,37 @@ int main(int argc, char** argv)
 
             auto buffer = ByteBuffer::create_uninitialized(block_size);
 
-            Vector<Result> results;
+            Vector<BenchmarkResult> results;
 
-            printf("Running: file_size=%d block_size=%d\n", file_size, block_size);
+            printf("Running: file_size=%d block_size=%d%s%s\n", file_size, block_size, append ? " (append)" : "", sync_writes ? " (fsync)" : "");
+            auto statistics_before = block_queue_statistics();
+            auto allocation_before = allocation_statistics();
             Core::ElapsedTimer timer;
             timer.start();
             while (timer.elapsed() < time_per_benchmark * 1000) {
                 printf(".");
                 fflush(stdout);
-                results.append(benchmark(filename, file_size, block_size, buffer, allow_cache));
+                if (append)
+                    results.append(append_benchmark(directory, file_size, block_size, buffer, sync_writes));
+                else
+                    results.append(benchmark(filename, file_size, block_size, buffer, allow_cache, sync_writes));
                 usleep(100);
             }
             auto average = average_result(results);
             printf("\nFinished: runs=%zu time=%dms write_bps=%llu read_bps=%llu\n", results.size(), timer.elapsed(), average.write_bps, average.read_bps);
 
+            auto statistics_after = block_queue_statistics();
+            u64 requests = statistics_after.submitted_requests - statistics_before.submitted_requests;
+            u64 merged = statistics_after.merged_requests - statistics_before.merged_requests;
+            u64 transfers = statistics_after.transfers - statistics_before.transfers;
+            u64 blocks = statistics_after.blocks - statistics_before.blocks;
+            printf("Block queue: requests=%llu merged=%llu transfers=%llu blocks_per_transfer=%llu\n", requests, merged, transfers, transfers ? blocks / transfers : 0);
+
+            auto allocation_after = allocation_statistics();
+            u64 allocated_blocks = allocation_after.allocated_blocks - allocation_before.allocated_blocks;
+            u64 allocated_extents = allocation_after.allocated_extents - allocation_before.allocated_extents;
+            printf("Allocation: blocks=%llu extents=%llu blocks_per_extent=%llu free_extents=%llu largest_free_extent=%llu\n", allocated_blocks, allocated_extents, allocated_extents ? allocated_blocks / allocated_extents : 0, allocation_after.free_extents, allocation_after.largest_free_extent);
+
             sleep(1);
         }
     }
@@ -141,7 +230,7 @@ int main(int argc, char** argv)
     }
 }
 
-Result benchmark(const String& filename, int file_size, int block_size, ByteBuffer& buffer, bool allow_cache)
+BenchmarkResult benchmark(const String& filename, int file_size, int block_size, ByteBuffer& buffer, bool allow_cache, bool sync_writes)
 {
     int flags = O_CREAT | O_TRUNC | O_RDWR;
     if (!allow_cache)
@@ -159,7 +248,7 @@ Result benchmark(const String& filename, int file_size, int block_size, ByteBuff
         exit(1);
     };
 
-    Result res;
+    BenchmarkResult res;
 
     Core::ElapsedTimer timer;
 
@@ -171,6 +260,10 @@ Result benchmark(const String& filename, int file_size, int block_size, ByteBuff
             perror("write");
             cleanup_and_exit();
         }
+        if (sync_writes && fsync(fd) < 0) {
+            perror("fsync");
+            cleanup_and_exit();
+        }
         nwrote += n;
     }
 
@@ -206,3 +299,65 @@ Result benchmark(const String& filename, int file_size, int block_size, ByteBuff
 
     return res;
 }
+
+// Grows a few files side by side, a chunk at a time, the way logs and
+// downloads do. Without the filesystem's help, their blocks end up interleaved.
+BenchmarkResult append_benchmark(const String& directory, int file_size, int block_size, ByteBuffer& buffer, bool sync_writes)
+{
+    static constexpr int file_count = 4;
+    String filenames[file_count];
+    int fds[file_count];
+
+    for (int i = 0; i < file_count; ++i) {
+        filenames[i] = String::format("%s/disk_benchmark.%d.tmp", directory.characters(), i);
+        fds[i] = open(filenames[i].characters(), O_CREAT | O_TRUNC | O_WRONLY | O_APPEND, 0644);
+        if (fds[i] == -1) {
+            perror("open");
+            exit(1);
+        }
+    }
+
+    auto cleanup_and_exit = [&]() {
+        for (int i = 0; i < file_count; ++i) {
+            close(fds[i]);
+            unlink(filenames[i].characters());
+        }
+        exit(1);
+    };
+
+    BenchmarkResult res;
+
+    Core::ElapsedTimer timer;
+    timer.start();
+    for (int j = 0; j < file_size; j += block_size) {
+        for (int i = 0; i < file_count; ++i) {
+            if (write(fds[i], buffer.data(), block_size) < 0) {
+                perror("write");
+                cleanup_and_exit();
+            }
+            // Like a logging daemon that wants every line on disk before moving on.
+            if (sync_writes && fsync(fds[i]) < 0) {
+                perror("fsync");
+                cleanup_and_exit();
+            }
+        }
+    }
+    // Make sure everything has a place on disk before we look at where it went.
+    sync();
+
+    res.write_bps = (u64)(timer.elapsed() ? ((u64)file_size * file_count / timer.elapsed()) : file_size) * 1000;
+    res.read_bps = 0;
+
+    for (int i = 0; i < file_count; ++i) {
+        if (close(fds[i]) != 0) {
+            perror("close");
+            cleanup_and_exit();
+        }
+        if (unlink(filenames[i].characters()) != 0) {
+            perror("unlink");
+            cleanup_and_exit();
+        }
+    }
+
+    return res;
+}
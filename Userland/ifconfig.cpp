@@ -77,6 +77,10 @@ int main(int argc, char** argv)
             auto bytes_in = if_object.get("bytes_in").to_u32();
             auto packets_out = if_object.get("packets_out").to_u32();
             auto bytes_out = if_object.get("bytes_out").to_u32();
+            auto packets_dropped = if_object.get("packets_dropped").to_u32();
+            auto receive_queues = if_object.get("receive_queues").to_u32();
+            auto average_latency = if_object.get("average_latency").to_u32();
+            auto max_latency = if_object.get("max_latency").to_u32();
             auto mtu = if_object.get("mtu").to_u32();
 
             printf("%s:\n", name.characters());
@@ -87,6 +91,8 @@ int main(int argc, char** argv)
             printf("\tclass: %s\n", class_name.characters());
             printf("\tRX: %u packets %u bytes (%s)\n", packets_in, bytes_in, human_readable_size(bytes_in).characters());
             printf("\tTX: %u packets %u bytes (%s)\n", packets_out, bytes_out, human_readable_size(bytes_out).characters());
+            printf("\tdropped: %u packets\n", packets_dropped);
+            printf("\tRX queues: %u, latency: %u us average, %u us max\n", receive_queues, average_latency, max_latency);
             printf("\tMTU: %u\n", mtu);
             printf("\n");
         });
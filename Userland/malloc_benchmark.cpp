@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <AK/Atomic.h>
+#include <AK/NonnullOwnPtrVector.h>
+#include <AK/String.h>
+#include <AK/Types.h>
+#include <AK/Vector.h>
+#include <LibCore/ElapsedTimer.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static constexpr size_t batch_size = 64;
+
+struct Worker {
+    pthread_t thread;
+    size_t allocation_size { 0 };
+    bool remote_frees { false };
+    Worker* neighbor { nullptr };
+    Atomic<void**> mailbox { nullptr };
+    u64 operations { 0 };
+};
+
+static Atomic<bool> s_stop;
+
+static void exit_with_usage(int rc)
+{
+    fprintf(stderr, "Usage: malloc_benchmark [-h] [-r] [-t time_per_benchmark] [-n thread_count1,thread_count2,...] [-s size1,size2,...]\n");
+    exit(rc);
+}
+
+static void free_batch(void** batch)
+{
+    for (size_t i = 0; i < batch_size; ++i)
+        free(batch[i]);
+    free(batch);
+}
+
+static void* worker_main(void* argument)
+{
+    auto& worker = *reinterpret_cast<Worker*>(argument);
+    while (!s_stop.load(AK::memory_order_relaxed)) {
+        auto** batch = (void**)malloc(batch_size * sizeof(void*));
+        for (size_t i = 0; i < batch_size; ++i) {
+            batch[i] = malloc(worker.allocation_size);
+            *(volatile u8*)batch[i] = (u8)i;
+        }
+        worker.operations += batch_size + 1;
+
+        if (!worker.remote_frees) {
+            free_batch(batch);
+            continue;
+        }
+
+        // Hand the batch to our neighbor so it gets freed by another thread,
+        // and free whatever we were handed ourselves.
+        void** expected = nullptr;
+        if (!worker.neighbor->mailbox.compare_exchange_strong(expected, batch, AK::memory_order_acq_rel))
+            free_batch(batch);
+        if (auto** received = worker.mailbox.exchange(nullptr, AK::memory_order_acq_rel))
+            free_batch(received);
+    }
+    return nullptr;
+}
+
+static u64 benchmark(size_t thread_count, size_t allocation_size, bool remote_frees, int time_per_benchmark)
+{
+    NonnullOwnPtrVector<Worker> workers;
+    for (size_t i = 0; i < thread_count; ++i)
+        workers.append(make<Worker>());
+    for (size_t i = 0; i < thread_count; ++i) {
+        workers[i].allocation_size = allocation_size;
+        workers[i].remote_frees = remote_frees;
+        workers[i].neighbor = &workers[(i + 1) % thread_count];
+    }
+
+    s_stop.store(false);
+    Core::ElapsedTimer timer;
+    timer.start();
+    for (auto& worker : workers) {
+        if (pthread_create(&worker.thread, nullptr, worker_main, &worker) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    sleep(time_per_benchmark);
+    s_stop.store(true);
+
+    u64 operations = 0;
+    for (auto& worker : workers) {
+        pthread_join(worker.thread, nullptr);
+        operations += worker.operations;
+        if (auto** leftover = worker.mailbox.exchange(nullptr))
+            free_batch(leftover);
+    }
+    auto elapsed = timer.elapsed();
+    return elapsed ? operations * 1000 / elapsed : operations;
+}
+
+int main(int argc, char** argv)
+{
+    int time_per_benchmark = 5;
+    bool remote_frees = false;
+    Vector<int> thread_counts;
+    Vector<int> allocation_sizes;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "hrt:n:s:")) != -1) {
+        switch (opt) {
+        case 'h':
+            exit_with_usage(0);
+            break;
+        case 'r':
+            remote_frees = true;
+            break;
+        case 't':
+            time_per_benchmark = atoi(optarg);
+            break;
+        case 'n':
+            for (auto count : String(optarg).split(','))
+                thread_counts.append(atoi(count.characters()));
+            break;
+        case 's':
+            for (auto size : String(optarg).split(','))
+                allocation_sizes.append(atoi(size.characters()));
+            break;
+        default:
+            exit_with_usage(1);
+        }
+    }
+
+    if (thread_counts.is_empty())
+        thread_counts = { 1, 2, 4, 8 };
+    if (allocation_sizes.is_empty())
+        allocation_sizes = { 16, 128, 1024 };
+
+    for (auto allocation_size : allocation_sizes) {
+        u64 single_thread_ops = 0;
+        for (auto thread_count : thread_counts) {
+            if (thread_count <= 0 || allocation_size <= 0)
+                exit_with_usage(1);
+            printf("Running: threads=%d size=%d frees=%s\n", thread_count, allocation_size, remote_frees ? "remote" : "local");
+            auto ops = benchmark(thread_count, allocation_size, remote_frees, time_per_benchmark);
+            if (!single_thread_ops)
+                single_thread_ops = ops / thread_count;
+            printf("Finished: ops_per_second=%llu ops_per_second_per_thread=%llu scaling=%llu%%\n",
+                ops, ops / thread_count, single_thread_ops ? ops * 100 / (single_thread_ops * thread_count) : 0);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2018-2020, the SerenityOS developers.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <AK/ByteBuffer.h>
+#include <AK/JsonArray.h>
+#include <AK/JsonObject.h>
+#include <AK/JsonValue.h>
+#include <AK/String.h>
+#include <AK/Types.h>
+#include <LibCore/ElapsedTimer.h>
+#include <LibCore/File.h>
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static void exit_with_usage(int rc)
+{
+    fprintf(stderr, "Usage: net_benchmark [-h] [-s | -c address] [-p port] [-t seconds] [-l buffer_size] [-L drop_percentage]\n");
+    fprintf(stderr, "Without -s or -c, a server and a client are run against each other over loopback.\n");
+    fprintf(stderr, "With -L, that many percent of the loopback packets are dropped meanwhile.\n");
+    exit(rc);
+}
+
+static void print_rate(const char* label, u64 bytes, u64 elapsed_ms)
+{
+    if (!elapsed_ms)
+        elapsed_ms = 1;
+    printf("%s%llu KiB in %llu ms, %llu KiB/s\n", label, bytes / KiB, elapsed_ms, (bytes * 1000 / elapsed_ms) / KiB);
+}
+
+// Prints what the kernel thinks of the connection starting at the given
+// local port, so we can tell whether the windows opened up as expected.
+static void print_connection_statistics(int fd)
+{
+    sockaddr_in address;
+    socklen_t address_size = sizeof(address);
+    if (getsockname(fd, (sockaddr*)&address, &address_size) < 0)
+        return;
+    auto file = Core::File::construct("/proc/net/tcp");
+    if (!file->open(Core::IODevice::ReadOnly))
+        return;
+    auto json = JsonValue::from_string(file->read_all());
+    if (!json.has_value() || !json.value().is_array())
+        return;
+    json.value().as_array().for_each([&](auto& value) {
+        auto& socket = value.as_object();
+        if (socket.get("local_port").to_u32() != ntohs(address.sin_port))
+            return;
+        printf("mss=%u cwnd=%u ssthresh=%u snd_wnd=%u rcv_wnd=%u srtt=%u ms rttvar=%u ms rto=%u ms\n",
+            socket.get("max_segment_size").to_u32(),
+            socket.get("congestion_window").to_u32(),
+            socket.get("slow_start_threshold").to_u32(),
+            socket.get("send_window").to_u32(),
+            socket.get("receive_window").to_u32(),
+            socket.get("smoothed_rtt").to_u32(),
+            socket.get("rtt_variance").to_u32(),
+            socket.get("retransmission_timeout").to_u32());
+        printf("retransmissions=%u (fast=%u, timeouts=%u) sack=%s\n",
+            socket.get("retransmissions").to_u32(),
+            socket.get("fast_retransmissions").to_u32(),
+            socket.get("retransmission_timeouts").to_u32(),
+            socket.get("sack").to_bool() ? "yes" : "no");
+    });
+}
+
+// Prints how many times each received byte was copied inside the kernel,
+// counting the copy into our buffer. Loopback always costs one more.
+static void print_receive_copies(int fd, u64 bytes_received)
+{
+    sockaddr_in local_address;
+    sockaddr_in peer_address;
+    socklen_t address_size = sizeof(local_address);
+    if (getsockname(fd, (sockaddr*)&local_address, &address_size) < 0 || !bytes_received)
+        return;
+    address_size = sizeof(peer_address);
+    if (getpeername(fd, (sockaddr*)&peer_address, &address_size) < 0)
+        return;
+    auto file = Core::File::construct("/proc/net/tcp");
+    if (!file->open(Core::IODevice::ReadOnly))
+        return;
+    auto json = JsonValue::from_string(file->read_all());
+    if (!json.has_value() || !json.value().is_array())
+        return;
+    json.value().as_array().for_each([&](auto& value) {
+        const JsonObject& socket = value.as_object();
+        if (socket.get("local_port").to_u32() != ntohs(local_address.sin_port) || socket.get("peer_port").to_u32() != ntohs(peer_address.sin_port))
+            return;
+        u64 bytes_copied = socket.get("bytes_copied").to_number<u64>();
+        printf("server: %llu bytes copied, %llu.%02llu copies per byte\n", bytes_copied, bytes_copied / bytes_received, (bytes_copied % bytes_received) * 100 / bytes_received);
+    });
+}
+
+static bool set_loopback_drop_rate(int percentage)
+{
+    auto file = Core::File::construct("/proc/sys/loopback_drop_rate");
+    if (!file->open(Core::IODevice::WriteOnly)) {
+        fprintf(stderr, "Couldn't open /proc/sys/loopback_drop_rate: %s\n", file->error_string());
+        return false;
+    }
+    return file->write(String::number(percentage));
+}
+
+static int run_server(int listen_fd, ByteBuffer& buffer)
+{
+    sockaddr_in peer;
+    socklen_t peer_size = sizeof(peer);
+    int fd = accept(listen_fd, (sockaddr*)&peer, &peer_size);
+    if (fd < 0) {
+        perror("accept");
+        return 1;
+    }
+
+    u64 total = 0;
+    Core::ElapsedTimer timer;
+    timer.start();
+    for (;;) {
+        ssize_t nread = read(fd, buffer.data(), buffer.size());
+        if (nread < 0) {
+            perror("read");
+            close(fd);
+            return 1;
+        }
+        if (nread == 0)
+            break;
+        total += nread;
+    }
+
+    print_rate("server: received ", total, timer.elapsed());
+    print_receive_copies(fd, total);
+    close(fd);
+    return 0;
+}
+
+static int listen_on(u16 port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    int option = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = INADDR_ANY;
+    if (bind(fd, (const sockaddr*)&address, sizeof(address)) < 0) {
+        perror("bind");
+        return -1;
+    }
+    if (listen(fd, 1) < 0) {
+        perror("listen");
+        return -1;
+    }
+    return fd;
+}
+
+static int run_client(const char* host, u16 port, int seconds, ByteBuffer& buffer)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return 1;
+    }
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &address.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid address: %s\n", host);
+        return 1;
+    }
+    if (connect(fd, (const sockaddr*)&address, sizeof(address)) < 0) {
+        perror("connect");
+        return 1;
+    }
+
+    printf("Sending to %s:%u for %d seconds with %zu byte writes\n", host, port, seconds, buffer.size());
+
+    u64 total = 0;
+    u64 interval_bytes = 0;
+    u64 interval_start = 0;
+    Core::ElapsedTimer timer;
+    timer.start();
+    for (;;) {
+        u64 elapsed = timer.elapsed();
+        if (elapsed - interval_start >= 1000) {
+            char label[32];
+            snprintf(label, sizeof(label), "%3llu-%3llu s: ", interval_start / 1000, elapsed / 1000);
+            print_rate(label, interval_bytes, elapsed - interval_start);
+            interval_start = elapsed;
+            interval_bytes = 0;
+        }
+        if (elapsed >= (u64)seconds * 1000)
+            break;
+
+        ssize_t nwritten = write(fd, buffer.data(), buffer.size());
+        if (nwritten < 0) {
+            perror("write");
+            close(fd);
+            return 1;
+        }
+        total += nwritten;
+        interval_bytes += nwritten;
+    }
+
+    print_rate("client: sent ", total, timer.elapsed());
+    print_connection_statistics(fd);
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    bool server = false;
+    const char* host = nullptr;
+    int port = 5201;
+    int seconds = 10;
+    int buffer_size = 128 * KiB;
+    int drop_percentage = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "hsc:p:t:l:L:")) != -1) {
+        switch (opt) {
+        case 'h':
+            exit_with_usage(0);
+            break;
+        case 's':
+            server = true;
+            break;
+        case 'c':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'l':
+            buffer_size = atoi(optarg);
+            break;
+        case 'L':
+            drop_percentage = atoi(optarg);
+            break;
+        default:
+            exit_with_usage(1);
+        }
+    }
+
+    if ((server && host) || port <= 0 || port > 65535 || seconds <= 0 || buffer_size <= 0)
+        exit_with_usage(1);
+    if (drop_percentage < 0 || drop_percentage > 100 || (drop_percentage && (server || host)))
+        exit_with_usage(1);
+
+    auto buffer = ByteBuffer::create_zeroed(buffer_size);
+
+    if (host)
+        return run_client(host, port, seconds, buffer);
+
+    int listen_fd = listen_on(port);
+    if (listen_fd < 0)
+        return 1;
+
+    if (server) {
+        printf("Listening on port %d\n", port);
+        for (;;) {
+            if (run_server(listen_fd, buffer) != 0)
+                return 1;
+        }
+    }
+
+    if (drop_percentage) {
+        if (!set_loopback_drop_rate(drop_percentage))
+            return 1;
+        printf("Dropping %d%% of loopback packets\n", drop_percentage);
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        close(listen_fd);
+        return run_client("127.0.0.1", port, seconds, buffer);
+    }
+
+    int rc = run_server(listen_fd, buffer);
+    close(listen_fd);
+    int status;
+    waitpid(pid, &status, 0);
+    if (drop_percentage)
+        set_loopback_drop_rate(0);
+    if (rc != 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return 1;
+    return 0;
+}